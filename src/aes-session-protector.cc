@@ -47,6 +47,21 @@ void AesSessionKey::SetupKey(const ScopedPassword& secret) {
   LOG_DEBUG("key: %s", ConvertToHex(key_, AesSessionKey::kKeyLengthInBytes).c_str());
 }
 
+void AesSessionKey::DeriveKey(
+    const ScopedPassword& secret, const string& transcript) {
+  static const char kLabel[] = "uvpn aes session key";
+
+  char prk[EVP_MAX_MD_SIZE];
+  Hkdf::Extract(Hmac::kSHA256, salt_, kKeyLengthInBytes,
+                secret.Data(), secret.Used(), prk);
+
+  string info(kLabel, sizeof(kLabel));
+  info.append(transcript);
+  Hkdf::Expand(Hmac::kSHA256, prk, Hmac::kSHA256.Length(),
+               info.data(), info.size(), key_, kKeyLengthInBytes);
+  memset(prk, 0, sizeof(prk));
+}
+
 const char* AesSessionKey::GetKey() const {
   return key_;
 }
@@ -62,8 +77,13 @@ AesSessionEncoder::AesSessionEncoder(Prng* prng, const AesSessionKey& key)
   memcpy(key_, key.GetKey(), AesSessionKey::kKeyLengthInBytes);
 }
 
+AesSessionEncoder::AesSessionEncoder(Prng* prng, const char* key)
+    : OpensslEncoder(OpensslProtector::kAES_256_CBC, prng) {
+  memcpy(key_, key, AesSessionKey::kKeyLengthInBytes);
+}
 
 AesSessionEncoder::~AesSessionEncoder() {
+  memset(key_, 0, AesSessionKey::kKeyLengthInBytes);
 }
 
 bool AesSessionEncoder::Start(InputCursor* output, StartOptions options) {
@@ -71,13 +91,7 @@ bool AesSessionEncoder::Start(InputCursor* output, StartOptions options) {
 
   // Generate and send a random key.
   const int kIVLength = OpensslProtector::kAES_256_CBC.IVLength();
-  output->Reserve(kIVLength);
-
-  // TODO: this dance is horrible. I should use something more c++ish, and not need
-  // to manage memory this way. (isn't that the whole point of io buffers??)
-  char* iv = output->Data();
-  prng_->Get(iv, kIVLength);
-  output->Increment(kIVLength);
+  char* iv = prng_->Fill(output, kIVLength);
 
   return OpensslEncoder::Start(key_, iv, options);
 }
@@ -93,7 +107,13 @@ AesSessionDecoder::AesSessionDecoder(Prng* prng, const AesSessionKey& key)
   memcpy(key_, key.GetKey(), AesSessionKey::kKeyLengthInBytes);
 }
 
+AesSessionDecoder::AesSessionDecoder(Prng* prng, const char* key)
+    : OpensslDecoder(OpensslProtector::kAES_256_CBC), prng_(prng) {
+  memcpy(key_, key, AesSessionKey::kKeyLengthInBytes);
+}
+
 AesSessionDecoder::~AesSessionDecoder() {
+  memset(key_, 0, AesSessionKey::kKeyLengthInBytes);
 }
 
 AesSessionDecoder::Result AesSessionDecoder::Start(
@@ -18,7 +18,13 @@ class AesSessionKey {
   int RecvSalt(OutputCursor* output);
 
   // Needs to be called after a salt has been sent or received.
+  // Uses PBKDF2, slow on purpose: use it when secret is a password, or
+  // something derived from one with little entropy.
   void SetupKey(const ScopedPassword& secret);
+  // Same as above, for secrets that already have plenty of entropy, like
+  // the one SRP computes. HKDF-SHA256, with salt as the salt, and transcript
+  // (a hash of the handshake that produced the secret) mixed in the info.
+  void DeriveKey(const ScopedPassword& secret, const string& transcript);
   const char* GetKey() const;
 
  private:
@@ -32,6 +38,8 @@ class AesSessionKey {
 class AesSessionEncoder : public OpensslEncoder {
  public:
   AesSessionEncoder(Prng* prng, const AesSessionKey& key);
+  // key must be AesSessionKey::kKeyLengthInBytes long.
+  AesSessionEncoder(Prng* prng, const char* key);
   virtual ~AesSessionEncoder();
 
   virtual bool Start(InputCursor* output, StartOptions options);
@@ -45,6 +53,8 @@ class AesSessionEncoder : public OpensslEncoder {
 class AesSessionDecoder : public OpensslDecoder {
  public:
   AesSessionDecoder(Prng* prng, const AesSessionKey& key);
+  // key must be AesSessionKey::kKeyLengthInBytes long.
+  AesSessionDecoder(Prng* prng, const char* key);
   virtual ~AesSessionDecoder();
 
   virtual Result Start(
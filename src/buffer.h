@@ -36,15 +36,21 @@ class BufferChunk {
  public:
   static const int kRoundedSize = 1 << 14;
 
+  // Chunks of kPooledSize, used for large reads, are kept in a pool of
+  // up to kPoolSize chunks per thread once freed. malloc would mmap and
+  // munmap each of them, faulting in fresh pages on every read.
+  static const int kPooledSize = 1 << 18;
+  static const int kPoolSize = 4;
+
   explicit BufferChunk(int size)
-      : data_(size ? new char[size] : NULL),
+      : data_(size ? Allocate(size) : NULL),
         size_(size),
         used_(0),
 	absolute_offset_(0),
         refcount_(0),
         next_(NULL) {
   }
-  ~BufferChunk() { delete []data_; }
+  ~BufferChunk() { Free(data_, size_); }
 
   static int RoundSize(int size) {
     if (size < kRoundedSize)
@@ -80,6 +86,29 @@ class BufferChunk {
   int RefCount() { return refcount_; }
 
  private:
+  static char** Pool() {
+    static __thread char* pool[kPoolSize];
+    return pool;
+  }
+  static int* Pooled() {
+    static __thread int pooled;
+    return &pooled;
+  }
+
+  static char* Allocate(int size) {
+    if (size == kPooledSize && *Pooled())
+      return Pool()[--*Pooled()];
+    return new char[size];
+  }
+
+  static void Free(char* data, int size) {
+    if (data && size == kPooledSize && *Pooled() < kPoolSize) {
+      Pool()[(*Pooled())++] = data;
+      return;
+    }
+    delete []data;
+  }
+
   char* data_;
   // How much memory was allocated for the chunk?
   unsigned int size_;
@@ -205,7 +234,9 @@ class InputCursor {
   unsigned int ContiguousSize() const;
 
   void Increment(unsigned int size);
-  void Reserve(unsigned int size);
+  // Makes sure size bytes are available. If a new chunk is needed, it
+  // is chunk_size bytes large, if that is larger.
+  void Reserve(unsigned int size, unsigned int chunk_size = 0);
   void Add(const char* data, unsigned int size);
 
   void Add(const string& str) {
@@ -261,9 +292,9 @@ inline void InputCursor::Increment(unsigned int size) {
   }
 }
 
-inline void InputCursor::Reserve(unsigned int size) {
+inline void InputCursor::Reserve(unsigned int size, unsigned int chunk_size) {
   if (!data_->Last() || data_->Last()->Available() < size)
-    data_->Append(new BufferChunk(BufferChunk::RoundSize(size)));
+    data_->Append(new BufferChunk(BufferChunk::RoundSize(max(size, chunk_size))));
 }
 
 inline void InputCursor::Add(const char* buffer, unsigned int size) {
@@ -309,12 +340,11 @@ inline void OutputCursor::MoveToNextChunk() {
 
 inline unsigned int OutputCursor::ContiguousSize() const {
   unsigned int size(CurrentChunkContiguousSize());
-  if (size || !CurrentChunk())
-    return size;
-  BufferChunk* chunk(CurrentChunk()->Next());
-  if (chunk)
-    return chunk->Used();
-  return 0;
+  if (!size && CurrentChunk() && CurrentChunk()->Next())
+    size = CurrentChunk()->Next()->Used();
+  if (size_is_limited_)
+    return min(size, limited_size_);
+  return size;
 }
 
 inline unsigned int OutputCursor::CurrentChunkContiguousSize() const {
@@ -371,6 +401,8 @@ inline void OutputCursor::Increment(unsigned int amount) {
       amount, LeftSize());
   LOG_DEBUG("incrementing by %d, contiguous size is %d, left size is %d",
 	    amount, ContiguousSize(), LeftSize());
+  if (size_is_limited_)
+    limited_size_ -= min(amount, limited_size_);
   do {
     if (CurrentChunkContiguousSize() >= amount) {
       offset_ += amount;
@@ -384,6 +416,8 @@ inline void OutputCursor::Increment(unsigned int amount) {
 }
 
 inline unsigned int OutputCursor::Get(char* ptr, unsigned int size) const {
+  if (size_is_limited_)
+    size = min(size, limited_size_);
   unsigned int left_to_copy(size);
   BufferChunk* chunk(CurrentChunk());
   unsigned int offset(offset_);
@@ -428,6 +462,17 @@ inline unsigned int OutputCursor::GetIovec(
     chunk = chunk->Next();
   } 
 
+  // Leave out what is past the limit, if any.
+  unsigned int left(LeftSize());
+  while (count && retval - (*vect)[count - 1].iov_len >= left) {
+    retval -= (*vect)[count - 1].iov_len;
+    --count;
+  }
+  if (retval > static_cast<int>(left)) {
+    (*vect)[count - 1].iov_len -= retval - left;
+    retval = left;
+  }
+
   *size = count;
   return retval;
 }
@@ -98,6 +98,11 @@ class ClientConnectedSession {
   typedef function<void (ClientConnectedSession*, OutputCursor*)> read_handler_t;
   typedef function<void (ClientConnectedSession*, CloseReason)> close_handler_t;
   virtual void SetCallbacks(read_handler_t*, close_handler_t*) = 0;
+
+  // Called by the IOChannel to end the session, once it no longer needs
+  // it. Whatever was sent already still goes out, the session is deleted
+  // later and must not be used after this.
+  virtual void Disconnect() = 0;
 };
 
 class ClientConnectionManager {
@@ -135,7 +140,10 @@ class ClientConnectionManager {
 
   virtual void RegisterTranscoder(ClientTranscoder* transcoder) = 0;
 
-  virtual void AddConnection(const string& destination, UserChatter* chatter) = 0;
+  // Returns the session created, still to be authenticated, or NULL if
+  // destination could not be reached.
+  virtual ClientConnectedSession* AddConnection(
+      const string& destination, UserChatter* chatter) = 0;
 };
 
 
@@ -37,7 +37,7 @@ ClientConnectedSession* ClientCryptoConnectionManager::CreateSession(
   return NULL;
 }
 
-void ClientCryptoConnectionManager::AddConnection(
+ClientConnectedSession* ClientCryptoConnectionManager::AddConnection(
     const string& destination, UserChatter* chatter) {
   // Pseudo code:
   //   - pick which transcoders we want to use.
@@ -56,7 +56,7 @@ void ClientCryptoConnectionManager::AddConnection(
   auto_ptr<Sockaddr> sockaddr(Sockaddr::Parse(destination, 1029));
   if (!sockaddr.get()) {
     LOG_ERROR("could not convert %s to address", destination.c_str());
-    return;
+    return NULL;
   }
 
   // Create a transcoder. In this case, we'll just open a tcp connection
@@ -66,6 +66,8 @@ void ClientCryptoConnectionManager::AddConnection(
       transport_.get(), this, *(sockaddr.get()));
   if (!connection) {
     // TODO: handle errors! what do we do here?
+    LOG_ERROR("could not connect to %s", destination.c_str());
+    return NULL;
   }
 
   // Create a new authentication session.
@@ -74,7 +76,7 @@ void ClientCryptoConnectionManager::AddConnection(
   sessions_map_[connection->GetKey()] = session;
 
   LOG_DEBUG("created new session %08x", (unsigned int)session);
-  return;
+  return session;
 }
 
 void ClientCryptoConnectionManager::RegisterTransport(Transport* transport) {
@@ -211,6 +213,10 @@ void ClientCryptoConnectionManager::Session::HandleError(
   }
 }
 
+void ClientCryptoConnectionManager::Session::Disconnect() {
+  HandleError(connection_->GetKey(), connection_.get(), Shutdown);
+}
+
 void ClientCryptoConnectionManager::Session::Close() {
   connection_->Close();
 }
@@ -42,7 +42,8 @@ class ClientCryptoConnectionManager : public ClientConnectionManager {
   void RegisterAuthenticator(ClientAuthenticator* authenticator);
   void RegisterTranscoder(ClientTranscoder* transcoder);
 
-  void AddConnection(const string& destination, UserChatter* chatter);
+  ClientConnectedSession* AddConnection(
+      const string& destination, UserChatter* chatter);
 
  private:
   class Session : public ClientConnectedSession {
@@ -72,6 +73,7 @@ class ClientCryptoConnectionManager : public ClientConnectionManager {
     // Called by the IOChannel or ClientAuthenticator to be notified when data is
     // available for read from a session, or when session is closed.
     virtual void SetCallbacks(read_handler_t*, close_handler_t*);
+    virtual void Disconnect();
 
     // Tells the caller if the connection is ready, or if more data is needed.
     ClientConnectedSession::State IsReady(const ConnectionKey& key, OutputCursor* cursor);
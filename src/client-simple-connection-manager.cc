@@ -11,7 +11,11 @@
 //  - if session is not in table, it returns session->IsReady();
 ClientSimpleConnectionManager::ClientSimpleConnectionManager(
     Prng* prng, Dispatcher* dispatcher)
-    : prng_(prng), dispatcher_(dispatcher) {
+    : prng_(prng), dispatcher_(dispatcher),
+      scheduler_(NULL),
+      ticking_(false),
+      tick_handler_(bind(&ClientSimpleConnectionManager::TickHandler, this)),
+      tick_event_("multipath tick", &tick_handler_) {
 }
 
 ClientConnectedSession::State ClientSimpleConnectionManager::GetSession(
@@ -37,7 +41,7 @@ ClientConnectedSession* ClientSimpleConnectionManager::CreateSession(
   return NULL;
 }
 
-void ClientSimpleConnectionManager::AddConnection(
+ClientConnectedSession* ClientSimpleConnectionManager::AddConnection(
     const string& destination, UserChatter* chatter) {
   // Pseudo code:
   //   - pick which transcoders we want to use.
@@ -56,7 +60,7 @@ void ClientSimpleConnectionManager::AddConnection(
   auto_ptr<Sockaddr> sockaddr(Sockaddr::Parse(destination, 1029));
   if (!sockaddr.get()) {
     LOG_ERROR("could not convert %s to address", destination.c_str());
-    return;
+    return NULL;
   }
 
   // Create a transcoder. In this case, we'll just open a tcp connection
@@ -66,15 +70,18 @@ void ClientSimpleConnectionManager::AddConnection(
       transport_.get(), this, *(sockaddr.get()));
   if (!connection) {
     // TODO: handle errors! what do we do here?
+    LOG_ERROR("could not connect to %s", destination.c_str());
+    return NULL;
   }
 
   // Create a new authentication session.
   Session* session(new Session(
-      this, chatter, connection, authenticator_.get(), channel_.get()));
+      this, chatter, sockaddr.release(), connection, authenticator_.get(),
+      channel_.get()));
   sessions_map_[connection->GetKey()] = session;
 
   LOG_DEBUG("created new session %08x", (unsigned int)session);
-  return;
+  return session;
 }
 
 void ClientSimpleConnectionManager::RegisterTransport(Transport* transport) {
@@ -94,9 +101,41 @@ void ClientSimpleConnectionManager::RegisterAuthenticator(
   authenticator_.reset(authenticator);
 }
 
+void ClientSimpleConnectionManager::EnableMultipath(EventScheduler* scheduler) {
+  scheduler_ = scheduler;
+}
+
+void ClientSimpleConnectionManager::RegisterPathTranscoder(
+    ClientTranscoder* transcoder, Transport* transport) {
+  path_transcoders_.push_back(transcoder);
+  path_transports_.push_back(transport);
+}
+
+void ClientSimpleConnectionManager::StartTick() {
+  if (ticking_)
+    return;
+  ticking_ = true;
+  tick_event_.Start(scheduler_, Multipath::kTickInterval);
+}
+
+bool ClientSimpleConnectionManager::TickHandler() {
+  ticking_ = false;
+  Timer::ms_timer_t now(Timer().Milliseconds());
+  // Sessions can be closed while sending probes.
+  vector<Session*> sessions(multipath_sessions_.begin(), multipath_sessions_.end());
+  for (vector<Session*>::iterator it(sessions.begin()); it != sessions.end(); ++it) {
+    if (multipath_sessions_.count(*it))
+      (*it)->HandleTick(now);
+  }
+
+  if (!multipath_sessions_.empty())
+    StartTick();
+  return true;
+}
+
 ClientSimpleConnectionManager::Session::Session(
     ClientSimpleConnectionManager* parent,
-    UserChatter* chatter,
+    UserChatter* chatter, Sockaddr* destination,
     ClientTranscoder::Connection* connection,
     ClientAuthenticator* authenticator, ClientIOChannel* channel)
     : parent_(parent),
@@ -109,13 +148,27 @@ ClientSimpleConnectionManager::Session::Session(
         &ClientSimpleConnectionManager::Session::AuthenticationDoneHandler, this,
 	placeholders::_1, placeholders::_2, placeholders::_3)),
       read_callback_(NULL),
-      close_callback_(NULL) {
+      close_callback_(NULL),
+      destination_(destination),
+      bonded_(false),
+      join_counter_(0),
+      last_join_(0) {
   DEBUG_FATAL_UNLESS(channel_)("no channel to use for connections??");
   DEBUG_FATAL_UNLESS(authenticator_)("no authenticator to use for connections??");
+  memset(path_connections_, 0, sizeof(path_connections_));
 
   authenticator_->StartAuthentication(this, NULL, chatter_, &authentication_done_handler_);
 }
 
+ClientSimpleConnectionManager::Session::~Session() {
+  // Only deleted via DeleteLater, whoever is called can delete itself.
+  parent_->multipath_sessions_.erase(this);
+  for (int i = 0; i < Multipath::kMaxPaths; ++i) {
+    if (path_connections_[i] != connection_.get())
+      delete path_connections_[i];
+  }
+}
+
 ClientConnectedSession::State ClientSimpleConnectionManager::Session::IsReady(
     const ConnectionKey& key, OutputCursor* cursor) {
   return Ready;
@@ -134,6 +187,8 @@ void ClientSimpleConnectionManager::Session::AuthenticationDoneHandler(
     case ClientAuthenticator::SessionMaybeAuthenticated:
       SetEncoder(encoder);
       SetDecoder(decoder);
+      if (parent_->scheduler_ && !parent_->path_transcoders_.empty())
+        StartPaths();
       channel_->HandleSession(this);
       break;
 
@@ -176,9 +231,149 @@ EncodeSessionProtector* ClientSimpleConnectionManager::Session::GetEncoder() {
 void ClientSimpleConnectionManager::Session::HandlePacket(
     const ConnectionKey& key, ClientTranscoder::Connection* connection,
     OutputCursor* data) {
+  if (multipath_.get() && Multipath::HasHeader(*data)) {
+    int path(FindPath(connection));
+    if (path >= 0)
+      HandleMultipathPacket(path, data);
+    return;
+  }
   (*read_callback_)(this, data);
 }
 
+void ClientSimpleConnectionManager::Session::StartPaths() {
+  Timer::ms_timer_t now(Timer().Milliseconds());
+  multipath_.reset(new Multipath());
+  reorder_.reset(new ReorderBuffer());
+  path_connections_[multipath_->AddPath(true, now)] = connection_.get();
+
+  vector<ClientTranscoder*>* transcoders(&parent_->path_transcoders_);
+  for (unsigned int i = 0; i < transcoders->size(); ++i) {
+    int path(multipath_->AddPath(false, now));
+    if (path < 0) {
+      LOG_ERROR("too many paths, ignoring the others");
+      break;
+    }
+
+    Transport* transport(parent_->path_transports_[i]);
+    if (!transport)
+      transport = parent_->transport_.get();
+    ClientTranscoder::Connection* connection((*transcoders)[i]->Connect(
+        transport, parent_, *destination_));
+    if (!connection) {
+      LOG_ERROR("could not open path %d", path);
+      multipath_->RemovePath(path);
+      continue;
+    }
+    path_connections_[path] = connection;
+    parent_->sessions_map_[connection->GetKey()] = this;
+    SendJoin(path, true);
+  }
+  last_join_ = now;
+
+  parent_->multipath_sessions_.insert(this);
+  parent_->StartTick();
+}
+
+int ClientSimpleConnectionManager::Session::FindPath(
+    const ClientTranscoder::Connection* connection) const {
+  for (int i = 0; i < Multipath::kMaxPaths; ++i)
+    if (connection && path_connections_[i] == connection)
+      return i;
+  return -1;
+}
+
+void ClientSimpleConnectionManager::Session::HandleMultipathPacket(
+    int path, OutputCursor* data) {
+  Timer::ms_timer_t now(Timer().Milliseconds());
+  uint32_t sequence;
+  if (!multipath_->HandleHeader(path, now, data, &sequence)) {
+    LOG_DEBUG("dropping truncated multipath message");
+    return;
+  }
+
+  // The first message on a joined path tells us the server accepted it.
+  if (!bonded_ && multipath_->ConfirmedPaths() > 1) {
+    LOG_INFO("server accepted path %d, spreading messages", path);
+    bonded_ = true;
+  }
+
+  // Probes carry nothing else.
+  if (data->LeftSize()) {
+    vector<string> ready;
+    reorder_->SetHoldTime(multipath_->HoldTime());
+    reorder_->Add(sequence, data, now, &ready);
+    for (vector<string>::const_iterator it(ready.begin()); it != ready.end(); ++it) {
+      Buffer packet;
+      packet.Input()->Add(*it);
+      (*read_callback_)(this, packet.Output());
+    }
+  }
+
+  if (bonded_ && multipath_->NeedsProbe(path, now))
+    SendProbe(path, now);
+}
+
+void ClientSimpleConnectionManager::Session::HandleTick(Timer::ms_timer_t now) {
+  vector<string> ready;
+  reorder_->Expire(now, &ready);
+  for (vector<string>::const_iterator it(ready.begin()); it != ready.end(); ++it) {
+    Buffer packet;
+    packet.Input()->Add(*it);
+    (*read_callback_)(this, packet.Output());
+  }
+
+  // Joins or their answers may have been lost.
+  bool rejoin(now - last_join_ >= Multipath::kMinDeadTime);
+  if (rejoin)
+    last_join_ = now;
+
+  for (int i = 0; i < Multipath::kMaxPaths; ++i) {
+    if (!path_connections_[i])
+      continue;
+    if (!multipath_->IsConfirmed(i)) {
+      if (rejoin)
+        SendJoin(i, false);
+    } else if (bonded_ && multipath_->NeedsProbe(i, now)) {
+      SendProbe(i, now);
+    }
+  }
+}
+
+void ClientSimpleConnectionManager::Session::SendJoin(int path, bool first) {
+  if (!join_encoder_.get())
+    join_encoder_.reset(new ScrambleSessionEncoder(parent_->prng_));
+
+  ClientTranscoder::Connection* connection(path_connections_[path]);
+  if (first)
+    connection->BindKeys(join_counter_ + 1);
+  if (!Multipath::AddJoin(*encoder_, ++join_counter_, connection->Message())) {
+    LOG_ERROR("session keys can't be exported, can't join path %d", path);
+    return;
+  }
+  connection->SendMessage(this, join_encoder_.get());
+}
+
+void ClientSimpleConnectionManager::Session::SendProbe(
+    int path, Timer::ms_timer_t now) {
+  ClientTranscoder::Connection* connection(path_connections_[path]);
+  multipath_->AddHeader(path, true, now, connection->Message());
+  connection->SendMessage(this, GetEncoder());
+}
+
+void ClientSimpleConnectionManager::Session::DropPath(int path) {
+  LOG_INFO("dropping path %d", path);
+  ClientTranscoder::Connection* connection(path_connections_[path]);
+  parent_->sessions_map_.erase(connection->GetKey());
+  path_connections_[path] = NULL;
+  multipath_->RemovePath(path);
+
+  // The connection_ is deleted with the session, the transcoder may still
+  // be using the others.
+  connection->Close();
+  if (connection != connection_.get())
+    parent_->dispatcher_->DeleteLater(connection);
+}
+
 void ClientSimpleConnectionManager::HandleError(
     const ConnectionKey& key, ClientTranscoder::Connection* connection,
     const ClientConnectedSession::CloseReason error) {
@@ -197,6 +392,14 @@ void ClientSimpleConnectionManager::Session::HandleError(
   SessionsMap* map(&parent_->sessions_map_);
   SessionsMap::iterator it(map->find(key));
   if (it != map->end()) {
+    // Paths not joined yet, or not the last one left, can go alone.
+    int path(multipath_.get() ? FindPath(connection) : -1);
+    if (path >= 0 && (!multipath_->IsConfirmed(path) ||
+                      multipath_->ConfirmedPaths() > 1)) {
+      DropPath(path);
+      return;
+    }
+
     LOG_DEBUG("deleting session now");
     Session* session(it->second);
     map->erase(it);
@@ -209,18 +412,59 @@ void ClientSimpleConnectionManager::Session::HandleError(
   }
 }
 
+void ClientSimpleConnectionManager::Session::Disconnect() {
+  LOG_DEBUG("disconnecting session");
+  // All paths go, not just the first one as with HandleError.
+  if (!parent_->sessions_map_.erase(connection_->GetKey()))
+    return;
+  Close();
+  parent_->dispatcher_->DeleteLater(this);
+}
+
 void ClientSimpleConnectionManager::Session::Close() {
+  parent_->multipath_sessions_.erase(this);
+  for (int i = 0; i < Multipath::kMaxPaths; ++i) {
+    if (!path_connections_[i] || path_connections_[i] == connection_.get())
+      continue;
+    parent_->sessions_map_.erase(path_connections_[i]->GetKey());
+    path_connections_[i]->Close();
+  }
   connection_->Close();
 }
 
 InputCursor* ClientSimpleConnectionManager::Session::Message() {
+  if (multipath_.get())
+    return message_.Input();
   return connection_->Message();
 }
 
 bool ClientSimpleConnectionManager::Session::SendMessage() {
+  if (multipath_.get())
+    return SendMultipathMessage();
   return connection_->SendMessage(this, GetEncoder());
 }
 
+bool ClientSimpleConnectionManager::Session::SendMultipathMessage() {
+  string payload;
+  message_.Output()->ConsumeString(&payload);
+  if (!bonded_) {
+    connection_->Message()->Add(payload);
+    return connection_->SendMessage(this, GetEncoder());
+  }
+
+  Timer::ms_timer_t now(Timer().Milliseconds());
+  int path(multipath_->Pick(now));
+  if (path < 0) {
+    LOG_DEBUG("no path left to send on, dropping message");
+    return false;
+  }
+
+  ClientTranscoder::Connection* connection(path_connections_[path]);
+  multipath_->AddHeader(path, false, now, connection->Message());
+  connection->Message()->Add(payload);
+  return connection->SendMessage(this, GetEncoder());
+}
+
 void ClientSimpleConnectionManager::Session::SetCallbacks(
     read_handler_t* readh, close_handler_t* closeh) {
   read_callback_ = readh;
@@ -10,13 +10,17 @@
 # include "client-authenticator.h"
 # include "protector.h"
 # include "client-connection-manager.h"
+# include "event-scheduler.h"
+# include "multipath.h"
 
 # include <map>
 # include <memory>
+# include <set>
 # include <vector>
 
 class UserChatter;
 class Prng;
+class Sockaddr;
 
 class ClientSimpleConnectionManager : public ClientConnectionManager {
  public:
@@ -42,15 +46,26 @@ class ClientSimpleConnectionManager : public ClientConnectionManager {
   void RegisterAuthenticator(ClientAuthenticator* authenticator);
   void RegisterTranscoder(ClientTranscoder* transcoder);
 
-  void AddConnection(const string& destination, UserChatter* chatter);
+  // Once authenticated, sessions open one more connection to the server
+  // with each transcoder registered here, and spread their messages over
+  // all of them, see Multipath. If transport is not NULL, the path is
+  // opened with it rather than with the registered one, so it can go out
+  // of a different network. Neither is owned.
+  void EnableMultipath(EventScheduler* scheduler);
+  void RegisterPathTranscoder(
+      ClientTranscoder* transcoder, Transport* transport = NULL);
+
+  ClientConnectedSession* AddConnection(
+      const string& destination, UserChatter* chatter);
 
  private:
   class Session : public ClientConnectedSession {
    public:
     Session(ClientSimpleConnectionManager* parent,
-	    UserChatter* chatter,
+	    UserChatter* chatter, Sockaddr* destination,
 	    ClientTranscoder::Connection* connection,
 	    ClientAuthenticator* authenticator, ClientIOChannel* channel);
+    ~Session();
 
     // Must always return a value, even if the session is not authenticated yet.
     virtual DecodeSessionProtector* GetDecoder();
@@ -72,10 +87,15 @@ class ClientSimpleConnectionManager : public ClientConnectionManager {
     // Called by the IOChannel or ClientAuthenticator to be notified when data is
     // available for read from a session, or when session is closed.
     virtual void SetCallbacks(read_handler_t*, close_handler_t*);
+    virtual void Disconnect();
 
     // Tells the caller if the connection is ready, or if more data is needed.
     ClientConnectedSession::State IsReady(const ConnectionKey& key, OutputCursor* cursor);
 
+    // Delivers messages held for too long, sends probes, and joins again
+    // the paths the server did not answer on.
+    void HandleTick(Timer::ms_timer_t now);
+
    private:
     void StartAuthenticator(ClientConnectedSession* session, OutputCursor* cursor);
     void AuthenticationDoneHandler(
@@ -87,6 +107,16 @@ class ClientSimpleConnectionManager : public ClientConnectionManager {
 
     void Close();
 
+    void StartPaths();
+    int FindPath(const ClientTranscoder::Connection* connection) const;
+    void HandleMultipathPacket(int path, OutputCursor* data);
+    bool SendMultipathMessage();
+    // The first join on a connection is the one the server accepts, if
+    // any: its counter binds the keys of the connection.
+    void SendJoin(int path, bool first);
+    void SendProbe(int path, Timer::ms_timer_t now);
+    void DropPath(int path);
+
     ClientSimpleConnectionManager* parent_;
 
     enum SessionState {
@@ -110,8 +140,27 @@ class ClientSimpleConnectionManager : public ClientConnectionManager {
 
     read_handler_t* read_callback_;
     close_handler_t* close_callback_;
+
+    auto_ptr<Sockaddr> destination_;
+
+    // Set once authenticated, if there are transcoders for more paths.
+    // Path 0 is connection_, the others are owned here.
+    auto_ptr<Multipath> multipath_;
+    auto_ptr<ReorderBuffer> reorder_;
+    ClientTranscoder::Connection* path_connections_[Multipath::kMaxPaths];
+    Buffer message_;
+    // Until the server accepted a join, messages are sent on connection_,
+    // without headers.
+    bool bonded_;
+    // Joins are read by a new session on the server, with no keys yet.
+    auto_ptr<EncodeSessionProtector> join_encoder_;
+    uint32_t join_counter_;
+    Timer::ms_timer_t last_join_;
   };
 
+  void StartTick();
+  bool TickHandler();
+
 
   Prng* prng_;
   Dispatcher* dispatcher_;
@@ -126,6 +175,16 @@ class ClientSimpleConnectionManager : public ClientConnectionManager {
 
   auto_ptr<Transport> transport_;
   auto_ptr<ClientTranscoder> transcoder_;
+
+  EventScheduler* scheduler_;
+  vector<ClientTranscoder*> path_transcoders_;
+  // For each path transcoder, its transport, or NULL.
+  vector<Transport*> path_transports_;
+  // Sessions using more than one connection.
+  set<Session*> multipath_sessions_;
+  bool ticking_;
+  EventScheduler::Event::timer_handler_t tick_handler_;
+  OneOffEvent tick_event_;
 };
 
 #endif // CLIENT_SIMPLE_CONNECTION_MANAGER_H
@@ -4,7 +4,10 @@
 #include "client-authenticator.h"
 #include "serializers.h"
 
-ClientTcpTranscoder::ClientTcpTranscoder() {
+ClientTcpTranscoder::ClientTcpTranscoder(TcpFraming::Mode framing,
+                                         bool kernel_tls)
+    : framing_(framing),
+      kernel_tls_(kernel_tls) {
 }
 
 ClientTranscoder::Connection* ClientTcpTranscoder::Connect(
@@ -17,20 +20,30 @@ ClientTranscoder::Connection* ClientTcpTranscoder::Connect(
     return NULL;
   }
 
-  return new Connection(channel, manager);
+  return new Connection(channel, manager, framing_, kernel_tls_);
 }
 
 ClientTcpTranscoder::Connection::Connection(
-    BoundChannel* channel, ClientConnectionManager* manager)
+    BoundChannel* channel, ClientConnectionManager* manager,
+    TcpFraming::Mode framing, bool kernel_tls)
     : key_(this),
       channel_(channel),
       session_(NULL),
       manager_(manager),
       decoder_(NULL),
+      framing_(framing),
+      kernel_tls_(KernelTls::Client),
       read_handler_(bind(&ClientTcpTranscoder::Connection::HandleRead, this)),
       write_handler_(bind(&ClientTcpTranscoder::Connection::HandleWrite, this)) {
   LOG_DEBUG();
   channel_->WantRead(&read_handler_);
+
+  // Sent together with the first message.
+  if (framing_ == TcpFraming::Framed) {
+    TcpFraming::AddMagic(from_user_encrypted_.Input());
+    if (kernel_tls)
+      kernel_tls_.Request(channel_.get(), &from_user_encrypted_);
+  }
 }
 
 const ConnectionKey& ClientTcpTranscoder::Connection::GetKey() const {
@@ -44,6 +57,8 @@ InputCursor* ClientTcpTranscoder::Connection::Message() {
 
 InputCursor* ClientTcpTranscoder::Connection::Header() {
   LOG_DEBUG();
+  if (framing_ == TcpFraming::Framed)
+    return frame_.Input();
   return from_user_encrypted_.Input();
 }
 
@@ -55,17 +70,31 @@ bool ClientTcpTranscoder::Connection::SendMessage(
     ClientConnectedSession* session, EncodeSessionProtector* encoder) {
   LOG_DEBUG("%d bytes are ready to send", from_user_cleartext_.Output()->LeftSize());
   channel_->WantWrite(&write_handler_);
+  if (framing_ == TcpFraming::Framed)
+    return SendFrame(session, encoder);
 
   // Send size of the packet.
   if (encoder) {
     LOG_DEBUG("encoding message");
+    OutputCursor* cleartext(from_user_cleartext_.Output());
+    Buffer compressed;
+    if (encoder->Compresses()) {
+      if (!compressor_.get())
+        compressor_.reset(new StreamCompressor);
+      if (!compressor_->Compress(cleartext, compressed.Input())) {
+        HandleError(session, ClientConnectedSession::Encoding, "packet too large to compress");
+        return false;
+      }
+      cleartext = compressed.Output();
+    }
+
     if (!encoder->Start(from_user_encrypted_.Input(), SessionProtector::NoPadding)) {
       HandleError(session, ClientConnectedSession::Encoding, "could not start encoder");
       return false;
     }
 
     Buffer size;
-    EncodeToBuffer(static_cast<uint16_t>(from_user_cleartext_.Output()->LeftSize()), size.Input());
+    EncodeToBuffer(static_cast<uint16_t>(cleartext->LeftSize()), size.Input());
     if (!encoder->Continue(size.Output(), from_user_encrypted_.Input())) {
       HandleError(session, ClientConnectedSession::Encoding, "could not encrypt data");
       return false;
@@ -74,11 +103,11 @@ bool ClientTcpTranscoder::Connection::SendMessage(
     // Pad the buffer now, so we never end up with leftover data.
     encoder->AddPadding(
         from_user_encrypted_.Input(),
-        from_user_cleartext_.Output()->LeftSize() + sizeof(uint16_t));
+        cleartext->LeftSize() + sizeof(uint16_t));
 
     // Encode packet itself.
     if (!encoder->Continue(
-	     from_user_cleartext_.Output(), from_user_encrypted_.Input()) ||
+	     cleartext, from_user_encrypted_.Input()) ||
         !encoder->End(from_user_encrypted_.Input())) {
       HandleError(session, ClientConnectedSession::Encoding, "could not add packet");
       return false;
@@ -93,11 +122,59 @@ bool ClientTcpTranscoder::Connection::SendMessage(
   return true;
 }
 
+bool ClientTcpTranscoder::Connection::SendFrame(
+    ClientConnectedSession* session, EncodeSessionProtector* encoder) {
+  OutputCursor* cleartext(from_user_cleartext_.Output());
+  if (encoder) {
+    Buffer compressed;
+    if (encoder->Compresses()) {
+      if (!compressor_.get())
+        compressor_.reset(new StreamCompressor);
+      if (!compressor_->Compress(cleartext, compressed.Input())) {
+        HandleError(session, ClientConnectedSession::Encoding, "packet too large to compress");
+        return false;
+      }
+      cleartext = compressed.Output();
+    }
+
+    // The whole message is known, no need to send its size encrypted.
+    if (kernel_tls_.SendsClear()) {
+      EncodeToBuffer(cleartext, frame_.Input());
+    } else if (!encoder->EncodeFrame(cleartext, frame_.Input())) {
+      HandleError(session, ClientConnectedSession::Encoding, "could not encode frame");
+      return false;
+    }
+  } else {
+    EncodeToBuffer(cleartext, frame_.Input());
+  }
+
+  if (!TcpFraming::AddFrame(frame_.Output(), from_user_encrypted_.Input())) {
+    HandleError(session, ClientConnectedSession::Encoding, "frame too large");
+    return false;
+  }
+  return true;
+}
+
 BoundChannel::processing_state_e ClientTcpTranscoder::Connection::HandleWrite() {
   LOG_DEBUG("attempting to write %d bytes",
 	    from_user_encrypted_.Output()->LeftSize());
 
-  channel_->Write(from_user_encrypted_.Output());
+  // Data after our switch to kernel tls waits for the switch.
+  if (kernel_tls_.WriteLimit()) {
+    OutputCursor limited(*from_user_encrypted_.Output());
+    limited.LimitLeftSize(kernel_tls_.WriteLimit());
+    unsigned int allowed(limited.LeftSize());
+    channel_->Write(&limited);
+
+    unsigned int written(allowed - limited.LeftSize());
+    from_user_encrypted_.Output()->Increment(written);
+    if (!kernel_tls_.HandleWritten(channel_.get(), written)) {
+      HandleError(NULL, ClientConnectedSession::System, "could not start kernel tls");
+      return BoundChannel::DONE;
+    }
+  } else {
+    channel_->Write(from_user_encrypted_.Output());
+  }
   // Remove write handler, as we don't have anything more to write.
   if (!from_user_encrypted_.Output()->LeftSize())
     return BoundChannel::DONE;
@@ -138,8 +215,20 @@ BoundChannel::processing_state_e ClientTcpTranscoder::Connection::HandleRead() {
 
   // TODO(security): reserve here is wrong :/ we should fill the buffer
   // and create back pressure on the kernel.
-  from_server_encrypted_.Input()->Reserve(kReadSize);
-  BoundChannel::io_result_e status(channel_->Read(from_server_encrypted_.Input()));
+  if (framing_ == TcpFraming::Framed)
+    from_server_encrypted_.Input()->Reserve(
+        TcpFraming::kMinReadSize, TcpFraming::kReadSize);
+  else
+    from_server_encrypted_.Input()->Reserve(kReadSize);
+  // Records the server sends after switching to kernel tls must be left
+  // in the kernel until we have the key.
+  BoundChannel::io_result_e status;
+  if (kernel_tls_.ReadsFrameByFrame())
+    status = channel_->ReadAtMost(
+        from_server_encrypted_.Input(),
+        TcpFraming::MissingBytes(*from_server_encrypted_.Output()));
+  else
+    status = channel_->Read(from_server_encrypted_.Input());
   if (status != BoundChannel::OK) {
     if (status == BoundChannel::CLOSED)
       HandleError(NULL, ClientConnectedSession::Shutdown, "closed");
@@ -148,6 +237,9 @@ BoundChannel::processing_state_e ClientTcpTranscoder::Connection::HandleRead() {
     return BoundChannel::DONE;
   }
 
+  if (framing_ == TcpFraming::Framed)
+    return HandleFrames();
+
   DecodeSessionProtector::Result result;
   while (from_server_encrypted_.Output()->LeftSize()) {
     // This TCP connection has not been bound to a session (yet?).
@@ -244,7 +336,18 @@ BoundChannel::processing_state_e ClientTcpTranscoder::Connection::HandleRead() {
 
     decoder_->End(from_server_cleartext_.Input());
     cleartext.LimitLeftSize(size);
-    session_->HandlePacket(key_, this, &cleartext);
+    if (decoder_->Compresses()) {
+      if (!decompressor_.get())
+        decompressor_.reset(new StreamDecompressor);
+      Buffer decompressed;
+      if (!decompressor_->Decompress(&cleartext, decompressed.Input())) {
+        HandleError(session_, ClientConnectedSession::Decoding, "could not decompress packet");
+        return BoundChannel::DONE;
+      }
+      session_->HandlePacket(key_, this, decompressed.Output());
+    } else {
+      session_->HandlePacket(key_, this, &cleartext);
+    }
 
     session_ = NULL;
     decoder_ = NULL;
@@ -260,3 +363,104 @@ BoundChannel::processing_state_e ClientTcpTranscoder::Connection::HandleRead() {
 
   return BoundChannel::MORE;
 }
+
+BoundChannel::processing_state_e ClientTcpTranscoder::Connection::HandleFrames() {
+  uint32_t size;
+  TcpFraming::Result framing;
+  while ((framing = TcpFraming::PeekFrame(
+              *from_server_encrypted_.Output(), &size)) == TcpFraming::Complete ||
+         framing == TcpFraming::Control) {
+    if (framing == TcpFraming::Control) {
+      from_server_encrypted_.Output()->Increment(sizeof(uint32_t));
+      if (!HandleControl(size))
+        return BoundChannel::DONE;
+      continue;
+    }
+
+    OutputCursor frame(*from_server_encrypted_.Output());
+    frame.Increment(sizeof(uint32_t));
+    frame.LimitLeftSize(size);
+
+    ClientConnectedSession* session(NULL);
+    ClientConnectedSession::State state(
+        manager_->GetSession(key_, &frame, &session));
+    if (state == ClientConnectedSession::NeedNewSession) {
+      session = manager_->CreateSession(key_, &frame, this);
+      if (!session) {
+        HandleError(session, ClientConnectedSession::Manager, "cannot create session");
+        return BoundChannel::DONE;
+      }
+    }
+
+    if (state == ClientConnectedSession::NeedNewSession ||
+        state == ClientConnectedSession::Ready)
+      state = session->IsReady(key_, &frame);
+
+    // The frame is complete, more data would not help.
+    if (state != ClientConnectedSession::Ready) {
+      HandleError(session, ClientConnectedSession::Manager, "could not determine session");
+      return BoundChannel::DONE;
+    }
+
+    // With kernel tls, the frame was decrypted already.
+    DecodeSessionProtector* decoder(session->GetDecoder());
+    Buffer cleartext;
+    OutputCursor* message(&frame);
+    if (!kernel_tls_.ReceivesClear()) {
+      if (decoder->DecodeFrame(&frame, cleartext.Input()) !=
+          DecodeSessionProtector::SUCCEEDED) {
+        HandleError(session, ClientConnectedSession::Decoding, "could not decode frame");
+        return BoundChannel::DONE;
+      }
+      message = cleartext.Output();
+    }
+
+    if (decoder->Compresses()) {
+      if (!decompressor_.get())
+        decompressor_.reset(new StreamDecompressor);
+      Buffer decompressed;
+      if (!decompressor_->Decompress(message, decompressed.Input())) {
+        HandleError(session, ClientConnectedSession::Decoding, "could not decompress packet");
+        return BoundChannel::DONE;
+      }
+      session->HandlePacket(key_, this, decompressed.Output());
+    } else {
+      session->HandlePacket(key_, this, message);
+    }
+
+    from_server_encrypted_.Output()->Increment(sizeof(uint32_t) + size);
+  }
+
+  if (framing == TcpFraming::Invalid) {
+    HandleError(NULL, ClientConnectedSession::Decoding, "frame too large");
+    return BoundChannel::DONE;
+  }
+  return BoundChannel::MORE;
+}
+
+bool ClientTcpTranscoder::Connection::HandleControl(uint32_t control) {
+  switch (control) {
+    case TcpFraming::kControlKernelTlsStart: {
+      // Keys come from the session on this connection, which must be
+      // authenticated by now: the server only starts after that.
+      ClientConnectedSession* session(NULL);
+      if (manager_->GetSession(key_, from_server_encrypted_.Output(), &session) !=
+              ClientConnectedSession::Ready ||
+          !kernel_tls_.HandleStart(channel_.get(), session->GetDecoder(),
+                                   &from_user_encrypted_) ||
+          from_server_encrypted_.Output()->LeftSize()) {
+        HandleError(session, ClientConnectedSession::Decoding, "could not start kernel tls");
+        return false;
+      }
+      channel_->WantWrite(&write_handler_);
+      return true;
+    }
+
+    case TcpFraming::kControlKernelTlsRefuse:
+      kernel_tls_.HandleRefuse();
+      return true;
+  }
+
+  HandleError(NULL, ClientConnectedSession::Decoding, "unexpected control value");
+  return false;
+}
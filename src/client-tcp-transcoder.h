@@ -6,6 +6,9 @@
 # include "client-transcoder.h"
 # include "packet-queue.h"
 # include "transport.h"
+# include "stream-compressor.h"
+# include "tcp-framing.h"
+# include "kernel-tls.h"
 
 class EncodeSessionProtector;
 class DecodeSessionProtector;
@@ -14,7 +17,10 @@ class Sockaddr;
 
 class ClientTcpTranscoder : public ClientTranscoder {
  public:
-  ClientTcpTranscoder();
+  // Framed or Unframed, see tcp-framing.h. With kernel_tls, framed
+  // connections ask the server to switch to kernel tls, see kernel-tls.h.
+  explicit ClientTcpTranscoder(TcpFraming::Mode framing = TcpFraming::Framed,
+                               bool kernel_tls = false);
 
   virtual Connection* Connect(
       Transport* transport, ClientConnectionManager* manager,
@@ -23,7 +29,8 @@ class ClientTcpTranscoder : public ClientTranscoder {
  private:
   class Connection : public ClientTranscoder::Connection {
    public:
-    Connection(BoundChannel* channel, ClientConnectionManager* manager);
+    Connection(BoundChannel* channel, ClientConnectionManager* manager,
+               TcpFraming::Mode framing, bool kernel_tls);
 
     const ConnectionKey& GetKey() const;
 
@@ -33,8 +40,13 @@ class ClientTcpTranscoder : public ClientTranscoder {
     InputCursor* Message();
     bool SendMessage(
         ClientConnectedSession* session, EncodeSessionProtector* encoder);
+    void BindKeys(uint32_t binding) { kernel_tls_.Bind(binding); }
 
    private:
+    // Same as SendMessage, on framed connections.
+    bool SendFrame(
+        ClientConnectedSession* session, EncodeSessionProtector* encoder);
+
     void HandleError(ClientConnectedSession* session,
 		     const ClientConnectedSession::CloseReason error, const char* message);
     BoundChannel::processing_state_e HandleDecodeError(
@@ -45,6 +57,11 @@ class ClientTcpTranscoder : public ClientTranscoder {
 
     BoundChannel::processing_state_e HandleWrite();
     BoundChannel::processing_state_e HandleRead();
+    // Decodes all the complete frames read so far, on framed connections.
+    BoundChannel::processing_state_e HandleFrames();
+    // Handles a TcpFraming control value. Returns false if the connection
+    // must be closed.
+    bool HandleControl(uint32_t control);
 
     ConnectionKey key_;
 
@@ -52,16 +69,29 @@ class ClientTcpTranscoder : public ClientTranscoder {
     ClientConnectedSession* session_;
     ClientConnectionManager* manager_;
     DecodeSessionProtector* decoder_;
+    // Packets on the connection are compressed with the previous ones
+    // as dictionary, if the session negotiated compression. Created on
+    // the first packet compressed.
+    auto_ptr<StreamCompressor> compressor_;
+    auto_ptr<StreamDecompressor> decompressor_;
+    TcpFraming::Mode framing_;
+    KernelTls kernel_tls_;
 
     const BoundChannel::event_handler_t read_handler_;
     const BoundChannel::event_handler_t write_handler_;
 
     Buffer from_user_cleartext_;
     Buffer from_user_encrypted_;
+    // On framed connections, the message being encoded, before its size
+    // is known.
+    Buffer frame_;
   
     Buffer from_server_encrypted_;
     Buffer from_server_cleartext_;
   };
+
+  TcpFraming::Mode framing_;
+  bool kernel_tls_;
 };
 
 #endif /* CLIENT_TCP_TRANSCODER_H */
@@ -41,6 +41,11 @@ class ClientTranscoder {
     virtual InputCursor* Message() = 0;
     virtual bool SendMessage(
         ClientConnectedSession* session, EncodeSessionProtector* encoder) = 0;
+
+    // Binds the keys the connection derives from its session (see
+    // SessionProtector::ExportKey) to binding: connections joined to a
+    // session must each use their own.
+    virtual void BindKeys(uint32_t binding) {}
   };
 
   ClientTranscoder() {}
@@ -2,6 +2,47 @@
 #include "transport.h"
 #include "client-authenticator.h"
 #include "serializers.h"
+#include "handshake-admission.h"
+#include "prng.h"
+
+const Timer::ms_timer_t ClientUdpTranscoder::kFecTickInterval;
+
+ClientUdpTranscoder::ClientUdpTranscoder(const char* hello_key)
+    : filter_(hello_key),
+      scheduler_(NULL),
+      fec_block_size_(0),
+      fec_ticking_(false),
+      fec_tick_handler_(bind(&ClientUdpTranscoder::FecTickHandler, this)),
+      fec_tick_event_("fec tick", &fec_tick_handler_) {
+}
+
+void ClientUdpTranscoder::EnableFec(EventScheduler* scheduler, int block_size) {
+  scheduler_ = scheduler;
+  fec_block_size_ = block_size;
+}
+
+void ClientUdpTranscoder::StartFecTick() {
+  if (fec_ticking_)
+    return;
+  fec_ticking_ = true;
+  fec_tick_event_.Start(scheduler_, kFecTickInterval);
+}
+
+bool ClientUdpTranscoder::FecTickHandler() {
+  fec_ticking_ = false;
+  Timer::ms_timer_t now(Timer().Milliseconds());
+  for (set<Connection*>::iterator it(fec_pending_.begin());
+       it != fec_pending_.end();) {
+    if ((*it)->HandleFecTick(now))
+      ++it;
+    else
+      fec_pending_.erase(it++);
+  }
+
+  if (!fec_pending_.empty())
+    StartFecTick();
+  return true;
+}
 
 ClientTranscoder::Connection* ClientUdpTranscoder::Connect(
     Transport* transport, ClientConnectionManager* manager,
@@ -12,17 +53,41 @@ ClientTranscoder::Connection* ClientUdpTranscoder::Connect(
     return NULL;
   }
 
-  return new Connection(socket, manager);
+  uint64_t id;
+  DefaultPrng::ForThisThread()->Get(reinterpret_cast<char*>(&id), sizeof(id));
+  return new Connection(this, socket, manager, id);
 }
 
 ClientUdpTranscoder::Connection::Connection(
-    BoundChannel* socket, ClientConnectionManager* manager)
-    : key_(this),
+    ClientUdpTranscoder* parent, BoundChannel* socket,
+    ClientConnectionManager* manager, uint64_t id)
+    : parent_(parent),
+      key_(this),
+      id_(id),
+      datagram_started_(false),
       socket_(socket),
       manager_(manager),
       server_read_handler_(bind(&ClientUdpTranscoder::Connection::HandleRead, this)),
-      server_write_handler_(bind(&ClientUdpTranscoder::Connection::HandleWrite, this)) {
+      server_write_handler_(bind(&ClientUdpTranscoder::Connection::HandleWrite, this)),
+      sequence_(0),
+      message_started_(false),
+      handshaking_(true),
+      challenges_(0),
+      hello_encoder_(NULL),
+      keyed_(false),
+      corrupted_(0),
+      fec_session_(NULL) {
+  Buffer clear_id;
+  EncodeToBuffer(id_, clear_id.Input());
+  clear_id.Output()->ConsumeString(&clear_id_);
+
   socket_->WantRead(&server_read_handler_);
+  if (parent_->scheduler_)
+    fec_encoder_.reset(new FecEncoder(parent_->fec_block_size_));
+}
+
+ClientUdpTranscoder::Connection::~Connection() {
+  parent_->fec_pending_.erase(this);
 }
 
 void ClientUdpTranscoder::Connection::HandleError(
@@ -58,6 +123,47 @@ BoundChannel::processing_state_e ClientUdpTranscoder::Connection::HandleWrite()
   return DatagramChannel::MORE;
 }
 
+InputCursor* ClientUdpTranscoder::Connection::Datagram() {
+  InputCursor* datagram(queue_.ToQueue());
+  if (!datagram_started_) {
+    EncodeToBuffer(id_, datagram);
+    datagram_started_ = true;
+  }
+  return datagram;
+}
+
+void ClientUdpTranscoder::Connection::DatagramQueued() {
+  queue_.Queued();
+  datagram_started_ = false;
+}
+
+void ClientUdpTranscoder::Connection::QueueHello(const string& hello) {
+  parent_->filter_.AddHello(id_, hello, Datagram());
+  DatagramQueued();
+}
+
+bool ClientUdpTranscoder::Connection::HandleChallenge(OutputCursor* packet) {
+  string cookie;
+  if (!handshaking_ || hello_.empty() ||
+      !HandshakeAdmission::ParseChallenge(*packet, &cookie))
+    return false;
+
+  if (++challenges_ > kMaxChallenges) {
+    LOG_ERROR("server keeps challenging us, ignoring challenge");
+    return true;
+  }
+
+  LOG_DEBUG("server is under load, sending hello again with cookie");
+  Buffer hello;
+  HandshakeAdmission::AddCookie(cookie, hello.Input());
+  hello.Input()->Add(hello_);
+  string withcookie;
+  hello.Output()->ConsumeString(&withcookie);
+  QueueHello(withcookie);
+  socket_->WantWrite(&server_write_handler_);
+  return true;
+}
+
 BoundChannel::processing_state_e
     ClientUdpTranscoder::Connection::HandleRead() {
   LOG_DEBUG();
@@ -71,6 +177,9 @@ BoundChannel::processing_state_e
     return DatagramChannel::MORE;
   }
 
+  if (HandleChallenge(packet.Output()))
+    return DatagramChannel::MORE;
+
   ClientConnectedSession* session;
   ClientConnectedSession::State state(
       manager_->GetSession(key_, packet.Output(), &session));
@@ -99,11 +208,48 @@ BoundChannel::processing_state_e
   DecodeSessionProtector::Result result;
   result = decoder->Decode(packet.Output(), decoded.Input());
   if (result != DecodeSessionProtector::SUCCEEDED) {
+    // Once frames are authenticated, this one is forged or corrupted:
+    // anyone spoofing the server address must not be able to close us.
+    if (decoder->Authenticates()) {
+      ++corrupted_;
+      LOG_DEBUG("dropping undecodable packet, %llu dropped so far",
+                (unsigned long long)corrupted_);
+      return DatagramChannel::MORE;
+    }
     HandleError(session, this, ClientConnectedSession::Truncated,
                 "decoding failed - truncated packet?");
     return DatagramChannel::MORE;
   }
 
+  uint64_t sequence;
+  if (DecodeFromBuffer(decoded.Output(), &sequence)) {
+    HandleError(session, this, ClientConnectedSession::Truncated,
+                "packet too short to have a sequence number");
+    return DatagramChannel::MORE;
+  }
+  if (sequence & FecEncoder::kRepairFlag) {
+    if (decoder->Authenticates())
+      HandleRepair(session, sequence & ~FecEncoder::kRepairFlag,
+                   decoded.Output());
+    return DatagramChannel::MORE;
+  }
+  // Until keys are agreed, anyone can send packets that decode: they must
+  // not be able to move the window.
+  ReplayWindow::Result fresh(decoder->Authenticates() ?
+      window_.Check(sequence) : window_.Test(sequence));
+  if (fresh != ReplayWindow::Accepted) {
+    LOG_DEBUG("dropping packet %llu, %llu replayed, %llu too old so far",
+              (unsigned long long)sequence,
+              (unsigned long long)window_.ReplayedCount(),
+              (unsigned long long)window_.TooOldCount());
+    return DatagramChannel::MORE;
+  }
+  if (handshaking_) {
+    handshaking_ = false;
+    hello_.clear();
+  }
+  fec_decoder_.Add(sequence, *decoded.Output());
+
   // TODO: same as above, handle partial packets. This means that we might
   // need to keep a queue of incoming packets, and try to decode them in
   // sequence. Unless we keep some headers in the clear, that's going to be
@@ -113,34 +259,125 @@ BoundChannel::processing_state_e
   return DatagramChannel::MORE;
 }
 
+void ClientUdpTranscoder::Connection::HandleRepair(
+    ClientConnectedSession* session, uint64_t first, OutputCursor* repair) {
+  vector<string> recovered;
+  if (!fec_decoder_.HandleRepair(first, repair, &recovered)) {
+    LOG_DEBUG("dropping malformed repair for block %llu",
+              (unsigned long long)first);
+    return;
+  }
+
+  for (vector<string>::iterator it(recovered.begin());
+       it != recovered.end(); ++it) {
+    Buffer message;
+    message.Input()->Add(*it);
+    uint64_t sequence;
+    if (DecodeFromBuffer(message.Output(), &sequence) ||
+        window_.Check(sequence) != ReplayWindow::Accepted)
+      continue;
+
+    LOG_DEBUG("recovered packet %llu", (unsigned long long)sequence);
+    session->HandlePacket(key_, this, message.Output());
+  }
+}
+
 InputCursor* ClientUdpTranscoder::Connection::Message() {
+  if (!message_started_) {
+    EncodeToBuffer(sequence_++, buffer_.Input());
+    message_started_ = true;
+  }
   return buffer_.Input();
 }
 
 InputCursor* ClientUdpTranscoder::Connection::Header() {
-  return queue_.ToQueue();
+  return Datagram();
 }
 
 void ClientUdpTranscoder::Connection::Close() {
-  // TODO: close socket.
-  // TODO: who deletes this object?
+  // The socket goes away with this object, deleted by the session: send
+  // what is still queued now, or it would be lost. Best effort, as any
+  // other datagram.
+  while (queue_.Pending()) {
+    socket_->Write(queue_.ToSend()->Output());
+    queue_.Sent();
+  }
 }
 
 bool ClientUdpTranscoder::Connection::SendMessage(
     ClientConnectedSession* session, EncodeSessionProtector* encoder) {
   LOG_DEBUG();
 
+  // Make sure the sequence number is there, even for empty messages.
+  Message();
+  message_started_ = false;
+  if (encoder && !hello_encoder_)
+    hello_encoder_ = encoder;
+  else if (encoder && encoder != hello_encoder_)
+    keyed_ = true;
+  bool full = fec_encoder_.get() && !handshaking_ && keyed_ &&
+      encoder == session->GetEncoder() && ProtectMessage(session);
+
+  // The hello is kept aside, in case the server challenges us.
+  Buffer hello;
+  bool keep = handshaking_ && hello_.empty();
+  InputCursor* datagram(keep ? hello.Input() : Datagram());
   if (encoder) {
-    if (!encoder->Encode(buffer_.Output(), queue_.ToQueue())) {
+    if (!encoder->EncodeBound(clear_id_, buffer_.Output(), datagram)) {
       LOG_ERROR("encoding failed");
       // TODO: handle errors!
       return false;
     }
   } else {
-    EncodeToBuffer(buffer_.Output(), queue_.ToQueue());
+    EncodeToBuffer(buffer_.Output(), datagram);
   }
 
-  queue_.Queued();
+  if (keep) {
+    hello.Output()->ConsumeString(&hello_);
+    QueueHello(hello_);
+  } else {
+    DatagramQueued();
+  }
+  if (full)
+    SendRepairs();
   socket_->WantWrite(&server_write_handler_);
   return true;
 }
+
+bool ClientUdpTranscoder::Connection::ProtectMessage(
+    ClientConnectedSession* session) {
+  OutputCursor message(*buffer_.Output());
+  uint64_t sequence;
+  DecodeFromBuffer(&message, &sequence);
+
+  fec_session_ = session;
+  bool full = fec_encoder_->Add(sequence, message, Timer().Milliseconds());
+  parent_->fec_pending_.insert(this);
+  parent_->StartFecTick();
+  return full;
+}
+
+void ClientUdpTranscoder::Connection::SendRepairs() {
+  vector<string> repairs;
+  fec_encoder_->SetPeerLoss(fec_decoder_.PeerLoss());
+  fec_encoder_->Close(fec_decoder_.Loss(), &repairs);
+
+  EncodeSessionProtector* encoder(fec_session_->GetEncoder());
+  for (vector<string>::iterator it(repairs.begin()); it != repairs.end(); ++it) {
+    Buffer repair;
+    repair.Input()->Add(*it);
+    if (!encoder->EncodeBound(clear_id_, repair.Output(), Datagram())) {
+      LOG_ERROR("encoding repair failed");
+      return;
+    }
+    DatagramQueued();
+  }
+}
+
+bool ClientUdpTranscoder::Connection::HandleFecTick(Timer::ms_timer_t now) {
+  if (fec_encoder_->Expired(now)) {
+    SendRepairs();
+    socket_->WantWrite(&server_write_handler_);
+  }
+  return fec_encoder_->Pending();
+}
@@ -6,6 +6,12 @@
 # include "packet-queue.h"
 # include "transport.h"
 # include "client-connection-manager.h"
+# include "replay-window.h"
+# include "hello-filter.h"
+# include "event-scheduler.h"
+# include "fec.h"
+
+# include <set>
 
 class SessionProtector;
 class BoundChannel;
@@ -14,16 +20,30 @@ class Sockaddr;
 class ClientUdpTranscoder : public ClientTranscoder {
  public:
   static const int kMaxPacketSize = 8192;
+  // How often blocks not full yet are checked, and closed if they have
+  // been open for too long, see FecEncoder.
+  static const Timer::ms_timer_t kFecTickInterval = 5;
+
+  // hello_key tags the first datagram of each connection, see
+  // hello-filter.h. NULL uses the default key.
+  explicit ClientUdpTranscoder(const char* hello_key = NULL);
 
   virtual Connection* Connect(
       Transport* transport, ClientConnectionManager* manager,
       const Sockaddr& address);
 
+  // Sends repairs for the messages of connections, once the handshake is
+  // over, in blocks of block_size, see fec.h. Repairs received are always
+  // used, whether this is called or not.
+  void EnableFec(EventScheduler* scheduler, int block_size);
+
  private:
   class Connection : public ClientTranscoder::Connection {
    public:
     Connection(
-        BoundChannel* channel, ClientConnectionManager* manager);
+        ClientUdpTranscoder* parent, BoundChannel* channel,
+        ClientConnectionManager* manager, uint64_t id);
+    ~Connection();
 
     const ConnectionKey& GetKey() const;
 
@@ -34,7 +54,28 @@ class ClientUdpTranscoder : public ClientTranscoder {
     bool SendMessage(
         ClientConnectedSession* session, EncodeSessionProtector* encoder);
 
+    // Sends the repairs of the current block, if it has been open for too
+    // long. Returns true if a block is still open.
+    bool HandleFecTick(Timer::ms_timer_t now);
+
    private:
+    // A server under load may answer our hello with a challenge, see
+    // handshake-admission.h. At most kMaxChallenges are honored.
+    static const int kMaxChallenges = 3;
+
+    // Returns the datagram being built, starting with our connection id.
+    InputCursor* Datagram();
+    void DatagramQueued();
+    // Queues a datagram with hello, tagged so the server doesn't drop it.
+    void QueueHello(const string& hello);
+
+    bool HandleChallenge(OutputCursor* packet);
+    // Adds the message in buffer_ to the current block. Returns true if
+    // the block is full, and its repairs should be sent.
+    bool ProtectMessage(ClientConnectedSession* session);
+    void SendRepairs();
+    void HandleRepair(
+        ClientConnectedSession* session, uint64_t first, OutputCursor* repair);
     BoundChannel::processing_state_e HandleRead();
     BoundChannel::processing_state_e HandleWrite();
     void HandleError(
@@ -42,7 +83,14 @@ class ClientUdpTranscoder : public ClientTranscoder {
         ClientTranscoder::Connection* connection,
         ClientConnectedSession::CloseReason error, const char* message);
 
+    ClientUdpTranscoder* parent_;
     ConnectionKey key_;
+    // Sent in front of each datagram, so the server can tell who we are
+    // even if our address changes. See server-udp-transcoder.h.
+    const uint64_t id_;
+    // id_ as sent, bound to each frame so the server can trust it.
+    string clear_id_;
+    bool datagram_started_;
 
     auto_ptr<BoundChannel> socket_;
     ClientConnectionManager* manager_;
@@ -51,8 +99,45 @@ class ClientUdpTranscoder : public ClientTranscoder {
     BoundChannel::event_handler_t server_read_handler_;
     BoundChannel::event_handler_t server_write_handler_;
 
+    // Each message starts with a sequence number, added the first time
+    // Message() is called.
+    uint64_t sequence_;
+    bool message_started_;
+    ReplayWindow window_;
+
+    // Copy of the first datagram sent, until the server replies with
+    // something other than a challenge.
+    bool handshaking_;
+    int challenges_;
+    string hello_;
+    // The encoder of the first message. Messages are only protected once
+    // a different one is used: the session has keys of its own.
+    const EncodeSessionProtector* hello_encoder_;
+    bool keyed_;
+    // Datagrams dropped as they failed to decode once keyed.
+    uint64_t corrupted_;
+
+    // Created only if fec is enabled. fec_session_ is the session that
+    // protected the last message, its encoder is used for the repairs.
+    auto_ptr<FecEncoder> fec_encoder_;
+    ClientConnectedSession* fec_session_;
+    FecDecoder fec_decoder_;
+
     Buffer buffer_;
   };
+
+  void StartFecTick();
+  bool FecTickHandler();
+
+  HelloFilter filter_;
+
+  EventScheduler* scheduler_;
+  int fec_block_size_;
+  // Connections with a block open.
+  set<Connection*> fec_pending_;
+  bool fec_ticking_;
+  EventScheduler::Event::timer_handler_t fec_tick_handler_;
+  OneOffEvent fec_tick_event_;
 };
 
 #endif /* SIMPLE_UDP_TRANSCODER_H */
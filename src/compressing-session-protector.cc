@@ -0,0 +1,286 @@
+#include "compressing-session-protector.h"
+#include "serializers.h"
+#include "buffer.h"
+#include "timers.h"
+#include "hash.h"
+
+#include "../lib/lz4/lz4.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+const uint8_t CompressingSessionEncoder::kFrameRaw;
+const uint8_t CompressingSessionEncoder::kFrameLz4;
+const int CompressingSessionEncoder::kMinFrameSize;
+const int CompressingSessionEncoder::kSampleSize;
+const int CompressingSessionEncoder::kMaxDistinct;
+const int CompressingSessionEncoder::kMinSavings;
+const int CompressingSessionEncoder::kFlows;
+const uint16_t CompressingSessionEncoder::kMaxBackoff;
+const int CompressingSessionEncoder::kPacketOffset;
+
+// LZ4_compress64kCtx only takes inputs below 64k, and the original size
+// is sent as an uint16.
+static const int kMaxCompressedFrame = 65535;
+
+CompressingSessionEncoder::CompressingSessionEncoder(
+    EncodeSessionProtector* encoder)
+    : encoder_(encoder),
+      lz4_context_(NULL),
+      frames_(0),
+      compressed_(0),
+      skipped_(0),
+      sampled_out_(0),
+      bytes_in_(0),
+      bytes_out_(0),
+      microseconds_(0) {
+  memset(flows_, 0, sizeof(flows_));
+}
+
+CompressingSessionEncoder::~CompressingSessionEncoder() {
+  free(lz4_context_);
+  if (!frames_)
+    return;
+
+  LOG_INFO("compression: %llu frames, %llu compressed, %llu skipped, "
+           "%llu sampled out, %llu -> %llu bytes (%.1f%%), %llu us spent",
+           (unsigned long long)frames_, (unsigned long long)compressed_,
+           (unsigned long long)skipped_, (unsigned long long)sampled_out_,
+           (unsigned long long)bytes_in_, (unsigned long long)bytes_out_,
+           bytes_in_ ? 100.0 * bytes_out_ / bytes_in_ : 100.0,
+           (unsigned long long)microseconds_);
+}
+
+CompressingSessionEncoder::Flow* CompressingSessionEncoder::GetFlow(
+    const string& frame) {
+  // Addresses, protocol and, if there, ports. Anything that does not look
+  // like an IP packet ends up in the first flow.
+  const unsigned char* packet(
+      reinterpret_cast<const unsigned char*>(frame.data()) + kPacketOffset);
+  int size(frame.size() - kPacketOffset);
+  char key[2 * 16 + 1 + 4];
+  int keysize(0);
+  int transport(0);
+  if (size >= 20 && (packet[0] >> 4) == 4 &&
+      ((packet[2] << 8) | packet[3]) == size) {
+    memcpy(key, packet + 12, 8);
+    key[8] = packet[9];
+    keysize = 9;
+    transport = (packet[0] & 0x0f) * 4;
+  } else if (size >= 40 && (packet[0] >> 4) == 6 &&
+             ((packet[4] << 8) | packet[5]) + 40 == size) {
+    memcpy(key, packet + 8, 32);
+    key[32] = packet[6];
+    keysize = 33;
+    transport = 40;
+  } else {
+    return &flows_[0];
+  }
+
+  // TCP, UDP, SCTP, and such all start with the ports.
+  if (transport >= 20 && transport + 4 <= size) {
+    memcpy(key + keysize, packet + transport, 4);
+    keysize += 4;
+  }
+  return &flows_[FNVHash(key, keysize, 0) % kFlows];
+}
+
+bool CompressingSessionEncoder::LooksRandom(const string& frame) {
+  uint32_t seen[256 / 32];
+  memset(seen, 0, sizeof(seen));
+
+  int distinct(0);
+  const unsigned char* sample(reinterpret_cast<const unsigned char*>(
+      frame.data() + frame.size() - kSampleSize));
+  for (int i = 0; i < kSampleSize; ++i) {
+    uint32_t bit(1 << (sample[i] & 31));
+    uint32_t* word(&seen[sample[i] >> 5]);
+    if (!(*word & bit)) {
+      *word |= bit;
+      ++distinct;
+    }
+  }
+  return distinct > kMaxDistinct;
+}
+
+bool CompressingSessionEncoder::Compress(
+    const string& frame, string* compressed) {
+  compressed->resize(LZ4_compressBound(frame.size()));
+
+  uint64_t start(Timer().Microseconds());
+  int size(LZ4_compress64kCtx(&lz4_context_, frame.data(), &(*compressed)[0],
+                              frame.size()));
+  microseconds_ += Timer().Microseconds() - start;
+
+  // One byte of flag and two of size are needed on top.
+  int wanted(frame.size() - frame.size() / kMinSavings - 3);
+  if (size <= 0 || size > wanted)
+    return false;
+  compressed->resize(size);
+  return true;
+}
+
+bool CompressingSessionEncoder::Encode(
+    OutputCursor* input, InputCursor* output) {
+  return EncodeBound(string(), input, output);
+}
+
+bool CompressingSessionEncoder::EncodeBound(
+    const string& bound, OutputCursor* input, InputCursor* output) {
+  string frame;
+  input->ConsumeString(&frame);
+
+  ++frames_;
+  bytes_in_ += frame.size();
+
+  Buffer encoded;
+  string compressed;
+  Flow* flow(NULL);
+  bool tried(false);
+  bool worth(false);
+  if (frame.size() >= static_cast<size_t>(kMinFrameSize) &&
+      frame.size() <= static_cast<size_t>(kMaxCompressedFrame)) {
+    flow = GetFlow(frame);
+    if (flow->skip) {
+      --flow->skip;
+      ++skipped_;
+    } else if (LooksRandom(frame)) {
+      tried = true;
+      ++sampled_out_;
+    } else {
+      tried = true;
+      worth = Compress(frame, &compressed);
+    }
+  }
+
+  if (worth) {
+    ++compressed_;
+    flow->backoff = 0;
+    EncodeToBuffer(kFrameLz4, encoded.Input());
+    EncodeToBuffer(static_cast<uint16_t>(frame.size()), encoded.Input());
+    encoded.Input()->Add(compressed);
+    bytes_out_ += compressed.size() + 3;
+  } else {
+    // Tried and failed: leave the flow alone for a while.
+    if (tried) {
+      flow->backoff = flow->backoff ? flow->backoff * 2 : 1;
+      if (flow->backoff > kMaxBackoff)
+        flow->backoff = kMaxBackoff;
+      flow->skip = flow->backoff;
+    }
+    EncodeToBuffer(kFrameRaw, encoded.Input());
+    encoded.Input()->Add(frame);
+    bytes_out_ += frame.size() + 1;
+  }
+
+  return encoder_->EncodeBound(bound, encoded.Output(), output);
+}
+
+bool CompressingSessionEncoder::EncodeFrame(
+    OutputCursor* input, InputCursor* output) {
+  return encoder_->EncodeFrame(input, output);
+}
+
+bool CompressingSessionEncoder::Start(
+    InputCursor* output, StartOptions options) {
+  return encoder_->Start(output, options);
+}
+
+bool CompressingSessionEncoder::End(InputCursor* output) {
+  return encoder_->End(output);
+}
+
+bool CompressingSessionEncoder::Continue(
+    OutputCursor* input, InputCursor* output) {
+  return encoder_->Continue(input, output);
+}
+
+bool CompressingSessionEncoder::AddPadding(InputCursor* output, int datasize) {
+  return encoder_->AddPadding(output, datasize);
+}
+
+CompressingSessionDecoder::CompressingSessionDecoder(
+    DecodeSessionProtector* decoder)
+    : decoder_(decoder),
+      frames_(0),
+      compressed_(0),
+      corrupted_(0) {
+}
+
+CompressingSessionDecoder::~CompressingSessionDecoder() {
+  LOG_DEBUG("decompression: %llu frames, %llu compressed, %llu corrupted",
+            (unsigned long long)frames_, (unsigned long long)compressed_,
+            (unsigned long long)corrupted_);
+}
+
+DecodeSessionProtector::Result CompressingSessionDecoder::Decode(
+    OutputCursor* input, InputCursor* output) {
+  return DecodeBound(string(), input, output);
+}
+
+DecodeSessionProtector::Result CompressingSessionDecoder::DecodeBound(
+    const string& bound, OutputCursor* input, InputCursor* output) {
+  Buffer decoded;
+  Result result(decoder_->DecodeBound(bound, input, decoded.Input()));
+  if (result != SUCCEEDED)
+    return result;
+
+  ++frames_;
+  uint8_t type;
+  if (DecodeFromBuffer(decoded.Output(), &type)) {
+    ++corrupted_;
+    return CORRUPTED_DATA;
+  }
+
+  if (type == CompressingSessionEncoder::kFrameRaw) {
+    EncodeToBuffer(decoded.Output(), output);
+    return SUCCEEDED;
+  }
+
+  uint16_t size;
+  if (type != CompressingSessionEncoder::kFrameLz4 ||
+      DecodeFromBuffer(decoded.Output(), &size)) {
+    ++corrupted_;
+    return CORRUPTED_DATA;
+  }
+
+  string compressed;
+  decoded.Output()->ConsumeString(&compressed);
+  string frame(size, '\0');
+  // Never writes past size, whatever the peer sent.
+  if (compressed.empty() ||
+      LZ4_uncompress_unknownOutputSize(compressed.data(), &frame[0],
+                                       compressed.size(), size) != size) {
+    ++corrupted_;
+    return CORRUPTED_DATA;
+  }
+
+  ++compressed_;
+  output->Add(frame);
+  return SUCCEEDED;
+}
+
+DecodeSessionProtector::Result CompressingSessionDecoder::DecodeFrame(
+    OutputCursor* input, InputCursor* output) {
+  return decoder_->DecodeFrame(input, output);
+}
+
+DecodeSessionProtector::Result CompressingSessionDecoder::Start(
+    OutputCursor* input, InputCursor* output, StartOptions options) {
+  return decoder_->Start(input, output, options);
+}
+
+DecodeSessionProtector::Result CompressingSessionDecoder::End(
+    InputCursor* output) {
+  return decoder_->End(output);
+}
+
+DecodeSessionProtector::Result CompressingSessionDecoder::Continue(
+    OutputCursor* input, InputCursor* output, uint32_t until) {
+  return decoder_->Continue(input, output, until);
+}
+
+DecodeSessionProtector::Result CompressingSessionDecoder::RemovePadding(
+    OutputCursor* output, int datasize, uint8_t* padsize) {
+  return decoder_->RemovePadding(output, datasize, padsize);
+}
@@ -0,0 +1,144 @@
+#ifndef COMPRESSING_SESSION_PROTECTOR_H
+# define COMPRESSING_SESSION_PROTECTOR_H
+
+# include "protector.h"
+
+# include <stdint.h>
+# include <memory>
+# include <string>
+
+// Compresses frames with LZ4 before handing them to another encoder, used
+// when both peers negotiated SrpCapabilityCompression. After the inner
+// decoder, each frame is:
+//   <kFrameRaw (1 byte)><frame, as it was>
+//   <kFrameLz4 (1 byte)><original size (uint16)><lz4 compressed frame>
+//
+// Only whole frames, as passed to Encode() by the datagram transcoders,
+// are compressed. EncodeFrame and Start / Continue / End are passed to
+// the inner encoder untouched: the tcp transcoders compress packets
+// themselves before encoding them, with a StreamCompressor for each
+// connection.
+//
+// Most traffic is compressed already, or encrypted: TLS, ssh, video.
+// Compressing it is pure waste, so the encoder tries to guess first:
+//   - frames shorter than kMinFrameSize are never compressed.
+//   - kSampleSize bytes from the end of the frame are sampled. If they
+//     contain more than kMaxDistinct different values, they look random
+//     (random data would have ~56 out of 64), and the frame is sent raw.
+//   - otherwise the frame is compressed, and sent compressed only if it
+//     shrank by at least 1/kMinSavings.
+// Failed guesses are remembered per flow (IP addresses, protocol and
+// ports): the flow is not sampled again for a number of frames, doubling
+// up to kMaxBackoff at each new failure. Flows live in a table of kFlows
+// entries indexed by a hash, colliding flows just share the entry.
+class CompressingSessionEncoder : public EncodeSessionProtector {
+ public:
+  static const uint8_t kFrameRaw = 0;
+  static const uint8_t kFrameLz4 = 1;
+
+  static const int kMinFrameSize = 128;
+  static const int kSampleSize = 64;
+  static const int kMaxDistinct = 48;
+  static const int kMinSavings = 16;
+  static const int kFlows = 256;
+  static const uint16_t kMaxBackoff = 128;
+  // Frames from the datagram transcoders start with a sequence number,
+  // the IP packet follows.
+  static const int kPacketOffset = sizeof(uint64_t);
+
+  // Takes ownership of encoder.
+  explicit CompressingSessionEncoder(EncodeSessionProtector* encoder);
+  virtual ~CompressingSessionEncoder();
+
+  virtual bool Compresses() const { return true; }
+  virtual bool ExportKey(const char* label, char* key, int size) const {
+    return encoder_->ExportKey(label, key, size);
+  }
+  virtual bool Encode(OutputCursor* input, InputCursor* output);
+  virtual bool EncodeBound(
+      const string& bound, OutputCursor* input, InputCursor* output);
+  virtual bool EncodeFrame(OutputCursor* input, InputCursor* output);
+
+  virtual bool Start(InputCursor* output, StartOptions options);
+  virtual bool End(InputCursor* output);
+  virtual bool Continue(OutputCursor* input, InputCursor* output);
+  virtual bool AddPadding(InputCursor* output, int datasize);
+
+  uint64_t FrameCount() const { return frames_; }
+  uint64_t CompressedCount() const { return compressed_; }
+  // Frames not even tried, as their flow was backing off, or the sample
+  // looked random.
+  uint64_t SkippedCount() const { return skipped_; }
+  uint64_t SampledOutCount() const { return sampled_out_; }
+  // Bytes of all frames before and after compression, and time spent in
+  // the compressor, in microseconds.
+  uint64_t BytesIn() const { return bytes_in_; }
+  uint64_t BytesOut() const { return bytes_out_; }
+  uint64_t CompressMicroseconds() const { return microseconds_; }
+
+ private:
+  struct Flow {
+    uint16_t backoff;
+    uint16_t skip;
+  };
+
+  Flow* GetFlow(const string& frame);
+  static bool LooksRandom(const string& frame);
+  // Returns true, and fills compressed, if it was worth compressing frame.
+  bool Compress(const string& frame, string* compressed);
+
+  auto_ptr<EncodeSessionProtector> encoder_;
+  void* lz4_context_;
+  Flow flows_[kFlows];
+
+  uint64_t frames_;
+  uint64_t compressed_;
+  uint64_t skipped_;
+  uint64_t sampled_out_;
+  uint64_t bytes_in_;
+  uint64_t bytes_out_;
+  uint64_t microseconds_;
+
+  NO_COPY(CompressingSessionEncoder);
+};
+
+// Decoder for frames produced by CompressingSessionEncoder.
+class CompressingSessionDecoder : public DecodeSessionProtector {
+ public:
+  // Takes ownership of decoder.
+  explicit CompressingSessionDecoder(DecodeSessionProtector* decoder);
+  virtual ~CompressingSessionDecoder();
+
+  virtual bool Compresses() const { return true; }
+  virtual bool ExportKey(const char* label, char* key, int size) const {
+    return decoder_->ExportKey(label, key, size);
+  }
+  virtual bool Authenticates() const { return decoder_->Authenticates(); }
+  virtual Result Decode(OutputCursor* input, InputCursor* output);
+  virtual Result DecodeBound(
+      const string& bound, OutputCursor* input, InputCursor* output);
+  virtual Result DecodeFrame(OutputCursor* input, InputCursor* output);
+
+  virtual Result Start(
+      OutputCursor* input, InputCursor* output, StartOptions options);
+  virtual Result End(InputCursor* output);
+  virtual Result Continue(
+      OutputCursor* input, InputCursor* output, uint32_t until=0);
+  virtual Result RemovePadding(
+      OutputCursor* output, int datasize, uint8_t* padsize);
+
+  uint64_t FrameCount() const { return frames_; }
+  uint64_t CompressedCount() const { return compressed_; }
+  uint64_t CorruptedCount() const { return corrupted_; }
+
+ private:
+  auto_ptr<DecodeSessionProtector> decoder_;
+
+  uint64_t frames_;
+  uint64_t compressed_;
+  uint64_t corrupted_;
+
+  NO_COPY(CompressingSessionDecoder);
+};
+
+#endif /* COMPRESSING_SESSION_PROTECTOR_H */
@@ -25,6 +25,31 @@ inline string ConvertToHex(const char* str, int size) {
   return hex;
 }
 
+// Returns false if hex has an odd number of digits, or something else.
+inline bool ConvertFromHex(const string& hex, string* data) {
+  if (hex.size() % 2)
+    return false;
+
+  data->clear();
+  for (unsigned int i = 0; i < hex.size(); i += 2) {
+    int value(0);
+    for (unsigned int j = i; j < i + 2; ++j) {
+      char ch(hex[j]);
+      value <<= 4;
+      if (ch >= '0' && ch <= '9')
+        value |= ch - '0';
+      else if (ch >= 'a' && ch <= 'f')
+        value |= ch - 'a' + 10;
+      else if (ch >= 'A' && ch <= 'F')
+        value |= ch - 'A' + 10;
+      else
+        return false;
+    }
+    data->push_back(static_cast<char>(value));
+  }
+  return true;
+}
+
 template<typename TYPE>
 inline string ToString(const TYPE& data) {
   stringstream ss;
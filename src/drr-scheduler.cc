@@ -0,0 +1,65 @@
+#include "drr-scheduler.h"
+#include "errors.h"
+
+#include <algorithm>
+
+const unsigned int DrrScheduler::kRoundBytes;
+const unsigned int DrrScheduler::kMinQuantum;
+
+DrrScheduler::DrrScheduler()
+    : active_(0),
+      turns_(0),
+      sent_(0) {
+}
+
+DrrScheduler::~DrrScheduler() {
+  LOG_DEBUG("drr: %llu turns, %llu bytes sent",
+            (unsigned long long)turns_, (unsigned long long)sent_);
+}
+
+unsigned int DrrScheduler::Quantum() const {
+  if (active_ <= 1)
+    return kRoundBytes;
+  return max(kRoundBytes / active_, kMinQuantum);
+}
+
+DrrScheduler::Flow::Flow(DrrScheduler* scheduler)
+    : scheduler_(scheduler),
+      deficit_(0),
+      active_(false) {
+}
+
+DrrScheduler::Flow::~Flow() {
+  if (active_)
+    --scheduler_->active_;
+}
+
+unsigned int DrrScheduler::Flow::Turn(unsigned int queued) {
+  if (!queued)
+    return 0;
+
+  if (!active_) {
+    active_ = true;
+    ++scheduler_->active_;
+  }
+  ++scheduler_->turns_;
+
+  deficit_ += scheduler_->Quantum();
+  return min(deficit_, queued);
+}
+
+void DrrScheduler::Flow::Sent(unsigned int sent, unsigned int queued) {
+  scheduler_->sent_ += sent;
+  deficit_ -= min(sent, deficit_);
+
+  if (!queued) {
+    deficit_ = 0;
+    if (active_) {
+      active_ = false;
+      --scheduler_->active_;
+    }
+    return;
+  }
+
+  deficit_ = min(deficit_, scheduler_->Quantum());
+}
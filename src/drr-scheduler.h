@@ -0,0 +1,67 @@
+#ifndef DRR_SCHEDULER_H
+# define DRR_SCHEDULER_H
+
+# include "base.h"
+# include "macros.h"
+
+# include <stdint.h>
+
+// Deficit round robin (Shreedhar and Varghese, 1995) between the
+// connections sharing the server egress.
+//
+// The dispatcher calls the write handler of each connection with data
+// queued once per iteration: that's the round. At each turn, a flow gets
+// a quantum of bytes added to its deficit, and can send up to its
+// deficit. Flows with megabytes queued can't monopolize an iteration, and
+// flows sending large and small messages get the same share of bytes.
+//
+// The quantum is a share of kRoundBytes among the flows with data queued,
+// no less than kMinQuantum, so a round sends about kRoundBytes no matter
+// how many flows there are. A flow that could not send what it was
+// allowed to (the socket buffer was full) keeps at most a quantum of
+// deficit, and one that emptied its queue keeps none.
+class DrrScheduler {
+ public:
+  static const unsigned int kRoundBytes = 1024 * 1024;
+  static const unsigned int kMinQuantum = 4 * 1024;
+
+  class Flow {
+   public:
+    explicit Flow(DrrScheduler* scheduler);
+    ~Flow();
+
+    // Called at the flow's turn, with queued bytes waiting to be sent.
+    // Returns how many of them can be sent now.
+    unsigned int Turn(unsigned int queued);
+    // Called after the turn, with the bytes sent, and those still queued.
+    void Sent(unsigned int sent, unsigned int queued);
+
+    unsigned int Deficit() const { return deficit_; }
+
+   private:
+    DrrScheduler* scheduler_;
+    unsigned int deficit_;
+    bool active_;
+
+    NO_COPY(Flow);
+  };
+
+  DrrScheduler();
+  ~DrrScheduler();
+
+  // Bytes added to the deficit of a flow at each turn.
+  unsigned int Quantum() const;
+
+  int ActiveFlows() const { return active_; }
+  uint64_t TurnCount() const { return turns_; }
+  uint64_t SentBytes() const { return sent_; }
+
+ private:
+  int active_;
+  uint64_t turns_;
+  uint64_t sent_;
+
+  NO_COPY(DrrScheduler);
+};
+
+#endif /* DRR_SCHEDULER_H */
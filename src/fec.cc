@@ -0,0 +1,492 @@
+#include "fec.h"
+#include "serializers.h"
+#include "errors.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# define FEC_SSSE3
+# include <tmmintrin.h>
+#endif
+
+const int ReedSolomon::kMaxData;
+const int ReedSolomon::kMaxRepair;
+
+const uint64_t FecEncoder::kRepairFlag;
+const int FecEncoder::kDefaultBlockSize;
+const Timer::ms_timer_t FecEncoder::kMaxBlockDelay;
+
+const int FecDecoder::kMaxHeld;
+const int FecDecoder::kMaxBlocks;
+const uint32_t FecDecoder::kLossSample;
+
+namespace {
+
+// Powers of 2, the generator, and their logarithms. exp is twice as long
+// as needed, so the sum of two logarithms can be looked up directly.
+struct Gf256Tables {
+  Gf256Tables() {
+    unsigned int value(1);
+    for (int i = 0; i < 255; ++i) {
+      exp[i] = exp[i + 255] = static_cast<uint8_t>(value);
+      log[value] = static_cast<uint8_t>(i);
+      value <<= 1;
+      if (value & 0x100)
+        value ^= 0x11d;
+    }
+    exp[510] = exp[511] = exp[0];
+    log[0] = 0;
+  }
+
+  uint8_t exp[512];
+  uint8_t log[256];
+};
+
+const Gf256Tables& Tables() {
+  static const Gf256Tables tables;
+  return tables;
+}
+
+// <size (uint16)><message>, padded with zeros to size.
+void MakeSymbol(const string& message, unsigned int size, string* symbol) {
+  Buffer buffer;
+  EncodeToBuffer(static_cast<uint16_t>(message.size()), buffer.Input());
+  buffer.Output()->ConsumeString(symbol);
+  symbol->append(message);
+  symbol->resize(size, '\0');
+}
+
+bool ParseSymbol(const string& symbol, string* message) {
+  Buffer buffer;
+  buffer.Input()->Add(symbol);
+  uint16_t size;
+  if (DecodeFromBuffer(buffer.Output(), &size) ||
+      size > buffer.Output()->LeftSize())
+    return false;
+  buffer.Output()->ConsumeString(message, size);
+  return true;
+}
+
+const uint8_t* Bytes(const string& str) {
+  return reinterpret_cast<const uint8_t*>(str.data());
+}
+
+uint8_t* Bytes(string* str) {
+  return reinterpret_cast<uint8_t*>(&(*str)[0]);
+}
+
+}  // namespace
+
+uint8_t Gf256::Multiply(uint8_t first, uint8_t second) {
+  if (!first || !second)
+    return 0;
+  const Gf256Tables& tables(Tables());
+  return tables.exp[tables.log[first] + tables.log[second]];
+}
+
+uint8_t Gf256::Inverse(uint8_t value) {
+  const Gf256Tables& tables(Tables());
+  return tables.exp[255 - tables.log[value]];
+}
+
+void Gf256::MultiplyAddScalar(uint8_t factor, const uint8_t* source,
+                              uint8_t* destination, unsigned int size) {
+  if (!factor)
+    return;
+
+  const Gf256Tables& tables(Tables());
+  const uint8_t* exp(tables.exp + tables.log[factor]);
+  for (unsigned int i = 0; i < size; ++i) {
+    if (source[i])
+      destination[i] ^= exp[tables.log[source[i]]];
+  }
+}
+
+#ifdef FEC_SSSE3
+namespace {
+
+// Built for SSSE3 whatever the flags, only called if the cpu has it.
+__attribute__((target("ssse3")))
+void MultiplyAddSsse3(uint8_t factor, const uint8_t* source,
+                      uint8_t* destination, unsigned int size) {
+  uint8_t low[16], high[16];
+  for (int i = 0; i < 16; ++i) {
+    low[i] = Gf256::Multiply(factor, static_cast<uint8_t>(i));
+    high[i] = Gf256::Multiply(factor, static_cast<uint8_t>(i << 4));
+  }
+  const __m128i low_table(_mm_loadu_si128(reinterpret_cast<const __m128i*>(low)));
+  const __m128i high_table(_mm_loadu_si128(reinterpret_cast<const __m128i*>(high)));
+  const __m128i mask(_mm_set1_epi8(0x0f));
+
+  unsigned int done(0);
+  for (; done + 16 <= size; done += 16) {
+    __m128i input(_mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(source + done)));
+    __m128i product(_mm_xor_si128(
+        _mm_shuffle_epi8(low_table, _mm_and_si128(input, mask)),
+        _mm_shuffle_epi8(high_table,
+                         _mm_and_si128(_mm_srli_epi64(input, 4), mask))));
+    __m128i* output(reinterpret_cast<__m128i*>(destination + done));
+    _mm_storeu_si128(output, _mm_xor_si128(_mm_loadu_si128(output), product));
+  }
+  Gf256::MultiplyAddScalar(factor, source + done, destination + done,
+                           size - done);
+}
+
+bool HasSsse3() {
+  static const bool supported(
+      (__builtin_cpu_init(), __builtin_cpu_supports("ssse3")));
+  return supported;
+}
+
+}  // namespace
+#endif
+
+void Gf256::MultiplyAdd(uint8_t factor, const uint8_t* source,
+                        uint8_t* destination, unsigned int size) {
+  if (!factor)
+    return;
+
+#ifdef FEC_SSSE3
+  if (HasSsse3()) {
+    MultiplyAddSsse3(factor, source, destination, size);
+    return;
+  }
+#endif
+  MultiplyAddScalar(factor, source, destination, size);
+}
+
+uint8_t ReedSolomon::Coefficient(int repair, int data) {
+  return Gf256::Inverse(static_cast<uint8_t>((kMaxData + repair) ^ data));
+}
+
+void ReedSolomon::Encode(const vector<const string*>& data, int index,
+                         string* repair) {
+  unsigned int size(data.empty() ? 0 :
+                    static_cast<unsigned int>(data[0]->size()));
+  repair->assign(size, '\0');
+  for (unsigned int i = 0; i < data.size(); ++i)
+    Gf256::MultiplyAdd(Coefficient(index, i), Bytes(*data[i]), Bytes(repair),
+                       size);
+}
+
+bool ReedSolomon::Decode(const vector<const string*>& data,
+                         const vector<const string*>& repairs,
+                         const vector<int>& indexes,
+                         vector<string>* recovered) {
+  vector<int> missing;
+  for (unsigned int i = 0; i < data.size(); ++i)
+    if (!data[i])
+      missing.push_back(i);
+  if (missing.empty())
+    return true;
+  if (missing.size() > repairs.size())
+    return false;
+
+  // Takes out of the repairs what the data received contributed.
+  const int count(static_cast<int>(missing.size()));
+  const unsigned int size(static_cast<unsigned int>(repairs[0]->size()));
+  vector<string> left(count);
+  for (int row = 0; row < count; ++row) {
+    left[row] = *repairs[row];
+    for (unsigned int i = 0; i < data.size(); ++i) {
+      if (data[i])
+        Gf256::MultiplyAdd(Coefficient(indexes[row], i), Bytes(*data[i]),
+                           Bytes(&left[row]), size);
+    }
+  }
+
+  // Inverts the coefficients of the missing data, with Gauss-Jordan.
+  vector<uint8_t> matrix(count * count), inverse(count * count, 0);
+  for (int row = 0; row < count; ++row) {
+    for (int column = 0; column < count; ++column)
+      matrix[row * count + column] = Coefficient(indexes[row], missing[column]);
+    inverse[row * count + row] = 1;
+  }
+
+  for (int column = 0; column < count; ++column) {
+    int pivot(column);
+    while (pivot < count && !matrix[pivot * count + column])
+      ++pivot;
+    if (pivot == count)
+      return false;
+
+    for (int i = 0; i < count; ++i) {
+      swap(matrix[pivot * count + i], matrix[column * count + i]);
+      swap(inverse[pivot * count + i], inverse[column * count + i]);
+    }
+
+    uint8_t scale(Gf256::Inverse(matrix[column * count + column]));
+    for (int i = 0; i < count; ++i) {
+      matrix[column * count + i] = Gf256::Multiply(matrix[column * count + i], scale);
+      inverse[column * count + i] = Gf256::Multiply(inverse[column * count + i], scale);
+    }
+
+    for (int row = 0; row < count; ++row) {
+      uint8_t factor(matrix[row * count + column]);
+      if (row == column || !factor)
+        continue;
+      Gf256::MultiplyAdd(factor, &matrix[column * count], &matrix[row * count], count);
+      Gf256::MultiplyAdd(factor, &inverse[column * count], &inverse[row * count], count);
+    }
+  }
+
+  for (int column = 0; column < count; ++column) {
+    recovered->push_back(string(size, '\0'));
+    for (int row = 0; row < count; ++row)
+      Gf256::MultiplyAdd(inverse[column * count + row], Bytes(left[row]),
+                         Bytes(&recovered->back()), size);
+  }
+  return true;
+}
+
+FecEncoder::FecEncoder(int block_size)
+    : block_size_(block_size),
+      first_(0),
+      opened_(0),
+      largest_(0),
+      peer_loss_(0),
+      blocks_(0),
+      repairs_(0) {
+}
+
+FecEncoder::~FecEncoder() {
+  LOG_DEBUG("fec: %llu blocks, %llu repairs sent",
+            (unsigned long long)blocks_, (unsigned long long)repairs_);
+}
+
+bool FecEncoder::Add(uint64_t sequence, const OutputCursor& payload,
+                     Timer::ms_timer_t now) {
+  // Messages not protected in between, the block can't be recovered.
+  if (!block_.empty() && sequence != first_ + block_.size()) {
+    LOG_DEBUG("fec: sequence %llu out of block, dropping it",
+              (unsigned long long)sequence);
+    block_.clear();
+  }
+  if (block_.empty()) {
+    first_ = sequence;
+    opened_ = now;
+    largest_ = 0;
+  }
+
+  Buffer message;
+  EncodeToBuffer(sequence, message.Input());
+  OutputCursor copy(payload);
+  string data;
+  copy.ConsumeString(&data);
+  message.Input()->Add(data);
+
+  block_.push_back(string());
+  message.Output()->ConsumeString(&block_.back());
+  if (block_.back().size() > largest_)
+    largest_ = static_cast<unsigned int>(block_.back().size());
+  return static_cast<int>(block_.size()) >= block_size_;
+}
+
+bool FecEncoder::Expired(Timer::ms_timer_t now) const {
+  return !block_.empty() && now - opened_ >= kMaxBlockDelay;
+}
+
+int FecEncoder::RepairCount(int count) const {
+  int repairs((count * static_cast<int>(peer_loss_) * 2 + 999) / 1000);
+  int most(count < ReedSolomon::kMaxRepair ? count : ReedSolomon::kMaxRepair);
+  if (repairs < 1)
+    repairs = 1;
+  return repairs < most ? repairs : most;
+}
+
+void FecEncoder::Close(uint32_t loss, vector<string>* repairs) {
+  if (block_.empty())
+    return;
+
+  const unsigned int size(largest_ + sizeof(uint16_t));
+  vector<string> symbols(block_.size());
+  vector<const string*> data(block_.size());
+  for (unsigned int i = 0; i < block_.size(); ++i) {
+    MakeSymbol(block_[i], size, &symbols[i]);
+    data[i] = &symbols[i];
+  }
+
+  const int count(RepairCount(static_cast<int>(block_.size())));
+  for (int index = 0; index < count; ++index) {
+    Buffer repair;
+    EncodeToBuffer(first_ | kRepairFlag, repair.Input());
+    EncodeToBuffer(static_cast<uint8_t>(block_.size()), repair.Input());
+    EncodeToBuffer(static_cast<uint8_t>(index), repair.Input());
+    EncodeToBuffer(static_cast<uint16_t>(loss), repair.Input());
+
+    string symbol;
+    ReedSolomon::Encode(data, index, &symbol);
+    repair.Input()->Add(symbol);
+
+    repairs->push_back(string());
+    repair.Output()->ConsumeString(&repairs->back());
+  }
+
+  ++blocks_;
+  repairs_ += count;
+  block_.clear();
+}
+
+FecDecoder::FecDecoder()
+    : seen_repairs_(false),
+      started_(false),
+      highest_(0),
+      received_(0),
+      sample_highest_(0),
+      sample_received_(0),
+      loss_(0),
+      peer_loss_(0),
+      peer_block_size_(0),
+      recovered_(0) {
+}
+
+FecDecoder::~FecDecoder() {
+  if (seen_repairs_)
+    LOG_DEBUG("fec: %llu messages recovered, loss %u.%u%%",
+              (unsigned long long)recovered_, loss_ / 10, loss_ % 10);
+}
+
+void FecDecoder::HandleLoss(uint64_t sequence) {
+  if (!started_) {
+    started_ = true;
+    highest_ = sample_highest_ = sequence;
+    return;
+  }
+
+  ++received_;
+  if (sequence > highest_)
+    highest_ = sequence;
+  uint64_t sent(highest_ - sample_highest_);
+  if (sent < kLossSample)
+    return;
+
+  uint64_t arrived(received_ - sample_received_);
+  uint64_t lost(arrived < sent ? sent - arrived : 0);
+  loss_ = static_cast<uint32_t>((3 * loss_ + lost * 1000 / sent) / 4);
+  sample_highest_ = highest_;
+  sample_received_ = received_;
+}
+
+void FecDecoder::Hold(uint64_t sequence, const string& message) {
+  held_[sequence] = message;
+  while (held_.size() > static_cast<unsigned int>(kMaxHeld))
+    held_.erase(held_.begin());
+}
+
+void FecDecoder::Add(uint64_t sequence, const OutputCursor& payload) {
+  HandleLoss(sequence);
+  if (!seen_repairs_)
+    return;
+
+  Buffer message;
+  EncodeToBuffer(sequence, message.Input());
+  OutputCursor copy(payload);
+  string data;
+  copy.ConsumeString(&data);
+  message.Input()->Add(data);
+
+  string held;
+  message.Output()->ConsumeString(&held);
+  Hold(sequence, held);
+}
+
+bool FecDecoder::HandleRepair(uint64_t first, OutputCursor* repair,
+                              vector<string>* recovered) {
+  uint8_t count, index;
+  uint16_t loss;
+  if (DecodeFromBuffer(repair, &count) || DecodeFromBuffer(repair, &index) ||
+      DecodeFromBuffer(repair, &loss) || !count ||
+      count > ReedSolomon::kMaxData || index >= ReedSolomon::kMaxRepair ||
+      repair->LeftSize() < sizeof(uint16_t))
+    return false;
+
+  seen_repairs_ = true;
+  peer_loss_ = loss;
+  if (count > peer_block_size_)
+    peer_block_size_ = count;
+
+  BlockMap::iterator it(blocks_.find(first));
+  if (it == blocks_.end()) {
+    // Older than anything we still remember.
+    if (blocks_.size() >= static_cast<unsigned int>(kMaxBlocks) &&
+        first < blocks_.begin()->first)
+      return true;
+
+    it = blocks_.insert(make_pair(first, Block())).first;
+    it->second.count = count;
+    if (blocks_.size() > static_cast<unsigned int>(kMaxBlocks))
+      blocks_.erase(blocks_.begin());
+  }
+
+  Block* block(&it->second);
+  if (block->done)
+    return true;
+  if (block->count != count)
+    return false;
+
+  string symbol;
+  repair->ConsumeString(&symbol);
+  if (!block->repairs.empty() &&
+      block->repairs.begin()->second.size() != symbol.size())
+    return false;
+  block->repairs[index].swap(symbol);
+  return Recover(first, block, recovered);
+}
+
+bool FecDecoder::Recover(uint64_t first, Block* block,
+                         vector<string>* recovered) {
+  const unsigned int size(
+      static_cast<unsigned int>(block->repairs.begin()->second.size()));
+  vector<string> symbols(block->count);
+  vector<const string*> data(block->count, static_cast<const string*>(NULL));
+  vector<uint64_t> missing;
+  for (int i = 0; i < block->count; ++i) {
+    HeldMap::const_iterator held(held_.find(first + i));
+    if (held == held_.end()) {
+      missing.push_back(first + i);
+      continue;
+    }
+    if (held->second.size() + sizeof(uint16_t) > size)
+      return false;
+    MakeSymbol(held->second, size, &symbols[i]);
+    data[i] = &symbols[i];
+  }
+
+  // Nothing to do, or wait for more repairs.
+  if (missing.empty())
+    block->done = true;
+  if (missing.empty() || missing.size() > block->repairs.size())
+    return true;
+
+  vector<const string*> repairs;
+  vector<int> indexes;
+  for (map<int, string>::const_iterator it(block->repairs.begin());
+       it != block->repairs.end(); ++it) {
+    repairs.push_back(&it->second);
+    indexes.push_back(it->first);
+  }
+
+  vector<string> decoded;
+  block->done = true;
+  if (!ReedSolomon::Decode(data, repairs, indexes, &decoded))
+    return false;
+
+  for (unsigned int i = 0; i < decoded.size(); ++i) {
+    string message;
+    if (!ParseSymbol(decoded[i], &message))
+      return false;
+
+    // The sequence number is part of what was protected.
+    Buffer check;
+    check.Input()->Add(message);
+    uint64_t sequence;
+    if (DecodeFromBuffer(check.Output(), &sequence) || sequence != missing[i])
+      return false;
+
+    Hold(sequence, message);
+    recovered->push_back(message);
+    ++recovered_;
+  }
+  return true;
+}
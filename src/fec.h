@@ -0,0 +1,175 @@
+#ifndef FEC_H
+# define FEC_H
+
+# include "base.h"
+# include "macros.h"
+# include "buffer.h"
+# include "timers.h"
+
+# include <stdint.h>
+# include <map>
+# include <string>
+# include <vector>
+
+// Arithmetic in GF(2^8), modulo x^8 + x^4 + x^3 + x^2 + 1 (0x11d), as
+// most Reed-Solomon codes use.
+class Gf256 {
+ public:
+  static uint8_t Multiply(uint8_t first, uint8_t second);
+  // value must not be 0.
+  static uint8_t Inverse(uint8_t value);
+
+  // destination[i] ^= factor * source[i], for size bytes. On x86 cpus
+  // with SSSE3, checked at run time, 16 bytes at a time: the products of
+  // the low and high nibbles of each byte are looked up in two 16 entries
+  // tables with PSHUFB, and xored together.
+  static void MultiplyAdd(uint8_t factor, const uint8_t* source,
+                          uint8_t* destination, unsigned int size);
+  // Same, a byte at a time, with log and exp tables.
+  static void MultiplyAddScalar(uint8_t factor, const uint8_t* source,
+                                uint8_t* destination, unsigned int size);
+};
+
+// Systematic Reed-Solomon erasure code, built on a Cauchy matrix: data
+// symbols are sent as they are, and repair symbol j is
+//   sum over i of data[i] / ((kMaxData + j) + i)
+// so that any n symbols out of n data symbols and their repairs are
+// enough to get the data back. Coefficients don't depend on how many data
+// symbols there are, so blocks can be closed before they are full.
+class ReedSolomon {
+ public:
+  static const int kMaxData = 64;
+  static const int kMaxRepair = 16;
+
+  static uint8_t Coefficient(int repair, int data);
+
+  // Computes repair symbol index from data, all symbols of the same size.
+  static void Encode(const vector<const string*>& data, int index,
+                     string* repair);
+
+  // data has one entry per data symbol, NULL for the missing ones, which
+  // are appended to recovered, in order. repairs are the repair symbols
+  // available, indexes their index. Returns false if there are not enough
+  // of them.
+  static bool Decode(const vector<const string*>& data,
+                     const vector<const string*>& repairs,
+                     const vector<int>& indexes, vector<string>* recovered);
+};
+
+// Adds repairs to the messages sent on a datagram connection. Messages
+// are grouped in blocks of consecutive sequence numbers, closed when
+// block size messages are in, or kMaxBlockDelay after the first one, and
+// the repairs of the block are then sent as messages of their own:
+//   <first sequence | kRepairFlag (uint64)><count (uint8)><index (uint8)>
+//   <loss (uint16)><symbol>
+// Symbols are the messages of the block, sequence number included, each
+// prefixed with its size (uint16) and padded with zeros to the largest
+// one. loss is the loss rate measured by the sender of the repair on the
+// messages it receives, in thousandths: the peer sends twice as many
+// repairs as the losses it expects, at least one per block.
+class FecEncoder {
+ public:
+  static const uint64_t kRepairFlag = 1ULL << 63;
+  static const int kDefaultBlockSize = 16;
+  static const Timer::ms_timer_t kMaxBlockDelay = 10;
+
+  explicit FecEncoder(int block_size);
+  ~FecEncoder();
+
+  // Adds the message with sequence, payload not including the sequence
+  // number. Returns true if the block is full, and Close should be called.
+  bool Add(uint64_t sequence, const OutputCursor& payload,
+           Timer::ms_timer_t now);
+  bool Pending() const { return !block_.empty(); }
+  bool Expired(Timer::ms_timer_t now) const;
+
+  // Appends the repair messages of the current block to repairs, and
+  // starts a new block. loss is the one measured locally, see
+  // FecDecoder::Loss.
+  void Close(uint32_t loss, vector<string>* repairs);
+
+  // Loss rate reported by the peer, in thousandths.
+  void SetPeerLoss(uint32_t loss) { peer_loss_ = loss; }
+  // Takes effect from the next block.
+  void SetBlockSize(int block_size) { block_size_ = block_size; }
+  // How many repairs are sent for a block of count messages.
+  int RepairCount(int count) const;
+
+ private:
+  int block_size_;
+  uint64_t first_;
+  Timer::ms_timer_t opened_;
+  vector<string> block_;
+  unsigned int largest_;
+  uint32_t peer_loss_;
+
+  uint64_t blocks_;
+  uint64_t repairs_;
+
+  NO_COPY(FecEncoder);
+};
+
+// Keeps the messages recently received on a datagram connection, and
+// uses them with the repairs received to recover the missing ones.
+class FecDecoder {
+ public:
+  static const int kMaxHeld = 4 * ReedSolomon::kMaxData;
+  static const int kMaxBlocks = 8;
+  // Loss is sampled every kLossSample messages.
+  static const uint32_t kLossSample = 64;
+
+  FecDecoder();
+  ~FecDecoder();
+
+  // Call with every message received, payload not including the sequence
+  // number. Messages are only kept once a repair has been seen.
+  void Add(uint64_t sequence, const OutputCursor& payload);
+  // Consumes the repair for the block starting at first, after its
+  // sequence number. Appends to recovered the messages recovered, sequence
+  // number included. Returns false if the repair is malformed.
+  bool HandleRepair(uint64_t first, OutputCursor* repair,
+                    vector<string>* recovered);
+
+  // Loss rate measured on messages received, and the one measured by the
+  // peer, as reported in its repairs, in thousandths.
+  uint32_t Loss() const { return loss_; }
+  uint32_t PeerLoss() const { return peer_loss_; }
+  // Size of the largest block the peer sent repairs for: blocks closed
+  // early are smaller than the block size it uses. 0 if none yet.
+  int PeerBlockSize() const { return peer_block_size_; }
+  bool SeenRepairs() const { return seen_repairs_; }
+  uint64_t RecoveredCount() const { return recovered_; }
+
+ private:
+  struct Block {
+    Block() : count(0), done(false) {}
+    int count;
+    bool done;
+    map<int, string> repairs;
+  };
+  typedef map<uint64_t, string> HeldMap;
+  typedef map<uint64_t, Block> BlockMap;
+
+  void HandleLoss(uint64_t sequence);
+  void Hold(uint64_t sequence, const string& message);
+  bool Recover(uint64_t first, Block* block, vector<string>* recovered);
+
+  bool seen_repairs_;
+  HeldMap held_;
+  BlockMap blocks_;
+
+  bool started_;
+  uint64_t highest_;
+  uint64_t received_;
+  uint64_t sample_highest_;
+  uint64_t sample_received_;
+  uint32_t loss_;
+  uint32_t peer_loss_;
+  int peer_block_size_;
+
+  uint64_t recovered_;
+
+  NO_COPY(FecDecoder);
+};
+
+#endif /* FEC_H */
@@ -0,0 +1,9 @@
+#ifndef FILE_WATCHER_H
+# define FILE_WATCHER_H
+
+# if UVPN_SYSTEM == LINUX
+#  include "linux/inotify-watcher.h"
+CLASS_ALIAS(FileWatcher, InotifyWatcher);
+# endif
+
+#endif /* FILE_WATCHER_H */
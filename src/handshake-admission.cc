@@ -0,0 +1,241 @@
+#include "handshake-admission.h"
+#include "openssl-helpers.h"
+#include "sockaddr.h"
+#include "buffer.h"
+#include "prng.h"
+#include "hash.h"
+
+const char HandshakeAdmission::kMagic[] = "\xffHVR";
+
+const HandshakeAdmission::ticket_t HandshakeAdmission::kNoTicket;
+const int HandshakeAdmission::kCookieSize;
+const Timer::ms_timer_t HandshakeAdmission::kHandshakeTimeout;
+const Timer::ms_timer_t HandshakeAdmission::kCookieLifetime;
+
+static const uint32_t kCreditPerToken = 1000;
+static const uint32_t kMaxCredit =
+    HandshakeAdmission::kPrefixBurst * kCreditPerToken;
+// Large enough for any address we know how to shorten, and for
+// most of a sockaddr_un.
+static const int kMaxKeySize = 64;
+
+// Copies in key the bytes of address identifying a client, or, if prefix
+// is true, the network the client is in. Returns the number of bytes used.
+static int AddressKey(const Sockaddr& address, bool prefix, char* key) {
+  int size = 0;
+  key[size++] = address.Family();
+
+  const sockaddr* data(address.Data());
+  if (address.Family() == AF_INET) {
+    const sockaddr_in* in(reinterpret_cast<const sockaddr_in*>(data));
+    const char* ip(reinterpret_cast<const char*>(&in->sin_addr));
+    memcpy(key + size, ip, prefix ? 3 : 4);
+    size += prefix ? 3 : 4;
+    if (!prefix) {
+      memcpy(key + size, &in->sin_port, sizeof(in->sin_port));
+      size += sizeof(in->sin_port);
+    }
+    return size;
+  }
+
+  if (address.Family() == AF_INET6) {
+    const sockaddr_in6* in6(reinterpret_cast<const sockaddr_in6*>(data));
+    const char* ip(reinterpret_cast<const char*>(&in6->sin6_addr));
+    if (prefix) {
+      // An IPv4 client on a dual stack socket still gets a /24.
+      if (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {
+        key[0] = AF_INET;
+        memcpy(key + size, ip + 12, 3);
+        return size + 3;
+      }
+      memcpy(key + size, ip, 7);
+      return size + 7;
+    }
+    memcpy(key + size, ip, sizeof(in6->sin6_addr));
+    size += sizeof(in6->sin6_addr);
+    memcpy(key + size, &in6->sin6_port, sizeof(in6->sin6_port));
+    return size + sizeof(in6->sin6_port);
+  }
+
+  int tocopy(min(static_cast<int>(address.Size()), kMaxKeySize - size));
+  memcpy(key + size, data, tocopy);
+  return size + tocopy;
+}
+
+HandshakeAdmission::HandshakeAdmission(Prng* prng)
+    : prng_(prng),
+      oldest_(1),
+      next_(1),
+      pending_(0),
+      generation_(0),
+      rotated_(Timer().Milliseconds()),
+      admitted_(0),
+      challenged_(0),
+      dropped_(0) {
+  prng_->Get(reinterpret_cast<char*>(&seed_), sizeof(seed_));
+  prng_->Get(secrets_[0], kSecretSize);
+  prng_->Get(secrets_[1], kSecretSize);
+
+  for (int i = 0; i < kPrefixBuckets; ++i) {
+    buckets_[i].refilled = rotated_;
+    buckets_[i].credit = kMaxCredit;
+  }
+}
+
+bool HandshakeAdmission::TakeToken(
+    const Sockaddr& address, Timer::ms_timer_t now) {
+  char key[kMaxKeySize];
+  int size(AddressKey(address, true, key));
+  Bucket* bucket(&buckets_[FNVHash(key, size, seed_) & (kPrefixBuckets - 1)]);
+
+  Timer::ms_timer_t elapsed(now - bucket->refilled);
+  bucket->refilled = now;
+  if (elapsed >= kMaxCredit / kPrefixRate)
+    bucket->credit = kMaxCredit;
+  else
+    bucket->credit = min(kMaxCredit, bucket->credit + elapsed * kPrefixRate);
+
+  if (bucket->credit < kCreditPerToken)
+    return false;
+  bucket->credit -= kCreditPerToken;
+  return true;
+}
+
+void HandshakeAdmission::RotateSecret(Timer::ms_timer_t now) {
+  if (now - rotated_ < kCookieLifetime)
+    return;
+
+  // The previous secret stays valid, so a cookie lives at least
+  // kCookieLifetime.
+  ++generation_;
+  prng_->Get(secrets_[generation_ & 1], kSecretSize);
+  rotated_ = now;
+}
+
+void HandshakeAdmission::ExpirePending(Timer::ms_timer_t now) {
+  for (; oldest_ < next_; ++oldest_) {
+    Started* started(&started_[oldest_ % kPendingRing]);
+    if (started->pending) {
+      if (now - started->when < kHandshakeTimeout)
+        break;
+      started->pending = false;
+      --pending_;
+    }
+  }
+}
+
+HandshakeAdmission::ticket_t HandshakeAdmission::StartPending(
+    Timer::ms_timer_t now) {
+  if (pending_ >= kMaxPending || next_ - oldest_ >= kPendingRing)
+    return kNoTicket;
+
+  Started* started(&started_[next_ % kPendingRing]);
+  started->when = now;
+  started->pending = true;
+  ++pending_;
+  return next_++;
+}
+
+void HandshakeAdmission::Release(ticket_t ticket) {
+  if (ticket < oldest_ || ticket >= next_)
+    return;
+
+  Started* started(&started_[ticket % kPendingRing]);
+  if (started->pending) {
+    started->pending = false;
+    --pending_;
+  }
+}
+
+void HandshakeAdmission::CalculateCookie(
+    const Sockaddr& address, uint8_t generation, char* cookie) const {
+  char key[kMaxKeySize];
+  int size(AddressKey(address, false, key));
+
+  char mac[EVP_MAX_MD_SIZE];
+  Hmac::Context context;
+  Hmac hmac(&context, secrets_[generation & 1], kSecretSize, Hmac::kSHA256);
+  hmac.Update(key, size);
+  hmac.Get(mac);
+
+  cookie[0] = generation;
+  memcpy(cookie + 1, mac, kMacSize);
+}
+
+bool HandshakeAdmission::ValidCookie(
+    const Sockaddr& address, const char* cookie) const {
+  uint8_t generation(cookie[0]);
+  if (generation != generation_ &&
+      generation != static_cast<uint8_t>(generation_ - 1))
+    return false;
+
+  char expected[kCookieSize];
+  CalculateCookie(address, generation, expected);
+
+  // Don't leak how many bytes matched.
+  char differences = 0;
+  for (int i = 1; i < kCookieSize; ++i)
+    differences |= expected[i] ^ cookie[i];
+  return !differences;
+}
+
+HandshakeAdmission::Verdict HandshakeAdmission::Check(
+    const Sockaddr& address, OutputCursor* packet, Timer::ms_timer_t now,
+    ticket_t* ticket, InputCursor* challenge) {
+  *ticket = kNoTicket;
+
+  if (!TakeToken(address, now)) {
+    ++dropped_;
+    return Drop;
+  }
+
+  RotateSecret(now);
+  ExpirePending(now);
+
+  char frame[kFrameSize];
+  bool has_cookie = packet->Get(frame, kFrameSize) == sizeof(frame) &&
+      !memcmp(frame, kMagic, kMagicSize);
+  if (has_cookie) {
+    // An invalid cookie is either stale, or forged. Either way, a new
+    // hello will be sent by the client, or an attacker is at work.
+    if (!ValidCookie(address, frame + kMagicSize)) {
+      ++dropped_;
+      return Drop;
+    }
+  } else if (pending_ >= kChallengeThreshold) {
+    challenge->Add(kMagic, kMagicSize);
+    char cookie[kCookieSize];
+    CalculateCookie(address, generation_, cookie);
+    challenge->Add(cookie, kCookieSize);
+    ++challenged_;
+    return Challenge;
+  }
+
+  *ticket = StartPending(now);
+  if (*ticket == kNoTicket) {
+    ++dropped_;
+    return Drop;
+  }
+
+  if (has_cookie)
+    packet->Increment(kFrameSize);
+  ++admitted_;
+  return Admit;
+}
+
+bool HandshakeAdmission::ParseChallenge(
+    const OutputCursor& packet, string* cookie) {
+  char frame[kFrameSize];
+  if (packet.LeftSize() != sizeof(frame) ||
+      packet.Get(frame, kFrameSize) != sizeof(frame) ||
+      memcmp(frame, kMagic, kMagicSize))
+    return false;
+
+  cookie->assign(frame + kMagicSize, kCookieSize);
+  return true;
+}
+
+void HandshakeAdmission::AddCookie(const string& cookie, InputCursor* packet) {
+  packet->Add(kMagic, kMagicSize);
+  packet->Add(cookie);
+}
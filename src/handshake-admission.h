@@ -0,0 +1,144 @@
+#ifndef HANDSHAKE_ADMISSION_H
+# define HANDSHAKE_ADMISSION_H
+
+# include "base.h"
+# include "macros.h"
+# include "timers.h"
+
+# include <stdint.h>
+# include <string>
+
+class Prng;
+class Sockaddr;
+class InputCursor;
+class OutputCursor;
+
+// Decides if a datagram from an unknown address deserves a new session.
+//
+// Creating a session means allocating state and doing expensive crypto
+// before the peer has proven anything, not even that it can receive packets
+// at the address it claims. So, before creating a session:
+//
+//   - each source prefix (/24 for IPv4, /56 for IPv6) has a token bucket,
+//     hellos exceeding its rate are dropped. Buckets live in a fixed size
+//     table indexed by a keyed hash of the prefix: nothing is allocated, and
+//     prefixes colliding just share the same bucket.
+//   - at most kMaxPending handshakes can be in progress at any time. A
+//     handshake stops being in progress when Release() is called, or after
+//     kHandshakeTimeout.
+//   - when more than kChallengeThreshold handshakes are in progress, hellos
+//     must carry a cookie, like DTLS HelloVerifyRequest. Hellos without one
+//     are answered with a challenge carrying the cookie, which the client
+//     echoes back in front of its hello. The cookie is an HMAC of the source
+//     address with a secret rotated every kCookieLifetime, so no state is
+//     kept for challenged clients.
+//
+// Challenges are smaller than any hello, so they cannot be used for
+// amplification.
+class HandshakeAdmission {
+ public:
+  enum Verdict {
+    Admit,      //< create the session.
+    Challenge,  //< send back the challenge, don't create the session.
+    Drop        //< ignore the packet.
+  };
+
+  typedef uint64_t ticket_t;
+  static const ticket_t kNoTicket = 0;
+
+  // Rate of hellos accepted from each prefix, per second, and burst.
+  static const uint32_t kPrefixRate = 10;
+  static const uint32_t kPrefixBurst = 20;
+  static const int kPrefixBuckets = 4096;
+
+  static const int kMaxPending = 256;
+  static const int kChallengeThreshold = kMaxPending / 4;
+  static const Timer::ms_timer_t kHandshakeTimeout = 5000;
+  static const Timer::ms_timer_t kCookieLifetime = 30000;
+
+  // On the wire, a challenge and a cookie are both kMagic followed by the
+  // cookie itself: one byte with the generation of the secret used,
+  // and kMacSize bytes of HMAC.
+  static const char kMagic[];
+  static const int kMagicSize = 4;
+  static const int kMacSize = 16;
+  static const int kCookieSize = 1 + kMacSize;
+  static const int kFrameSize = kMagicSize + kCookieSize;
+
+  explicit HandshakeAdmission(Prng* prng);
+
+  // Checks packet, the first datagram received from address. now is
+  // the time in ms, as returned by Timer::Milliseconds().
+  //
+  // On Admit, the cookie, if any, is consumed from packet, and ticket is
+  // set to the value to pass to Release() once the handshake is over. On
+  // Challenge, the challenge to send back is appended to challenge.
+  Verdict Check(const Sockaddr& address, OutputCursor* packet,
+                Timer::ms_timer_t now, ticket_t* ticket,
+                InputCursor* challenge);
+
+  // The handshake is over, whatever the outcome. kNoTicket is ignored,
+  // and so are tickets that already timed out.
+  void Release(ticket_t ticket);
+
+  int Pending() const { return pending_; }
+
+  uint64_t AdmittedCount() const { return admitted_; }
+  uint64_t ChallengedCount() const { return challenged_; }
+  uint64_t DroppedCount() const { return dropped_; }
+
+  // Client side. Returns true if packet is a challenge, and stores the
+  // cookie in it.
+  static bool ParseChallenge(const OutputCursor& packet, string* cookie);
+  // Adds cookie in front of a new hello.
+  static void AddCookie(const string& cookie, InputCursor* packet);
+
+ private:
+  NO_COPY(HandshakeAdmission);
+
+  static const int kSecretSize = 32;
+  // Leaves room for handshakes released before the oldest in progress.
+  static const int kPendingRing = kMaxPending * 2;
+
+  struct Bucket {
+    Timer::ms_timer_t refilled;
+    // In thousandths of a token, so refilling needs no division.
+    uint32_t credit;
+  };
+
+  struct Started {
+    Timer::ms_timer_t when;
+    bool pending;
+  };
+
+  bool TakeToken(const Sockaddr& address, Timer::ms_timer_t now);
+  void RotateSecret(Timer::ms_timer_t now);
+  void ExpirePending(Timer::ms_timer_t now);
+  ticket_t StartPending(Timer::ms_timer_t now);
+
+  void CalculateCookie(const Sockaddr& address, uint8_t generation,
+                       char* cookie) const;
+  bool ValidCookie(const Sockaddr& address, const char* cookie) const;
+
+  Prng* prng_;
+  size_t seed_;
+
+  Bucket buckets_[kPrefixBuckets];
+
+  // Handshakes in progress, oldest first. Ticket n is in slot n % kPendingRing.
+  Started started_[kPendingRing];
+  ticket_t oldest_;
+  ticket_t next_;
+  int pending_;
+
+  // Secrets for the current and previous generation of cookies.
+  char secrets_[2][kSecretSize];
+  uint8_t generation_;
+  Timer::ms_timer_t rotated_;
+
+  uint64_t admitted_;
+  uint64_t challenged_;
+  uint64_t dropped_;
+};
+
+#endif /* HANDSHAKE_ADMISSION_H */
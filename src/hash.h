@@ -4,6 +4,7 @@
 // this is mostly for size_t
 // TODO: is this the same as std::size_t?
 # include <sys/types.h>
+# include <stdint.h>
 
 # ifndef FNV_MAGIC
 #  define FNV_MAGIC 0x01000193
@@ -42,6 +43,65 @@ inline size_t DragonHash(const char* tohash, size_t size, size_t seed) {
   return hash;
 }
 
+// SipHash-2-4, by Aumasson and Bernstein: a keyed hash fast enough for
+// short inputs, and strong enough that without the key, outputs can't be
+// guessed or forged. Used where FNV or Dragon would let an attacker pick
+// inputs that collide, or pass a check.
+inline uint64_t SipHash24(const char key[16], const char* tohash, size_t size) {
+# define SIP_ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+# define SIP_ROUND() \
+  do { \
+    v0 += v1; v1 = SIP_ROTL(v1, 13); v1 ^= v0; v0 = SIP_ROTL(v0, 32); \
+    v2 += v3; v3 = SIP_ROTL(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = SIP_ROTL(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = SIP_ROTL(v1, 17); v1 ^= v2; v2 = SIP_ROTL(v2, 32); \
+  } while (0)
+
+  unsigned const char* cur = reinterpret_cast<unsigned const char*>(tohash);
+  unsigned const char* k = reinterpret_cast<unsigned const char*>(key);
+
+  // Little endian loads, whatever the host is.
+  uint64_t k0 = 0, k1 = 0;
+  for (int i = 7; i >= 0; --i) {
+    k0 = (k0 << 8) | k[i];
+    k1 = (k1 << 8) | k[8 + i];
+  }
+
+  uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+  uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+  uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+  uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+
+  unsigned const char* end = cur + (size & ~static_cast<size_t>(7));
+  for (; cur < end; cur += 8) {
+    uint64_t m = 0;
+    for (int i = 7; i >= 0; --i)
+      m = (m << 8) | cur[i];
+    v3 ^= m;
+    SIP_ROUND();
+    SIP_ROUND();
+    v0 ^= m;
+  }
+
+  uint64_t last = static_cast<uint64_t>(size) << 56;
+  for (int i = static_cast<int>(size & 7) - 1; i >= 0; --i)
+    last |= static_cast<uint64_t>(cur[i]) << (8 * i);
+
+  v3 ^= last;
+  SIP_ROUND();
+  SIP_ROUND();
+  v0 ^= last;
+  v2 ^= 0xff;
+  SIP_ROUND();
+  SIP_ROUND();
+  SIP_ROUND();
+  SIP_ROUND();
+
+# undef SIP_ROUND
+# undef SIP_ROTL
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
 # ifndef DEFAULT_HASH
 #  define DEFAULT_HASH DragonHash
 # endif
@@ -0,0 +1,444 @@
+#include "header-compressor.h"
+#include "serializers.h"
+#include "buffer.h"
+#include "hash.h"
+
+#include <string.h>
+
+const uint8_t HeaderCompressor::kPacketIr;
+const uint8_t HeaderCompressor::kPacketCompressed;
+const int HeaderCompressor::kContexts;
+const int HeaderCompressor::kIrRepeats;
+const int HeaderCompressor::kRefreshInterval;
+const int HeaderCompressor::kWindow;
+const int HeaderCompressor::kMaxHeaderSize;
+
+namespace {
+
+const int kProtocolTcp = 6;
+const int kProtocolUdp = 17;
+const int kAllFields = BIT(6) - 1;
+
+inline uint16_t Read16(const unsigned char* data) {
+  return (data[0] << 8) | data[1];
+}
+
+inline uint32_t Read32(const unsigned char* data) {
+  return (static_cast<uint32_t>(Read16(data)) << 16) | Read16(data + 2);
+}
+
+inline void Write16(unsigned char* data, uint16_t value) {
+  data[0] = value >> 8;
+  data[1] = value & 0xff;
+}
+
+inline void Write32(unsigned char* data, uint32_t value) {
+  Write16(data, value >> 16);
+  Write16(data + 2, value & 0xffff);
+}
+
+// Returns false if packet can't be compressed.
+bool ParseHeaders(const unsigned char* packet, int size, HeaderLayout* layout) {
+  int protocol;
+  if (size >= 20 && packet[0] == 0x45 && Read16(packet + 2) == size &&
+      !(Read16(packet + 6) & 0x3fff)) {
+    // No options, not a fragment.
+    layout->ipv6 = false;
+    layout->transport = 20;
+    protocol = packet[9];
+  } else if (size >= 40 && (packet[0] >> 4) == 6 &&
+             Read16(packet + 4) + 40 == size) {
+    layout->ipv6 = true;
+    layout->transport = 40;
+    protocol = packet[6];
+  } else {
+    return false;
+  }
+
+  const unsigned char* transport(packet + layout->transport);
+  int left(size - layout->transport);
+  if (protocol == kProtocolTcp) {
+    int length((transport[12] >> 4) * 4);
+    if (left < 20 || length < 20 || left < length)
+      return false;
+    layout->tcp = true;
+    layout->size = layout->transport + length;
+  } else if (protocol == kProtocolUdp) {
+    if (left < 8 || Read16(transport + 4) != left)
+      return false;
+    layout->tcp = false;
+    layout->size = layout->transport + 8;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Zeroes all the fields that can change from one packet to the next.
+void ZeroChanging(const HeaderLayout& layout, unsigned char* header) {
+  unsigned char* transport(header + layout.transport);
+  if (layout.ipv6) {
+    memset(header + 4, 0, 2);
+  } else {
+    memset(header + 2, 0, 4);
+    memset(header + 10, 0, 2);
+  }
+
+  if (layout.tcp) {
+    // Sequence, ack, flags, window, checksum, and options. Data offset
+    // and urgent pointer are left.
+    memset(transport + 4, 0, 8);
+    memset(transport + 13, 0, 5);
+    memset(transport + 20, 0, layout.size - layout.transport - 20);
+  } else {
+    memset(transport + 4, 0, 4);
+  }
+}
+
+uint8_t Check(const unsigned char* header, int size) {
+  return FNVHash(reinterpret_cast<const char*>(header), size, 0) & 0xff;
+}
+
+uint16_t Ipv4Checksum(const unsigned char* header) {
+  uint32_t sum(0);
+  for (int i = 0; i < 20; i += 2)
+    sum += Read16(header + i);
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+  return ~sum;
+}
+
+// Writes a field bits long, either in full, or only its lowest bits / 2
+// bits. Returns where the next field goes.
+unsigned char* WriteLsb(unsigned char* output, bool full, int bits,
+                        uint32_t value) {
+  if (bits == 32 && full)
+    Write32(output, value);
+  else if (bits == 32 || full)
+    Write16(output, value & 0xffff);
+  else
+    *output = value & 0xff;
+  return output + (full ? bits : bits / 2) / 8;
+}
+
+// Opposite of WriteLsb: field holds the previous value, and is replaced.
+bool ReadLsb(OutputCursor* input, bool full, int bits, unsigned char* field) {
+  int size((full ? bits : bits / 2) / 8);
+  unsigned char read[4];
+  if (input->Consume(reinterpret_cast<char*>(read), size) !=
+      static_cast<unsigned int>(size))
+    return false;
+  if (full) {
+    memcpy(field, read, size);
+    return true;
+  }
+
+  uint32_t reference(bits == 32 ? Read32(field) : Read16(field));
+  uint32_t lsb(size == 2 ? Read16(read) : read[0]);
+  int lsbbits(bits / 2);
+  int32_t delta((lsb - reference) & ((1 << lsbbits) - 1));
+  if (delta >= (1 << (lsbbits - 1)))
+    delta -= 1 << lsbbits;
+
+  uint32_t value(reference + delta);
+  if (bits == 32)
+    Write32(field, value);
+  else
+    Write16(field, value & 0xffff);
+  return true;
+}
+
+bool Get(OutputCursor* input, unsigned char* field, int size) {
+  return input->Consume(reinterpret_cast<char*>(field), size) ==
+      static_cast<unsigned int>(size);
+}
+
+}  // namespace
+
+HeaderCompressor::HeaderCompressor()
+    : packets_(0),
+      compressed_(0),
+      irs_(0),
+      header_bytes_in_(0),
+      header_bytes_out_(0) {
+  memset(contexts_, 0, sizeof(contexts_));
+}
+
+HeaderCompressor::~HeaderCompressor() {
+  if (!packets_)
+    return;
+
+  LOG_INFO("header compression: %llu packets, %llu compressed, %llu IR, "
+           "headers %llu -> %llu bytes (%.1f%%)",
+           (unsigned long long)packets_, (unsigned long long)compressed_,
+           (unsigned long long)irs_, (unsigned long long)header_bytes_in_,
+           (unsigned long long)header_bytes_out_,
+           header_bytes_in_ ? 100.0 * header_bytes_out_ / header_bytes_in_
+                            : 100.0);
+}
+
+bool HeaderCompressor::FitsLsb(
+    const Context& context, Lsb lsb, uint32_t value, int bits) {
+  if (!context.count)
+    return false;
+
+  int64_t half(1 << (bits / 2 - 1));
+  uint32_t mask(bits == 32 ? 0xffffffff : (1 << bits) - 1);
+  for (int i = 0; i < context.count; ++i) {
+    int64_t delta((value - context.values[lsb][i]) & mask);
+    if (delta >= (static_cast<int64_t>(1) << (bits - 1)))
+      delta -= static_cast<int64_t>(1) << bits;
+    if (delta < -half || delta >= half)
+      return false;
+  }
+  return true;
+}
+
+void HeaderCompressor::Compress(OutputCursor* input, InputCursor* output) {
+  string packet;
+  input->ConsumeString(&packet);
+  ++packets_;
+
+  const unsigned char* data(
+      reinterpret_cast<const unsigned char*>(packet.data()));
+  HeaderLayout layout;
+  if (!ParseHeaders(data, packet.size(), &layout)) {
+    output->Add(packet);
+    return;
+  }
+
+  unsigned char invariant[kMaxHeaderSize];
+  memcpy(invariant, data, layout.size);
+  ZeroChanging(layout, invariant);
+  int id(FNVHash(reinterpret_cast<const char*>(invariant), layout.size, 0) %
+         kContexts);
+
+  Context* context(&contexts_[id]);
+  bool known(context->used && context->layout.size == layout.size &&
+             !memcmp(context->invariant, invariant, layout.size));
+  if (!known) {
+    memset(context, 0, sizeof(*context));
+    context->used = true;
+    context->layout = layout;
+    memcpy(context->invariant, invariant, layout.size);
+  }
+
+  const unsigned char* transport(data + layout.transport);
+  const unsigned char* last(context->last + layout.transport);
+  int options(layout.size - layout.transport - 20);
+  if (known && layout.tcp) {
+    context->same_flags = transport[13] == last[13] ?
+        context->same_flags + 1 : 0;
+    context->same_window = !memcmp(transport + 14, last + 14, 2) ?
+        context->same_window + 1 : 0;
+    context->same_options = !memcmp(transport + 20, last + 20, options) ?
+        context->same_options + 1 : 0;
+  }
+
+  uint32_t values[kLsbCount];
+  values[kLsbId] = layout.ipv6 ? 0 : Read16(data + 4);
+  values[kLsbSeq] = layout.tcp ? Read32(transport + 4) : 0;
+  values[kLsbAck] = layout.tcp ? Read32(transport + 8) : 0;
+
+  if (context->sent >= kRefreshInterval)
+    context->sent = 0;
+
+  header_bytes_in_ += layout.size;
+  if (context->sent < kIrRepeats) {
+    ++irs_;
+    unsigned char ir[2] = { kPacketIr, static_cast<unsigned char>(id) };
+    output->Add(reinterpret_cast<char*>(ir), sizeof(ir));
+    output->Add(packet);
+    header_bytes_out_ += layout.size + sizeof(ir);
+  } else {
+    ++compressed_;
+    unsigned char header[4 + kMaxHeaderSize];
+    unsigned char* out(header);
+    *out++ = kPacketCompressed;
+    *out++ = id;
+    *out++ = Check(data, layout.size);
+    unsigned char* fields(out++);
+    *fields = 0;
+
+    if (!layout.ipv6) {
+      bool full(!FitsLsb(*context, kLsbId, values[kLsbId], 16));
+      *fields |= full ? kFieldIdFull : 0;
+      out = WriteLsb(out, full, 16, values[kLsbId]);
+    }
+
+    if (layout.tcp) {
+      bool full(!FitsLsb(*context, kLsbSeq, values[kLsbSeq], 32));
+      *fields |= full ? kFieldSeqFull : 0;
+      out = WriteLsb(out, full, 32, values[kLsbSeq]);
+
+      full = !FitsLsb(*context, kLsbAck, values[kLsbAck], 32);
+      *fields |= full ? kFieldAckFull : 0;
+      out = WriteLsb(out, full, 32, values[kLsbAck]);
+
+      if (context->same_flags < kWindow) {
+        *fields |= kFieldFlags;
+        *out++ = transport[13];
+      }
+      if (context->same_window < kWindow) {
+        *fields |= kFieldWindow;
+        memcpy(out, transport + 14, 2);
+        out += 2;
+      }
+      if (options && context->same_options < kWindow) {
+        *fields |= kFieldOptions;
+        memcpy(out, transport + 20, options);
+        out += options;
+      }
+      memcpy(out, transport + 16, 2);
+    } else {
+      memcpy(out, transport + 6, 2);
+    }
+    out += 2;
+
+    output->Add(reinterpret_cast<char*>(header), out - header);
+    output->Add(packet.data() + layout.size, packet.size() - layout.size);
+    header_bytes_out_ += out - header;
+  }
+
+  for (int i = 0; i < kLsbCount; ++i)
+    context->values[i][context->next] = values[i];
+  context->next = (context->next + 1) % kWindow;
+  if (context->count < kWindow)
+    ++context->count;
+
+  memcpy(context->last, data, layout.size);
+  ++context->sent;
+}
+
+HeaderDecompressor::HeaderDecompressor()
+    : packets_(0),
+      compressed_(0),
+      irs_(0),
+      dropped_(0) {
+  memset(contexts_, 0, sizeof(contexts_));
+}
+
+HeaderDecompressor::~HeaderDecompressor() {
+  LOG_DEBUG("header decompression: %llu packets, %llu compressed, %llu IR, "
+            "%llu dropped",
+            (unsigned long long)packets_, (unsigned long long)compressed_,
+            (unsigned long long)irs_, (unsigned long long)dropped_);
+}
+
+bool HeaderDecompressor::Drop(const char* reason) {
+  ++dropped_;
+  LOG_DEBUG("dropping packet, %s", reason);
+  return false;
+}
+
+bool HeaderDecompressor::Decompress(OutputCursor* input, InputCursor* output) {
+  ++packets_;
+  uint8_t type;
+  if (input->Get(reinterpret_cast<char*>(&type), 1) != 1)
+    return Drop("empty packet");
+
+  if ((type >> 4) == 4 || (type >> 4) == 6) {
+    EncodeToBuffer(input, output);
+    return true;
+  }
+
+  string packet;
+  input->ConsumeString(&packet);
+  if (packet.size() < 2 ||
+      static_cast<uint8_t>(packet[1]) >= HeaderCompressor::kContexts)
+    return Drop("invalid context");
+
+  if (type == HeaderCompressor::kPacketIr)
+    return DecompressIr(packet, output);
+  if (type == HeaderCompressor::kPacketCompressed)
+    return DecompressHeaders(packet, output);
+  return Drop("unknown packet type");
+}
+
+bool HeaderDecompressor::DecompressIr(
+    const string& packet, InputCursor* output) {
+  const unsigned char* data(
+      reinterpret_cast<const unsigned char*>(packet.data()) + 2);
+  int size(packet.size() - 2);
+  HeaderLayout layout;
+  if (!ParseHeaders(data, size, &layout))
+    return Drop("IR packet with invalid headers");
+
+  Context* context(&contexts_[static_cast<uint8_t>(packet[1])]);
+  context->valid = true;
+  context->layout = layout;
+  memcpy(context->last, data, layout.size);
+
+  ++irs_;
+  output->Add(packet.data() + 2, size);
+  return true;
+}
+
+bool HeaderDecompressor::DecompressHeaders(
+    const string& packet, InputCursor* output) {
+  Context* context(&contexts_[static_cast<uint8_t>(packet[1])]);
+  if (!context->valid)
+    return Drop("unknown context");
+
+  Buffer buffer;
+  buffer.Input()->Add(packet.data() + 2, packet.size() - 2);
+  OutputCursor* input(buffer.Output());
+  uint8_t check, fields;
+  if (!Get(input, &check, 1) || !Get(input, &fields, 1) ||
+      (fields & ~kAllFields))
+    return Drop("invalid compressed packet");
+
+  const HeaderLayout& layout(context->layout);
+  unsigned char header[HeaderCompressor::kMaxHeaderSize];
+  memcpy(header, context->last, layout.size);
+  unsigned char* transport(header + layout.transport);
+  int options(layout.size - layout.transport - 20);
+
+  bool valid(true);
+  if (!layout.ipv6)
+    valid = ReadLsb(input, fields & HeaderCompressor::kFieldIdFull, 16,
+                    header + 4);
+  if (valid && layout.tcp) {
+    valid = ReadLsb(input, fields & HeaderCompressor::kFieldSeqFull, 32,
+                    transport + 4) &&
+        ReadLsb(input, fields & HeaderCompressor::kFieldAckFull, 32,
+                transport + 8) &&
+        (!(fields & HeaderCompressor::kFieldFlags) ||
+         Get(input, transport + 13, 1)) &&
+        (!(fields & HeaderCompressor::kFieldWindow) ||
+         Get(input, transport + 14, 2)) &&
+        (!(fields & HeaderCompressor::kFieldOptions) ||
+         Get(input, transport + 20, options)) &&
+        Get(input, transport + 16, 2);
+  } else if (valid) {
+    valid = Get(input, transport + 6, 2);
+  }
+  if (!valid)
+    return Drop("truncated compressed packet");
+
+  int size(layout.size + input->LeftSize());
+  if (size > 0xffff)
+    return Drop("compressed packet too large");
+  if (layout.ipv6) {
+    Write16(header + 4, size - 40);
+  } else {
+    Write16(header + 2, size);
+    Write16(header + 10, 0);
+    Write16(header + 10, Ipv4Checksum(header));
+  }
+  if (!layout.tcp)
+    Write16(transport + 4, size - layout.transport);
+
+  // Too many packets were lost, and values were not recovered correctly.
+  // Nothing can be decompressed with this context until the next IR.
+  if (Check(header, layout.size) != check) {
+    context->valid = false;
+    return Drop("headers do not match their check, context lost");
+  }
+
+  ++compressed_;
+  memcpy(context->last, header, layout.size);
+  output->Add(reinterpret_cast<char*>(header), layout.size);
+  EncodeToBuffer(input, output);
+  return true;
+}
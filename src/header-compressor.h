@@ -0,0 +1,169 @@
+#ifndef HEADER_COMPRESSOR_H
+# define HEADER_COMPRESSOR_H
+
+# include "base.h"
+# include "macros.h"
+
+# include <stdint.h>
+
+class InputCursor;
+class OutputCursor;
+
+// Where the headers are in a packet.
+struct HeaderLayout {
+  bool ipv6;
+  bool tcp;
+  // Offset of the TCP or UDP header, and size of all the headers.
+  int transport;
+  int size;
+};
+
+// Compression of the IP and TCP / UDP headers of tunnelled packets, in the
+// spirit of ROHC (RFC 3095) in unidirectional mode: no feedback from the
+// decompressor, packets can be lost or reordered.
+//
+// Both sides keep a context for each flow, in a table of kContexts entries
+// indexed by a hash of the fields that never change in a flow (addresses,
+// ports, ...). The first kIrRepeats packets of a flow are sent in full to
+// set up the context, and again every kRefreshInterval packets:
+//   <kPacketIr (1 byte)><context id (1 byte)><packet>
+// The other packets only carry what changed:
+//   <kPacketCompressed (1 byte)><context id (1 byte)><check (1 byte)>
+//   <fields (1 byte)><changed fields><transport checksum (uint16)><payload>
+// Lengths and the IPv4 checksum are recomputed by the decompressor.
+// Sequence numbers, acks and IPv4 ids are sent as their lowest bits, as
+// long as the value can be recovered from any of the last kWindow packets
+// sent: up to kWindow - 1 packets in a row can be lost. TCP flags, window
+// and options are only left out after they did not change for kWindow
+// packets. The check byte is a hash of the original headers: if too many
+// packets were lost, the decompressor drops packets until the next
+// refresh, rather than delivering garbage.
+//
+// Packets that can't be compressed (fragments, IPv4 options, IPv6
+// extension headers, neither TCP nor UDP) are sent as they are: they
+// start with 4 or 6, and can't be confused with the above.
+class HeaderCompressor {
+ public:
+  static const uint8_t kPacketIr = 0x20;
+  static const uint8_t kPacketCompressed = 0x30;
+
+  static const int kContexts = 64;
+  static const int kIrRepeats = 3;
+  static const int kRefreshInterval = 256;
+  static const int kWindow = 16;
+  // IPv6 and a TCP header with all the options.
+  static const int kMaxHeaderSize = 40 + 60;
+
+  // Bits of the fields byte.
+  enum Field {
+    kFieldIdFull = BIT(0),
+    kFieldSeqFull = BIT(1),
+    kFieldAckFull = BIT(2),
+    kFieldFlags = BIT(3),
+    kFieldWindow = BIT(4),
+    kFieldOptions = BIT(5)
+  };
+
+  HeaderCompressor();
+  ~HeaderCompressor();
+
+  // Consumes the packet in input, and adds what has to be sent instead
+  // to output.
+  void Compress(OutputCursor* input, InputCursor* output);
+
+  uint64_t PacketCount() const { return packets_; }
+  uint64_t CompressedCount() const { return compressed_; }
+  uint64_t IrCount() const { return irs_; }
+  // Bytes of headers before and after compression, of the packets that
+  // could be compressed.
+  uint64_t HeaderBytesIn() const { return header_bytes_in_; }
+  uint64_t HeaderBytesOut() const { return header_bytes_out_; }
+
+ private:
+  // Values sent as their lowest bits.
+  enum Lsb {
+    kLsbId,
+    kLsbSeq,
+    kLsbAck,
+    kLsbCount
+  };
+
+  struct Context {
+    bool used;
+    HeaderLayout layout;
+    // Headers of the flow, with all the fields that can change zeroed.
+    unsigned char invariant[kMaxHeaderSize];
+    // Headers of the last packet sent.
+    unsigned char last[kMaxHeaderSize];
+    // Packets sent since the last IR.
+    int sent;
+
+    // Last kWindow values sent, up to count.
+    uint32_t values[kLsbCount][kWindow];
+    int count;
+    int next;
+
+    // Consecutive packets in which flags, window and options did not
+    // change.
+    int same_flags;
+    int same_window;
+    int same_options;
+  };
+
+  // True if value, bits long, can be sent as its lowest bits / 2 bits:
+  // it can be recovered from any of the last values in the window.
+  static bool FitsLsb(const Context& context, Lsb lsb, uint32_t value,
+                      int bits);
+
+  Context contexts_[kContexts];
+
+  uint64_t packets_;
+  uint64_t compressed_;
+  uint64_t irs_;
+  uint64_t header_bytes_in_;
+  uint64_t header_bytes_out_;
+
+  NO_COPY(HeaderCompressor);
+};
+
+class HeaderDecompressor {
+ public:
+  HeaderDecompressor();
+  ~HeaderDecompressor();
+
+  // Consumes input, and adds the original packet to output. Returns false,
+  // leaving output alone, if the packet can't be decompressed: it is
+  // garbage, or refers to a context that was lost.
+  bool Decompress(OutputCursor* input, InputCursor* output);
+
+  // True once the peer sent a compressed packet, so it can decompress
+  // them as well.
+  bool PeerCompresses() const { return irs_ || compressed_; }
+
+  uint64_t PacketCount() const { return packets_; }
+  uint64_t CompressedCount() const { return compressed_; }
+  uint64_t DroppedCount() const { return dropped_; }
+
+ private:
+  struct Context {
+    bool valid;
+    HeaderLayout layout;
+    // Headers of the last packet decompressed.
+    unsigned char last[HeaderCompressor::kMaxHeaderSize];
+  };
+
+  bool Drop(const char* reason);
+  bool DecompressIr(const string& packet, InputCursor* output);
+  bool DecompressHeaders(const string& packet, InputCursor* output);
+
+  Context contexts_[HeaderCompressor::kContexts];
+
+  uint64_t packets_;
+  uint64_t compressed_;
+  uint64_t irs_;
+  uint64_t dropped_;
+
+  NO_COPY(HeaderDecompressor);
+};
+
+#endif /* HEADER_COMPRESSOR_H */
@@ -0,0 +1,75 @@
+#include "hello-filter.h"
+#include "buffer.h"
+#include "hash.h"
+#include "conversions.h"
+
+#include <string.h>
+
+const int HelloFilter::kKeySize;
+const int HelloFilter::kTagSize;
+const int HelloFilter::kCoverage;
+const char HelloFilter::kDefaultKey[] = "uvpn hello: 0001";
+
+HelloFilter::HelloFilter() : rejected_(0) {
+  memcpy(key_, kDefaultKey, kKeySize);
+}
+
+HelloFilter::HelloFilter(const char* key) : rejected_(0) {
+  memcpy(key_, key ? key : kDefaultKey, kKeySize);
+}
+
+bool HelloFilter::ParseKey(const string& hex, string* key) {
+  key->clear();
+  if (hex.empty())
+    return true;
+  return ConvertFromHex(hex, key) && key->size() == static_cast<size_t>(kKeySize);
+}
+
+HelloFilter::~HelloFilter() {
+  memset(key_, 0, sizeof(key_));
+}
+
+uint64_t HelloFilter::CalculateTag(
+    uint64_t id, const char* data, int size) const {
+  // Everything on the stack: this runs for every unknown datagram.
+  char tohash[sizeof(id) + kCoverage];
+  for (int i = sizeof(id) - 1; i >= 0; --i, id >>= 8)
+    tohash[i] = static_cast<char>(id & 0xff);
+  if (size > kCoverage)
+    size = kCoverage;
+  memcpy(tohash + sizeof(id), data, size);
+  return SipHash24(key_, tohash, sizeof(id) + size);
+}
+
+void HelloFilter::AddHello(
+    uint64_t id, const string& hello, InputCursor* datagram) const {
+  uint64_t tag(CalculateTag(id, hello.data(), hello.size()));
+  char encoded[kTagSize];
+  for (int i = kTagSize - 1; i >= 0; --i, tag >>= 8)
+    encoded[i] = static_cast<char>(tag & 0xff);
+
+  datagram->Add(encoded, kTagSize);
+  datagram->Add(hello);
+}
+
+bool HelloFilter::Check(uint64_t id, OutputCursor* packet) {
+  char head[kTagSize + kCoverage];
+  int size(packet->Get(head, sizeof(head)));
+  if (size < kTagSize) {
+    ++rejected_;
+    return false;
+  }
+
+  uint64_t tag(CalculateTag(id, head + kTagSize, size - kTagSize));
+  // Compared as a whole, so timing doesn't tell how many bytes matched.
+  uint64_t received(0);
+  for (int i = 0; i < kTagSize; ++i)
+    received = (received << 8) | static_cast<unsigned char>(head[i]);
+  if (received != tag) {
+    ++rejected_;
+    return false;
+  }
+
+  packet->Increment(kTagSize);
+  return true;
+}
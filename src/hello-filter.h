@@ -0,0 +1,62 @@
+#ifndef HELLO_FILTER_H
+# define HELLO_FILTER_H
+
+# include "base.h"
+# include "macros.h"
+
+# include <stdint.h>
+# include <string>
+
+class InputCursor;
+class OutputCursor;
+
+// Cheap check on datagrams for unknown connection ids, done before
+// anything else: no session, no admission token, no cipher.
+//
+// The first datagram of a connection carries, right after the connection
+// id, a kTagSize tag: SipHash-2-4 keyed with the filter key over the id and
+// the first kCoverage bytes following the tag. Port scans, garbage, stray
+// packets of a connection the server has forgotten and replies sent to the
+// wrong port all fail the check, and are dropped after hashing ~40 bytes.
+//
+// With the default key, this only keeps out traffic that is not uvpn:
+// anyone can compute the tag. A deployment using its own key (see
+// --hello-key) also keeps out hosts not knowing it, which can't even tell
+// uvpn is listening.
+class HelloFilter {
+ public:
+  static const int kKeySize = 16;
+  static const int kTagSize = 8;
+  static const int kCoverage = 32;
+  static const char kDefaultKey[kKeySize + 1];
+
+  // Parses a key given as kKeySize * 2 hex digits, as in --hello-key, into
+  // key. An empty hex leaves key empty, for the default key. Returns false
+  // if hex is not a valid key.
+  static bool ParseKey(const string& hex, string* key);
+
+  HelloFilter();
+  // key must be kKeySize bytes, NULL uses kDefaultKey.
+  explicit HelloFilter(const char* key);
+  ~HelloFilter();
+
+  // Client side: appends the tag, and the hello itself, to a datagram
+  // already carrying the connection id.
+  void AddHello(uint64_t id, const string& hello, InputCursor* datagram) const;
+
+  // Server side: returns true, and consumes the tag, if packet starts with
+  // a valid tag for id. Otherwise, the packet must be dropped.
+  bool Check(uint64_t id, OutputCursor* packet);
+
+  uint64_t RejectedCount() const { return rejected_; }
+
+ private:
+  NO_COPY(HelloFilter);
+
+  uint64_t CalculateTag(uint64_t id, const char* data, int size) const;
+
+  char key_[kKeySize];
+  uint64_t rejected_;
+};
+
+#endif /* HELLO_FILTER_H */
@@ -0,0 +1,180 @@
+#include "kernel-tls.h"
+#include "tcp-framing.h"
+#include "transport.h"
+#include "protector.h"
+#include "errors.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef SOL_TLS
+# define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+# define TCP_ULP 31
+#endif
+
+const int KernelTls::kKeySize;
+const int KernelTls::kIvSize;
+const int KernelTls::kMaterialSize;
+
+KernelTls::KernelTls(Role role)
+    : role_(role),
+      requested_(false),
+      sending_(Off),
+      receiving_(Off),
+      clear_left_(0),
+      binding_(0) {
+}
+
+KernelTls::~KernelTls() {
+  memset(client_key_, 0, sizeof(client_key_));
+  memset(server_key_, 0, sizeof(server_key_));
+}
+
+void KernelTls::Request(BoundChannel* channel, Buffer* output) {
+  if (!channel->AttachKernelTls()) {
+    LOG_INFO("kernel tls not available on this connection, not requesting it");
+    return;
+  }
+
+  TcpFraming::AddControl(TcpFraming::kControlKernelTlsRequest,
+                         output->Input());
+  requested_ = true;
+  receiving_ = Pending;
+}
+
+void KernelTls::HandleRequest(BoundChannel* channel, Buffer* output) {
+  if (requested_)
+    return;
+
+  if (!channel->AttachKernelTls()) {
+    LOG_INFO("kernel tls requested, but not available");
+    TcpFraming::AddControl(TcpFraming::kControlKernelTlsRefuse,
+                           output->Input());
+    return;
+  }
+  requested_ = true;
+}
+
+void KernelTls::MaybeStart(const SessionProtector& encoder, Buffer* output) {
+  if (!requested_ || sending_ != Off)
+    return;
+  if (!DeriveKeys(encoder))
+    return;
+
+  AddStart(output);
+  receiving_ = Pending;
+}
+
+bool KernelTls::HandleStart(BoundChannel* channel,
+                            const SessionProtector* protector,
+                            Buffer* output) {
+  if (receiving_ != Pending) {
+    LOG_ERROR("unexpected kernel tls start");
+    return false;
+  }
+
+  if (role_ == Client && (!protector || !DeriveKeys(*protector))) {
+    LOG_ERROR("kernel tls started by the server, but no key to use");
+    return false;
+  }
+  if (!channel->StartKernelTls(false, ReceiveKey())) {
+    LOG_ERROR("could not start kernel tls, receiving side");
+    return false;
+  }
+  receiving_ = On;
+
+  if (role_ == Client)
+    AddStart(output);
+  return true;
+}
+
+void KernelTls::HandleRefuse() {
+  if (!requested_ || role_ != Client)
+    return;
+
+  LOG_INFO("kernel tls refused by the server");
+  requested_ = false;
+  receiving_ = Off;
+}
+
+bool KernelTls::HandleWritten(BoundChannel* channel, unsigned int written) {
+  if (sending_ != Pending)
+    return true;
+
+  clear_left_ -= written;
+  if (clear_left_)
+    return true;
+
+  if (!channel->StartKernelTls(true, SendKey())) {
+    LOG_ERROR("could not start kernel tls, sending side");
+    return false;
+  }
+  sending_ = On;
+  LOG_INFO("kernel tls started");
+  return true;
+}
+
+bool KernelTls::DeriveKeys(const SessionProtector& protector) {
+  string client("kernel tls client");
+  string server("kernel tls server");
+  if (binding_) {
+    char suffix[sizeof(" path ") + 10];
+    snprintf(suffix, sizeof(suffix), " path %u", binding_);
+    client.append(suffix);
+    server.append(suffix);
+  }
+  return protector.ExportKey(client.c_str(), client_key_, kMaterialSize) &&
+         protector.ExportKey(server.c_str(), server_key_, kMaterialSize);
+}
+
+void KernelTls::AddStart(Buffer* output) {
+  TcpFraming::AddControl(TcpFraming::kControlKernelTlsStart, output->Input());
+  sending_ = Pending;
+  clear_left_ = output->Output()->LeftSize();
+}
+
+const char* KernelTls::SendKey() const {
+  return role_ == Client ? client_key_ : server_key_;
+}
+
+const char* KernelTls::ReceiveKey() const {
+  return role_ == Client ? server_key_ : client_key_;
+}
+
+bool KernelTls::Attach(int fd) {
+  static const char kUlp[] = "tls";
+  if (setsockopt(fd, SOL_TCP, TCP_ULP, kUlp, sizeof(kUlp)) < 0) {
+    LOG_PERROR("cannot attach tls to fd %d", fd);
+    return false;
+  }
+  return true;
+}
+
+bool KernelTls::Install(int fd, bool transmit, const char* material) {
+  tls12_crypto_info_aes_gcm_256 info;
+  memset(&info, 0, sizeof(info));
+  info.info.version = TLS_1_3_VERSION;
+  info.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+  memcpy(info.key, material, kKeySize);
+  // The kernel wants the iv split in salt and explicit part, as in TLS
+  // 1.2. Records are numbered from 0.
+  memcpy(info.salt, material + kKeySize, sizeof(info.salt));
+  memcpy(info.iv, material + kKeySize + sizeof(info.salt), sizeof(info.iv));
+
+  int result(setsockopt(fd, SOL_TLS, transmit ? TLS_TX : TLS_RX,
+                        &info, sizeof(info)));
+  memset(&info, 0, sizeof(info));
+  if (result < 0) {
+    LOG_PERROR("cannot set tls %s key on fd %d",
+               transmit ? "transmit" : "receive", fd);
+    return false;
+  }
+  return true;
+}
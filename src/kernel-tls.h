@@ -0,0 +1,124 @@
+#ifndef KERNEL_TLS_H
+# define KERNEL_TLS_H
+
+# include "base.h"
+# include "macros.h"
+# include "buffer.h"
+
+class SessionProtector;
+class BoundChannel;
+
+// Hands the encryption of framed tcp connections to the kernel (kTLS):
+// once switched, each direction of the connection is a stream of TLS 1.3
+// records protected with AES-256-GCM by the kernel, and the transcoders
+// pass frames to the socket as they are, bypassing the session
+// protectors. The dispatcher thread does not touch ciphertext anymore,
+// and the kernel AES-GCM is typically faster than our AES-CBC + HMAC.
+//
+// There is no TLS handshake: the keys of each direction are derived from
+// the session secret, see SessionProtector::ExportKey, once the session
+// is authenticated. Each direction switches at a precise point of the
+// stream, marked with TcpFraming control values:
+//   - the client asks with kControlKernelTlsRequest, right after the
+//     magic, if its kernel supports tls sockets.
+//   - the server answers with kControlKernelTlsRefuse, or, in front of
+//     the first message it sends once the session is authenticated, with
+//     kControlKernelTlsStart: all that follows are records.
+//   - the client answers with its own kControlKernelTlsStart, all that
+//     follows are records.
+// Records following a kControlKernelTlsStart must be left in the kernel
+// until it has the key: until then, the receiver reads one frame at a
+// time, never past the end of the current one.
+class KernelTls {
+ public:
+  // Bytes of secret material for each direction: a key, and a 12 bytes
+  // iv, as TLS 1.3 AES-256-GCM uses.
+  static const int kKeySize = 32;
+  static const int kIvSize = 12;
+  static const int kMaterialSize = kKeySize + kIvSize;
+
+  enum Role {
+    Client,
+    Server
+  };
+
+  explicit KernelTls(Role role);
+  ~KernelTls();
+
+  // Client side, when the connection is created: adds the request to
+  // output, if channel supports kernel tls.
+  void Request(BoundChannel* channel, Buffer* output);
+  // Server side, on kControlKernelTlsRequest.
+  void HandleRequest(BoundChannel* channel, Buffer* output);
+  // Server side, before a message encoded with encoder is added to
+  // output: starts the switch if the client asked for it, and encoder
+  // belongs to an authenticated session.
+  void MaybeStart(const SessionProtector& encoder, Buffer* output);
+  // Both sides, on kControlKernelTlsStart. The client passes the
+  // protector of the session on the connection, to derive the keys from,
+  // the server has them already. Returns false if the connection can't
+  // go on, and must be closed.
+  bool HandleStart(BoundChannel* channel, const SessionProtector* protector,
+                   Buffer* output);
+  // Client side, on kControlKernelTlsRefuse.
+  void HandleRefuse();
+
+  // Keys are derived from the session, and records numbered from 0 on
+  // each connection: connections sharing a session must derive them with
+  // a different binding, or the same key and nonces would be used twice.
+  // 0 by default, multipath joins use their counter. Must be called
+  // before the keys are derived.
+  void Bind(uint32_t binding) { binding_ = binding; }
+
+  // Must be called with the number of bytes of output written to channel
+  // each time, no more than WriteLimit(). Switches the sending side once
+  // our kControlKernelTlsStart is written. Returns false if the switch
+  // failed, and the connection must be closed.
+  bool HandleWritten(BoundChannel* channel, unsigned int written);
+
+  // How many bytes can be written before the sending side switches, 0
+  // if there is no limit.
+  unsigned int WriteLimit() const { return clear_left_; }
+  // True if messages must be sent as they are, without being encoded:
+  // they will come after our kControlKernelTlsStart.
+  bool SendsClear() const { return sending_ != Off; }
+  // True if messages are received already decrypted by the kernel.
+  bool ReceivesClear() const { return receiving_ == On; }
+  // True if reads must not go past the end of the current frame.
+  bool ReadsFrameByFrame() const { return receiving_ == Pending; }
+
+  // Socket helpers, used by the transports: Attach prepares fd for
+  // kernel tls, Install sets the key of one direction.
+  static bool Attach(int fd);
+  static bool Install(int fd, bool transmit, const char* material);
+
+ private:
+  enum State {
+    Off,
+    Pending,
+    On
+  };
+
+  // Derives the material of both directions from protector.
+  bool DeriveKeys(const SessionProtector& protector);
+  // Adds our kControlKernelTlsStart to output, and prepares to switch the
+  // sending side once output is written up to it.
+  void AddStart(Buffer* output);
+  const char* SendKey() const;
+  const char* ReceiveKey() const;
+
+  const Role role_;
+  // Client: asked for kernel tls, server: was asked.
+  bool requested_;
+  State sending_;
+  State receiving_;
+  unsigned int clear_left_;
+  uint32_t binding_;
+
+  char client_key_[kMaterialSize];
+  char server_key_[kMaterialSize];
+
+  NO_COPY(KernelTls);
+};
+
+#endif /* KERNEL_TLS_H */
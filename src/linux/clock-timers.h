@@ -112,6 +112,18 @@ class ClockTimer {
     return result;
   }
 
+  // Time in ms from some arbitrary point, wrapping around every ~49 days.
+  // Only differences between values are meaningful, and only if computed
+  // with unsigned arithmetic: cheap timestamps for rate limiters and such.
+  ms_timer_t Milliseconds() const {
+    return static_cast<ms_timer_t>(ts_.tv_sec) * 1000 + ts_.tv_nsec / 1000000;
+  }
+
+  // Time in us from the same arbitrary point, for measurements.
+  uint64_t Microseconds() const {
+    return static_cast<uint64_t>(ts_.tv_sec) * 1000000 + ts_.tv_nsec / 1000;
+  }
+
  private:
   static timespec GetCurrentTime() {
     timespec ts;
@@ -8,7 +8,7 @@
 #include <memory>
 
 EpollDispatcher::EpollDispatcher() 
-    : poll_fd_(-1) {
+    : poll_fd_(-1), stopped_(false) {
 }
 
 EpollDispatcher::~EpollDispatcher() {
@@ -133,7 +133,8 @@ bool EpollDispatcher::Start(EventScheduler* scheduler) {
   RUNTIME_FATAL_UNLESS(poll_fd_ >= 0)("must first call Init()");
 
   epoll_event events[kQueueLength];
-  while (true) {
+  stopped_ = false;
+  while (!stopped_) {
     LOG_DEBUG("waiting for events.");
 
     for (DeletionsSet::const_iterator it(pending_deletions_.begin());
@@ -175,5 +176,9 @@ bool EpollDispatcher::Start(EventScheduler* scheduler) {
         (*(event->write_handler))();
     }
   }
-  return false;
+  return true;
+}
+
+void EpollDispatcher::Stop() {
+  stopped_ = true;
 }
@@ -32,6 +32,7 @@ class EpollDispatcher {
   bool Init();
   bool Start() { return Start(NULL); }
   bool Start(EventScheduler* scheduler);
+  // Start returns once the handlers it is running are done.
   void Stop();
 
   bool AddFd(int fd, event_mask_t events,
@@ -48,6 +49,7 @@ class EpollDispatcher {
 
  private:
   int poll_fd_;
+  bool stopped_;
 
   struct EpollEvent {
     EpollEvent(
@@ -0,0 +1,123 @@
+#include "inotify-watcher.h"
+
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include <vector>
+#include <algorithm>
+
+static const uint32_t kInotifyMask = IN_CLOSE_WRITE | IN_MOVED_TO;
+
+InotifyWatcher::InotifyWatcher(EpollDispatcher* dispatcher)
+    : dispatcher_(dispatcher),
+      read_handler_(bind(&InotifyWatcher::HandleRead, this)),
+      fd_(-1) {
+}
+
+InotifyWatcher::~InotifyWatcher() {
+  if (fd_ >= 0) {
+    dispatcher_->DelFd(fd_);
+    close(fd_);
+  }
+}
+
+bool InotifyWatcher::Init() {
+  DEBUG_FATAL_UNLESS(fd_ < 0)("watcher initialized twice?");
+
+  fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd_ < 0) {
+    LOG_PERROR("inotify_init1 failed");
+    return false;
+  }
+
+  if (!dispatcher_->AddFd(fd_, EpollDispatcher::READ, &read_handler_, NULL)) {
+    LOG_ERROR("could not add inotify fd %d to dispatcher", fd_);
+    close(fd_);
+    fd_ = -1;
+    return false;
+  }
+  return true;
+}
+
+bool InotifyWatcher::Watch(const string& path, const change_handler_t* handler) {
+  if (fd_ < 0) {
+    LOG_ERROR("cannot watch %s, watcher not initialized", path.c_str());
+    return false;
+  }
+
+  string directory(".");
+  string name(path);
+  string::size_type slash(path.rfind('/'));
+  if (slash != string::npos) {
+    directory.assign(slash ? path.substr(0, slash) : "/");
+    name.assign(path.substr(slash + 1));
+  }
+
+  int wd = inotify_add_watch(fd_, directory.c_str(), kInotifyMask);
+  if (wd < 0) {
+    LOG_PERROR("cannot watch %s", directory.c_str());
+    return false;
+  }
+
+  LOG_DEBUG("watching %s in %s (wd %d)", name.c_str(), directory.c_str(), wd);
+  watched_.push_back(Watched(wd, name, handler));
+  return true;
+}
+
+void InotifyWatcher::HandleRead() {
+  char buffer[kBufferSize]
+      __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+  // A single update generally causes multiple events, don't invoke handlers
+  // more than once per batch.
+  vector<const change_handler_t*> changed;
+  bool overflow = false;
+
+  while (1) {
+    ssize_t r = read(fd_, buffer, sizeof(buffer));
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN)
+        LOG_PERROR("error reading inotify events from %d", fd_);
+      break;
+    }
+    if (r == 0)
+      break;
+
+    for (char* cursor = buffer; cursor < buffer + r;) {
+      const struct inotify_event* event(
+          reinterpret_cast<struct inotify_event*>(cursor));
+      cursor += sizeof(struct inotify_event) + event->len;
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        LOG_ERROR("inotify queue overflow, assuming all files changed");
+        overflow = true;
+        continue;
+      }
+      if (!event->len)
+        continue;
+
+      for (WatchedList::const_iterator it(watched_.begin());
+           it != watched_.end(); ++it) {
+        if (it->wd != event->wd || it->name != event->name)
+          continue;
+        if (find(changed.begin(), changed.end(), it->handler) == changed.end())
+          changed.push_back(it->handler);
+      }
+    }
+  }
+
+  if (overflow) {
+    changed.clear();
+    for (WatchedList::const_iterator it(watched_.begin());
+         it != watched_.end(); ++it)
+      changed.push_back(it->handler);
+  }
+
+  for (vector<const change_handler_t*>::const_iterator it(changed.begin());
+       it != changed.end(); ++it)
+    (**it)();
+}
@@ -0,0 +1,53 @@
+#ifndef LINUX_INOTIFY_WATCHER_H
+# define LINUX_INOTIFY_WATCHER_H
+
+# include "../base.h"
+# include "../errors.h"
+# include "../macros.h"
+# include "epoll-dispatcher.h"
+
+# include <string>
+# include <list>
+
+// Notifies when a file has been rewritten or replaced.
+//
+// The directory containing the file is watched, rather than the file itself,
+// so the watch keeps working when the file is replaced with a rename(2).
+// Handlers are invoked from the dispatcher loop, once the writer has closed
+// the file, or the new file has been moved in place.
+class InotifyWatcher {
+ public:
+  typedef function<void ()> change_handler_t;
+
+  explicit InotifyWatcher(EpollDispatcher* dispatcher);
+  ~InotifyWatcher();
+
+  bool Init();
+  // Fails if Init() was not called, or failed.
+  bool Watch(const string& path, const change_handler_t* handler);
+
+ private:
+  NO_COPY(InotifyWatcher);
+
+  static const int kBufferSize = 4096;
+
+  struct Watched {
+    Watched(int wd, const string& name, const change_handler_t* handler)
+        : wd(wd), name(name), handler(handler) {}
+
+    int wd;
+    string name;
+    const change_handler_t* handler;
+  };
+  typedef list<Watched> WatchedList;
+
+  void HandleRead();
+
+  EpollDispatcher* dispatcher_;
+  EpollDispatcher::event_handler_t read_handler_;
+
+  WatchedList watched_;
+  int fd_;
+};
+
+#endif /* LINUX_INOTIFY_WATCHER_H */
@@ -0,0 +1,413 @@
+#include "multipath.h"
+#include "serializers.h"
+#include "protector.h"
+#include "conversions.h"
+#include "errors.h"
+
+#include <string.h>
+
+const uint8_t Multipath::kFrameMultipath;
+const uint8_t Multipath::kFrameJoin;
+const int Multipath::kMaxPaths;
+const int Multipath::kHeaderSize;
+const int Multipath::kTokenSize;
+const int Multipath::kJoinSize;
+const Timer::ms_timer_t Multipath::kDefaultRtt;
+const Timer::ms_timer_t Multipath::kProbeInterval;
+const Timer::ms_timer_t Multipath::kMinDeadTime;
+const uint32_t Multipath::kLossSample;
+const Timer::ms_timer_t Multipath::kTickInterval;
+
+const int ReorderBuffer::kMaxHeld;
+const Timer::ms_timer_t ReorderBuffer::kMinHoldTime;
+const Timer::ms_timer_t ReorderBuffer::kMaxHoldTime;
+
+// Echo delays don't go past this, which also means "nothing to echo".
+static const uint16_t kNoEcho = 0xffff;
+// Longer round trips are taken for garbage.
+static const Timer::ms_timer_t kMaxRtt = 60000;
+
+Multipath::Multipath()
+    : sequence_(0) {
+  memset(paths_, 0, sizeof(paths_));
+}
+
+Multipath::~Multipath() {
+  for (int i = 0; i < kMaxPaths; ++i) {
+    if (!paths_[i].sent)
+      continue;
+    LOG_INFO("multipath: path %d, %llu messages sent, rtt %u ms, loss %u.%u%%",
+             i, (unsigned long long)paths_[i].sent, Rtt(i),
+             paths_[i].loss / 10, paths_[i].loss % 10);
+  }
+}
+
+int Multipath::AddPath(bool confirmed, Timer::ms_timer_t now) {
+  for (int i = 0; i < kMaxPaths; ++i) {
+    Path* path(&paths_[i]);
+    if (path->used)
+      continue;
+
+    memset(path, 0, sizeof(*path));
+    path->used = true;
+    path->confirmed = confirmed;
+    path->last_sent = now;
+    path->last_heard = now;
+    return i;
+  }
+  return -1;
+}
+
+void Multipath::RemovePath(int path) {
+  paths_[path].used = false;
+}
+
+bool Multipath::IsConfirmed(int path) const {
+  return paths_[path].used && paths_[path].confirmed;
+}
+
+int Multipath::ConfirmedPaths() const {
+  int count(0);
+  for (int i = 0; i < kMaxPaths; ++i)
+    if (paths_[i].used && paths_[i].confirmed)
+      ++count;
+  return count;
+}
+
+bool Multipath::IsAlive(int id, Timer::ms_timer_t now) const {
+  const Path& path(paths_[id]);
+  // Nothing sent since we last heard from the peer.
+  if (static_cast<int32_t>(path.last_sent - path.last_heard) <= 0)
+    return true;
+
+  Timer::ms_timer_t dead(4 * Rtt(id));
+  if (dead < kMinDeadTime)
+    dead = kMinDeadTime;
+  return now - path.last_heard <= dead;
+}
+
+bool Multipath::Usable(const Path& path, Timer::ms_timer_t now) const {
+  return path.used && path.confirmed && IsAlive(&path - paths_, now);
+}
+
+int32_t Multipath::Weight(const Path& path) {
+  uint64_t cost(static_cast<uint64_t>(path.measured ? path.srtt : kDefaultRtt) *
+                (1000 + path.loss));
+  if (!cost)
+    cost = 1;
+  int32_t weight(1000000000ULL / cost);
+  return weight ? weight : 1;
+}
+
+bool Multipath::HasHeader(const OutputCursor& message) {
+  uint8_t type;
+  return message.Get(reinterpret_cast<char*>(&type), sizeof(type)) ==
+      sizeof(type) && type == kFrameMultipath;
+}
+
+int Multipath::Pick(Timer::ms_timer_t now) {
+  int best(-1);
+  int32_t total(0);
+  for (int i = 0; i < kMaxPaths; ++i) {
+    Path* path(&paths_[i]);
+    if (!Usable(*path, now))
+      continue;
+
+    int32_t weight(Weight(*path));
+    path->current += weight;
+    total += weight;
+    if (best < 0 || path->current > paths_[best].current)
+      best = i;
+  }
+
+  if (best >= 0) {
+    paths_[best].current -= total;
+    return best;
+  }
+
+  // Everything looks dead: keep trying the path we last heard from.
+  for (int i = 0; i < kMaxPaths; ++i) {
+    const Path& path(paths_[i]);
+    if (!path.used || !path.confirmed)
+      continue;
+    if (best < 0 || static_cast<int32_t>(
+            path.last_heard - paths_[best].last_heard) > 0)
+      best = i;
+  }
+  return best;
+}
+
+void Multipath::AddHeader(int id, bool probe, Timer::ms_timer_t now,
+                          InputCursor* output) {
+  Path* path(&paths_[id]);
+  uint32_t sequence(probe ? sequence_ : sequence_++);
+  ++path->sequence;
+  ++path->sent;
+  path->last_sent = now;
+
+  uint16_t delay(kNoEcho);
+  if (path->stamped) {
+    Timer::ms_timer_t held(now - path->stamp_received);
+    delay = held < kNoEcho ? held : kNoEcho - 1;
+  }
+
+  EncodeToBuffer(kFrameMultipath, output);
+  EncodeToBuffer(sequence, output);
+  EncodeToBuffer(path->sequence, output);
+  EncodeToBuffer(static_cast<uint32_t>(now), output);
+  EncodeToBuffer(path->stamped ? path->stamp : 0, output);
+  EncodeToBuffer(delay, output);
+  EncodeToBuffer(path->highest, output);
+  EncodeToBuffer(path->received, output);
+}
+
+bool Multipath::HandleHeader(int id, Timer::ms_timer_t now,
+                             OutputCursor* message, uint32_t* sequence) {
+  if (message->LeftSize() < static_cast<unsigned int>(kHeaderSize))
+    return false;
+
+  uint8_t type;
+  uint32_t path_sequence, stamp, echo, highest, received;
+  uint16_t delay;
+  DecodeFromBuffer(message, &type);
+  DecodeFromBuffer(message, sequence);
+  DecodeFromBuffer(message, &path_sequence);
+  DecodeFromBuffer(message, &stamp);
+  DecodeFromBuffer(message, &echo);
+  DecodeFromBuffer(message, &delay);
+  DecodeFromBuffer(message, &highest);
+  DecodeFromBuffer(message, &received);
+  if (type != kFrameMultipath)
+    return false;
+
+  Path* path(&paths_[id]);
+  path->confirmed = true;
+  path->last_heard = now;
+  ++path->received;
+  if (static_cast<int32_t>(path_sequence - path->highest) > 0)
+    path->highest = path_sequence;
+  path->stamped = true;
+  path->stamp = stamp;
+  path->stamp_received = now;
+
+  // The same stamp is echoed until a newer one is received, one sample
+  // is enough.
+  if (delay != kNoEcho && echo != path->echo) {
+    path->echo = echo;
+    Timer::ms_timer_t sample(now - echo - delay);
+    if (sample < kMaxRtt)
+      HandleRtt(path, sample);
+  }
+  HandleLoss(path, highest, received);
+  return true;
+}
+
+void Multipath::HandleRtt(Path* path, Timer::ms_timer_t sample) {
+  if (!sample)
+    sample = 1;
+
+  // As tcp does, see RFC 6298.
+  if (!path->measured) {
+    path->srtt = sample;
+    path->rttvar = sample / 2;
+    path->measured = true;
+    return;
+  }
+
+  Timer::ms_timer_t error(path->srtt > sample ?
+                          path->srtt - sample : sample - path->srtt);
+  path->rttvar = (3 * path->rttvar + error) / 4;
+  path->srtt = (7 * path->srtt + sample) / 8;
+  if (!path->srtt)
+    path->srtt = 1;
+}
+
+void Multipath::HandleLoss(Path* path, uint32_t highest, uint32_t received) {
+  uint32_t sent(highest - path->reported_highest);
+  if (static_cast<int32_t>(sent) < static_cast<int32_t>(kLossSample))
+    return;
+
+  uint32_t arrived(received - path->reported_received);
+  uint32_t lost(arrived < sent ? sent - arrived : 0);
+  path->loss = (3 * path->loss + lost * 1000 / sent) / 4;
+  path->reported_highest = highest;
+  path->reported_received = received;
+}
+
+bool Multipath::NeedsProbe(int id, Timer::ms_timer_t now) const {
+  const Path& path(paths_[id]);
+  if (!path.used || !path.confirmed)
+    return false;
+
+  // Dead paths are tried every now and then, to notice when they're back.
+  if (!IsAlive(id, now))
+    return now - path.last_sent >= kMinDeadTime;
+  return static_cast<int32_t>(path.last_heard - path.last_sent) > 0 &&
+      now - path.last_sent >= kProbeInterval;
+}
+
+Timer::ms_timer_t Multipath::HoldTime() const {
+  int measured(0);
+  Timer::ms_timer_t lowest(0), highest(0), variance(0);
+  for (int i = 0; i < kMaxPaths; ++i) {
+    const Path& path(paths_[i]);
+    if (!path.used || !path.confirmed || !path.measured)
+      continue;
+
+    if (!measured || path.srtt < lowest)
+      lowest = path.srtt;
+    if (path.srtt > highest)
+      highest = path.srtt;
+    if (path.rttvar > variance)
+      variance = path.rttvar;
+    ++measured;
+  }
+
+  if (measured < 2)
+    return kDefaultRtt / 2;
+  // Half the difference in rtt is about the difference in one way delay.
+  return (highest - lowest) / 2 + 2 * variance;
+}
+
+Timer::ms_timer_t Multipath::Rtt(int path) const {
+  return paths_[path].measured ? paths_[path].srtt : kDefaultRtt;
+}
+
+uint32_t Multipath::Loss(int path) const {
+  return paths_[path].loss;
+}
+
+uint64_t Multipath::SentCount(int path) const {
+  return paths_[path].sent;
+}
+
+bool Multipath::SessionId(const SessionProtector& protector, uint64_t* id) {
+  return protector.ExportKey("multipath session id",
+                             reinterpret_cast<char*>(id), sizeof(*id));
+}
+
+bool Multipath::Token(const SessionProtector& protector, uint32_t counter,
+                      char* token) {
+  string label("multipath join ");
+  label.append(ToString(counter));
+  return protector.ExportKey(label.c_str(), token, kTokenSize);
+}
+
+bool Multipath::AddJoin(const SessionProtector& protector, uint32_t counter,
+                        InputCursor* output) {
+  uint64_t id;
+  char token[kTokenSize];
+  if (!SessionId(protector, &id) || !Token(protector, counter, token))
+    return false;
+
+  EncodeToBuffer(kFrameJoin, output);
+  EncodeToBuffer(id, output);
+  EncodeToBuffer(counter, output);
+  output->Add(token, kTokenSize);
+  return true;
+}
+
+bool Multipath::ParseJoin(OutputCursor* message, uint64_t* id,
+                          uint32_t* counter, string* token) {
+  uint8_t type;
+  if (message->LeftSize() != static_cast<unsigned int>(kJoinSize) ||
+      message->Get(reinterpret_cast<char*>(&type), sizeof(type)) !=
+          sizeof(type) || type != kFrameJoin)
+    return false;
+
+  message->Increment(sizeof(type));
+  DecodeFromBuffer(message, id);
+  DecodeFromBuffer(message, counter);
+  message->ConsumeString(token, kTokenSize);
+  return true;
+}
+
+bool Multipath::CheckJoin(const SessionProtector& protector, uint32_t counter,
+                          const string& token) {
+  char expected[kTokenSize];
+  if (!Token(protector, counter, expected) ||
+      token.size() != static_cast<unsigned int>(kTokenSize))
+    return false;
+
+  // Constant time, as the token is a secret until it matches.
+  char difference(0);
+  for (int i = 0; i < kTokenSize; ++i)
+    difference |= expected[i] ^ token[i];
+  memset(expected, 0, sizeof(expected));
+  return !difference;
+}
+
+ReorderBuffer::ReorderBuffer()
+    : hold_(Multipath::kDefaultRtt / 2),
+      next_(0),
+      reordered_(0),
+      late_(0),
+      skipped_(0) {
+}
+
+ReorderBuffer::~ReorderBuffer() {
+  LOG_DEBUG("reordering: %llu reordered, %llu late, %llu skipped",
+            (unsigned long long)reordered_, (unsigned long long)late_,
+            (unsigned long long)skipped_);
+}
+
+void ReorderBuffer::SetHoldTime(Timer::ms_timer_t hold) {
+  if (hold < kMinHoldTime)
+    hold = kMinHoldTime;
+  if (hold > kMaxHoldTime)
+    hold = kMaxHoldTime;
+  hold_ = hold;
+}
+
+void ReorderBuffer::Add(uint32_t sequence, OutputCursor* message,
+                        Timer::ms_timer_t now, vector<string>* ready) {
+  int32_t distance(sequence - static_cast<uint32_t>(next_));
+  string packet;
+  message->ConsumeString(&packet);
+
+  // Given up on already, or a copy.
+  if (distance < 0) {
+    ++late_;
+    ready->push_back(packet);
+    return;
+  }
+
+  if (!distance) {
+    ready->push_back(packet);
+    ++next_;
+    Deliver(ready);
+    return;
+  }
+
+  uint64_t key(next_ + distance);
+  if (held_.find(key) != held_.end())
+    return;
+
+  Held* held(&held_[key]);
+  held->message.swap(packet);
+  held->when = now;
+  ++reordered_;
+  if (held_.size() > static_cast<unsigned int>(kMaxHeld))
+    Skip(ready);
+}
+
+void ReorderBuffer::Expire(Timer::ms_timer_t now, vector<string>* ready) {
+  while (!held_.empty() && now - held_.begin()->second.when >= hold_)
+    Skip(ready);
+}
+
+void ReorderBuffer::Skip(vector<string>* ready) {
+  skipped_ += held_.begin()->first - next_;
+  next_ = held_.begin()->first;
+  Deliver(ready);
+}
+
+void ReorderBuffer::Deliver(vector<string>* ready) {
+  HeldMap::iterator it;
+  while ((it = held_.begin()) != held_.end() && it->first == next_) {
+    ready->push_back(string());
+    ready->back().swap(it->second.message);
+    held_.erase(it);
+    ++next_;
+  }
+}
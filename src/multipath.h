@@ -0,0 +1,217 @@
+#ifndef MULTIPATH_H
+# define MULTIPATH_H
+
+# include "base.h"
+# include "macros.h"
+# include "buffer.h"
+# include "timers.h"
+
+# include <stdint.h>
+# include <map>
+# include <string>
+# include <vector>
+
+class SessionProtector;
+
+// Spreads the messages of a session over several transcoder connections,
+// paths from now on: for example, two udp connections over different
+// uplinks, and a tcp connection as a fallback.
+//
+// Once the session is authenticated, the client opens more connections
+// to the server, and sends a join as their first message:
+//   <kFrameJoin (1 byte)><session id (uint64)><counter (uint32)><token>
+// where the id and token are derived from the session secret, see
+// SessionProtector::ExportKey, the token from the counter too. The
+// server moves the connection into the session with that id, and
+// answers on it. Counters must grow, so joins can't be replayed.
+//
+// From then on, each message on every path starts with:
+//   <kFrameMultipath (1 byte)><sequence (uint32)><path sequence (uint32)>
+//   <stamp (uint32)><echo (uint32)><echo delay (uint16)>
+//   <highest (uint32)><received (uint32)>
+// sequence counts messages in the session, so the receiver can put them
+// back in order, see ReorderBuffer. The rest measures the path it is sent
+// on: stamp is the time the message was sent, echo the last stamp
+// received on the path, echo delay for how long it was held, so the
+// sender of the stamp gets the round trip time. highest and received are
+// the highest path sequence received on the path, and how many messages
+// were, so the sender gets the loss rate. A message with nothing after
+// the header is a probe, sent on paths that would otherwise not carry
+// measurements back.
+//
+// Messages go to the paths in proportion to their estimated capacity,
+// 1 / (rtt * (1 + loss)), with the smooth weighted round robin nginx
+// uses, so they are interleaved rather than sent in bursts. Queueing in
+// a congested path shows up in its rtt, and moves traffic away from it.
+// A path we keep sending on without hearing back from is dead, and
+// skipped until it is heard from again: failover takes about one round
+// trip more than kMinDeadTime, with no renegotiation.
+class Multipath {
+ public:
+  static const uint8_t kFrameMultipath = 0x50;
+  static const uint8_t kFrameJoin = 0x51;
+
+  static const int kMaxPaths = 8;
+  static const int kHeaderSize = 1 + 4 + 4 + 4 + 4 + 2 + 4 + 4;
+  static const int kTokenSize = 16;
+  static const int kJoinSize = 1 + 8 + 4 + kTokenSize;
+
+  // Rtt assumed for paths not measured yet.
+  static const Timer::ms_timer_t kDefaultRtt = 100;
+  // Paths that received something, and sent nothing for this long, send
+  // a probe.
+  static const Timer::ms_timer_t kProbeInterval = 200;
+  // Paths sending for max(kMinDeadTime, 4 rtt) without hearing back are
+  // dead.
+  static const Timer::ms_timer_t kMinDeadTime = 1000;
+  // Loss is sampled every kLossSample messages sent on a path.
+  static const uint32_t kLossSample = 16;
+  // How often sessions should expire reordered messages, and send probes.
+  static const Timer::ms_timer_t kTickInterval = 10;
+
+  Multipath();
+  ~Multipath();
+
+  // Adds a path, returning its id, or -1 if there are kMaxPaths already.
+  // Confirmed paths can carry messages right away, others only once
+  // something is received on them.
+  int AddPath(bool confirmed, Timer::ms_timer_t now);
+  void RemovePath(int path);
+  bool IsConfirmed(int path) const;
+  // Number of confirmed paths.
+  int ConfirmedPaths() const;
+
+  // True if message starts with a header. Messages without one are sent
+  // before both ends agree to use several paths, and are not reordered.
+  static bool HasHeader(const OutputCursor& message);
+
+  // Returns the path to send the next message on, -1 if none is left.
+  int Pick(Timer::ms_timer_t now);
+  // Adds the header of a message to be sent on path. Probes don't take a
+  // sequence number.
+  void AddHeader(int path, bool probe, Timer::ms_timer_t now,
+                 InputCursor* output);
+  // Consumes the header of message, received on path, and sets sequence.
+  // Returns false if the header is truncated.
+  bool HandleHeader(int path, Timer::ms_timer_t now, OutputCursor* message,
+                    uint32_t* sequence);
+  // True if a probe should be sent on path.
+  bool NeedsProbe(int path, Timer::ms_timer_t now) const;
+
+  // How long the receiver should wait for messages reordered by the
+  // different paths, given the rtts measured.
+  Timer::ms_timer_t HoldTime() const;
+
+  bool IsAlive(int path, Timer::ms_timer_t now) const;
+  // Smoothed rtt, in ms, and loss rate, in thousandths.
+  Timer::ms_timer_t Rtt(int path) const;
+  uint32_t Loss(int path) const;
+  uint64_t SentCount(int path) const;
+
+  // Session ids and tokens for joins. Return false if protector can't
+  // export keys, eg, before authentication.
+  static bool SessionId(const SessionProtector& protector, uint64_t* id);
+  static bool AddJoin(const SessionProtector& protector, uint32_t counter,
+                      InputCursor* output);
+  // Consumes a join from message. Returns false if it is not one.
+  static bool ParseJoin(OutputCursor* message, uint64_t* id,
+                        uint32_t* counter, string* token);
+  static bool CheckJoin(const SessionProtector& protector, uint32_t counter,
+                        const string& token);
+
+ private:
+  struct Path {
+    bool used;
+    bool confirmed;
+
+    // Sending side.
+    uint32_t sequence;
+    uint64_t sent;
+    Timer::ms_timer_t last_sent;
+    int32_t current;
+
+    // Receiving side.
+    uint32_t highest;
+    uint32_t received;
+    bool stamped;
+    uint32_t stamp;
+    Timer::ms_timer_t stamp_received;
+    Timer::ms_timer_t last_heard;
+
+    // What the peer reports.
+    uint32_t echo;
+    uint32_t reported_highest;
+    uint32_t reported_received;
+    bool measured;
+    Timer::ms_timer_t srtt;
+    Timer::ms_timer_t rttvar;
+    uint32_t loss;
+  };
+
+  bool Usable(const Path& path, Timer::ms_timer_t now) const;
+  static int32_t Weight(const Path& path);
+  void HandleRtt(Path* path, Timer::ms_timer_t sample);
+  void HandleLoss(Path* path, uint32_t highest, uint32_t received);
+  static bool Token(const SessionProtector& protector, uint32_t counter,
+                    char* token);
+
+  Path paths_[kMaxPaths];
+  uint32_t sequence_;
+
+  NO_COPY(Multipath);
+};
+
+// Puts back in order messages received over several paths. Messages
+// following a gap are held until the gap is filled, for at most the hold
+// time, or until kMaxHeld are waiting: the missing ones are then taken
+// as lost, and delivered as they come, if they ever do.
+class ReorderBuffer {
+ public:
+  static const int kMaxHeld = 128;
+  static const Timer::ms_timer_t kMinHoldTime = 5;
+  static const Timer::ms_timer_t kMaxHoldTime = 200;
+
+  ReorderBuffer();
+  ~ReorderBuffer();
+
+  // Clamped to kMinHoldTime, kMaxHoldTime.
+  void SetHoldTime(Timer::ms_timer_t hold);
+
+  // Consumes message, and appends to ready all the messages that can be
+  // delivered now, in order.
+  void Add(uint32_t sequence, OutputCursor* message, Timer::ms_timer_t now,
+           vector<string>* ready);
+  // Appends to ready the messages that were held for too long, and the
+  // ones following them.
+  void Expire(Timer::ms_timer_t now, vector<string>* ready);
+
+  bool Empty() const { return held_.empty(); }
+  uint64_t ReorderedCount() const { return reordered_; }
+  uint64_t LateCount() const { return late_; }
+  uint64_t SkippedCount() const { return skipped_; }
+
+ private:
+  struct Held {
+    string message;
+    Timer::ms_timer_t when;
+  };
+  typedef map<uint64_t, Held> HeldMap;
+
+  // Skips to the first message held, and delivers it with the ones
+  // following it.
+  void Skip(vector<string>* ready);
+  void Deliver(vector<string>* ready);
+
+  Timer::ms_timer_t hold_;
+  // Sequences are unwrapped to 64 bits, relative to next_.
+  uint64_t next_;
+  HeldMap held_;
+
+  uint64_t reordered_;
+  uint64_t late_;
+  uint64_t skipped_;
+
+  NO_COPY(ReorderBuffer);
+};
+
+#endif /* MULTIPATH_H */
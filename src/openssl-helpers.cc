@@ -4,6 +4,9 @@
 #include "serializers.h"
 #include "prng.h"
 
+#include <pthread.h>
+#include <vector>
+
 void InitOpenSSL() {
   ENGINE_load_builtin_engines();
 
@@ -20,12 +23,71 @@ const Hmac::Engine Hmac::kSHA1(EVP_sha1());
 const Hmac::Engine Hmac::kSHA256(EVP_sha256());
 const Hmac::Engine Hmac::kSHA512(EVP_sha512());
 
+typedef vector<BN_CTX*> BnContextPool;
+
+static pthread_key_t thread_bn_pool_key;
+static pthread_once_t thread_bn_pool_once = PTHREAD_ONCE_INIT;
+
+static void DeleteThreadBnPool(void* arg) {
+  BnContextPool* pool(static_cast<BnContextPool*>(arg));
+  for (BnContextPool::iterator it = pool->begin(); it != pool->end(); ++it)
+    BN_CTX_free(*it);
+  delete pool;
+}
+
+static void CreateThreadBnPoolKey() {
+  RUNTIME_FATAL_UNLESS(
+      !pthread_key_create(&thread_bn_pool_key, DeleteThreadBnPool))(
+      "could not allocate thread specific key for BN_CTX pool");
+}
+
+static BnContextPool* GetThreadBnPool() {
+  pthread_once(&thread_bn_pool_once, CreateThreadBnPoolKey);
+
+  BnContextPool* pool(
+      static_cast<BnContextPool*>(pthread_getspecific(thread_bn_pool_key)));
+  if (!pool) {
+    pool = new BnContextPool;
+    pthread_setspecific(thread_bn_pool_key, pool);
+  }
+  return pool;
+}
+
 BigNumberContext::BigNumberContext() {
-  bn_ctx_ = BN_CTX_new();
+  BnContextPool* pool(GetThreadBnPool());
+  if (pool->empty()) {
+    bn_ctx_ = BN_CTX_new();
+    RUNTIME_FATAL_UNLESS(bn_ctx_)("BN_CTX_new failed! %ld", ERR_get_error());
+    return;
+  }
+
+  bn_ctx_ = pool->back();
+  pool->pop_back();
 }
 
 BigNumberContext::~BigNumberContext() {
-  BN_CTX_free(bn_ctx_);
+  BnContextPool* pool(GetThreadBnPool());
+  if (pool->size() >= kMaxPooledContexts) {
+    // BN_CTX_free overwrites all the temporaries before releasing them.
+    BN_CTX_free(bn_ctx_);
+    return;
+  }
+
+  Scrub(bn_ctx_);
+  pool->push_back(bn_ctx_);
+}
+
+void BigNumberContext::Scrub(BN_CTX* bn_ctx) {
+  // There is no way to walk the temporaries of a BN_CTX, but asking them
+  // back in a new frame returns the very same BIGNUMs, in the same order.
+  BN_CTX_start(bn_ctx);
+  for (int i = 0; i < kScrubTemporaries; ++i) {
+    BIGNUM* bn = BN_CTX_get(bn_ctx);
+    if (!bn)
+      break;
+    BN_clear(bn);
+  }
+  BN_CTX_end(bn_ctx);
 }
 
 void BigNumberContext::ModExp(
@@ -35,6 +97,22 @@ void BigNumberContext::ModExp(
     LOG_FATAL("BN_mod_exp failed! %ld", ERR_get_error());
 }
 
+void BigNumberContext::ModExp(
+    BigNumber* result, const BigNumber& base, const BigNumber& exp,
+    const BigNumber& module, const MontgomeryContext& mont) {
+  if (!BN_mod_exp_mont(result->Get(), base.Get(), exp.Get(), module.Get(),
+                       bn_ctx_, mont.Get()))
+    LOG_FATAL("BN_mod_exp_mont failed! %ld", ERR_get_error());
+}
+
+void BigNumberContext::ModExp(
+    BigNumber* result, BN_ULONG base, const BigNumber& exp,
+    const BigNumber& module, const MontgomeryContext& mont) {
+  if (!BN_mod_exp_mont_word(result->Get(), base, exp.Get(), module.Get(),
+                            bn_ctx_, mont.Get()))
+    LOG_FATAL("BN_mod_exp_mont_word failed! %ld", ERR_get_error());
+}
+
 void BigNumberContext::ModSub(
     BigNumber* result, const BigNumber& base, const BigNumber& sub,
     const BigNumber& module) {
@@ -83,6 +161,19 @@ bool BigNumberContext::IsDivisibleBy(
   return false;
 }
 
+MontgomeryContext::MontgomeryContext()
+    : mont_ctx_(BN_MONT_CTX_new()) {
+}
+
+MontgomeryContext::~MontgomeryContext() {
+  BN_MONT_CTX_free(mont_ctx_);
+}
+
+bool MontgomeryContext::Setup(const BigNumber& module) {
+  BigNumberContext bnctx;
+  return BN_MONT_CTX_set(mont_ctx_, module.Get(), bnctx.Get()) == 1;
+}
+
 bool EncodeToBuffer(const BigNumber& bn, InputCursor* cursor) {
   int size = BN_num_bytes(bn.Get());
   if (size > numeric_limits<uint16_t>::max())
@@ -137,7 +228,11 @@ BigNumber::BigNumber() {
 }
 
 BigNumber::~BigNumber() {
-  BN_free(&bn_);
+  BN_clear_free(&bn_);
+}
+
+void BigNumber::Clear() {
+  BN_clear(&bn_);
 }
 
 void BigNumber::SetFromInt(int value) {
@@ -165,6 +260,7 @@ void BigNumber::SetFromRandom(Prng* prng, int length) {
   buffer.resize(length);
   prng->Get(&(buffer[0]), length);
   SetFromBinary(buffer);
+  memset(&(buffer[0]), 0, length);
 }
 
 void BigNumber::ExportAsBinary(string* value) const {
@@ -249,3 +345,44 @@ void Hmac::Update(const char* data, int length) {
 void Hmac::Get(char* hash) {
   HMAC_Final(context_->Get(), reinterpret_cast<unsigned char*>(hash), NULL);
 }
+
+void Hkdf::Extract(
+    const Hmac::Engine& engine, const char* salt, int saltlen,
+    const char* ikm, int ikmlen, char* prk) {
+  char zeros[EVP_MAX_MD_SIZE];
+  if (!salt || !saltlen) {
+    memset(zeros, 0, engine.Length());
+    salt = zeros;
+    saltlen = engine.Length();
+  }
+
+  Hmac::Context context;
+  Hmac hmac(&context, salt, saltlen, engine);
+  hmac.Update(ikm, ikmlen);
+  hmac.Get(prk);
+}
+
+void Hkdf::Expand(
+    const Hmac::Engine& engine, const char* prk, int prklen,
+    const char* info, int infolen, char* okm, int okmlen) {
+  const int kHashLength = engine.Length();
+  DEBUG_FATAL_UNLESS(okmlen <= 255 * kHashLength)(
+      "cannot expand to %d bytes with a %d bytes hash", okmlen, kHashLength);
+
+  Hmac::Context context;
+  char block[EVP_MAX_MD_SIZE];
+  for (uint8_t counter = 1; okmlen > 0; ++counter) {
+    Hmac hmac(&context, prk, prklen, engine);
+    if (counter > 1)
+      hmac.Update(block, kHashLength);
+    hmac.Update(info, infolen);
+    hmac.Update(reinterpret_cast<const char*>(&counter), sizeof(counter));
+    hmac.Get(block);
+
+    int tocopy = min(okmlen, kHashLength);
+    memcpy(okm, block, tocopy);
+    okm += tocopy;
+    okmlen -= tocopy;
+  }
+  memset(block, 0, sizeof(block));
+}
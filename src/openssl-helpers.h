@@ -7,6 +7,7 @@
 #include <openssl/hmac.h>
 
 #include "base.h"
+#include "macros.h"
 #include "password.h"
 #include <string>
 
@@ -50,6 +51,8 @@ class BigNumber {
   void ExportAsHex(string* value) const;
 
   bool IsZero() const;
+  // Overwrites the value with zeros, keeping the memory allocated.
+  void Clear();
 
   BIGNUM* Get() { return &bn_; }
   const BIGNUM* Get() const { return &bn_; }
@@ -58,9 +61,32 @@ class BigNumber {
   BIGNUM bn_;
 };
 
+// Precomputed state to perform modular exponentiations in Montgomery
+// form for a given modulus. Once set up, it is never modified by openssl,
+// and can be shared by multiple BigNumberContext, even across threads.
+class MontgomeryContext {
+ public:
+  MontgomeryContext();
+  ~MontgomeryContext();
+
+  bool Setup(const BigNumber& module);
+
+  BN_MONT_CTX* Get() const { return mont_ctx_; }
+
+ private:
+  NO_COPY(MontgomeryContext);
+
+  BN_MONT_CTX* mont_ctx_;
+};
+
 extern bool EncodeToBuffer(const BigNumber&, InputCursor* cursor);
 extern int DecodeFromBuffer(OutputCursor* cursor, BigNumber* bn);
 
+// BN_CTX are borrowed from a small per thread pool when the context is
+// created, and scrubbed and returned to the pool when it is destroyed.
+// Keep BigNumberContext objects on the stack, for the duration of a single
+// computation: no matter how many sessions are alive, at most a few BN_CTX
+// exist per thread, and intermediate values are not left around in memory.
 class BigNumberContext {
  public:
   BigNumberContext();
@@ -68,6 +94,14 @@ class BigNumberContext {
 
   void ModExp(BigNumber* result, const BigNumber& base,
 	      const BigNumber& exp, const BigNumber& module);
+  // Same as above, but uses the precomputed montgomery context for module.
+  void ModExp(BigNumber* result, const BigNumber& base,
+	      const BigNumber& exp, const BigNumber& module,
+	      const MontgomeryContext& mont);
+  // Same as above, for small bases (like the generator of a group).
+  void ModExp(BigNumber* result, BN_ULONG base,
+	      const BigNumber& exp, const BigNumber& module,
+	      const MontgomeryContext& mont);
   void ModSub(BigNumber* result, const BigNumber& base,
 	      const BigNumber& sub, const BigNumber& module);
   void ModAdd(BigNumber* result, const BigNumber& base,
@@ -86,7 +120,20 @@ class BigNumberContext {
 
   bool IsDivisibleBy(const BigNumber& number, const BigNumber& divisor);
 
+  BN_CTX* Get() { return bn_ctx_; }
+
  private:
+  NO_COPY(BigNumberContext);
+
+  // How many BN_CTX are kept around per thread, at most.
+  static const unsigned int kMaxPooledContexts = 4;
+  // How many temporaries to overwrite when returning a BN_CTX to the pool.
+  // Montgomery exponentiation with the largest primes uses a window of 6
+  // bits, 32 precomputed values, plus a few more temporaries.
+  static const int kScrubTemporaries = 48;
+
+  static void Scrub(BN_CTX* bn_ctx);
+
   BN_CTX* bn_ctx_;
 };
 
@@ -145,6 +192,22 @@ class Hmac {
   Context* context_;
 };
 
+// HMAC-based key derivation function, as per RFC 5869.
+class Hkdf {
+ public:
+  // Computes engine.Length() bytes of pseudo random key in prk from the
+  // input keying material. salt can be NULL.
+  static void Extract(const Hmac::Engine& engine,
+                      const char* salt, int saltlen,
+                      const char* ikm, int ikmlen, char* prk);
+
+  // Expands prk into okmlen bytes of output keying material. okmlen must
+  // not be larger than 255 * engine.Length().
+  static void Expand(const Hmac::Engine& engine,
+                     const char* prk, int prklen,
+                     const char* info, int infolen, char* okm, int okmlen);
+};
+
 class Digest {
  public:
   typedef OpensslEngine<EVP_MD> Engine;
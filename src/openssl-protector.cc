@@ -184,10 +184,18 @@ bool OpensslEncoder::AddPadding(InputCursor* output, int datasize) {
   if (!pad)
     return true;
 
-  Buffer temp;
-  temp.Input()->Reserve(pad);
-  prng_->Get(temp.Input()->Data(), pad);
-  temp.Input()->Increment(pad);
-
-  return Continue(temp.Output(), output);
+  // Padding is at most one block, no need to go through a Buffer.
+  unsigned char padding[EVP_MAX_BLOCK_LENGTH];
+  prng_->Get(reinterpret_cast<char*>(padding), pad);
+
+  int updatelen;
+  output->Reserve(pad + cipher_.BlockSize());
+  if (!EVP_EncryptUpdate(&ctx_, (unsigned char*)(output->Data()), &updatelen,
+                         padding, pad)) {
+    ERR_print_errors_fp(stderr);
+    LOG_DEBUG("encrypt update failed");
+    return false;
+  }
+  output->Increment(updatelen);
+  return true;
 }
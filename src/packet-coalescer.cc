@@ -0,0 +1,92 @@
+#include "packet-coalescer.h"
+#include "serializers.h"
+
+const uint8_t PacketCoalescer::kFrameCoalesced;
+const int PacketCoalescer::kMaxFrameSize;
+
+PacketCoalescer::PacketCoalescer()
+    : count_(0),
+      size_(0),
+      frames_(0),
+      packets_(0) {
+}
+
+PacketCoalescer::~PacketCoalescer() {
+  if (!frames_)
+    return;
+
+  LOG_INFO("coalescing: %llu packets in %llu frames (%.2f per frame)",
+           (unsigned long long)packets_, (unsigned long long)frames_,
+           static_cast<double>(packets_) / frames_);
+}
+
+bool PacketCoalescer::Fits(int size) const {
+  if (!count_)
+    return true;
+  return 1 + size_ + 2 + size <= kMaxFrameSize;
+}
+
+void PacketCoalescer::Add(OutputCursor* packet) {
+  int size(packet->LeftSize());
+  EncodeToBuffer(static_cast<uint16_t>(size), frame_.Input());
+  EncodeToBuffer(packet, frame_.Input());
+
+  size_ += 2 + size;
+  ++count_;
+}
+
+void PacketCoalescer::Flush(InputCursor* output) {
+  if (count_ == 1)
+    frame_.Output()->Increment(2);
+  else
+    EncodeToBuffer(kFrameCoalesced, output);
+  EncodeToBuffer(frame_.Output(), output);
+
+  ++frames_;
+  packets_ += count_;
+  count_ = 0;
+  size_ = 0;
+}
+
+void PacketCoalescer::Announce(InputCursor* output) {
+  EncodeToBuffer(kFrameCoalesced, output);
+}
+
+PacketSplitter::PacketSplitter()
+    : frames_(0),
+      coalesced_(0) {
+}
+
+PacketSplitter::~PacketSplitter() {
+  LOG_DEBUG("splitting: %llu frames, %llu coalesced",
+            (unsigned long long)frames_, (unsigned long long)coalesced_);
+}
+
+bool PacketSplitter::Split(OutputCursor* frame, vector<string>* packets) {
+  ++frames_;
+
+  uint8_t type;
+  if (frame->Get(reinterpret_cast<char*>(&type), sizeof(type)) !=
+          sizeof(type) || type != PacketCoalescer::kFrameCoalesced) {
+    string packet;
+    frame->ConsumeString(&packet);
+    packets->push_back(packet);
+    return true;
+  }
+  frame->Increment(sizeof(type));
+
+  vector<string> split;
+  while (frame->LeftSize()) {
+    string packet;
+    if (DecodeFromBuffer(frame, &packet)) {
+      LOG_DEBUG("truncated coalesced frame, dropped");
+      frame->Increment(frame->LeftSize());
+      return false;
+    }
+    split.push_back(packet);
+  }
+
+  ++coalesced_;
+  packets->insert(packets->end(), split.begin(), split.end());
+  return true;
+}
@@ -0,0 +1,85 @@
+#ifndef PACKET_COALESCER_H
+# define PACKET_COALESCER_H
+
+# include "base.h"
+# include "macros.h"
+# include "buffer.h"
+
+# include <stdint.h>
+# include <vector>
+
+// Packs small packets read from the tun device in the same burst (acks,
+// DNS queries, VoIP, ...) into a single message, so they share the IV,
+// padding, and outer UDP / IP headers instead of paying for them once
+// each.
+//
+// A message carrying more than one packet is:
+//   <kFrameCoalesced (1 byte)>(<size (uint16)><packet>)*
+// while a single packet is sent as it is. Packets start with 4 or 6 (IP),
+// or with the types used by HeaderCompressor, which can't be confused with
+// kFrameCoalesced. A kFrameCoalesced with no packets at all tells the peer
+// that coalesced messages can be sent back.
+//
+// Packets are never held back waiting for others: a frame is sent as soon
+// as it is full, or no more packets are ready to be read.
+class PacketCoalescer {
+ public:
+  static const uint8_t kFrameCoalesced = 0x10;
+  // Leaves room for encryption, outer headers and the like within a 1500
+  // bytes path MTU.
+  static const int kMaxFrameSize = 1400;
+
+  PacketCoalescer();
+  ~PacketCoalescer();
+
+  // True if no packet was added since the last Flush.
+  bool Empty() const { return !count_; }
+  // True if a packet of size bytes can be added to the frame. The first
+  // packet always fits, whatever its size.
+  bool Fits(int size) const;
+
+  // Consumes packet, and adds it to the frame.
+  void Add(OutputCursor* packet);
+  // Adds the frame to output, and starts a new one.
+  void Flush(InputCursor* output);
+
+  // Adds to output an empty frame, telling the peer we can split frames.
+  static void Announce(InputCursor* output);
+
+  uint64_t FrameCount() const { return frames_; }
+  uint64_t PacketCount() const { return packets_; }
+
+ private:
+  Buffer frame_;
+  int count_;
+  int size_;
+
+  uint64_t frames_;
+  uint64_t packets_;
+
+  NO_COPY(PacketCoalescer);
+};
+
+class PacketSplitter {
+ public:
+  PacketSplitter();
+  ~PacketSplitter();
+
+  // Consumes frame, and adds the packets it carries to packets. Returns
+  // false if the frame is truncated, leaving packets alone.
+  bool Split(OutputCursor* frame, vector<string>* packets);
+
+  // True once the peer announced it can split frames, or sent some.
+  bool PeerCoalesces() const { return coalesced_ != 0; }
+
+  uint64_t FrameCount() const { return frames_; }
+  uint64_t CoalescedCount() const { return coalesced_; }
+
+ private:
+  uint64_t frames_;
+  uint64_t coalesced_;
+
+  NO_COPY(PacketSplitter);
+};
+
+#endif /* PACKET_COALESCER_H */
@@ -6,8 +6,7 @@
 # include "buffer.h"
 # include "dispatcher.h"
 # include "transport.h"
-
-class Sockaddr;
+# include "sockaddr.h"
 class SessionProtector;
 
 class DatagramSenderPacketQueue {
@@ -17,6 +16,10 @@ class DatagramSenderPacketQueue {
     PacketSlot() : address(NULL) {}
     Sockaddr* address;
     Buffer buffer;
+
+    // An address no longer in use, freed once this slot has been sent:
+    // slots queued before this one may still point to it.
+    auto_ptr<Sockaddr> retired;
   };
 
   // TODO: this has to be limited in size.
@@ -1,7 +1,9 @@
 #include "prng.h"
 #include "errors.h"
+#include "buffer.h"
 
 #include <string.h> // memset
+#include <pthread.h>
 
 #include <openssl/rand.h> 
 #include <openssl/rc4.h> 
@@ -37,6 +39,14 @@ void Prng::GetZeroTerminated(char* buffer, int length) {
   buffer[length - 1] = '\0';
 }
 
+char* Prng::Fill(InputCursor* cursor, int length) {
+  cursor->Reserve(length);
+  char* data = cursor->Data();
+  Get(data, length);
+  cursor->Increment(length);
+  return data;
+}
+
 Rc4Prng::Rc4Prng() : reseed_(0) {
 }
 
@@ -65,3 +75,123 @@ void Rc4Prng::Seed() {
 
   reseed_ = kReSeedBytes;
 }
+
+ChaCha20Prng::ChaCha20Prng() : counter_(0), reseed_(0), used_(kBufferSize) {
+}
+
+ChaCha20Prng::~ChaCha20Prng() {
+  memset(key_, 0, sizeof(key_));
+  memset(buffer_, 0, sizeof(buffer_));
+}
+
+void ChaCha20Prng::Get(char* buffer, int length) {
+  while (length > 0) {
+    if (used_ >= kBufferSize)
+      Refill();
+
+    int tocopy = min(length, kBufferSize - used_);
+    char* keystream = reinterpret_cast<char*>(buffer_) + used_;
+    memcpy(buffer, keystream, tocopy);
+    // Never return the same bytes twice, even if the state leaks later.
+    memset(keystream, 0, tocopy);
+
+    used_ += tocopy;
+    buffer += tocopy;
+    length -= tocopy;
+  }
+}
+
+void ChaCha20Prng::Seed() {
+  unsigned char seed[kKeySize + kNonceSize];
+  if (RAND_bytes(seed, sizeof(seed)) <= 0) {
+    LOG_FATAL("Couldn't obtain random bytes (error %ld)", ERR_get_error()); 
+  }
+  memcpy(key_, seed, kKeySize);
+  memcpy(nonce_, seed + kKeySize, kNonceSize);
+  memset(seed, 0, sizeof(seed));
+
+  counter_ = 0;
+  reseed_ = kReSeedBytes;
+}
+
+void ChaCha20Prng::Refill() {
+  if (reseed_ <= 0)
+    Seed();
+
+  for (int i = 0; i < kBufferBlocks; ++i)
+    Block(key_, counter_++, nonce_, buffer_ + i * (kBlockSize / 4));
+
+  // Fast key erasure: the first bytes of keystream become the next key,
+  // and are never returned to the caller.
+  memcpy(key_, buffer_, kKeySize);
+  memset(buffer_, 0, kKeySize);
+  used_ = kKeySize;
+
+  if (reseed_ < static_cast<unsigned int>(kBufferSize))
+    reseed_ = 0;
+  else
+    reseed_ -= kBufferSize;
+}
+
+#define CHACHA_ROTATE(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define CHACHA_QUARTER_ROUND(a, b, c, d) \
+  a += b; d ^= a; d = CHACHA_ROTATE(d, 16); \
+  c += d; b ^= c; b = CHACHA_ROTATE(b, 12); \
+  a += b; d ^= a; d = CHACHA_ROTATE(d, 8); \
+  c += d; b ^= c; b = CHACHA_ROTATE(b, 7);
+
+void ChaCha20Prng::Block(
+    const uint32_t key[kKeySize / 4], uint32_t counter,
+    const uint32_t nonce[kNonceSize / 4], uint32_t output[kBlockSize / 4]) {
+  // "expand 32-byte k", as little endian words.
+  uint32_t state[kBlockSize / 4] = {
+    0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+    key[0], key[1], key[2], key[3], key[4], key[5], key[6], key[7],
+    counter, nonce[0], nonce[1], nonce[2]
+  };
+
+  for (int i = 0; i < kBlockSize / 4; ++i)
+    output[i] = state[i];
+
+  for (int i = 0; i < 10; ++i) {
+    CHACHA_QUARTER_ROUND(output[0], output[4], output[8], output[12]);
+    CHACHA_QUARTER_ROUND(output[1], output[5], output[9], output[13]);
+    CHACHA_QUARTER_ROUND(output[2], output[6], output[10], output[14]);
+    CHACHA_QUARTER_ROUND(output[3], output[7], output[11], output[15]);
+    CHACHA_QUARTER_ROUND(output[0], output[5], output[10], output[15]);
+    CHACHA_QUARTER_ROUND(output[1], output[6], output[11], output[12]);
+    CHACHA_QUARTER_ROUND(output[2], output[7], output[8], output[13]);
+    CHACHA_QUARTER_ROUND(output[3], output[4], output[9], output[14]);
+  }
+
+  for (int i = 0; i < kBlockSize / 4; ++i)
+    output[i] += state[i];
+}
+
+#undef CHACHA_QUARTER_ROUND
+#undef CHACHA_ROTATE
+
+static pthread_key_t thread_prng_key;
+static pthread_once_t thread_prng_once = PTHREAD_ONCE_INIT;
+
+static void DeleteThreadPrng(void* prng) {
+  delete static_cast<ChaCha20Prng*>(prng);
+}
+
+static void CreateThreadPrngKey() {
+  RUNTIME_FATAL_UNLESS(
+      !pthread_key_create(&thread_prng_key, DeleteThreadPrng))(
+      "could not allocate thread specific key for prng");
+}
+
+ChaCha20Prng* ChaCha20Prng::ForThisThread() {
+  pthread_once(&thread_prng_once, CreateThreadPrngKey);
+
+  ChaCha20Prng* prng(
+      static_cast<ChaCha20Prng*>(pthread_getspecific(thread_prng_key)));
+  if (!prng) {
+    prng = new ChaCha20Prng();
+    pthread_setspecific(thread_prng_key, prng);
+  }
+  return prng;
+}
@@ -2,16 +2,21 @@
 # define PRNG_H
 
 # include <openssl/rc4.h> 
+# include <stdint.h>
 
 # include "charset.h"
 
 class Prng;
 class Rc4Prng;
+class ChaCha20Prng;
+class InputCursor;
 
-typedef Rc4Prng DefaultPrng;
+typedef ChaCha20Prng DefaultPrng;
 
 class Prng {
  public:
+  virtual ~Prng() {}
+
   virtual int GetInt();
   virtual int GetIntRange(int min, int max);
   virtual long int GetLongInt();
@@ -20,6 +25,11 @@ class Prng {
   virtual void Get(char* buffer, int length) = 0;
   // Like the method above, but avoids putting \0s.
   virtual void GetZeroTerminated(char* buffer, int length);
+
+  // Appends length bytes of random data to the cursor, in one contiguous
+  // block, and returns a pointer to them. Handy for IVs, padding and
+  // anything else that would otherwise need a temporary buffer.
+  virtual char* Fill(InputCursor* cursor, int length);
 };
 
 class Rc4Prng
@@ -38,4 +48,49 @@ class Rc4Prng
   RC4_KEY key_;
 };
 
+// ChaCha20 (RFC 7539) keystream used as a prng. Keystream is generated
+// kBufferBlocks at a time, so most calls are a memcpy out of buffer_.
+// After each refill the key is replaced with the first bytes of the
+// new keystream, so getting hold of the state does not allow to recover
+// random data returned before. Instances are not thread safe: use one per
+// thread, or ForThisThread().
+class ChaCha20Prng
+    : public Prng {
+ public:
+  static const int kKeySize = 32;
+  static const int kNonceSize = 12;
+  static const int kBlockSize = 64;
+  static const int kBufferBlocks = 16;
+  static const int kBufferSize = kBlockSize * kBufferBlocks;
+  static const int kReSeedBytes = 1 << 24;
+
+  ChaCha20Prng();
+  ~ChaCha20Prng();
+
+  void Get(char* buffer, int length);
+
+  // Returns an instance private to the calling thread, created on first
+  // use and deleted when the thread exits.
+  static ChaCha20Prng* ForThisThread();
+
+  // Computes a block of keystream, as per section 2.3 of RFC 7539.
+  static void Block(const uint32_t key[kKeySize / 4], uint32_t counter,
+                    const uint32_t nonce[kNonceSize / 4],
+                    uint32_t output[kBlockSize / 4]);
+
+ private:
+  void Seed();
+  void Refill();
+
+  uint32_t key_[kKeySize / 4];
+  uint32_t nonce_[kNonceSize / 4];
+  uint32_t counter_;
+
+  unsigned int reseed_;
+
+  // Keystream ready to be returned is in buffer_[used_, kBufferSize).
+  int used_;
+  uint32_t buffer_[kBufferSize / 4];
+};
+
 #endif /* PRNG_H */
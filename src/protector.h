@@ -22,6 +22,19 @@ class SessionProtector {
     CORRUPTED_DATA
   };
 
+  // True if the peers agreed to compress what is protected. Frames are
+  // compressed by the protector itself, streams by their users, see
+  // stream-compressor.h.
+  virtual bool Compresses() const { return false; }
+
+  // Derives size bytes of secret material bound to the session and to
+  // label, the same on both peers, for protocols running next to the
+  // protector (see kernel-tls.h). False if the protector has no secret to
+  // derive them from, like the ones used before authentication.
+  virtual bool ExportKey(const char* label, char* key, int size) const {
+    return false;
+  }
+
   // Encrypt and decrypt data. This interface was designed mostly on openssl API.
 
   // Note that althouugh it's possible to call Start and End multiple times
@@ -42,11 +55,29 @@ class SessionProtector {
 
 class EncodeSessionProtector : virtual public SessionProtector {
  public:
-  bool Encode(OutputCursor* input, InputCursor* output) {
+  // Encodes a whole frame. Encoders wrapping others, and needing to see
+  // each frame in one piece, can override it.
+  virtual bool Encode(OutputCursor* input, InputCursor* output) {
     return Start(output, AutoPadding) &&
 	   Continue(input, output) && End(output);
   }
 
+  // Encodes a whole frame like Encode, authenticating bound along with
+  // it: for data sent in the clear next to the frame, that the peer must
+  // pass to DecodeBound. Protectors that don't authenticate frames (see
+  // DecodeSessionProtector::Authenticates) ignore it.
+  virtual bool EncodeBound(
+      const string& bound, OutputCursor* input, InputCursor* output) {
+    return Encode(input, output);
+  }
+
+  // Encodes a whole frame like Encode, but as is: users compressing on
+  // their own (see Compresses()) must not have it compressed again.
+  // Wrappers adding to Encode pass it to the encoder they wrap.
+  virtual bool EncodeFrame(OutputCursor* input, InputCursor* output) {
+    return Encode(input, output);
+  }
+
   // Must be called once, when we start decrypting / encrypting a
   // stream of data.
   virtual bool Start(InputCursor* output, StartOptions options) = 0;
@@ -82,7 +113,8 @@ class DecodeSessionProtector : virtual public SessionProtector {
   // this will add padding and flush the pending data.
   virtual Result End(InputCursor* output) = 0;
 
-  Result Decode(OutputCursor* input, InputCursor* output) {
+  // Decodes a whole frame, see EncodeSessionProtector::Encode.
+  virtual Result Decode(OutputCursor* input, InputCursor* output) {
     Result result;
     if ((result = Start(input, output, AutoPadding)) != SUCCEEDED ||
         (result = Continue(input, output)) != SUCCEEDED)
@@ -90,6 +122,23 @@ class DecodeSessionProtector : virtual public SessionProtector {
     return End(output);
   }
 
+  // True if Decode only succeeds on frames the peer encoded: a replayed
+  // frame still does, a forged one does not. Before authentication,
+  // anyone can produce frames the protector decodes.
+  virtual bool Authenticates() const { return false; }
+
+  // Decodes a frame from EncodeSessionProtector::EncodeBound, failing
+  // if bound is not what the peer passed.
+  virtual Result DecodeBound(
+      const string& bound, OutputCursor* input, InputCursor* output) {
+    return Decode(input, output);
+  }
+
+  // Decodes a frame from EncodeSessionProtector::EncodeFrame.
+  virtual Result DecodeFrame(OutputCursor* input, InputCursor* output) {
+    return Decode(input, output);
+  }
+
   // Decrypts as much data as is available in input, up until 'until'
   // bytes have been deciphered, at which point it stops.
   // Note that deciphering will most likely stop at a block boundary,
@@ -0,0 +1,57 @@
+#include "replay-window.h"
+#include "errors.h"
+
+#include <string.h>
+
+const int ReplayWindow::kWordBits;
+const int ReplayWindow::kWindowWords;
+const uint64_t ReplayWindow::kWindowSize;
+
+ReplayWindow::ReplayWindow()
+    : highest_(0), replayed_(0), too_old_(0), reordered_(0) {
+  memset(bitmap_, 0, sizeof(bitmap_));
+}
+
+ReplayWindow::Result ReplayWindow::Test(uint64_t sequence) const {
+  if (sequence > highest_)
+    return Accepted;
+  if (highest_ - sequence >= kWindowSize) {
+    LOG_DEBUG("sequence %llu too old, highest %llu",
+              (unsigned long long)sequence, (unsigned long long)highest_);
+    return TooOld;
+  }
+
+  uint64_t bit(static_cast<uint64_t>(1) << (sequence % kWordBits));
+  if (bitmap_[(sequence / kWordBits) % kWindowWords] & bit) {
+    LOG_DEBUG("sequence %llu replayed", (unsigned long long)sequence);
+    return Replayed;
+  }
+  return Accepted;
+}
+
+ReplayWindow::Result ReplayWindow::Check(uint64_t sequence) {
+  Result result(Test(sequence));
+  if (result == Replayed)
+    ++replayed_;
+  if (result == TooOld)
+    ++too_old_;
+  if (result != Accepted)
+    return result;
+
+  uint64_t index(sequence / kWordBits);
+  if (sequence > highest_) {
+    // Move the window forward, clearing the words we are going to reuse.
+    // If we moved more than the whole window, clear all of it.
+    uint64_t current(highest_ / kWordBits);
+    uint64_t shift(min(index - current, static_cast<uint64_t>(kWindowWords)));
+    for (uint64_t i = 1; i <= shift; ++i)
+      bitmap_[(current + i) % kWindowWords] = 0;
+    highest_ = sequence;
+  } else if (sequence < highest_) {
+    ++reordered_;
+  }
+
+  bitmap_[index % kWindowWords] |=
+      static_cast<uint64_t>(1) << (sequence % kWordBits);
+  return Accepted;
+}
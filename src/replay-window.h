@@ -0,0 +1,57 @@
+#ifndef REPLAY_WINDOW_H
+# define REPLAY_WINDOW_H
+
+# include "base.h"
+# include "macros.h"
+
+# include <stdint.h>
+
+// Keeps track of which sequence numbers have been seen recently, to
+// detect replayed datagrams. This is the bitmap algorithm described in
+// RFC 6479: the window is a ring of kWindowWords words, and it is moved
+// forward one word at a time, by zeroing the words being reused. Check()
+// is O(1), and no memory is ever allocated.
+class ReplayWindow {
+ public:
+  static const int kWordBits = 64;
+  static const int kWindowWords = 32;
+  // Last word is the one being filled in, so the window is guaranteed
+  // to cover at least this many packets behind the highest one seen.
+  static const uint64_t kWindowSize = (kWindowWords - 1) * kWordBits;
+
+  enum Result {
+    Accepted,
+    Replayed,
+    TooOld
+  };
+
+  ReplayWindow();
+
+  // Returns Accepted if the sequence number has not been seen before
+  // and is within the window, in which case it is marked as seen.
+  Result Check(uint64_t sequence);
+  // Like Check, but leaves the window alone: for sequence numbers that
+  // can't be trusted, as they could come from anyone. A forged one
+  // would otherwise move the window forward, and the session with it.
+  Result Test(uint64_t sequence) const;
+
+  uint64_t Highest() const { return highest_; }
+
+  // Statistics, mostly useful to see what the network is doing to us.
+  uint64_t ReplayedCount() const { return replayed_; }
+  uint64_t TooOldCount() const { return too_old_; }
+  // Packets accepted, but received after a packet with a higher sequence.
+  uint64_t ReorderedCount() const { return reordered_; }
+
+ private:
+  uint64_t highest_;
+  uint64_t bitmap_[kWindowWords];
+
+  uint64_t replayed_;
+  uint64_t too_old_;
+  uint64_t reordered_;
+
+  NO_COPY(ReplayWindow);
+};
+
+#endif /* REPLAY_WINDOW_H */
@@ -0,0 +1,102 @@
+#include "resident-userdb.h"
+#include "errors.h"
+
+ResidentUserDb::ResidentUserDb(const string& name)
+    : change_handler_(bind(&ResidentUserDb::Reload, this)),
+      file_(name),
+      name_(name),
+      current_(new Snapshot) {
+}
+
+ResidentUserDb::~ResidentUserDb() {
+  delete current_;
+}
+
+bool ResidentUserDb::Load(FileWatcher* watcher) {
+  // Start watching before reading, so no change can be missed.
+  if (watcher && !watcher->Watch(name_, &change_handler_))
+    LOG_ERROR("cannot watch %s, changes will require a restart", name_.c_str());
+
+  return Reload();
+}
+
+bool ResidentUserDb::Reload() {
+  auto_ptr<Snapshot> fresh(new Snapshot);
+  bool loaded;
+  if (UdbBinaryIndex::IsBinary(name_))
+    loaded = fresh->index.Map(name_);
+  else
+    loaded = UdbSecretFile::ReadAll(name_, &fresh->users);
+
+  if (!loaded) {
+    LOG_ERROR("could not reload %s, keeping previous version", name_.c_str());
+    return false;
+  }
+
+  LOG_DEBUG("loaded %d users from %s",
+            fresh->index.IsMapped() ? fresh->index.Users() :
+                static_cast<int>(fresh->users.size()),
+            name_.c_str());
+
+  // Make sure the new snapshot is fully visible before publishing it.
+  __sync_synchronize();
+  retired_.reset(__sync_lock_test_and_set(&current_, fresh.release()));
+  return true;
+}
+
+bool ResidentUserDb::ValidUsername(const string& username, string* reason) {
+  return file_.ValidUsername(username, reason);
+}
+
+bool ResidentUserDb::GetUser(const string& username, string* secret) {
+  const Snapshot* snapshot(current_);
+  if (snapshot->index.IsMapped()) {
+    const char* found;
+    int size;
+    if (!snapshot->index.Find(username, &found, &size))
+      return false;
+
+    if (secret)
+      secret->assign(found, size);
+    return true;
+  }
+
+  UserMap::const_iterator it(snapshot->users.find(username));
+  if (it == snapshot->users.end())
+    return false;
+
+  if (secret)
+    secret->assign(it->second);
+  return true;
+}
+
+bool ResidentUserDb::GetAllUsers(UserMap* users) {
+  const Snapshot* snapshot(current_);
+  if (snapshot->index.IsMapped())
+    return snapshot->index.ReadAll(users);
+
+  for (UserMap::const_iterator it(snapshot->users.begin());
+       it != snapshot->users.end(); ++it)
+    (*users)[it->first] = it->second;
+  return true;
+}
+
+bool ResidentUserDb::Commit() {
+  LOG_ERROR("cannot commit %s - db is read only", name_.c_str());
+  return false;
+}
+
+bool ResidentUserDb::AddUser(const string& username, const string& secret) {
+  LOG_ERROR("cannot add user %s - db is read only", username.c_str());
+  return false;
+}
+
+bool ResidentUserDb::SetUser(const string& username, const string& secret) {
+  LOG_ERROR("cannot set user %s - db is read only", username.c_str());
+  return false;
+}
+
+bool ResidentUserDb::DelUser(const string& username) {
+  LOG_ERROR("cannot delete user %s - db is read only", username.c_str());
+  return false;
+}
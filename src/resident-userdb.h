@@ -0,0 +1,68 @@
+#ifndef RESIDENT_USERDB_H
+# define RESIDENT_USERDB_H
+
+# include "base.h"
+# include "userdb.h"
+# include "udb-binary.h"
+# include "file-watcher.h"
+
+# include <string>
+
+// Read only UserDb, keeping all the users in memory.
+//
+// The file is parsed once when calling Load(), and then again every time
+// it changes on disk. Lookups never touch the disk: they use whatever
+// snapshot of the users is current. A new snapshot is built on the side,
+// and swapped in atomically. The old one is kept around until the next
+// reload, so a lookup running concurrently with a reload never finds it
+// freed.
+//
+// Both text (UdbSecretFile) and binary (UdbBinaryIndex) files are supported,
+// the format is detected on every reload. Binary files are mmap()ed
+// rather than parsed.
+//
+// If the file on disk cannot be read or is corrupted, the previous
+// snapshot is kept.
+class ResidentUserDb : public UserDb {
+ public:
+  explicit ResidentUserDb(const string& name);
+  virtual ~ResidentUserDb();
+
+  // Reads the db from disk. If watcher is not NULL, the db will be reloaded
+  // automatically every time the file changes.
+  bool Load(FileWatcher* watcher);
+  bool Reload();
+
+  // Nothing to open, or close: everything is in memory already.
+  virtual bool Open() { return true; }
+  virtual bool Close() { return true; }
+
+  virtual bool ValidUsername(const string& username, string* reason);
+  virtual bool GetUser(const string& username, string* secret);
+  virtual bool GetAllUsers(UserMap* users);
+
+  // The db is read only, all the methods below fail.
+  virtual bool Commit();
+  virtual bool AddUser(const string& username, const string& secret);
+  virtual bool SetUser(const string& username, const string& secret);
+  virtual bool DelUser(const string& username);
+
+ private:
+  NO_COPY(ResidentUserDb);
+
+  // Only one of the two is used, depending on the format of the file.
+  struct Snapshot {
+    UserMap users;
+    UdbBinaryIndex index;
+  };
+
+  FileWatcher::change_handler_t change_handler_;
+
+  UdbSecretFile file_;
+  const string name_;
+
+  Snapshot* current_;
+  auto_ptr<Snapshot> retired_;
+};
+
+#endif /* RESIDENT_USERDB_H */
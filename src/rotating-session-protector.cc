@@ -0,0 +1,325 @@
+#include "rotating-session-protector.h"
+#include "openssl-helpers.h"
+#include "password.h"
+#include "buffer.h"
+
+#include <arpa/inet.h>
+#include <openssl/crypto.h>
+
+const int SessionKeyChain::kSecretLength;
+const int SessionKeyChain::kMacKeyLength;
+const int RotatingSessionEncoder::kTagLength;
+
+namespace {
+
+// Expands the chain secret into size bytes of key for label and
+// generation.
+void ExpandKey(const char* secret, const char* label, int labelsize,
+               uint32_t generation, char* key, int size) {
+  string info(label, labelsize);
+  uint32_t encoded(htonl(generation));
+  info.append(reinterpret_cast<const char*>(&encoded), sizeof(encoded));
+  Hkdf::Expand(Hmac::kSHA256, secret, SessionKeyChain::kSecretLength,
+               info.data(), info.size(), key, size);
+}
+
+// Tags are a truncated HMAC-SHA256 of the size and bytes of bound, and of
+// the frame, fed by the caller between StartTag and FinishTag.
+void StartTag(Hmac* hmac, const string& bound) {
+  uint32_t length(htonl(static_cast<uint32_t>(bound.size())));
+  hmac->Update(reinterpret_cast<const char*>(&length), sizeof(length));
+  hmac->Update(bound.data(), static_cast<int>(bound.size()));
+}
+
+void FinishTag(Hmac* hmac, char* tag) {
+  char hash[EVP_MAX_MD_SIZE];
+  hmac->Get(hash);
+  memcpy(tag, hash, RotatingSessionEncoder::kTagLength);
+}
+
+}  // namespace
+
+SessionKeyChain::SessionKeyChain(
+    const AesSessionKey& key, const ScopedPassword& secret) {
+  memcpy(first_, key.GetKey(), AesSessionKey::kKeyLengthInBytes);
+
+  RUNTIME_FATAL_UNLESS(Hmac::kSHA256.Length() == kSecretLength)(
+      "forgot to update .h? kSecretLength %d, sha256 %d",
+      kSecretLength, Hmac::kSHA256.Length());
+  Hkdf::Extract(Hmac::kSHA256, first_, AesSessionKey::kKeyLengthInBytes,
+                secret.Data(), secret.Used(), secret_);
+}
+
+SessionKeyChain::~SessionKeyChain() {
+  memset(first_, 0, AesSessionKey::kKeyLengthInBytes);
+  memset(secret_, 0, kSecretLength);
+}
+
+void SessionKeyChain::GetKey(uint32_t generation, char* key) const {
+  if (!generation) {
+    memcpy(key, first_, AesSessionKey::kKeyLengthInBytes);
+    return;
+  }
+
+  static const char kLabel[] = "uvpn session key";
+  ExpandKey(secret_, kLabel, sizeof(kLabel), generation, key,
+            AesSessionKey::kKeyLengthInBytes);
+}
+
+void SessionKeyChain::GetMacKey(uint32_t generation, char* key) const {
+  static const char kLabel[] = "uvpn session mac key";
+  ExpandKey(secret_, kLabel, sizeof(kLabel), generation, key, kMacKeyLength);
+}
+
+void SessionKeyChain::ExportKey(
+    const char* label, char* key, int size) const {
+  string info("uvpn exported key ");
+  info.append(label);
+  Hkdf::Expand(Hmac::kSHA256, secret_, kSecretLength,
+               info.data(), info.size(), key, size);
+}
+
+RotatingSessionEncoder::RotatingSessionEncoder(
+    Prng* prng, const SessionKeyChain& keys)
+    : prng_(prng), keys_(keys), generation_(0),
+      rotate_(false), frames_(0), bytes_(0) {
+  char key[AesSessionKey::kKeyLengthInBytes];
+  keys_.GetKey(generation_, key);
+  current_.reset(new AesSessionEncoder(prng_, key));
+  memset(key, 0, sizeof(key));
+  keys_.GetMacKey(generation_, mac_);
+}
+
+RotatingSessionEncoder::~RotatingSessionEncoder() {
+  memset(mac_, 0, sizeof(mac_));
+}
+
+void RotatingSessionEncoder::NextKey() {
+  ++generation_;
+  LOG_DEBUG("switching to key generation %u", generation_);
+
+  char key[AesSessionKey::kKeyLengthInBytes];
+  keys_.GetKey(generation_, key);
+  current_.reset(new AesSessionEncoder(prng_, key));
+  memset(key, 0, sizeof(key));
+  keys_.GetMacKey(generation_, mac_);
+
+  rotate_ = false;
+  frames_ = 0;
+  bytes_ = 0;
+}
+
+bool RotatingSessionEncoder::Encode(OutputCursor* input, InputCursor* output) {
+  return EncodeBound(string(), input, output);
+}
+
+bool RotatingSessionEncoder::EncodeBound(
+    const string& bound, OutputCursor* input, InputCursor* output) {
+  if (rotate_ || frames_ >= kRotateAfterFrames || bytes_ >= kRotateAfterBytes)
+    NextKey();
+  ++frames_;
+  bytes_ += input->LeftSize();
+
+  // Room for the whole frame in one piece, so the tag is computed where
+  // the frame was written: key id, iv, data padded to the next block.
+  const OpensslCryptoEngine& cipher(OpensslProtector::kAES_256_CBC);
+  output->Reserve(sizeof(uint8_t) + cipher.IVLength() + input->LeftSize() +
+                  2 * cipher.BlockSize() + kTagLength);
+  const char* frame(output->Data());
+  const unsigned int available(output->ContiguousSize());
+
+  const uint8_t id(static_cast<uint8_t>(generation_));
+  output->Add(reinterpret_cast<const char*>(&id), sizeof(id));
+  if (!current_->Encode(input, output))
+    return false;
+  const int size(available - output->ContiguousSize());
+  DEBUG_FATAL_UNLESS(frame + size == output->Data())(
+      "frame of %d bytes was not written in one piece", size);
+
+  Hmac::Context context;
+  Hmac hmac(&context, mac_, SessionKeyChain::kMacKeyLength, Hmac::kSHA256);
+  StartTag(&hmac, bound);
+  hmac.Update(frame, size);
+  char tag[kTagLength];
+  FinishTag(&hmac, tag);
+  output->Add(tag, kTagLength);
+  return true;
+}
+
+bool RotatingSessionEncoder::Start(InputCursor* output, StartOptions options) {
+  // No tag: the peer could not tell a switch from a forgery.
+  ++frames_;
+
+  const uint8_t id(static_cast<uint8_t>(generation_));
+  output->Add(reinterpret_cast<const char*>(&id), sizeof(id));
+  return current_->Start(output, options);
+}
+
+bool RotatingSessionEncoder::End(InputCursor* output) {
+  return current_->End(output);
+}
+
+bool RotatingSessionEncoder::Continue(OutputCursor* input, InputCursor* output) {
+  bytes_ += input->LeftSize();
+  return current_->Continue(input, output);
+}
+
+bool RotatingSessionEncoder::AddPadding(InputCursor* output, int datasize) {
+  return current_->AddPadding(output, datasize);
+}
+
+bool RotatingSessionEncoder::ExportKey(
+    const char* label, char* key, int size) const {
+  keys_.ExportKey(label, key, size);
+  return true;
+}
+
+RotatingSessionDecoder::RotatingSessionDecoder(
+    Prng* prng, const SessionKeyChain& keys)
+    : prng_(prng), keys_(keys), generation_(0),
+      active_(NULL), overlap_left_(0) {
+  current_.reset(NewDecoder(generation_));
+  keys_.GetMacKey(generation_, current_mac_);
+}
+
+RotatingSessionDecoder::~RotatingSessionDecoder() {
+  memset(current_mac_, 0, sizeof(current_mac_));
+  memset(previous_mac_, 0, sizeof(previous_mac_));
+  memset(next_mac_, 0, sizeof(next_mac_));
+}
+
+AesSessionDecoder* RotatingSessionDecoder::NewDecoder(uint32_t generation) {
+  char key[AesSessionKey::kKeyLengthInBytes];
+  keys_.GetKey(generation, key);
+  AesSessionDecoder* decoder(new AesSessionDecoder(prng_, key));
+  memset(key, 0, sizeof(key));
+  return decoder;
+}
+
+AesSessionDecoder* RotatingSessionDecoder::Select(
+    uint8_t id, const char** mac) {
+  if (id == static_cast<uint8_t>(generation_)) {
+    *mac = current_mac_;
+    return current_.get();
+  }
+  if (id == static_cast<uint8_t>(generation_ + 1)) {
+    // The peer has likely started using a new key. Don't trust it until
+    // a frame has been authenticated, see Decode().
+    if (!next_.get()) {
+      next_.reset(NewDecoder(generation_ + 1));
+      keys_.GetMacKey(generation_ + 1, next_mac_);
+    }
+    *mac = next_mac_;
+    return next_.get();
+  }
+  if (previous_.get() && overlap_left_ &&
+      id == static_cast<uint8_t>(generation_ - 1)) {
+    *mac = previous_mac_;
+    return previous_.get();
+  }
+
+  LOG_DEBUG("frame with unknown key id %d, current generation %u",
+            id, generation_);
+  return NULL;
+}
+
+void RotatingSessionDecoder::Commit() {
+  if (active_ == next_.get()) {
+    LOG_DEBUG("peer switched to key generation %u", generation_ + 1);
+    previous_ = current_;
+    current_ = next_;
+    memcpy(previous_mac_, current_mac_, sizeof(previous_mac_));
+    memcpy(current_mac_, next_mac_, sizeof(current_mac_));
+    ++generation_;
+    overlap_left_ = kOverlapFrames;
+  } else if (active_ == current_.get() && overlap_left_) {
+    if (!--overlap_left_)
+      previous_.reset();
+  }
+}
+
+RotatingSessionDecoder::Result RotatingSessionDecoder::Decode(
+    OutputCursor* input, InputCursor* output) {
+  return DecodeBound(string(), input, output);
+}
+
+RotatingSessionDecoder::Result RotatingSessionDecoder::DecodeBound(
+    const string& bound, OutputCursor* input, InputCursor* output) {
+  // Frames are always whole: whatever happens, this one is consumed.
+  OutputCursor frame(*input);
+  const unsigned int left(input->LeftSize());
+  input->Increment(left);
+  if (left < sizeof(uint8_t) + RotatingSessionEncoder::kTagLength)
+    return CORRUPTED_DATA;
+
+  const char* mac;
+  uint8_t id;
+  frame.Get(reinterpret_cast<char*>(&id), sizeof(id));
+  if (!(active_ = Select(id, &mac)))
+    return CORRUPTED_DATA;
+
+  const unsigned int size(left - RotatingSessionEncoder::kTagLength);
+  OutputCursor tagged(frame);
+  tagged.LimitLeftSize(size);
+  Hmac::Context context;
+  Hmac hmac(&context, mac, SessionKeyChain::kMacKeyLength, Hmac::kSHA256);
+  StartTag(&hmac, bound);
+  for (unsigned int chunk; (chunk = tagged.ContiguousSize());
+       tagged.Increment(chunk))
+    hmac.Update(tagged.Data(), chunk);
+  char tag[RotatingSessionEncoder::kTagLength];
+  FinishTag(&hmac, tag);
+
+  char received[RotatingSessionEncoder::kTagLength];
+  OutputCursor trailer(frame);
+  trailer.Increment(size);
+  trailer.Get(received, sizeof(received));
+  if (CRYPTO_memcmp(tag, received, sizeof(tag))) {
+    LOG_DEBUG("frame with key id %d fails authentication", id);
+    active_ = NULL;
+    return CORRUPTED_DATA;
+  }
+
+  frame.Increment(sizeof(id));
+  frame.LimitLeftSize(size - sizeof(id));
+  Result result(active_->Decode(&frame, output));
+  if (result == SUCCEEDED)
+    Commit();
+  return result;
+}
+
+RotatingSessionDecoder::Result RotatingSessionDecoder::Start(
+    OutputCursor* input, InputCursor* output, StartOptions options) {
+  uint8_t id;
+  if (input->Consume(reinterpret_cast<char*>(&id), sizeof(id)) < sizeof(id))
+    return MORE_DATA_REQUIRED;
+
+  const char* mac;
+  if (!(active_ = Select(id, &mac)))
+    return CORRUPTED_DATA;
+  return active_->Start(input, output, options);
+}
+
+RotatingSessionDecoder::Result RotatingSessionDecoder::End(InputCursor* output) {
+  DEBUG_FATAL_UNLESS(active_)("End() called without a succesful Start()");
+  // Frames decoded piecemeal carry no tag, they don't get to Commit().
+  return active_->End(output);
+}
+
+RotatingSessionDecoder::Result RotatingSessionDecoder::Continue(
+    OutputCursor* input, InputCursor* output, uint32_t until) {
+  DEBUG_FATAL_UNLESS(active_)("Continue() called without a succesful Start()");
+  return active_->Continue(input, output, until);
+}
+
+RotatingSessionDecoder::Result RotatingSessionDecoder::RemovePadding(
+    OutputCursor* output, int datasize, uint8_t* padsize) {
+  DEBUG_FATAL_UNLESS(active_)("RemovePadding() called without a succesful Start()");
+  return active_->RemovePadding(output, datasize, padsize);
+}
+
+bool RotatingSessionDecoder::ExportKey(
+    const char* label, char* key, int size) const {
+  keys_.ExportKey(label, key, size);
+  return true;
+}
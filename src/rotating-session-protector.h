@@ -0,0 +1,146 @@
+#ifndef ROTATING_SESSION_PROTECTOR_H
+# define ROTATING_SESSION_PROTECTOR_H
+
+# include "aes-session-protector.h"
+# include "protector.h"
+
+class ScopedPassword;
+
+// Chain of keys used by a session. The first key is the one computed at
+// authentication time, all the following ones are derived with HKDF from
+// the secret negotiated during authentication, so both peers can compute
+// them with no further exchange, in a few microseconds.
+class SessionKeyChain {
+ public:
+  static const int kSecretLength = 256 / 8;
+  static const int kMacKeyLength = 256 / 8;
+
+  SessionKeyChain(const AesSessionKey& key, const ScopedPassword& secret);
+  ~SessionKeyChain();
+
+  // Stores in key the AesSessionKey::kKeyLengthInBytes of key to use
+  // for the specified generation.
+  void GetKey(uint32_t generation, char* key) const;
+  // Stores in key the kMacKeyLength bytes used to authenticate frames
+  // encoded with the key of generation.
+  void GetMacKey(uint32_t generation, char* key) const;
+  // Stores in key size bytes derived for label, unrelated to the keys
+  // of any generation.
+  void ExportKey(const char* label, char* key, int size) const;
+
+ private:
+  char first_[AesSessionKey::kKeyLengthInBytes];
+  char secret_[kSecretLength];
+};
+
+// Encoder that switches to a new key every kRotateAfterFrames frames
+// or kRotateAfterBytes bytes, whichever comes first. Each frame is
+// prefixed by one byte with the low bits of the generation of the key
+// used, so the peer knows when to switch.
+//
+// Frames encoded whole, with Encode, are followed by kTagLength bytes of
+// HMAC-SHA256 of the key id and of the ciphertext, keyed for the
+// generation (encrypt-then-MAC). With EncodeBound, the data bound to the
+// frame is authenticated first, preceded by its size. Frames encoded piecemeal, with Start,
+// Continue and End, as the tcp stream mode does, carry no tag: they are
+// always encoded with the current key, and never start a new one.
+class RotatingSessionEncoder : public EncodeSessionProtector {
+ public:
+  static const uint32_t kRotateAfterFrames = 1 << 22;
+  static const uint32_t kRotateAfterBytes = 1 << 30;
+  static const int kTagLength = 16;
+
+  RotatingSessionEncoder(Prng* prng, const SessionKeyChain& keys);
+  virtual ~RotatingSessionEncoder();
+
+  virtual bool Encode(OutputCursor* input, InputCursor* output);
+  virtual bool EncodeBound(
+      const string& bound, OutputCursor* input, InputCursor* output);
+  virtual bool Start(InputCursor* output, StartOptions options);
+  virtual bool End(InputCursor* output);
+  virtual bool Continue(OutputCursor* input, InputCursor* output);
+  virtual bool AddPadding(InputCursor* output, int datasize);
+  virtual bool ExportKey(const char* label, char* key, int size) const;
+
+  // Switches to the next key, starting from the next frame.
+  void Rotate() { rotate_ = true; }
+  uint32_t Generation() const { return generation_; }
+
+ private:
+  void NextKey();
+
+  Prng* prng_;
+  const SessionKeyChain keys_;
+
+  uint32_t generation_;
+  auto_ptr<AesSessionEncoder> current_;
+  char mac_[SessionKeyChain::kMacKeyLength];
+
+  bool rotate_;
+  uint32_t frames_;
+  uint32_t bytes_;
+
+  NO_COPY(RotatingSessionEncoder);
+};
+
+// Decoder for data produced by RotatingSessionEncoder. When the peer
+// switches to a new key, the old one is still accepted for
+// kOverlapFrames frames, so packets reordered or still in flight in the
+// network are not lost.
+//
+// Frames decoded whole, with Decode, are only decrypted once their tag
+// checks out, and only those make us switch to the next key: CBC alone
+// would let a forged frame with the right key id and valid padding, one
+// in 256, move us ahead of the peer. Frames decoded piecemeal can use the
+// next key, but never commit to it.
+class RotatingSessionDecoder : public DecodeSessionProtector {
+ public:
+  static const uint32_t kOverlapFrames = 1024;
+
+  RotatingSessionDecoder(Prng* prng, const SessionKeyChain& keys);
+  virtual ~RotatingSessionDecoder();
+
+  virtual bool Authenticates() const { return true; }
+  virtual Result Decode(OutputCursor* input, InputCursor* output);
+  virtual Result DecodeBound(
+      const string& bound, OutputCursor* input, InputCursor* output);
+  virtual Result Start(
+      OutputCursor* input, InputCursor* output, StartOptions options);
+  virtual Result End(InputCursor* output);
+  virtual Result Continue(
+      OutputCursor* input, InputCursor* output, uint32_t until=0);
+  virtual Result RemovePadding(
+      OutputCursor* output, int datasize, uint8_t* padsize);
+  virtual bool ExportKey(const char* label, char* key, int size) const;
+
+  uint32_t Generation() const { return generation_; }
+
+ private:
+  AesSessionDecoder* NewDecoder(uint32_t generation);
+  // Returns the decoder for frames with key id, NULL if there is none,
+  // and sets mac to the key of their tags.
+  AesSessionDecoder* Select(uint8_t id, const char** mac);
+  // Called once a frame has been authenticated and decoded by active_.
+  void Commit();
+
+  Prng* prng_;
+  const SessionKeyChain keys_;
+
+  // Key currently in use by the peer, the one that was being used
+  // before, and the one the peer will use next, if we've seen it.
+  uint32_t generation_;
+  auto_ptr<AesSessionDecoder> current_;
+  auto_ptr<AesSessionDecoder> previous_;
+  auto_ptr<AesSessionDecoder> next_;
+  char current_mac_[SessionKeyChain::kMacKeyLength];
+  char previous_mac_[SessionKeyChain::kMacKeyLength];
+  char next_mac_[SessionKeyChain::kMacKeyLength];
+
+  // Decoder used by the frame being processed.
+  AesSessionDecoder* active_;
+  uint32_t overlap_left_;
+
+  NO_COPY(RotatingSessionDecoder);
+};
+
+#endif /* ROTATING_SESSION_PROTECTOR_H */
@@ -14,14 +14,9 @@ ScrambleSessionEncoder::~ScrambleSessionEncoder() {
 bool ScrambleSessionEncoder::Start(InputCursor* output, StartOptions options) {
   LOG_DEBUG();
 
-  // Reserve space for a key worth of random data.
+  // Generate the random key, straight into the output buffer.
   const int kKeyLength = OpensslProtector::kBF_CBC.KeyLength();
-  output->Reserve(kKeyLength);
-
-  // Generate the random key.
-  char* key = output->Data();
-  prng_->Get(key, kKeyLength);
-  output->Increment(kKeyLength);
+  char* key = prng_->Fill(output, kKeyLength);
 
   LOG_DEBUG("key length: %d", OpensslProtector::kBF_CBC.KeyLength());
   LOG_DEBUG("iv length: %d", OpensslProtector::kBF_CBC.IVLength());
@@ -83,6 +83,12 @@ inline bool EncodeToBuffer(uint32_t num, InputCursor* cursor) {
   return true;
 }
 
+inline bool EncodeToBuffer(uint64_t num, InputCursor* cursor) {
+  EncodeToBuffer(static_cast<uint32_t>(num >> 32), cursor);
+  EncodeToBuffer(static_cast<uint32_t>(num), cursor);
+  return true;
+}
+
 inline bool EncodeToBuffer(int16_t num, InputCursor* cursor) {
   num = htons(num);
   cursor->Add(reinterpret_cast<char*>(&num), sizeof(num));
@@ -154,6 +160,15 @@ inline int DecodeFromBuffer(OutputCursor* cursor, uint32_t* num) {
   return 0;
 }
 
+inline int DecodeFromBuffer(OutputCursor* cursor, uint64_t* num) {
+  uint32_t words[2];
+  int retval = cursor->Consume(reinterpret_cast<char*>(words), sizeof(words));
+  if (retval < static_cast<int>(sizeof(words)))
+    return sizeof(words) - retval;
+  *num = (static_cast<uint64_t>(ntohl(words[0])) << 32) | ntohl(words[1]);
+  return 0;
+}
+
 inline int DecodeFromBuffer(OutputCursor* cursor, string* str) {
   uint16_t size;
   int result = DecodeFromBuffer(cursor, &size);
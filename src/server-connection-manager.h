@@ -57,12 +57,22 @@ class ServerConnectedSession {
   // it received from the channel.
   virtual InputCursor* Message() = 0;
   virtual bool SendMessage() = 0;
+  // Called by the IOChannel after sending messages, see
+  // ServerTranscoder::Connection::IsCongested.
+  virtual bool IsCongested(
+      const ServerTranscoder::Connection::drained_handler_t* handler) {
+    return false;
+  }
 
   // Called by the IOChannel or ServerAuthenticator to be notified when data is
   // available for read from a session, or when session is closed.
   typedef function<void (ServerConnectedSession*, OutputCursor*)> read_handler_t;
   typedef function<void (ServerConnectedSession*, CloseReason)> close_handler_t;
   virtual void SetCallbacks(read_handler_t*, close_handler_t*) = 0;
+
+  // Called by the IOChannel to end the session, once it no longer needs
+  // it. The session is deleted later, and must not be used after this.
+  virtual void Disconnect() = 0;
 };
 
 class ServerConnectionManager {
@@ -32,7 +32,7 @@ ServerConnectedSession* ServerCryptoConnectionManager::CreateSession(
     const ConnectionKey& key, OutputCursor* cursor,
     ServerTranscoder::Connection* connection) {
   Session* session(new Session(
-      this, connection, authenticator_.get(), channel_.get()));
+      this, key, connection, authenticator_.get(), channel_.get()));
   sessions_map_[key] = session;
   LOG_DEBUG("creating new session %08x", (unsigned int)session);
   return session;
@@ -48,10 +48,12 @@ void ServerCryptoConnectionManager::RegisterAuthenticator(
 }
 
 ServerCryptoConnectionManager::Session::Session(
-    ServerCryptoConnectionManager* parent,
+    ServerCryptoConnectionManager* parent, const ConnectionKey& key,
     ServerTranscoder::Connection* connection,
     ServerAuthenticator* authenticator, ServerIOChannel* channel)
     : parent_(parent),
+      key_(key),
+      close_reason_(Shutdown),
       state_(SessionStateAuthenticationPending),
       connection_(connection),
       authenticator_(authenticator),
@@ -68,6 +70,12 @@ ServerCryptoConnectionManager::Session::Session(
   DEBUG_FATAL_UNLESS(authenticator_)("no authenticator to use for connections??");
 }
 
+ServerCryptoConnectionManager::Session::~Session() {
+  // Only deleted via DeleteLater, whoever is called can delete itself.
+  if (close_callback_)
+    (*close_callback_)(this, close_reason_);
+}
+
 void ServerCryptoConnectionManager::Session::StartAuthenticator(
     ServerConnectedSession* session, OutputCursor* cursor) {
   authenticator_->StartAuthentication(session, cursor, &authentication_done_handler_);
@@ -95,11 +103,10 @@ void ServerCryptoConnectionManager::Session::AuthenticationDoneHandler(
       break;
 
     case ServerAuthenticator::SessionFailed:
-      // TODO(security): we should stop here!
-      break;
-
     case ServerAuthenticator::SessionDenied:
-      // TODO(security): even worse! should stop here!
+      LOG_DEBUG("authentication %s, closing session",
+                status == ServerAuthenticator::SessionDenied ? "denied" : "failed");
+      HandleError(key_, connection_.get(), Manager);
       break;
 
     default:
@@ -157,6 +164,7 @@ void ServerCryptoConnectionManager::Session::HandleError(
     LOG_DEBUG("deleting session now");
     Session* session(it->second);
     map->erase(it);
+    close_reason_ = error;
 
     DEBUG_FATAL_UNLESS(session == this)(
         "how did we end up having one session deleting a different session?");
@@ -166,6 +174,10 @@ void ServerCryptoConnectionManager::Session::HandleError(
   }
 }
 
+void ServerCryptoConnectionManager::Session::Disconnect() {
+  HandleError(key_, connection_.get(), Shutdown);
+}
+
 void ServerCryptoConnectionManager::Session::Close() {
   connection_->Close();
 }
@@ -178,6 +190,11 @@ bool ServerCryptoConnectionManager::Session::SendMessage() {
   return connection_->SendMessage(this, GetEncoder());
 }
 
+bool ServerCryptoConnectionManager::Session::IsCongested(
+    const ServerTranscoder::Connection::drained_handler_t* handler) {
+  return connection_->IsCongested(handler);
+}
+
 void ServerCryptoConnectionManager::Session::SetCallbacks(
     read_handler_t* readh, close_handler_t* closeh) {
   read_callback_ = readh;
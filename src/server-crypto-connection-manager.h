@@ -355,9 +355,11 @@ class ServerCryptoConnectionManager : public ServerConnectionManager {
  private:
   class Session : public ServerConnectedSession {
    public:
-    Session(ServerCryptoConnectionManager* parent,
+    Session(ServerCryptoConnectionManager* parent, const ConnectionKey& key,
 	    ServerTranscoder::Connection* connection,
 	    ServerAuthenticator* authenticator, ServerIOChannel* channel);
+    // Tells whoever set the close callback that the session is gone.
+    ~Session();
 
     // Must always return a value, even if the session is not authenticated yet.
     virtual DecodeSessionProtector* GetDecoder();
@@ -375,10 +377,13 @@ class ServerCryptoConnectionManager : public ServerConnectionManager {
     // it received from the channel.
     virtual InputCursor* Message();
     virtual bool SendMessage();
+    virtual bool IsCongested(
+        const ServerTranscoder::Connection::drained_handler_t* handler);
   
     // Called by the IOChannel or ServerAuthenticator to be notified when data is
     // available for read from a session, or when session is closed.
     virtual void SetCallbacks(read_handler_t*, close_handler_t*);
+    virtual void Disconnect();
 
     // Tells the caller if the connection is ready, or if more data is needed.
     ServerConnectedSession::State IsReady(const ConnectionKey& key, OutputCursor* cursor);
@@ -395,6 +400,8 @@ class ServerCryptoConnectionManager : public ServerConnectionManager {
     void Close();
 
     ServerCryptoConnectionManager* parent_;
+    const ConnectionKey key_;
+    CloseReason close_reason_;
 
     enum SessionState {
       SessionStateAuthenticationPending,
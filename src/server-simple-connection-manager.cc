@@ -3,13 +3,18 @@
 #include "scramble-session-protector.h"
 #include "server-authenticator.h"
 #include "server-io-channel.h"
+#include "errors.h"
 
 // Logic, currently:
 //  - GetSession - checks only the key to see if session is new or not.
 //  - if session is not in table, it returns session->IsReady();
 ServerSimpleConnectionManager::ServerSimpleConnectionManager(
     Prng* prng, Dispatcher* dispatcher)
-    : prng_(prng), dispatcher_(dispatcher) {
+    : prng_(prng), dispatcher_(dispatcher),
+      scheduler_(NULL),
+      ticking_(false),
+      tick_handler_(bind(&ServerSimpleConnectionManager::TickHandler, this)),
+      tick_event_("multipath tick", &tick_handler_) {
 }
 
 ServerConnectedSession::State ServerSimpleConnectionManager::GetSession(
@@ -28,7 +33,7 @@ ServerConnectedSession* ServerSimpleConnectionManager::CreateSession(
     const ConnectionKey& key, OutputCursor* cursor,
     ServerTranscoder::Connection* connection) {
   Session* session(new Session(
-      this, connection, authenticator_.get(), channel_.get()));
+      this, key, connection, authenticator_.get(), channel_.get()));
   sessions_map_[key] = session;
   LOG_DEBUG("creating new session %08x", (unsigned int)session);
   return session;
@@ -43,11 +48,73 @@ void ServerSimpleConnectionManager::RegisterAuthenticator(
   authenticator_.reset(authenticator);
 }
 
+void ServerSimpleConnectionManager::EnableMultipath(EventScheduler* scheduler) {
+  scheduler_ = scheduler;
+}
+
+bool ServerSimpleConnectionManager::HandleJoin(
+    const ConnectionKey& key, Session* joining,
+    ServerTranscoder::Connection* connection, OutputCursor* data) {
+  // A client hello starts with the size of the username, which can't be
+  // that large: anything that parses as a join is one.
+  OutputCursor copy(*data);
+  uint64_t id;
+  uint32_t counter;
+  string token;
+  if (!Multipath::ParseJoin(&copy, &id, &counter, &token))
+    return false;
+
+  Session* session(StlMapGet(joinable_, id));
+  if (!session || !session->CheckJoin(counter, token)) {
+    LOG_INFO("refusing join for session %016llx", (unsigned long long)id);
+    joining->HandleError(key, connection, ServerConnectedSession::Manager);
+    return true;
+  }
+
+  // The session keys are used on other connections already.
+  connection->BindKeys(counter);
+
+  // The joining session was only created to look at the first message,
+  // and goes away without closing the connection.
+  joining->ReleaseConnection();
+  sessions_map_[key] = session;
+  dispatcher_->DeleteLater(joining);
+  session->AddPath(key, connection);
+
+  multipath_sessions_.insert(session);
+  StartTick();
+  return true;
+}
+
+void ServerSimpleConnectionManager::StartTick() {
+  if (ticking_)
+    return;
+  ticking_ = true;
+  tick_event_.Start(scheduler_, Multipath::kTickInterval);
+}
+
+bool ServerSimpleConnectionManager::TickHandler() {
+  ticking_ = false;
+  Timer::ms_timer_t now(Timer().Milliseconds());
+  // Sessions can be closed while sending probes.
+  vector<Session*> sessions(multipath_sessions_.begin(), multipath_sessions_.end());
+  for (vector<Session*>::iterator it(sessions.begin()); it != sessions.end(); ++it) {
+    if (multipath_sessions_.count(*it))
+      (*it)->HandleTick(now);
+  }
+
+  if (!multipath_sessions_.empty())
+    StartTick();
+  return true;
+}
+
 ServerSimpleConnectionManager::Session::Session(
-    ServerSimpleConnectionManager* parent,
+    ServerSimpleConnectionManager* parent, const ConnectionKey& key,
     ServerTranscoder::Connection* connection,
     ServerAuthenticator* authenticator, ServerIOChannel* channel)
     : parent_(parent),
+      key_(key),
+      close_reason_(Shutdown),
       state_(SessionStateAuthenticationPending),
       connection_(connection),
       authenticator_(authenticator),
@@ -59,9 +126,28 @@ ServerSimpleConnectionManager::Session::Session(
         &ServerSimpleConnectionManager::Session::AuthenticationDoneHandler, this,
 	placeholders::_1, placeholders::_2, placeholders::_3)),
       read_callback_(&authenticator_read_handler_), 
-      close_callback_(NULL) {
+      close_callback_(NULL),
+      joinable_(false),
+      id_(0),
+      join_counter_(0),
+      path_keys_(Multipath::kMaxPaths, key) {
   DEBUG_FATAL_UNLESS(channel_)("no channel to use for connections??");
   DEBUG_FATAL_UNLESS(authenticator_)("no authenticator to use for connections??");
+  memset(path_connections_, 0, sizeof(path_connections_));
+}
+
+ServerSimpleConnectionManager::Session::~Session() {
+  // Only deleted via DeleteLater, whoever is called can delete itself.
+  if (close_callback_)
+    (*close_callback_)(this, close_reason_);
+
+  if (joinable_ && StlMapGet(parent_->joinable_, id_) == this)
+    parent_->joinable_.erase(id_);
+  parent_->multipath_sessions_.erase(this);
+  for (int i = 0; i < Multipath::kMaxPaths; ++i) {
+    if (path_connections_[i] != connection_.get())
+      delete path_connections_[i];
+  }
 }
 
 void ServerSimpleConnectionManager::Session::StartAuthenticator(
@@ -87,15 +173,18 @@ void ServerSimpleConnectionManager::Session::AuthenticationDoneHandler(
     case ServerAuthenticator::SessionMaybeAuthenticated:
       SetEncoder(encoder);
       SetDecoder(decoder);
+      if (parent_->scheduler_ && Multipath::SessionId(*encoder_, &id_)) {
+        parent_->joinable_[id_] = this;
+        joinable_ = true;
+      }
       channel_->HandleConnect(this);
       break;
 
     case ServerAuthenticator::SessionFailed:
-      // TODO(security): we should stop here!
-      break;
-
     case ServerAuthenticator::SessionDenied:
-      // TODO(security): even worse! should stop here!
+      LOG_DEBUG("authentication %s, closing session",
+                status == ServerAuthenticator::SessionDenied ? "denied" : "failed");
+      HandleError(key_, connection_.get(), Manager);
       break;
 
     default:
@@ -129,9 +218,128 @@ EncodeSessionProtector* ServerSimpleConnectionManager::Session::GetEncoder() {
 void ServerSimpleConnectionManager::Session::HandlePacket(
     const ConnectionKey& key, ServerTranscoder::Connection* connection,
     OutputCursor* data) {
+  // The first message of a new connection can be a join.
+  if (read_callback_ == &authenticator_read_handler_ && parent_->scheduler_ &&
+      parent_->HandleJoin(key, this, connection, data))
+    return;
+
+  if (multipath_.get() && Multipath::HasHeader(*data)) {
+    int path(FindPath(connection));
+    if (path >= 0)
+      HandleMultipathPacket(path, data);
+    return;
+  }
   (*read_callback_)(this, data);
 }
 
+bool ServerSimpleConnectionManager::Session::CheckJoin(
+    uint32_t counter, const string& token) {
+  if (static_cast<int32_t>(counter - join_counter_) <= 0 ||
+      !Multipath::CheckJoin(*encoder_, counter, token))
+    return false;
+  join_counter_ = counter;
+
+  for (int i = 0; i < Multipath::kMaxPaths; ++i)
+    if (!path_connections_[i])
+      return true;
+  LOG_ERROR("session %08x has too many connections already", (unsigned int)this);
+  return false;
+}
+
+void ServerSimpleConnectionManager::Session::AddPath(
+    const ConnectionKey& key, ServerTranscoder::Connection* connection) {
+  Timer::ms_timer_t now(Timer().Milliseconds());
+  if (!multipath_.get()) {
+    multipath_.reset(new Multipath());
+    reorder_.reset(new ReorderBuffer());
+    int primary(multipath_->AddPath(true, now));
+    path_keys_[primary] = key_;
+    path_connections_[primary] = connection_.get();
+  }
+
+  int path(multipath_->AddPath(true, now));
+  path_keys_[path] = key;
+  path_connections_[path] = connection;
+  LOG_INFO("session %08x: connection joined as path %d",
+           (unsigned int)this, path);
+
+  // Lets the client know the join was accepted.
+  SendProbe(path, now);
+}
+
+ServerTranscoder::Connection*
+ServerSimpleConnectionManager::Session::ReleaseConnection() {
+  return connection_.release();
+}
+
+int ServerSimpleConnectionManager::Session::FindPath(
+    const ServerTranscoder::Connection* connection) const {
+  for (int i = 0; i < Multipath::kMaxPaths; ++i)
+    if (connection && path_connections_[i] == connection)
+      return i;
+  return -1;
+}
+
+void ServerSimpleConnectionManager::Session::HandleMultipathPacket(
+    int path, OutputCursor* data) {
+  Timer::ms_timer_t now(Timer().Milliseconds());
+  uint32_t sequence;
+  if (!multipath_->HandleHeader(path, now, data, &sequence)) {
+    LOG_DEBUG("dropping truncated multipath message");
+    return;
+  }
+
+  // Probes carry nothing else.
+  if (data->LeftSize()) {
+    vector<string> ready;
+    reorder_->SetHoldTime(multipath_->HoldTime());
+    reorder_->Add(sequence, data, now, &ready);
+    for (vector<string>::const_iterator it(ready.begin()); it != ready.end(); ++it) {
+      Buffer packet;
+      packet.Input()->Add(*it);
+      (*read_callback_)(this, packet.Output());
+    }
+  }
+
+  if (multipath_->NeedsProbe(path, now))
+    SendProbe(path, now);
+}
+
+void ServerSimpleConnectionManager::Session::HandleTick(Timer::ms_timer_t now) {
+  vector<string> ready;
+  reorder_->Expire(now, &ready);
+  for (vector<string>::const_iterator it(ready.begin()); it != ready.end(); ++it) {
+    Buffer packet;
+    packet.Input()->Add(*it);
+    (*read_callback_)(this, packet.Output());
+  }
+
+  for (int i = 0; i < Multipath::kMaxPaths; ++i)
+    if (path_connections_[i] && multipath_->NeedsProbe(i, now))
+      SendProbe(i, now);
+}
+
+void ServerSimpleConnectionManager::Session::SendProbe(
+    int path, Timer::ms_timer_t now) {
+  ServerTranscoder::Connection* connection(path_connections_[path]);
+  multipath_->AddHeader(path, true, now, connection->Message());
+  connection->SendMessage(this, GetEncoder());
+}
+
+void ServerSimpleConnectionManager::Session::DropPath(int path) {
+  LOG_INFO("session %08x: dropping path %d", (unsigned int)this, path);
+  ServerTranscoder::Connection* connection(path_connections_[path]);
+  parent_->sessions_map_.erase(path_keys_[path]);
+  path_connections_[path] = NULL;
+  multipath_->RemovePath(path);
+
+  // The connection_ is deleted with the session, the transcoder may still
+  // be using the others.
+  connection->Close();
+  if (connection != connection_.get())
+    parent_->dispatcher_->DeleteLater(connection);
+}
+
 void ServerSimpleConnectionManager::HandleError(
     const ConnectionKey& key, ServerTranscoder::Connection* connection,
     const ServerConnectedSession::CloseReason error) {
@@ -150,9 +358,17 @@ void ServerSimpleConnectionManager::Session::HandleError(
   SessionsMap* map(&parent_->sessions_map_);
   SessionsMap::iterator it(map->find(key));
   if (it != map->end()) {
+    // Losing one path is fine, as long as others are left.
+    int path(multipath_.get() ? FindPath(connection) : -1);
+    if (path >= 0 && multipath_->ConfirmedPaths() > 1) {
+      DropPath(path);
+      return;
+    }
+
     LOG_DEBUG("deleting session now");
     Session* session(it->second);
     map->erase(it);
+    close_reason_ = error;
 
     DEBUG_FATAL_UNLESS(session == this)(
         "how did we end up having one session deleting a different session?");
@@ -162,18 +378,64 @@ void ServerSimpleConnectionManager::Session::HandleError(
   }
 }
 
+void ServerSimpleConnectionManager::Session::Disconnect() {
+  LOG_DEBUG("disconnecting session");
+  // All paths go, not just the one of key_ as with HandleError.
+  if (!parent_->sessions_map_.erase(key_))
+    return;
+  close_reason_ = Shutdown;
+  Close();
+  parent_->dispatcher_->DeleteLater(this);
+}
+
 void ServerSimpleConnectionManager::Session::Close() {
+  parent_->multipath_sessions_.erase(this);
+  for (int i = 0; i < Multipath::kMaxPaths; ++i) {
+    if (!path_connections_[i] || path_connections_[i] == connection_.get())
+      continue;
+    parent_->sessions_map_.erase(path_keys_[i]);
+    path_connections_[i]->Close();
+  }
   connection_->Close();
 }
 
 InputCursor* ServerSimpleConnectionManager::Session::Message() {
+  if (multipath_.get())
+    return message_.Input();
   return connection_->Message();
 }
 
 bool ServerSimpleConnectionManager::Session::SendMessage() {
+  if (multipath_.get())
+    return SendMultipathMessage();
   return connection_->SendMessage(this, GetEncoder());
 }
 
+bool ServerSimpleConnectionManager::Session::SendMultipathMessage() {
+  string payload;
+  message_.Output()->ConsumeString(&payload);
+
+  Timer::ms_timer_t now(Timer().Milliseconds());
+  int path(multipath_->Pick(now));
+  if (path < 0) {
+    LOG_DEBUG("no path left to send on, dropping message");
+    return false;
+  }
+
+  ServerTranscoder::Connection* connection(path_connections_[path]);
+  multipath_->AddHeader(path, false, now, connection->Message());
+  connection->Message()->Add(payload);
+  return connection->SendMessage(this, GetEncoder());
+}
+
+bool ServerSimpleConnectionManager::Session::IsCongested(
+    const ServerTranscoder::Connection::drained_handler_t* handler) {
+  // Paths queueing up show it in their rtt, and get less traffic.
+  if (multipath_.get())
+    return false;
+  return connection_->IsCongested(handler);
+}
+
 void ServerSimpleConnectionManager::Session::SetCallbacks(
     read_handler_t* readh, close_handler_t* closeh) {
   read_callback_ = readh;
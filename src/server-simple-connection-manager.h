@@ -4,6 +4,12 @@
 # include "server-connection-manager.h"
 # include "server-authenticator.h"
 # include "dispatcher.h"
+# include "event-scheduler.h"
+# include "multipath.h"
+
+# include <map>
+# include <set>
+# include <vector>
 
 class Prng;
 
@@ -37,12 +43,18 @@ class ServerSimpleConnectionManager : public ServerConnectionManager {
   virtual void RegisterIOChannel(ServerIOChannel* channel);
   virtual void RegisterAuthenticator(ServerAuthenticator* authenticator);
 
+  // Lets clients join more connections to their session once authenticated,
+  // see Multipath. scheduler is used to expire reordered messages.
+  void EnableMultipath(EventScheduler* scheduler);
+
  private:
   class Session : public ServerConnectedSession {
    public:
-    Session(ServerSimpleConnectionManager* parent,
+    Session(ServerSimpleConnectionManager* parent, const ConnectionKey& key,
 	    ServerTranscoder::Connection* connection,
 	    ServerAuthenticator* authenticator, ServerIOChannel* channel);
+    // Tells whoever set the close callback that the session is gone.
+    ~Session();
 
     // Must always return a value, even if the session is not authenticated yet.
     virtual DecodeSessionProtector* GetDecoder();
@@ -60,14 +72,27 @@ class ServerSimpleConnectionManager : public ServerConnectionManager {
     // it received from the channel.
     virtual InputCursor* Message();
     virtual bool SendMessage();
+    virtual bool IsCongested(
+        const ServerTranscoder::Connection::drained_handler_t* handler);
   
     // Called by the IOChannel or ServerAuthenticator to be notified when data is
     // available for read from a session, or when session is closed.
     virtual void SetCallbacks(read_handler_t*, close_handler_t*);
+    virtual void Disconnect();
 
     // Tells the caller if the connection is ready, or if more data is needed.
     ServerConnectedSession::State IsReady(const ConnectionKey& key, OutputCursor* cursor);
 
+    // Checks a join received for this session. Counters must grow, so only
+    // one join is accepted for each.
+    bool CheckJoin(uint32_t counter, const string& token);
+    // Takes ownership of connection, and starts sending on it.
+    void AddPath(const ConnectionKey& key, ServerTranscoder::Connection* connection);
+    // Gives up the connection to another session, before being deleted.
+    ServerTranscoder::Connection* ReleaseConnection();
+    // Delivers messages held for too long, and sends probes.
+    void HandleTick(Timer::ms_timer_t now);
+
    private:
     void StartAuthenticator(ServerConnectedSession* session, OutputCursor* cursor);
     void AuthenticationDoneHandler(
@@ -79,7 +104,15 @@ class ServerSimpleConnectionManager : public ServerConnectionManager {
 
     void Close();
 
+    int FindPath(const ServerTranscoder::Connection* connection) const;
+    void HandleMultipathPacket(int path, OutputCursor* data);
+    bool SendMultipathMessage();
+    void SendProbe(int path, Timer::ms_timer_t now);
+    void DropPath(int path);
+
     ServerSimpleConnectionManager* parent_;
+    const ConnectionKey key_;
+    CloseReason close_reason_;
 
     enum SessionState {
       SessionStateAuthenticationPending,
@@ -102,14 +135,44 @@ class ServerSimpleConnectionManager : public ServerConnectionManager {
 
     read_handler_t* read_callback_;
     close_handler_t* close_callback_;
+
+    // Set once the session is authenticated, if multipath is enabled.
+    bool joinable_;
+    uint64_t id_;
+    uint32_t join_counter_;
+
+    // Set once a client joined a second connection. Path 0 is connection_,
+    // the others are owned here.
+    auto_ptr<Multipath> multipath_;
+    auto_ptr<ReorderBuffer> reorder_;
+    vector<ConnectionKey> path_keys_;
+    ServerTranscoder::Connection* path_connections_[Multipath::kMaxPaths];
+    Buffer message_;
   };
 
+  // Moves the connection sending a join to the session it names. Returns
+  // false if data is not a join.
+  bool HandleJoin(const ConnectionKey& key, Session* joining,
+                  ServerTranscoder::Connection* connection, OutputCursor* data);
+  void StartTick();
+  bool TickHandler();
+
   Prng* prng_;
   Dispatcher* dispatcher_;
 
   typedef unordered_map<ConnectionKey, Session*> SessionsMap;
   SessionsMap sessions_map_;
 
+  EventScheduler* scheduler_;
+  // Authenticated sessions, by Multipath::SessionId.
+  typedef map<uint64_t, Session*> JoinableMap;
+  JoinableMap joinable_;
+  // Sessions using more than one connection.
+  set<Session*> multipath_sessions_;
+  bool ticking_;
+  EventScheduler::Event::timer_handler_t tick_handler_;
+  OneOffEvent tick_event_;
+
   auto_ptr<ServerIOChannel> channel_;
   auto_ptr<ServerAuthenticator> authenticator_;
 };
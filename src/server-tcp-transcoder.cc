@@ -3,6 +3,10 @@
 #include "server-authenticator.h"
 #include "serializers.h"
 
+const unsigned int ServerTcpTranscoder::Connection::kMaxQueuedBytes;
+const unsigned int ServerTcpTranscoder::Connection::kCongestedBytes;
+const unsigned int ServerTcpTranscoder::Connection::kDrainedBytes;
+
 ServerTcpTranscoder::ServerTcpTranscoder(
     Transport* transport, const Sockaddr& address,
     ServerConnectionManager* manager)
@@ -33,24 +37,36 @@ AcceptingChannel::processing_state_e ServerTcpTranscoder::HandleConnection() {
   }
   LOG_DEBUG("accepted new connection");
 
-  Connection* connection = new Connection(channel, manager_);
+  Connection* connection = new Connection(channel, manager_, &scheduler_);
   // TODO: track connections somewhere.
   return AcceptingChannel::MORE;
 }
 
 ServerTcpTranscoder::Connection::Connection(
-    BoundChannel* channel, ServerConnectionManager* manager)
+    BoundChannel* channel, ServerConnectionManager* manager,
+    DrrScheduler* scheduler)
     : key_(this),
       channel_(channel),
       session_(NULL),
       manager_(manager),
       decoder_(NULL),
+      framing_(TcpFraming::Unknown),
+      kernel_tls_(KernelTls::Server),
+      flow_(scheduler),
+      drained_handler_(NULL),
+      dropped_(0),
       read_handler_(bind(&ServerTcpTranscoder::Connection::HandleRead, this)),
       write_handler_(bind(&ServerTcpTranscoder::Connection::HandleWrite, this)) {
   LOG_DEBUG();
   channel_->WantRead(&read_handler_);
 }
 
+ServerTcpTranscoder::Connection::~Connection() {
+  if (dropped_)
+    LOG_INFO("connection dropped %llu messages, queue full",
+             (unsigned long long)dropped_);
+}
+
 InputCursor* ServerTcpTranscoder::Connection::Message() {
   LOG_DEBUG();
   return from_tunnel_cleartext_.Input();
@@ -58,6 +74,8 @@ InputCursor* ServerTcpTranscoder::Connection::Message() {
 
 InputCursor* ServerTcpTranscoder::Connection::Header() {
   LOG_DEBUG();
+  if (framing_ == TcpFraming::Framed)
+    return frame_.Input();
   return from_tunnel_encrypted_.Input();
 }
 
@@ -68,18 +86,41 @@ void ServerTcpTranscoder::Connection::Close() {
 bool ServerTcpTranscoder::Connection::SendMessage(
     ServerConnectedSession* session, EncodeSessionProtector* encoder) {
   LOG_DEBUG("%d bytes are ready to send", from_tunnel_cleartext_.Output()->LeftSize());
+  // The peer is not reading fast enough: dropping the message is better
+  // than buffering without bounds, tcp inside the tunnel will recover.
+  if (from_tunnel_encrypted_.Output()->LeftSize() >= kMaxQueuedBytes) {
+    from_tunnel_cleartext_.Output()->Increment(
+        from_tunnel_cleartext_.Output()->LeftSize());
+    ++dropped_;
+    return true;
+  }
+
   channel_->WantWrite(&write_handler_);
+  if (framing_ == TcpFraming::Framed)
+    return SendFrame(session, encoder);
 
   // Send size of the packet.
   if (encoder) {
     LOG_DEBUG("encoding message");
+    OutputCursor* cleartext(from_tunnel_cleartext_.Output());
+    Buffer compressed;
+    if (encoder->Compresses()) {
+      if (!compressor_.get())
+        compressor_.reset(new StreamCompressor);
+      if (!compressor_->Compress(cleartext, compressed.Input())) {
+        HandleError(session, ServerConnectedSession::Encoding, "packet too large to compress");
+        return false;
+      }
+      cleartext = compressed.Output();
+    }
+
     if (!encoder->Start(from_tunnel_encrypted_.Input(), SessionProtector::NoPadding)) {
       HandleError(session, ServerConnectedSession::Encoding, "could not start encoder");
       return false;
     }
 
     Buffer size;
-    EncodeToBuffer(static_cast<uint16_t>(from_tunnel_cleartext_.Output()->LeftSize()), size.Input());
+    EncodeToBuffer(static_cast<uint16_t>(cleartext->LeftSize()), size.Input());
     if (!encoder->Continue(size.Output(), from_tunnel_encrypted_.Input())) {
       HandleError(session, ServerConnectedSession::Encoding, "could not encrypt data");
       return false;
@@ -88,11 +129,11 @@ bool ServerTcpTranscoder::Connection::SendMessage(
     // Pad the buffer now, so we never end up with leftover data.
     encoder->AddPadding(
         from_tunnel_encrypted_.Input(),
-        from_tunnel_cleartext_.Output()->LeftSize() + sizeof(uint16_t));
+        cleartext->LeftSize() + sizeof(uint16_t));
 
     // Encode packet itself.
     if (!encoder->Continue(
-	     from_tunnel_cleartext_.Output(), from_tunnel_encrypted_.Input()) ||
+	     cleartext, from_tunnel_encrypted_.Input()) ||
         !encoder->End(from_tunnel_encrypted_.Input())) {
       HandleError(session, ServerConnectedSession::Encoding, "could not add packet");
       return false;
@@ -107,13 +148,81 @@ bool ServerTcpTranscoder::Connection::SendMessage(
   return true;
 }
 
+bool ServerTcpTranscoder::Connection::SendFrame(
+    ServerConnectedSession* session, EncodeSessionProtector* encoder) {
+  OutputCursor* cleartext(from_tunnel_cleartext_.Output());
+  if (encoder) {
+    kernel_tls_.MaybeStart(*encoder, &from_tunnel_encrypted_);
+
+    Buffer compressed;
+    if (encoder->Compresses()) {
+      if (!compressor_.get())
+        compressor_.reset(new StreamCompressor);
+      if (!compressor_->Compress(cleartext, compressed.Input())) {
+        HandleError(session, ServerConnectedSession::Encoding, "packet too large to compress");
+        return false;
+      }
+      cleartext = compressed.Output();
+    }
+
+    // The whole message is known, no need to send its size encrypted.
+    if (kernel_tls_.SendsClear()) {
+      EncodeToBuffer(cleartext, frame_.Input());
+    } else if (!encoder->EncodeFrame(cleartext, frame_.Input())) {
+      HandleError(session, ServerConnectedSession::Encoding, "could not encode frame");
+      return false;
+    }
+  } else {
+    EncodeToBuffer(cleartext, frame_.Input());
+  }
+
+  if (!TcpFraming::AddFrame(frame_.Output(), from_tunnel_encrypted_.Input())) {
+    HandleError(session, ServerConnectedSession::Encoding, "frame too large");
+    return false;
+  }
+  return true;
+}
+
+bool ServerTcpTranscoder::Connection::IsCongested(
+    const drained_handler_t* handler) {
+  if (!handler || from_tunnel_encrypted_.Output()->LeftSize() < kCongestedBytes) {
+    drained_handler_ = NULL;
+    return false;
+  }
+  drained_handler_ = handler;
+  return true;
+}
+
 BoundChannel::processing_state_e ServerTcpTranscoder::Connection::HandleWrite() {
-  LOG_DEBUG("attempting to write %d bytes",
-	    from_tunnel_encrypted_.Output()->LeftSize());
+  OutputCursor* output(from_tunnel_encrypted_.Output());
+  LOG_DEBUG("attempting to write %d bytes", output->LeftSize());
+
+  // Write no more than what the scheduler allows in this round, so other
+  // connections get their turn.
+  unsigned int allowed(flow_.Turn(output->LeftSize()));
+  // Data after our switch to kernel tls waits for the switch.
+  if (kernel_tls_.WriteLimit())
+    allowed = min(allowed, kernel_tls_.WriteLimit());
+  OutputCursor turn(*output);
+  turn.LimitLeftSize(allowed);
+  channel_->Write(&turn);
+
+  unsigned int written(allowed - turn.LeftSize());
+  output->Increment(written);
+  flow_.Sent(written, output->LeftSize());
+  if (!kernel_tls_.HandleWritten(channel_.get(), written)) {
+    HandleError(NULL, ServerConnectedSession::System, "could not start kernel tls");
+    return BoundChannel::DONE;
+  }
+
+  if (drained_handler_ && output->LeftSize() <= kDrainedBytes) {
+    const drained_handler_t* handler(drained_handler_);
+    drained_handler_ = NULL;
+    (*handler)();
+  }
 
-  channel_->Write(from_tunnel_encrypted_.Output());
   // Remove write handler, as we don't have anything more to write.
-  if (!from_tunnel_encrypted_.Output()->LeftSize())
+  if (!output->LeftSize())
     return BoundChannel::DONE;
   return BoundChannel::MORE;
 }
@@ -148,8 +257,20 @@ BoundChannel::processing_state_e ServerTcpTranscoder::Connection::HandleRead() {
 
   // TODO(security): buffer could grow indefinetely, we need bounds and a way to push
   // pressure back to the kernel and to the sender.
-  from_client_encrypted_.Input()->Reserve(kReadSize);
-  BoundChannel::io_result_e status(channel_->Read(from_client_encrypted_.Input()));
+  if (framing_ == TcpFraming::Framed)
+    from_client_encrypted_.Input()->Reserve(
+        TcpFraming::kMinReadSize, TcpFraming::kReadSize);
+  else
+    from_client_encrypted_.Input()->Reserve(kReadSize);
+  // Once we switched to kernel tls, the records the client sends after
+  // switching must be left in the kernel.
+  BoundChannel::io_result_e status;
+  if (kernel_tls_.ReadsFrameByFrame())
+    status = channel_->ReadAtMost(
+        from_client_encrypted_.Input(),
+        TcpFraming::MissingBytes(*from_client_encrypted_.Output()));
+  else
+    status = channel_->Read(from_client_encrypted_.Input());
   if (status != BoundChannel::OK) {
     if (status == BoundChannel::CLOSED)
       HandleError(NULL, ServerConnectedSession::Shutdown, "closed");
@@ -158,6 +279,14 @@ BoundChannel::processing_state_e ServerTcpTranscoder::Connection::HandleRead() {
     return BoundChannel::DONE;
   }
 
+  if (framing_ == TcpFraming::Unknown) {
+    framing_ = TcpFraming::Detect(from_client_encrypted_.Output());
+    if (framing_ == TcpFraming::Unknown)
+      return BoundChannel::MORE;
+  }
+  if (framing_ == TcpFraming::Framed)
+    return HandleFrames();
+
   DecodeSessionProtector::Result result;
   while (from_client_encrypted_.Output()->LeftSize()) {
     // This TCP connection has not been bound to a session (yet?).
@@ -253,7 +382,18 @@ BoundChannel::processing_state_e ServerTcpTranscoder::Connection::HandleRead() {
 
     decoder_->End(from_client_cleartext_.Input());
     cleartext.LimitLeftSize(size);
-    session_->HandlePacket(key_, this, &cleartext);
+    if (decoder_->Compresses()) {
+      if (!decompressor_.get())
+        decompressor_.reset(new StreamDecompressor);
+      Buffer decompressed;
+      if (!decompressor_->Decompress(&cleartext, decompressed.Input())) {
+        HandleError(session_, ServerConnectedSession::Decoding, "could not decompress packet");
+        return BoundChannel::DONE;
+      }
+      session_->HandlePacket(key_, this, decompressed.Output());
+    } else {
+      session_->HandlePacket(key_, this, &cleartext);
+    }
 
     session_ = NULL;
     decoder_ = NULL;
@@ -269,3 +409,99 @@ BoundChannel::processing_state_e ServerTcpTranscoder::Connection::HandleRead() {
 
   return BoundChannel::MORE;
 }
+
+BoundChannel::processing_state_e ServerTcpTranscoder::Connection::HandleFrames() {
+  uint32_t size;
+  TcpFraming::Result framing;
+  while ((framing = TcpFraming::PeekFrame(
+              *from_client_encrypted_.Output(), &size)) == TcpFraming::Complete ||
+         framing == TcpFraming::Control) {
+    if (framing == TcpFraming::Control) {
+      from_client_encrypted_.Output()->Increment(sizeof(uint32_t));
+      if (!HandleControl(size))
+        return BoundChannel::DONE;
+      continue;
+    }
+
+    OutputCursor frame(*from_client_encrypted_.Output());
+    frame.Increment(sizeof(uint32_t));
+    frame.LimitLeftSize(size);
+
+    ServerConnectedSession* session(NULL);
+    ServerConnectedSession::State state(
+        manager_->GetSession(key_, &frame, &session));
+    if (state == ServerConnectedSession::NeedNewSession) {
+      session = manager_->CreateSession(key_, &frame, this);
+      if (!session) {
+        HandleError(session, ServerConnectedSession::Manager, "cannot create session");
+        return BoundChannel::DONE;
+      }
+    }
+
+    if (state == ServerConnectedSession::NeedNewSession ||
+        state == ServerConnectedSession::Ready)
+      state = session->IsReady(key_, &frame);
+
+    // The frame is complete, more data would not help.
+    if (state != ServerConnectedSession::Ready) {
+      HandleError(session, ServerConnectedSession::Manager, "could not determine session");
+      return BoundChannel::DONE;
+    }
+
+    // With kernel tls, the frame was decrypted already.
+    DecodeSessionProtector* decoder(session->GetDecoder());
+    Buffer cleartext;
+    OutputCursor* message(&frame);
+    if (!kernel_tls_.ReceivesClear()) {
+      if (decoder->DecodeFrame(&frame, cleartext.Input()) !=
+          DecodeSessionProtector::SUCCEEDED) {
+        HandleError(session, ServerConnectedSession::Decoding, "could not decode frame");
+        return BoundChannel::DONE;
+      }
+      message = cleartext.Output();
+    }
+
+    if (decoder->Compresses()) {
+      if (!decompressor_.get())
+        decompressor_.reset(new StreamDecompressor);
+      Buffer decompressed;
+      if (!decompressor_->Decompress(message, decompressed.Input())) {
+        HandleError(session, ServerConnectedSession::Decoding, "could not decompress packet");
+        return BoundChannel::DONE;
+      }
+      session->HandlePacket(key_, this, decompressed.Output());
+    } else {
+      session->HandlePacket(key_, this, message);
+    }
+
+    from_client_encrypted_.Output()->Increment(sizeof(uint32_t) + size);
+  }
+
+  if (framing == TcpFraming::Invalid) {
+    HandleError(NULL, ServerConnectedSession::Decoding, "frame too large");
+    return BoundChannel::DONE;
+  }
+  return BoundChannel::MORE;
+}
+
+bool ServerTcpTranscoder::Connection::HandleControl(uint32_t control) {
+  switch (control) {
+    case TcpFraming::kControlKernelTlsRequest:
+      kernel_tls_.HandleRequest(channel_.get(), &from_tunnel_encrypted_);
+      if (from_tunnel_encrypted_.Output()->LeftSize())
+        channel_->WantWrite(&write_handler_);
+      return true;
+
+    case TcpFraming::kControlKernelTlsStart:
+      // Frames were read one at a time, nothing can follow.
+      if (!kernel_tls_.HandleStart(channel_.get(), NULL, &from_tunnel_encrypted_) ||
+          from_client_encrypted_.Output()->LeftSize()) {
+        HandleError(NULL, ServerConnectedSession::Decoding, "could not start kernel tls");
+        return false;
+      }
+      return true;
+  }
+
+  HandleError(NULL, ServerConnectedSession::Decoding, "unexpected control value");
+  return false;
+}
@@ -6,6 +6,10 @@
 # include "server-transcoder.h"
 # include "packet-queue.h"
 # include "transport.h"
+# include "stream-compressor.h"
+# include "tcp-framing.h"
+# include "drr-scheduler.h"
+# include "kernel-tls.h"
 # include "sockaddr.h"
 
 # include <memory>
@@ -25,7 +29,16 @@ class ServerTcpTranscoder : public ServerTranscoder {
  private:
   class Connection : public ServerTranscoder::Connection {
    public:
-    Connection(BoundChannel* channel, ServerConnectionManager* manager);
+    // Over kMaxQueuedBytes waiting to be sent, messages are dropped.
+    // Over kCongestedBytes, IsCongested returns true, until the queue
+    // goes below kDrainedBytes.
+    static const unsigned int kMaxQueuedBytes = 1024 * 1024;
+    static const unsigned int kCongestedBytes = 256 * 1024;
+    static const unsigned int kDrainedBytes = 64 * 1024;
+
+    Connection(BoundChannel* channel, ServerConnectionManager* manager,
+               DrrScheduler* scheduler);
+    ~Connection();
 
     void Close();
  
@@ -34,8 +47,13 @@ class ServerTcpTranscoder : public ServerTranscoder {
 
     bool SendMessage(
         ServerConnectedSession* session, EncodeSessionProtector* encoder);
+    bool IsCongested(const drained_handler_t* handler);
+    void BindKeys(uint32_t binding) { kernel_tls_.Bind(binding); }
 
    private:
+    // Same as SendMessage, on framed connections.
+    bool SendFrame(
+        ServerConnectedSession* session, EncodeSessionProtector* encoder);
     void HandleError(ServerConnectedSession* session,
 		     ServerConnectedSession::CloseReason error, const char* message);
     BoundChannel::processing_state_e HandleDecodeError(
@@ -46,6 +64,11 @@ class ServerTcpTranscoder : public ServerTranscoder {
 
     BoundChannel::processing_state_e HandleWrite();
     BoundChannel::processing_state_e HandleRead();
+    // Decodes all the complete frames read so far, on framed connections.
+    BoundChannel::processing_state_e HandleFrames();
+    // Handles a TcpFraming control value. Returns false if the connection
+    // must be closed.
+    bool HandleControl(uint32_t control);
 
     ConnectionKey key_;
 
@@ -53,6 +76,18 @@ class ServerTcpTranscoder : public ServerTranscoder {
     ServerConnectedSession* session_;
     ServerConnectionManager* manager_;
     DecodeSessionProtector* decoder_;
+    // Packets on the connection are compressed with the previous ones
+    // as dictionary, if the session negotiated compression. Created on
+    // the first packet compressed.
+    auto_ptr<StreamCompressor> compressor_;
+    auto_ptr<StreamDecompressor> decompressor_;
+    // Unknown until the first bytes from the client are read.
+    TcpFraming::Mode framing_;
+    KernelTls kernel_tls_;
+    // Our share of the writes, among all the connections.
+    DrrScheduler::Flow flow_;
+    const drained_handler_t* drained_handler_;
+    uint64_t dropped_;
 
     const BoundChannel::event_handler_t read_handler_;
     const BoundChannel::event_handler_t write_handler_;
@@ -67,6 +102,9 @@ class ServerTcpTranscoder : public ServerTranscoder {
     Buffer from_tunnel_cleartext_;
     // Encrypted data read from the tunnel, ready to be sent to remote uvpn client.
     Buffer from_tunnel_encrypted_;
+    // On framed connections, the message being encoded, before its size
+    // is known.
+    Buffer frame_;
   };
 
   AcceptingChannel::processing_state_e HandleConnection();
@@ -79,6 +117,7 @@ class ServerTcpTranscoder : public ServerTranscoder {
 
   const Sockaddr& address_;
   auto_ptr<AcceptingChannel> socket_;
+  DrrScheduler scheduler_;
 };
 
 #endif /* SERVER_TCP_TRANSCODER_H */
@@ -46,6 +46,18 @@ class ServerTranscoder {
     // the message belongs to. If anything, for error reporting.
     virtual bool SendMessage(
         ServerConnectedSession* session, EncodeSessionProtector* encoder) = 0;
+
+    // True if the connection has more data queued than it can send in a
+    // reasonable time: the caller should stop producing more, as further
+    // messages may be dropped. handler is then invoked once, when the
+    // queue drained. A NULL handler cancels the pending one.
+    typedef function<void ()> drained_handler_t;
+    virtual bool IsCongested(const drained_handler_t* handler) { return false; }
+
+    // Binds the keys the connection derives from its session (see
+    // SessionProtector::ExportKey) to binding: connections joined to a
+    // session must each use their own.
+    virtual void BindKeys(uint32_t binding) {}
   };
 
   ServerTranscoder() {}
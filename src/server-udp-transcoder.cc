@@ -2,15 +2,27 @@
 #include "server-connection-manager.h"
 #include "server-authenticator.h"
 #include "serializers.h"
+#include "stl-helpers.h"
+#include "timers.h"
+
+const Timer::ms_timer_t ServerUdpTranscoder::kFecTickInterval;
 
 ServerUdpTranscoder::ServerUdpTranscoder(
     Dispatcher* dispatcher, Transport* transport, const Sockaddr& address,
-    ServerConnectionManager* manager)
+    ServerConnectionManager* manager, HandshakeAdmission* admission,
+    const char* hello_key)
     : dispatcher_(dispatcher),
       transport_(transport),
       manager_(manager),
+      admission_(admission),
+      filter_(hello_key),
       client_connect_handler_(bind(&ServerUdpTranscoder::HandleRead, this)),
-      address_(address) {
+      address_(address),
+      corrupted_(0),
+      scheduler_(NULL),
+      fec_ticking_(false),
+      fec_tick_handler_(bind(&ServerUdpTranscoder::FecTickHandler, this)),
+      fec_tick_event_("fec tick", &fec_tick_handler_) {
 }
 
 bool ServerUdpTranscoder::Start() {
@@ -27,6 +39,33 @@ bool ServerUdpTranscoder::Start() {
   return true;
 }
 
+void ServerUdpTranscoder::EnableFec(EventScheduler* scheduler) {
+  scheduler_ = scheduler;
+}
+
+void ServerUdpTranscoder::StartFecTick() {
+  if (fec_ticking_)
+    return;
+  fec_ticking_ = true;
+  fec_tick_event_.Start(scheduler_, kFecTickInterval);
+}
+
+bool ServerUdpTranscoder::FecTickHandler() {
+  fec_ticking_ = false;
+  Timer::ms_timer_t now(Timer().Milliseconds());
+  for (set<Connection*>::iterator it(fec_pending_.begin());
+       it != fec_pending_.end();) {
+    if ((*it)->HandleFecTick(now))
+      ++it;
+    else
+      fec_pending_.erase(it++);
+  }
+
+  if (!fec_pending_.empty())
+    StartFecTick();
+  return true;
+}
+
 void ServerUdpTranscoder::HandleError(
     ServerConnectedSession* session, const ConnectionKey& key,
     ServerTranscoder::Connection* connection,
@@ -38,6 +77,36 @@ void ServerUdpTranscoder::HandleError(
     manager_->HandleError(key, connection, error);
 }
 
+bool ServerUdpTranscoder::Admit(
+    const Sockaddr& address, OutputCursor* packet,
+    HandshakeAdmission::ticket_t* ticket) {
+  *ticket = HandshakeAdmission::kNoTicket;
+  if (!admission_)
+    return true;
+
+  Buffer challenge;
+  switch (admission_->Check(address, packet, Timer().Milliseconds(), ticket,
+                            challenge.Input())) {
+    case HandshakeAdmission::Admit:
+      return true;
+
+    case HandshakeAdmission::Challenge:
+      // Sent right away, rather than queued: nothing about the client
+      // is kept, so if the socket is busy, the challenge is just lost.
+      LOG_DEBUG("challenging %s, %d handshakes in progress",
+                address.AsString().c_str(), admission_->Pending());
+      socket_->Write(challenge.Output(), address);
+      return false;
+
+    case HandshakeAdmission::Drop:
+      LOG_DEBUG("dropping hello from %s, %llu dropped so far",
+                address.AsString().c_str(),
+                (unsigned long long)admission_->DroppedCount());
+      return false;
+  }
+  return false;
+}
+
 DatagramChannel::processing_state_e ServerUdpTranscoder::HandleRead() {
   LOG_DEBUG();
 
@@ -49,26 +118,46 @@ DatagramChannel::processing_state_e ServerUdpTranscoder::HandleRead() {
   Buffer packet;
   packet.Input()->Reserve(kMaxPacketSize);
 
-  Sockaddr* address;
-  if (socket_->Read(packet.Input(), &address) != DatagramChannel::OK) {
+  Sockaddr* read_address;
+  if (socket_->Read(packet.Input(), &read_address) != DatagramChannel::OK) {
     // TODO: handle errors
     LOG_PERROR("udp socket is having troubles receiving data");
     return DatagramChannel::MORE;
   }
+  // Only kept if a new connection is created, or the connection moves.
+  auto_ptr<Sockaddr> address(read_address);
+
+  // The id is in the clear: once keyed, the client binds it to each
+  // frame, so a packet can't be replayed under another id.
+  string clear_id;
+  OutputCursor(*packet.Output()).ConsumeString(&clear_id, sizeof(uint64_t));
+  uint64_t id;
+  if (DecodeFromBuffer(packet.Output(), &id)) {
+    LOG_DEBUG("datagram from %s too short for a connection id",
+              address->AsString().c_str());
+    return DatagramChannel::MORE;
+  }
 
   ConnectionKey key(this);
-  key.Add(reinterpret_cast<const char*>(address->Data()),
-	  static_cast<uint16_t>(address->Size()));
+  key.Add(reinterpret_cast<const char*>(&id), sizeof(id));
 
   ServerConnectedSession* session;
-  Connection* connection(NULL);
-  // FIXME: this seems wrong, if the session is not new, but existing,
-  // we end up using connection set to NULL down below, especially
-  // in HandlePacket.
+  Connection* connection(StlMapGet(connections_, key));
   ServerConnectedSession::State state(
       manager_->GetSession(key, packet.Output(), &session));
   if (state == ServerConnectedSession::NeedNewSession) {
-    connection = new Connection(&queue_, address);
+    // Probes and garbage end here, at the cost of one hash.
+    if (!filter_.Check(id, packet.Output())) {
+      LOG_DEBUG("dropping untagged datagram, %llu dropped so far",
+                (unsigned long long)filter_.RejectedCount());
+      return DatagramChannel::MORE;
+    }
+
+    HandshakeAdmission::ticket_t ticket;
+    if (!Admit(*address, packet.Output(), &ticket))
+      return DatagramChannel::MORE;
+
+    connection = new Connection(this, key, address.release(), ticket);
     session = manager_->CreateSession(key, packet.Output(), connection);
     if (!session) {
       HandleError(session, key, connection, ServerConnectedSession::Manager,
@@ -81,32 +170,97 @@ DatagramChannel::processing_state_e ServerUdpTranscoder::HandleRead() {
       state == ServerConnectedSession::Ready)
     state = session->IsReady(key, packet.Output());
 
-  if (state != ServerConnectedSession::Ready) {
+  if (state != ServerConnectedSession::Ready || !connection) {
     HandleError(
         session, key, connection, ServerConnectedSession::Manager,
 	"could not determine session");
     return DatagramChannel::MORE;
   }
 
+  // A packet from a different address is either the client after moving,
+  // or someone who knows (or guessed) the id. Until the packet has been
+  // decoded and found fresh, it must not be able to affect the session.
+  bool moved = address.get() && !connection->SameAddress(*address);
+  if (moved && !connection->HandshakeOver()) {
+    LOG_DEBUG("dropping handshake packet from %s, unexpected address",
+              address->AsString().c_str());
+    return DatagramChannel::MORE;
+  }
+
   DecodeSessionProtector* decoder(session->GetDecoder());
   Buffer decoded;
   DecodeSessionProtector::Result result;
-  result = decoder->Decode(packet.Output(), decoded.Input());
+  result = decoder->DecodeBound(clear_id, packet.Output(), decoded.Input());
   if (result != DecodeSessionProtector::SUCCEEDED) {
+    // Once frames are authenticated, this one is forged or corrupted: the
+    // id is in the clear, whoever sent it must not be able to close the
+    // session.
+    if (moved || decoder->Authenticates()) {
+      ++corrupted_;
+      LOG_DEBUG("dropping undecodable packet, %llu dropped so far",
+                (unsigned long long)corrupted_);
+      return DatagramChannel::MORE;
+    }
     HandleError(session, key, connection, ServerConnectedSession::Decoding,
 	        "decoding failed - truncated packet?");
     return DatagramChannel::MORE;
   }
 
+  uint64_t sequence;
+  if (DecodeFromBuffer(decoded.Output(), &sequence)) {
+    if (moved)
+      return DatagramChannel::MORE;
+    HandleError(session, key, connection, ServerConnectedSession::Truncated,
+	        "packet too short to have a sequence number");
+    return DatagramChannel::MORE;
+  }
+  // Repairs are not fresh or stale, what they recover is. As they can
+  // recover any sequence number, they must come from the client.
+  if (sequence & FecEncoder::kRepairFlag) {
+    if (!moved && decoder->Authenticates())
+      connection->HandleRepair(
+          session, sequence & ~FecEncoder::kRepairFlag, decoded.Output());
+    return DatagramChannel::MORE;
+  }
+  // Don't close the session here: anyone can replay packets.
+  if (!connection->CheckSequence(sequence, decoder->Authenticates()))
+    return DatagramChannel::MORE;
+  connection->CheckHandshake(decoder);
+  if (moved && connection->Migrate(
+          address.get(), sequence, decoder->Authenticates()))
+    address.release();
+
+  connection->KeepForFec(sequence, *decoded.Output());
   session->HandlePacket(key, connection, decoded.Output());
   return DatagramChannel::MORE;
 }
 
-ServerUdpTranscoder::Connection::Connection(DatagramSenderPacketQueue* queue, Sockaddr* address)
-    : queue_(queue), address_(address), slot_(queue_->GetPacketSlot()) {
+ServerUdpTranscoder::Connection::Connection(
+    ServerUdpTranscoder* parent, const ConnectionKey& key, Sockaddr* address,
+    HandshakeAdmission::ticket_t ticket)
+    : parent_(parent), key_(key), queue_(&parent->queue_), address_(address),
+      sequence_(0), message_started_(false),
+      ticket_(ticket), handshake_decoder_(NULL), handshake_over_(false),
+      migrations_(0), fec_session_(NULL), slot_(queue_->GetPacketSlot()) {
+  parent_->connections_[key_] = this;
+}
+
+ServerUdpTranscoder::Connection::~Connection() {
+  parent_->connections_.erase(key_);
+  parent_->fec_pending_.erase(this);
+  if (parent_->admission_)
+    parent_->admission_->Release(ticket_);
+  LOG_DEBUG("connection closed, %llu replayed, %llu too old, %llu reordered, "
+            "%d migrations", (unsigned long long)window_.ReplayedCount(),
+            (unsigned long long)window_.TooOldCount(),
+            (unsigned long long)window_.ReorderedCount(), migrations_);
 }
 
 InputCursor* ServerUdpTranscoder::Connection::Message() {
+  if (!message_started_) {
+    EncodeToBuffer(sequence_++, buffer_.Input());
+    message_started_ = true;
+  }
   return buffer_.Input();
 }
 
@@ -119,8 +273,69 @@ void ServerUdpTranscoder::Connection::Close() {
   // TODO: who deletes this object?
 }
 
+bool ServerUdpTranscoder::Connection::CheckSequence(
+    uint64_t sequence, bool authenticated) {
+  if (!authenticated)
+    return window_.Test(sequence) == ReplayWindow::Accepted;
+  return window_.Check(sequence) == ReplayWindow::Accepted;
+}
+
+void ServerUdpTranscoder::Connection::CheckHandshake(
+    const DecodeSessionProtector* decoder) {
+  if (handshake_over_)
+    return;
+
+  if (!handshake_decoder_) {
+    handshake_decoder_ = decoder;
+    return;
+  }
+
+  if (decoder != handshake_decoder_) {
+    handshake_over_ = true;
+    if (ticket_ != HandshakeAdmission::kNoTicket) {
+      parent_->admission_->Release(ticket_);
+      ticket_ = HandshakeAdmission::kNoTicket;
+    }
+  }
+}
+
+bool ServerUdpTranscoder::Connection::SameAddress(
+    const Sockaddr& address) const {
+  return address.Size() == address_->Size() &&
+      !memcmp(address.Data(), address_->Data(), address.Size());
+}
+
+bool ServerUdpTranscoder::Connection::Migrate(
+    Sockaddr* address, uint64_t sequence, bool authenticated) {
+  // Without a tag covering id and sequence, anyone could take the session
+  // elsewhere. A packet reordered in the network, sent before the client
+  // moved, must not bring us back to the old address.
+  if (!authenticated || !handshake_over_ || sequence != window_.Highest())
+    return false;
+
+  LOG_DEBUG("connection moved from %s to %s",
+            address_->AsString().c_str(), address->AsString().c_str());
+
+  // Packets queued already still point to the old address. If nothing has
+  // been queued since the last move, though, nothing points to it.
+  if (slot_->retired.get())
+    delete address_;
+  else
+    slot_->retired.reset(address_);
+
+  address_ = address;
+  ++migrations_;
+  return true;
+}
+
 bool ServerUdpTranscoder::Connection::SendMessage(
     ServerConnectedSession* session, EncodeSessionProtector* encoder) {
+  // Make sure the sequence number is there, even for empty messages.
+  Message();
+  message_started_ = false;
+  bool full = fec_encoder_.get() && encoder == session->GetEncoder() &&
+      ProtectMessage(session);
+
   if (encoder) {
     if (!encoder->Encode(buffer_.Output(), slot_->buffer.Input())) {
       // TODO: handle errors
@@ -130,8 +345,86 @@ bool ServerUdpTranscoder::Connection::SendMessage(
     EncodeToBuffer(buffer_.Output(), slot_->buffer.Input());
   }
 
+  QueueSlot();
+  if (full)
+    SendRepairs();
+  return true;
+}
+
+void ServerUdpTranscoder::Connection::QueueSlot() {
   slot_->address = address_;
   queue_->QueuePacketSlot(slot_.release());
   slot_.reset(queue_->GetPacketSlot());
-  return true;
+}
+
+void ServerUdpTranscoder::Connection::KeepForFec(
+    uint64_t sequence, const OutputCursor& payload) {
+  fec_decoder_.Add(sequence, payload);
+}
+
+void ServerUdpTranscoder::Connection::HandleRepair(
+    ServerConnectedSession* session, uint64_t first, OutputCursor* repair) {
+  vector<string> recovered;
+  if (!fec_decoder_.HandleRepair(first, repair, &recovered)) {
+    LOG_DEBUG("dropping malformed repair for block %llu",
+              (unsigned long long)first);
+    return;
+  }
+  // The client protects its messages: we protect ours, once keyed, in
+  // blocks as large as the ones it uses.
+  if (parent_->scheduler_ && handshake_over_) {
+    if (!fec_encoder_.get())
+      fec_encoder_.reset(new FecEncoder(fec_decoder_.PeerBlockSize()));
+    else
+      fec_encoder_->SetBlockSize(fec_decoder_.PeerBlockSize());
+  }
+
+  for (vector<string>::iterator it(recovered.begin());
+       it != recovered.end(); ++it) {
+    Buffer message;
+    message.Input()->Add(*it);
+    uint64_t sequence;
+    if (DecodeFromBuffer(message.Output(), &sequence) ||
+        !CheckSequence(sequence, true))
+      continue;
+
+    LOG_DEBUG("recovered packet %llu", (unsigned long long)sequence);
+    session->HandlePacket(key_, this, message.Output());
+  }
+}
+
+bool ServerUdpTranscoder::Connection::ProtectMessage(
+    ServerConnectedSession* session) {
+  OutputCursor message(*buffer_.Output());
+  uint64_t sequence;
+  DecodeFromBuffer(&message, &sequence);
+
+  fec_session_ = session;
+  bool full = fec_encoder_->Add(sequence, message, Timer().Milliseconds());
+  parent_->fec_pending_.insert(this);
+  parent_->StartFecTick();
+  return full;
+}
+
+void ServerUdpTranscoder::Connection::SendRepairs() {
+  vector<string> repairs;
+  fec_encoder_->SetPeerLoss(fec_decoder_.PeerLoss());
+  fec_encoder_->Close(fec_decoder_.Loss(), &repairs);
+
+  EncodeSessionProtector* encoder(fec_session_->GetEncoder());
+  for (vector<string>::iterator it(repairs.begin()); it != repairs.end(); ++it) {
+    Buffer repair;
+    repair.Input()->Add(*it);
+    if (!encoder->Encode(repair.Output(), slot_->buffer.Input())) {
+      LOG_ERROR("encoding repair failed");
+      return;
+    }
+    QueueSlot();
+  }
+}
+
+bool ServerUdpTranscoder::Connection::HandleFecTick(Timer::ms_timer_t now) {
+  if (fec_encoder_->Expired(now))
+    SendRepairs();
+  return fec_encoder_->Pending();
 }
@@ -7,24 +7,61 @@
 # include "packet-queue.h"
 # include "sockaddr.h"
 # include "server-connection-manager.h"
+# include "replay-window.h"
+# include "handshake-admission.h"
+# include "hello-filter.h"
+# include "event-scheduler.h"
+# include "fec.h"
 
 # include <memory>
+# include <set>
 
 class ClientIOChannel;
 
+// Each datagram from the client starts with a connection id, a random
+// uint64_t picked by the client. Connections are looked up by id rather
+// than by address, so a client whose NAT rebinds, or that changes network,
+// keeps its session: once a packet for the connection has been decoded
+// with the session keys, replies are sent to the address it came from.
+//
+// Datagrams for unknown ids must carry a valid tag, see hello-filter.h.
+// Those that don't are dropped before the session manager, the admission
+// control or any decoder gets to see them.
+//
+// Messages whose sequence number has FecEncoder::kRepairFlag set are
+// repairs, see fec.h. They are used to recover lost messages on every
+// connection, and once a client sends them, repairs are sent back if fec
+// is enabled.
 class ServerUdpTranscoder : public ServerTranscoder {
  public:
   static const int kMaxPacketSize = 8192;
+  // How often blocks not full yet are checked, see FecEncoder.
+  static const Timer::ms_timer_t kFecTickInterval = 5;
+  // If admission is not NULL, it is asked before creating a session for
+  // every new address, see handshake-admission.h. hello_key checks the tag
+  // of datagrams for unknown ids, see hello-filter.h, NULL uses the
+  // default key.
   ServerUdpTranscoder(
       Dispatcher* dispatcher, Transport* transport, const Sockaddr& address,
-      ServerConnectionManager* manager);
+      ServerConnectionManager* manager, HandshakeAdmission* admission = NULL,
+      const char* hello_key = NULL);
 
   bool Start();
+  // Sends repairs to the clients that send them, in blocks as large as
+  // the largest the client sent repairs for.
+  void EnableFec(EventScheduler* scheduler);
+
+  uint64_t FilteredCount() const { return filter_.RejectedCount(); }
+  // Datagrams for a known connection that failed to decode, and were
+  // dropped without closing it.
+  uint64_t CorruptedCount() const { return corrupted_; }
 
  private:
   class Connection : public ServerTranscoder::Connection {
    public:
-    Connection(DatagramSenderPacketQueue* queue, Sockaddr* address);
+    Connection(ServerUdpTranscoder* parent, const ConnectionKey& key,
+               Sockaddr* address, HandshakeAdmission::ticket_t ticket);
+    ~Connection();
 
     void Close();
  
@@ -34,31 +71,107 @@ class ServerUdpTranscoder : public ServerTranscoder {
     bool SendMessage(
         ServerConnectedSession* session, EncodeSessionProtector* encoder);
 
+    // Returns true if the packet with this sequence number should be
+    // processed, false if it has been seen already or is too old.
+    // Unless authenticated, the sequence number does not move the window.
+    bool CheckSequence(uint64_t sequence, bool authenticated);
+
+    // Called for each packet successfully decoded. The handshake is
+    // considered over once decoder changes: authentication succeeded,
+    // and the session switched to its own keys.
+    void CheckHandshake(const DecodeSessionProtector* decoder);
+    bool HandshakeOver() const { return handshake_over_; }
+
+    bool SameAddress(const Sockaddr& address) const;
+    // Replies will be sent to address from now on, if the packet with
+    // this sequence number is authenticated, is the most recent one
+    // received, and the handshake is over. Takes ownership of address if
+    // true is returned.
+    bool Migrate(Sockaddr* address, uint64_t sequence, bool authenticated);
+
+    // Keeps the message received, to recover others with the repairs.
+    void KeepForFec(uint64_t sequence, const OutputCursor& payload);
+    // Consumes the repair for the block starting at first, and hands the
+    // messages recovered to session.
+    void HandleRepair(
+        ServerConnectedSession* session, uint64_t first, OutputCursor* repair);
+    // Sends the repairs of the current block, if it has been open for too
+    // long. Returns true if a block is still open.
+    bool HandleFecTick(Timer::ms_timer_t now);
+
    private:
+    // Adds the message in buffer_ to the current block. Returns true if
+    // the block is full, and its repairs should be sent.
+    bool ProtectMessage(ServerConnectedSession* session);
+    void SendRepairs();
+    // Queues the datagram in slot_, and gets a new one.
+    void QueueSlot();
+
+    ServerUdpTranscoder* parent_;
+    const ConnectionKey key_;
+
     DatagramSenderPacketQueue* queue_;
     Sockaddr* address_;
 
+    // Each message starts with a sequence number, added the first time
+    // Message() is called.
+    uint64_t sequence_;
+    bool message_started_;
+    ReplayWindow window_;
+
+    HandshakeAdmission::ticket_t ticket_;
+    const DecodeSessionProtector* handshake_decoder_;
+    bool handshake_over_;
+    int migrations_;
+
+    // fec_encoder_ is created once the client sends repairs, fec_session_
+    // is the session that protected the last message, its encoder is used
+    // for the repairs.
+    auto_ptr<FecEncoder> fec_encoder_;
+    ServerConnectedSession* fec_session_;
+    FecDecoder fec_decoder_;
+
     Buffer buffer_;
     auto_ptr<DatagramSenderPacketQueue::PacketSlot> slot_;
   };
 
   DatagramChannel::processing_state_e HandleRead();
+  // Returns true if a session should be created for the first packet
+  // received from address, in which case ticket is set.
+  bool Admit(const Sockaddr& address, OutputCursor* packet,
+             HandshakeAdmission::ticket_t* ticket);
   void HandleError(
       ServerConnectedSession* session, const ConnectionKey& key,
       ServerTranscoder::Connection* connection,
       ServerConnectedSession::CloseReason error, const char* msg);
+  void StartFecTick();
+  bool FecTickHandler();
 
   Dispatcher* dispatcher_;
   Transport* transport_;
 
   ServerConnectionManager* manager_;
+  HandshakeAdmission* admission_;
+  HelloFilter filter_;
 
   DatagramChannel::event_handler_t client_connect_handler_;
 
   DatagramSenderPacketQueue queue_;
 
+  // Connections created by this transcoder. Owned by the sessions.
+  typedef unordered_map<ConnectionKey, Connection*> ConnectionsMap;
+  ConnectionsMap connections_;
+
   const Sockaddr& address_;
   auto_ptr<DatagramChannel> socket_;
+  uint64_t corrupted_;
+
+  EventScheduler* scheduler_;
+  // Connections with a block open.
+  set<Connection*> fec_pending_;
+  bool fec_ticking_;
+  EventScheduler::Event::timer_handler_t fec_tick_handler_;
+  OneOffEvent fec_tick_event_;
 };
 
 #endif /* SERVER_UDP_TRANSCODER_H */
@@ -0,0 +1,205 @@
+#include "session-ticket.h"
+#include "openssl-helpers.h"
+#include "serializers.h"
+#include "password.h"
+#include "buffer.h"
+#include "prng.h"
+
+#include <openssl/evp.h>
+
+const int SessionTicket::kSecretLength;
+const int SessionTicket::kNonceLength;
+const Timer::ms_timer_t SessionTicketKeys::kRotateInterval;
+
+void SessionTicket::DeriveSecret(
+    const ScopedPassword& srpsecret, const string& transcript,
+    ScopedPassword* secret) {
+  static const char kLabel[] = "uvpn resumption secret";
+  string info(kLabel, sizeof(kLabel));
+  info.append(transcript);
+
+  char prk[EVP_MAX_MD_SIZE];
+  Hkdf::Extract(Hmac::kSHA256, NULL, 0, srpsecret.Data(), srpsecret.Used(),
+                prk);
+  Hkdf::Expand(Hmac::kSHA256, prk, Hmac::kSHA256.Length(),
+               info.c_str(), info.size(), secret->Data(), kSecretLength);
+  secret->Resize(kSecretLength);
+  memset(prk, 0, sizeof(prk));
+}
+
+void SessionTicket::CalculateTranscript(
+    const string& username, const string& ticket, const string& nonce,
+    string* transcript) {
+  Buffer buffer;
+  EncodeToBuffer(username, buffer.Input());
+  EncodeToBuffer(ticket, buffer.Input());
+  EncodeToBuffer(nonce, buffer.Input());
+  string encoded;
+  buffer.Output()->ConsumeString(&encoded);
+
+  Digest digest(Digest::kSHA256);
+  digest.Update(encoded);
+  digest.Get(transcript);
+}
+
+SessionTicketKeys::SessionTicketKeys(Prng* prng)
+    : prng_(prng),
+      current_(0),
+      scheduler_(NULL),
+      rotate_handler_(bind(&SessionTicketKeys::RotateHandler, this)),
+      rotate_event_("rotate ticket keys", &rotate_handler_) {
+  prng_->Get(reinterpret_cast<char*>(&keys_[0]), sizeof(Key));
+  // The previous key is not used until the first rotation, but must
+  // not match any ticket: give it a random name as well.
+  prng_->Get(reinterpret_cast<char*>(&keys_[1]), sizeof(Key));
+}
+
+SessionTicketKeys::~SessionTicketKeys() {
+  memset(keys_, 0, sizeof(keys_));
+}
+
+void SessionTicketKeys::Start(EventScheduler* scheduler) {
+  scheduler_ = scheduler;
+  rotate_event_.Start(scheduler_, kRotateInterval);
+}
+
+bool SessionTicketKeys::RotateHandler() {
+  Rotate();
+  rotate_event_.Start(scheduler_, kRotateInterval);
+  return true;
+}
+
+void SessionTicketKeys::Rotate() {
+  LOG_DEBUG("rotating session ticket keys");
+  current_ = !current_;
+  prng_->Get(reinterpret_cast<char*>(&keys_[current_]), sizeof(Key));
+}
+
+void SessionTicketKeys::CalculateMac(
+    const Key& key, const char* data, int size, char* mac) {
+  Hmac::Context context;
+  Hmac hmac(&context, key.mac, kMacKeyLength, Hmac::kSHA256);
+  hmac.Update(data, size);
+  hmac.Get(mac);
+}
+
+bool SessionTicketKeys::Issue(
+    const string& username, const ScopedPassword& secret, string* ticket) {
+  Buffer buffer;
+  EncodeToBuffer(username, buffer.Input());
+  EncodeToBuffer(secret.Data(), secret.Used(), buffer.Input());
+  string plaintext;
+  buffer.Output()->ConsumeString(&plaintext);
+
+  const Key& key(keys_[current_]);
+  char iv[kIvLength];
+  prng_->Get(iv, kIvLength);
+
+  string sealed(key.name, kNameLength);
+  sealed.append(iv, kIvLength);
+  sealed.resize(kNameLength + kIvLength + plaintext.size() +
+                EVP_MAX_BLOCK_LENGTH + kMacLength);
+
+  EVP_CIPHER_CTX ctx;
+  EVP_CIPHER_CTX_init(&ctx);
+  ScopeCipherContextCleaner cleaner(&ctx);
+
+  unsigned char* output(
+      reinterpret_cast<unsigned char*>(&sealed[kNameLength + kIvLength]));
+  int updatelen, finallen;
+  bool succeeded =
+      EVP_EncryptInit_ex(&ctx, EVP_aes_256_cbc(), NULL,
+                         reinterpret_cast<const unsigned char*>(key.cipher),
+                         reinterpret_cast<const unsigned char*>(iv)) &&
+      EVP_EncryptUpdate(&ctx, output, &updatelen,
+                        reinterpret_cast<const unsigned char*>(
+                            plaintext.data()), plaintext.size()) &&
+      EVP_EncryptFinal_ex(&ctx, output + updatelen, &finallen);
+  memset(&plaintext[0], 0, plaintext.size());
+  if (!succeeded) {
+    LOG_ERROR("could not encrypt session ticket");
+    return false;
+  }
+
+  int size(kNameLength + kIvLength + updatelen + finallen);
+  CalculateMac(key, sealed.data(), size, &sealed[size]);
+  sealed.resize(size + kMacLength);
+
+  ticket->swap(sealed);
+  return true;
+}
+
+bool SessionTicketKeys::Redeem(
+    const string& ticket, string* username, ScopedPassword* secret) const {
+  // At least one block of encrypted data.
+  static const int kMinLength =
+      kNameLength + kIvLength + kIvLength + kMacLength;
+  int size(ticket.size());
+  if (size < kMinLength) {
+    LOG_DEBUG("ticket too short, %d bytes", size);
+    return false;
+  }
+
+  const Key* key(NULL);
+  for (int i = 0; i < 2; ++i) {
+    if (!memcmp(ticket.data(), keys_[i].name, kNameLength))
+      key = &keys_[i];
+  }
+  if (!key) {
+    LOG_DEBUG("ticket sealed with unknown or expired key");
+    return false;
+  }
+
+  char mac[EVP_MAX_MD_SIZE];
+  CalculateMac(*key, ticket.data(), size - kMacLength, mac);
+  // Don't leak how many bytes matched.
+  char differences = 0;
+  for (int i = 0; i < kMacLength; ++i)
+    differences |= mac[i] ^ ticket[size - kMacLength + i];
+  if (differences) {
+    LOG_DEBUG("ticket mac does not match");
+    return false;
+  }
+
+  const unsigned char* input(reinterpret_cast<const unsigned char*>(
+      ticket.data() + kNameLength + kIvLength));
+  int inputlen(size - kNameLength - kIvLength - kMacLength);
+
+  string plaintext(inputlen + EVP_MAX_BLOCK_LENGTH, '\0');
+  unsigned char* output(reinterpret_cast<unsigned char*>(&plaintext[0]));
+
+  EVP_CIPHER_CTX ctx;
+  EVP_CIPHER_CTX_init(&ctx);
+  ScopeCipherContextCleaner cleaner(&ctx);
+
+  int updatelen, finallen;
+  if (!EVP_DecryptInit_ex(&ctx, EVP_aes_256_cbc(), NULL,
+                          reinterpret_cast<const unsigned char*>(key->cipher),
+                          reinterpret_cast<const unsigned char*>(
+                              ticket.data() + kNameLength)) ||
+      !EVP_DecryptUpdate(&ctx, output, &updatelen, input, inputlen) ||
+      !EVP_DecryptFinal_ex(&ctx, output + updatelen, &finallen)) {
+    // Can only happen if we sealed garbage: the mac matched.
+    LOG_ERROR("could not decrypt session ticket");
+    return false;
+  }
+
+  Buffer buffer;
+  buffer.Input()->Add(plaintext.data(), updatelen + finallen);
+  memset(&plaintext[0], 0, plaintext.size());
+
+  string secretstr;
+  bool parsed = !DecodeFromBuffer(buffer.Output(), username) &&
+      !DecodeFromBuffer(buffer.Output(), &secretstr) &&
+      secretstr.size() == static_cast<size_t>(SessionTicket::kSecretLength);
+  if (parsed) {
+    memcpy(secret->Data(), secretstr.data(), secretstr.size());
+    secret->Resize(secretstr.size());
+  }
+  memset(&secretstr[0], 0, secretstr.size());
+  if (!parsed) {
+    LOG_ERROR("session ticket content is invalid");
+    return false;
+  }
+  return true;
+}
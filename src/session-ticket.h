@@ -0,0 +1,97 @@
+#ifndef SESSION_TICKET_H
+# define SESSION_TICKET_H
+
+# include "base.h"
+# include "macros.h"
+# include "timers.h"
+# include "event-scheduler.h"
+
+# include <string>
+
+class Prng;
+class ScopedPassword;
+
+// Resumption tickets, to skip SRP when a client reconnects.
+//
+// After a full SRP handshake, the server gives the client a ticket: the
+// username and a secret derived from the SRP secret, encrypted and
+// authenticated with a key only the server knows. The server keeps no
+// state. A returning client sends the ticket in its hello, and both peers
+// derive new session keys from the secret in it, and from fresh nonces.
+// See PROTOCOL for the details of the exchange.
+//
+// Helpers used by both the client and the server.
+class SessionTicket {
+ public:
+  static const int kSecretLength = 256 / 8;
+  static const int kNonceLength = 256 / 8;
+
+  // Secret to put in a ticket, from the secret and transcript of the full
+  // SRP handshake that authenticated the user.
+  static void DeriveSecret(const ScopedPassword& srpsecret,
+                           const string& transcript, ScopedPassword* secret);
+
+  // SHA256(username | ticket | nonce), binds the session keys of a resumed
+  // session to the hello that resumed it.
+  static void CalculateTranscript(const string& username, const string& ticket,
+                                  const string& nonce, string* transcript);
+};
+
+// Server side keys used to seal tickets.
+//
+// Tickets are sealed with the current key, and accepted if sealed with the
+// current or the previous one. Keys are rotated every kRotateInterval, so
+// a ticket is good for at least that long, and never for more than twice
+// that. Keys only live in memory: restarting the server invalidates all
+// the tickets.
+//
+// A ticket is: key name, IV, AES-256-CBC of the content, and an
+// HMAC-SHA256 of all of the above, as suggested in RFC 5077.
+class SessionTicketKeys {
+ public:
+  static const Timer::ms_timer_t kRotateInterval = 60 * 60 * 1000;
+
+  static const int kNameLength = 16;
+  static const int kIvLength = 16;
+  static const int kCipherKeyLength = 256 / 8;
+  static const int kMacKeyLength = 256 / 8;
+  static const int kMacLength = 256 / 8;
+
+  explicit SessionTicketKeys(Prng* prng);
+  ~SessionTicketKeys();
+
+  // Rotates the keys every kRotateInterval from now on.
+  void Start(EventScheduler* scheduler);
+  void Rotate();
+
+  bool Issue(const string& username, const ScopedPassword& secret,
+             string* ticket);
+  // Returns false if ticket is corrupted, was not issued by this server,
+  // or was sealed with a key that's been rotated out already.
+  bool Redeem(const string& ticket, string* username,
+              ScopedPassword* secret) const;
+
+ private:
+  NO_COPY(SessionTicketKeys);
+
+  struct Key {
+    char name[kNameLength];
+    char cipher[kCipherKeyLength];
+    char mac[kMacKeyLength];
+  };
+
+  bool RotateHandler();
+  static void CalculateMac(const Key& key, const char* data, int size,
+                           char* mac);
+
+  Prng* prng_;
+
+  Key keys_[2];
+  int current_;
+
+  EventScheduler* scheduler_;
+  EventScheduler::Event::timer_handler_t rotate_handler_;
+  OneOffEvent rotate_event_;
+};
+
+#endif /* SESSION_TICKET_H */
@@ -11,12 +11,29 @@
 #include "fd-helpers.h"
 
 SocketTransport::SocketTransport(Dispatcher* dispatcher)
-    : dispatcher_(dispatcher) {
+    : dispatcher_(dispatcher),
+      profile_(TcpProfile::Default()) {
+}
+
+// Tcp options make no sense on unix sockets.
+static bool IsTcp(const Sockaddr& address) {
+  return address.Family() == AF_INET || address.Family() == AF_INET6;
 }
 
 SocketTransport::~SocketTransport() {
 }
 
+bool SocketTransport::BindToDevice(int fd) {
+  if (device_.empty())
+    return true;
+  if (setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, device_.c_str(),
+                 device_.size() + 1) != 0) {
+    LOG_PERROR("cannot bind socket to %s", device_.c_str());
+    return false;
+  }
+  return true;
+}
+
 BoundChannel* SocketTransport::DatagramConnect(const Sockaddr& address) {
   LOG_DEBUG("%s", address.AsString().c_str());
 
@@ -25,6 +42,8 @@ BoundChannel* SocketTransport::DatagramConnect(const Sockaddr& address) {
     LOG_PERROR("cannot create socket");
     return NULL;
   }
+  if (!BindToDevice(fd.Get()))
+    return NULL;
 
   if (connect(fd.Get(), address.Data(), address.Size()) != 0) {
     LOG_PERROR("connect failed");
@@ -62,11 +81,10 @@ BoundChannel* SocketTransport::StreamConnect(const Sockaddr& address) {
 
   // Make socket non blocking!
  
-  int enabled = 1;
-  if (setsockopt(
-      fd.Get(), SOL_TCP, TCP_NODELAY, &enabled, sizeof(enabled)) < 0) {
-    LOG_PERROR("cannot set TCP_NODELAY");
-  }
+  if (IsTcp(address))
+    profile_->ApplyToConnecting(fd.Get());
+  if (!BindToDevice(fd.Get()))
+    return NULL;
 
   if (connect(fd.Get(), address.Data(), address.Size()) != 0) {
     LOG_PERROR("connect failed");
@@ -102,14 +120,9 @@ AcceptingChannel* SocketTransport::StreamListenOn(const Sockaddr& address) {
     LOG_PERROR("cannot set SO_REUSEADDR");
   }
 
-  int enabled = 1;
-  if (setsockopt(
-          fd.Get(), SOL_TCP, TCP_NODELAY, &enabled, sizeof(enabled)) < 0) {
-    LOG_PERROR("cannot set TCP_NODELAY");
-  }
-
-  // TODO: change size of SNDBUFFER and RECVBUFFER? all those things
-  // should happen automagically.
+  // Accepted connections inherit the options of the listening socket.
+  if (IsTcp(address))
+    profile_->ApplyToListening(fd.Get());
 
   if (bind(fd.Get(), address.Data(), address.Size()) != 0) {
     LOG_PERROR("cannot bind");
@@ -276,23 +289,28 @@ SocketTransport::Socket::io_result_e SocketTransport::Socket::Write(
   }
 
   LOG_DEBUG("*** WRITE - written %d bytes of %d prepared", written, bytes);
-  buffer->Increment(bytes);
+  // Stream sockets can take less than what was prepared.
+  buffer->Increment(written);
   return OK;
 }
 
 SocketTransport::Socket::io_result_e SocketTransport::Socket::Read(
-    InputCursor* cursor, Sockaddr** remote) {
+    InputCursor* cursor, Sockaddr** remote, unsigned int limit) {
   struct sockaddr_storage sockaddr;
   socklen_t socksize = sizeof(sockaddr);
 
   DEBUG_FATAL_UNLESS(cursor->ContiguousSize())(
       "really want to read 0 bytes? no space in buffer...");
 
+  unsigned int available(cursor->ContiguousSize());
+  if (limit && limit < available)
+    available = limit;
+
   ssize_t size;
   while (true) {
     // TODO(protocol): use recvmsg, and handle MSG_ERRQUEUE.
     size = recvfrom(
-	fd_, cursor->Data(), cursor->ContiguousSize(), 0,
+	fd_, cursor->Data(), available, 0,
         reinterpret_cast<struct sockaddr*>(&sockaddr), &socksize);
     if (!size) {
       LOG_DEBUG("*** CLOSED fd %d", fd_);
@@ -4,12 +4,24 @@
 # include "transport.h"
 # include "dispatcher.h"
 # include "macros.h"
+# include "tcp-profile.h"
+# include "kernel-tls.h"
+
+# include <string>
 
 class SocketTransport : public Transport {
  public:
   SocketTransport(Dispatcher* dispatcher);
   ~SocketTransport();
 
+  // Socket options for tcp connections and listeners created from now on.
+  // TcpProfile::Default() unless set.
+  void SetStreamProfile(const TcpProfile* profile) { profile_ = profile; }
+  // Network interface the connections created from now on go out of,
+  // whatever the routes say, with SO_BINDTODEVICE. Needs CAP_NET_RAW.
+  // Empty, the default, leaves it to the routes.
+  void SetDevice(const string& device) { device_ = device; }
+
   virtual BoundChannel* DatagramConnect(const Sockaddr& address);
   virtual DatagramChannel* DatagramListenOn(const Sockaddr& address);
 
@@ -31,7 +43,9 @@ class SocketTransport : public Transport {
 
    protected:
     io_result_e Write(OutputCursor* buffer, const Sockaddr* remote);
-    io_result_e Read(InputCursor* buffer, Sockaddr** remote);
+    // Reads no more than limit bytes, if not 0.
+    io_result_e Read(InputCursor* buffer, Sockaddr** remote,
+                     unsigned int limit = 0);
 
     void SetFd(int fd);
     int GetFd() { return fd_; }
@@ -87,12 +101,29 @@ class SocketTransport : public Transport {
       return Socket::Read(buffer, NULL);
     }
 
+    virtual io_result_e ReadAtMost(InputCursor* buffer, unsigned int size) {
+      return Socket::Read(buffer, NULL, size);
+    }
+
+    virtual bool AttachKernelTls() {
+      return KernelTls::Attach(GetFd());
+    }
+
+    virtual bool StartKernelTls(bool transmit, const char* material) {
+      return KernelTls::Install(GetFd(), transmit, material);
+    }
+
     virtual io_result_e Write(OutputCursor* buffer) {
       return Socket::Write(buffer, NULL);
     }
   };
 
+  // Returns false if fd could not be bound to device_.
+  bool BindToDevice(int fd);
+
   Dispatcher* dispatcher_;
+  const TcpProfile* profile_;
+  string device_;
 
   NO_COPY(SocketTransport);
 };
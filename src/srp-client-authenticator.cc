@@ -3,6 +3,10 @@
 #include <memory>
 
 #include "aes-session-protector.h"
+#include "rotating-session-protector.h"
+#include "compressing-session-protector.h"
+#include "session-ticket.h"
+#include "serializers.h"
 #include "user-chatter.h"
 #include "conversions.h"
 #include "client-transcoder.h"
@@ -24,24 +28,37 @@ bool SrpClientAuthenticator::StartAuthentication(
   }
 
   new AuthenticationSession(
-      prng_, username.AsString(), connection, cursor, chatter, callback);
+      this, username.AsString(), connection, cursor, chatter, callback);
   // TODO: track sessions in some useful way!
  
   return true;
 }
 
+void SrpClientAuthenticator::ForgetTicket() {
+  ticket_.clear();
+  ticket_username_.clear();
+  ticket_secret_.Shred();
+}
+
 SrpClientAuthenticator::AuthenticationSession::AuthenticationSession(
-    Prng* prng, const string& username, ClientConnectedSession* connection,
-    OutputCursor* cursor, UserChatter* chatter,
-    authentication_done_handler_t* callback)
-    : prng_(prng),
-      session_(prng_, &cntx_, username),
+    SrpClientAuthenticator* parent, const string& username,
+    ClientConnectedSession* connection, OutputCursor* cursor,
+    UserChatter* chatter, authentication_done_handler_t* callback)
+    : parent_(parent),
+      prng_(parent->prng_),
+      session_(prng_, username),
       chatter_(chatter),
       server_hello_callback_(bind(
           &SrpClientAuthenticator::AuthenticationSession::HelloCallback, this, placeholders::_1, placeholders::_2)),
       server_public_key_callback_(bind(
           &SrpClientAuthenticator::AuthenticationSession::PublicKeyCallback, this, placeholders::_1, placeholders::_2)),
       authentication_done_callback_(callback) {
+  if (!parent_->ticket_.empty() && parent_->ticket_username_ == username) {
+    char nonce[SessionTicket::kNonceLength];
+    prng_->Get(nonce, sizeof(nonce));
+    nonce_.assign(nonce, sizeof(nonce));
+    session_.SetTicket(parent_->ticket_, nonce_);
+  }
   session_.FillClientHello(connection->Message());
 
   // TODO: instead of using a scrambler, maybe send a hash of the username?
@@ -71,6 +88,14 @@ void SrpClientAuthenticator::AuthenticationSession::HelloCallback(
   }
 
   cursor->Increment(cursor->LeftSize() - parsed.LeftSize());
+  if (session_.Resumed()) {
+    Resumed(connection, cursor);
+    return;
+  }
+
+  // The ticket, if any, was refused: no reason to try it again.
+  parent_->ticket_.clear();
+
   session_.FillClientPublicKey(connection->Message());
   // TODO: do something if connection is closed!
   connection->SetCallbacks(&server_public_key_callback_, NULL);
@@ -123,11 +148,59 @@ void SrpClientAuthenticator::AuthenticationSession::PublicKeyCallback(
     return;
   }
 
+  string transcript;
+  if (session_.Capabilities() & SrpCapabilityHkdfKey)
+    session_.GetTranscript(&transcript);
+
+  if (session_.Capabilities() & SrpCapabilityResumption) {
+    string ticket;
+    if (DecodeFromBuffer(&parsed, &ticket)) {
+      LOG_FATAL("could not read session ticket");
+      // TODO: handle errors.
+      return;
+    }
+    parent_->ticket_username_ = username_;
+    parent_->ticket_.swap(ticket);
+    SessionTicket::DeriveSecret(key, transcript, &parent_->ticket_secret_);
+  }
+
   cursor->Increment(cursor->LeftSize() - parsed.LeftSize());
 
-  aeskey.SetupKey(key);
-  AesSessionEncoder* encoder(new AesSessionEncoder(prng_, aeskey));
-  AesSessionDecoder* decoder(new AesSessionDecoder(prng_, aeskey));
+  if (session_.Capabilities() & SrpCapabilityHkdfKey)
+    aeskey.DeriveKey(key, transcript);
+  else
+    aeskey.SetupKey(key);
+  Authenticated(aeskey, key);
+}
+
+void SrpClientAuthenticator::AuthenticationSession::Resumed(
+    ClientConnectedSession* connection, OutputCursor* cursor) {
+  LOG_DEBUG("server accepted our ticket, resuming session");
+
+  AesSessionKey aeskey(prng_);
+  if (aeskey.RecvSalt(cursor)) {
+    LOG_FATAL("could not setup key");
+    // TODO: handle errors.
+    return;
+  }
+
+  string transcript;
+  SessionTicket::CalculateTranscript(
+      username_, parent_->ticket_, nonce_, &transcript);
+  session_.AddCapabilities(&transcript);
+  aeskey.DeriveKey(parent_->ticket_secret_, transcript);
+  Authenticated(aeskey, parent_->ticket_secret_);
+}
+
+void SrpClientAuthenticator::AuthenticationSession::Authenticated(
+    const AesSessionKey& aeskey, const ScopedPassword& secret) {
+  SessionKeyChain keys(aeskey, secret);
+  EncodeSessionProtector* encoder(new RotatingSessionEncoder(prng_, keys));
+  DecodeSessionProtector* decoder(new RotatingSessionDecoder(prng_, keys));
+  if (session_.Capabilities() & SrpCapabilityCompression) {
+    encoder = new CompressingSessionEncoder(encoder);
+    decoder = new CompressingSessionDecoder(decoder);
+  }
 
   (*authentication_done_callback_)(SessionMaybeAuthenticated, encoder, decoder);
 }
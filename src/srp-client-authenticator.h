@@ -5,8 +5,10 @@
 # include "client-authenticator.h"
 # include "srp-client.h"
 # include "client-transcoder.h"
+# include "password.h"
 
 class ClientIOChannel;
+class AesSessionKey;
 
 class SrpClientAuthenticator : public ClientAuthenticator {
  public:
@@ -18,16 +20,20 @@ class SrpClientAuthenticator : public ClientAuthenticator {
 
   int GetId() { return AuthenticatorIdSrp; }
 
+  // The next authentication goes through SRP, even if the last session
+  // left us a ticket.
+  void ForgetTicket();
+
  private:
   class AuthenticationSession {
    public:
     AuthenticationSession(
-        Prng* prng, const string& username, ClientConnectedSession* connection,
-        OutputCursor* cursor, UserChatter* chatter,
-        authentication_done_handler_t* callback);
+        SrpClientAuthenticator* parent, const string& username,
+        ClientConnectedSession* connection, OutputCursor* cursor,
+        UserChatter* chatter, authentication_done_handler_t* callback);
   
    private:
-    BigNumberContext cntx_;
+    SrpClientAuthenticator* parent_;
     Prng* prng_;
   
     const string username_;
@@ -44,9 +50,21 @@ class SrpClientAuthenticator : public ClientAuthenticator {
         ClientConnectedSession* connection, OutputCursor* cursor);
     void PublicKeyCallback(
 	ClientConnectedSession* connection, OutputCursor* cursor);
+    void Resumed(ClientConnectedSession* connection, OutputCursor* cursor);
+    void Authenticated(const AesSessionKey& aeskey,
+                       const ScopedPassword& secret);
+
+    // Set if we offered to resume a session.
+    string nonce_;
   };
 
   Prng* prng_;
+
+  // Last ticket received from the server, kept to skip SRP the next
+  // time we connect as the same user.
+  string ticket_username_;
+  string ticket_;
+  ScopedPassword ticket_secret_;
 };
 
 
@@ -2,17 +2,29 @@
 #include "serializers.h"
 #include "conversions.h"
 
-SrpClientSession::SrpClientSession(Prng* prng, BigNumberContext* bnctx, const string& username) 
-    : secret_(primes_, -1),
+SrpClientSession::SrpClientSession(Prng* prng, const string& username) 
+    : primes_(SecurePrimes::Shared()),
+      secret_(primes_, -1),
       username_(username),
-      prng_(prng),
-      bnctx_(bnctx) {
+      capabilities_(0),
+      resumed_(false),
+      prng_(prng) {
   InitOpenSSL();
 }
 
+void SrpClientSession::SetTicket(const string& ticket, const string& nonce) {
+  ticket_ = ticket;
+  nonce_ = nonce;
+}
+
 void SrpClientSession::FillClientHello(InputCursor* username) {
   LOG_DEBUG("username is %s", username_.c_str());
   EncodeToBuffer(username_, username);
+  EncodeToBuffer(kSrpCapabilities, username);
+  if (!ticket_.empty()) {
+    EncodeToBuffer(ticket_, username);
+    username->Add(nonce_);
+  }
 }
 
 int SrpClientSession::ParseServerHello(OutputCursor* serverhello) {
@@ -23,12 +35,57 @@ int SrpClientSession::ParseServerHello(OutputCursor* serverhello) {
     LOG_DEBUG("could not read index");
     return missing;
   }
+  if (index == kSrpResumedIndex) {
+    if (ticket_.empty()) {
+      LOG_DEBUG("server resumed a session, but we sent no ticket");
+      return -1;
+    }
+    uint8_t capabilities;
+    missing = DecodeFromBuffer(serverhello, &capabilities);
+    if (missing) {
+      LOG_DEBUG("could not read capabilities");
+      return missing;
+    }
+    const uint8_t kResumptionCapabilities =
+        SrpCapabilityHkdfKey | SrpCapabilityResumption;
+    if ((capabilities & ~kSrpCapabilities) ||
+        (capabilities & kResumptionCapabilities) != kResumptionCapabilities) {
+      LOG_DEBUG("server resumed with invalid capabilities: %02x",
+                capabilities);
+      return -1;
+    }
+    resumed_ = true;
+    capabilities_ = capabilities;
+    return 0;
+  }
+
   string salt;
   missing = DecodeFromBuffer(serverhello, &salt);
   if (missing) {
     LOG_DEBUG("could not read salt");
     return missing;
   }
+  // Old servers don't send capabilities. The server sends nothing else
+  // until we send our public key, so any byte left is ours.
+  uint8_t capabilities = 0;
+  bool sent(serverhello->LeftSize() > 0);
+  if (sent) {
+    missing = DecodeFromBuffer(serverhello, &capabilities);
+    if (missing)
+      return missing;
+  }
+  if (capabilities & ~kSrpCapabilities) {
+    LOG_DEBUG("server picked capabilities we don't offer: %02x",
+              capabilities);
+    return -1;
+  }
+  // Servers sending capabilities all support HKDF, which we always offer.
+  // Without it, nothing would bind the capabilities to the session key.
+  if (sent && !(capabilities & SrpCapabilityHkdfKey)) {
+    LOG_DEBUG("server picked capabilities without hkdf: %02x", capabilities);
+    return -1;
+  }
+
   if (!primes_.ValidIndex(index)) {
     LOG_DEBUG("invalid index");
     return -1;
@@ -40,6 +97,7 @@ int SrpClientSession::ParseServerHello(OutputCursor* serverhello) {
 
   salt_ = salt;
   index_ = index;
+  capabilities_ = capabilities;
 
   // TODO(SECURITY,DEBUG): remove this.
   LOG_DEBUG("index: %d, salt: %s",  index, ConvertToHex(salt_.c_str(), salt_.size()).c_str());
@@ -57,15 +115,15 @@ bool SrpClientSession::FillClientPublicKey(InputCursor* clientkey) {
   // The loops below are extremely unlikely to ever be used, but the
   // server is required to refuse numbers matching those parameters,
   // as per rfc 5054.
-  const BigNumber& g = primes_.GetGenerator(index_);
   const BigNumber& N = primes_.GetPrime(index_);
+  BigNumberContext bnctx;
   do {
     do {
       a_.SetFromRandom(prng_, kALength);
     } while (a_.IsZero());
 
-    bnctx_->ModExp(&A_, g, a_, N);
-  } while (bnctx_->IsDivisibleBy(A_, N));
+    primes_.ModExpGenerator(&bnctx, index_, a_, &A_);
+  } while (bnctx.IsDivisibleBy(A_, N));
 
   EncodeToBuffer(A_, clientkey);
   return true;
@@ -90,7 +148,8 @@ int SrpClientSession::ParseServerPublicKey(OutputCursor* serverkey) {
 
   // Verify that N is not a divisor of B, otherwise we are in trouble.
   const BigNumber& N = primes_.GetPrime(index_);
-  if (bnctx_->IsDivisibleBy(B_, N)) {
+  BigNumberContext bnctx;
+  if (bnctx.IsDivisibleBy(B_, N)) {
     LOG_ERROR("B mod N is 0, invalid");
     return -1;
   }
@@ -101,13 +160,12 @@ bool SrpClientSession::GetPrivateKey(
     const ScopedPassword& password, ScopedPassword* secret) {
   LOG_DEBUG();
 
-  const BigNumber& g = primes_.GetGenerator(index_);
   const BigNumber& N = primes_.GetPrime(index_);
+  const BigNumber& k = primes_.GetMultiplier(index_);
 
   secret_.FromPassword(username_, salt_, index_, password);
 
-  BigNumber k;
-  secret_.CalculateK(N, g, &k);
+  BigNumberContext bnctx;
 
   //        u = SHA1(PAD(A) | PAD(B))
   BigNumber u;
@@ -115,21 +173,35 @@ bool SrpClientSession::GetPrivateKey(
 
   // kmul = (k * (g^x)) % N
   BigNumber kmul;
-  bnctx_->ModMul(&kmul, k, secret_.v(), N);
+  bnctx.ModMul(&kmul, k, secret_.v(), N);
   // bsub = (B - kmul) % N
   BigNumber bsub;
-  bnctx_->ModSub(&bsub, B_, kmul, N);
+  bnctx.ModSub(&bsub, B_, kmul, N);
   // umul = (u * x) % N
   BigNumber umul;
-  bnctx_->ModMul(&umul, u, secret_.x(), N);
+  bnctx.ModMul(&umul, u, secret_.x(), N);
   // aadd = (a + umul) % N
   BigNumber aadd;
-  bnctx_->ModAdd(&aadd, a_, umul, N);
+  bnctx.ModAdd(&aadd, a_, umul, N);
 
   BigNumber ps;
   // <premaster secret> = (B - (k * g^x)) ^ (a + (u * x)) % N
-  bnctx_->ModExp(&ps, bsub, aadd, N);
+  primes_.ModExp(&bnctx, index_, bsub, aadd, &ps);
 
   ps.ExportAsBinary(secret);
+
+  // a is not needed anymore, and nobody should be able to find it later.
+  a_.Clear();
   return true;
 }
+
+void SrpClientSession::GetTranscript(string* transcript) {
+  SrpSecret::CalculateTranscript(
+      username_, salt_, primes_.GetPrime(index_), A_, B_, transcript);
+  AddCapabilities(transcript);
+}
+
+void SrpClientSession::AddCapabilities(string* transcript) const {
+  transcript->push_back(static_cast<char>(kSrpCapabilities));
+  transcript->push_back(static_cast<char>(capabilities_));
+}
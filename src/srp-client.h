@@ -11,13 +11,19 @@ class Buffer;
 
 class SrpClientSession {
  public:
-  SrpClientSession(
-      Prng* prng, BigNumberContext* context, const string& username);
+  SrpClientSession(Prng* prng, const string& username);
+
+  // Offers the server to resume a previous session, rather than going
+  // through SRP again. Must be called before FillClientHello.
+  void SetTicket(const string& ticket, const string& nonce);
 
   // Sends user's name to the server.
   void FillClientHello(InputCursor* clienthello);
-  // Gets the prime to use and the salt from the server.
+  // Gets the prime to use and the salt from the server. If the server
+  // accepted our ticket instead, Resumed() is true and there's no SRP
+  // exchange: the methods below must not be called.
   int ParseServerHello(OutputCursor* serverhello);
+  bool Resumed() const { return resumed_; }
 
   // Based on the prime above and a random number, generates a "public key"
   // which is sent to the server.
@@ -30,25 +36,37 @@ class SrpClientSession {
   // at this point, if everything went well, the server calculated the *same*
   // private key.
   bool GetPrivateKey(const ScopedPassword& password, ScopedPassword* secret);
+  // Only valid after both public keys have been exchanged. Includes the
+  // capabilities, see AddCapabilities.
+  void GetTranscript(string* transcript);
+  // Appends the capabilities we offered and the server picked.
+  void AddCapabilities(string* transcript) const;
+
+  // Capabilities picked by the server, see SrpCapability.
+  uint8_t Capabilities() const { return capabilities_; }
 
  private:
   // RFC 5054 requires at least 256 bits (aka, 32 bytes). 48 = 384 bits, which
   // should be way more than needed.
   static const int kALength = 384;
 
-  const SecurePrimes primes_;
+  const SecurePrimes& primes_;
 
   SrpSecret secret_;
   string username_;
   int index_;
   string salt_;
+  uint8_t capabilities_;
+
+  string ticket_;
+  string nonce_;
+  bool resumed_;
 
   BigNumber A_;
   BigNumber B_;
   BigNumber a_;
 
   Prng* prng_;
-  BigNumberContext* bnctx_;
 };
 
 #endif /* SRP_CLIENT_H */
@@ -1,6 +1,9 @@
 #include "srp-common.h"
 #include "macros.h"
 #include "errors.h"
+#include "srp-passwd.h"
+
+#include <pthread.h>
 
 // Those primes come from RFC5054.
 const SecurePrimes::Prime SecurePrimes::kValidPrimes[] = {
@@ -153,24 +156,35 @@ const SecurePrimes::Prime SecurePrimes::kValidPrimes[] = {
 }
 };
 
-SecurePrimes::SecurePrimes() {
-  generators_ = new BigNumber*[sizeof_array(kValidPrimes)];
-  primes_ = new BigNumber*[sizeof_array(kValidPrimes)];
+static SecurePrimes* shared_primes;
+static pthread_once_t shared_primes_once = PTHREAD_ONCE_INIT;
+
+static void CreateSharedPrimes() {
+  // Never deleted: sessions can be alive until the very end of the process.
+  shared_primes = new SecurePrimes;
+}
 
+const SecurePrimes& SecurePrimes::Shared() {
+  pthread_once(&shared_primes_once, CreateSharedPrimes);
+  return *shared_primes;
+}
+
+SecurePrimes::SecurePrimes()
+    : groups_(new Group[sizeof_array(kValidPrimes)]) {
   for (unsigned int i = 0; i < sizeof_array(kValidPrimes); i++) {
-    generators_[i] = NULL;
-    primes_[i] = NULL;
+    Group* group = &groups_[i];
+
+    RUNTIME_FATAL_UNLESS(group->prime.SetFromHex(kValidPrimes[i].value))
+	("hardcoded prime cannot be converted to hex?? %d", i);
+    group->generator.SetFromInt(kValidPrimes[i].generator);
+    SrpSecret::CalculateK(group->prime, group->generator, &group->multiplier);
+    RUNTIME_FATAL_UNLESS(group->montgomery.Setup(group->prime))
+	("could not setup montgomery context for prime %d", i);
   }
 }
 
 SecurePrimes::~SecurePrimes() {
-  for (unsigned int i = 0; i < sizeof_array(kValidPrimes); ++i) {
-    delete generators_[i];
-    delete primes_[i];
-  }
-
-  delete [] primes_;
-  delete [] generators_;
+  delete [] groups_;
 }
 
 bool SecurePrimes::ValidIndex(int index) const {
@@ -181,25 +195,44 @@ bool SecurePrimes::ValidIndex(int index) const {
 
 const BigNumber& SecurePrimes::GetPrime(int index) const {
   DEBUG_FATAL_UNLESS(ValidIndex(index))();
-  if (!primes_[index]) {
-    primes_[index] = new BigNumber;
-    RUNTIME_FATAL_UNLESS(primes_[index]->SetFromHex(kValidPrimes[index].value))
-	("hardcoded prime cannot be converted to hex?? %d", index);
-  }
+  return groups_[index].prime;
+}
 
-  return *(primes_[index]);
+const BigNumber& SecurePrimes::GetGenerator(int index) const {
+  DEBUG_FATAL_UNLESS(ValidIndex(index))();
+  return groups_[index].generator;
 }
 
-const SecurePrimes::Prime& SecurePrimes::GetDescriptor(int index) const {
+const BigNumber& SecurePrimes::GetMultiplier(int index) const {
   DEBUG_FATAL_UNLESS(ValidIndex(index))();
-  return kValidPrimes[index];
+  return groups_[index].multiplier;
 }
 
-const BigNumber& SecurePrimes::GetGenerator(int index) const {
+const MontgomeryContext& SecurePrimes::GetMontgomery(int index) const {
   DEBUG_FATAL_UNLESS(ValidIndex(index))();
-  if (!generators_[index]) {
-    generators_[index] = new BigNumber;
-    generators_[index]->SetFromInt(kValidPrimes[index].generator);
-  }
-  return *(generators_[index]);
+  return groups_[index].montgomery;
+}
+
+void SecurePrimes::ModExpGenerator(
+    BigNumberContext* bnctx, int index, const BigNumber& exp,
+    BigNumber* result) const {
+  DEBUG_FATAL_UNLESS(ValidIndex(index))();
+  // All generators in the table fit a single word, which allows openssl
+  // to replace most multiplications with shifts.
+  const Group& group = groups_[index];
+  bnctx->ModExp(result, kValidPrimes[index].generator, exp, group.prime,
+                group.montgomery);
+}
+
+void SecurePrimes::ModExp(
+    BigNumberContext* bnctx, int index, const BigNumber& base,
+    const BigNumber& exp, BigNumber* result) const {
+  DEBUG_FATAL_UNLESS(ValidIndex(index))();
+  const Group& group = groups_[index];
+  bnctx->ModExp(result, base, exp, group.prime, group.montgomery);
+}
+
+const SecurePrimes::Prime& SecurePrimes::GetDescriptor(int index) const {
+  DEBUG_FATAL_UNLESS(ValidIndex(index))();
+  return kValidPrimes[index];
 }
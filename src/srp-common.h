@@ -3,6 +3,38 @@
 
 # include "openssl-helpers.h"
 
+// Optional features of the SRP handshake. The client advertises the ones
+// it supports in its hello, the server replies with the ones it picked.
+// The server ignores bits it doesn't know about, and only picks among the
+// ones offered: a reply with any other bit is an error for the client.
+// Both bytes are part of the transcript the session key is derived from,
+// so a middleman changing either leaves the peers with different keys.
+// See PROTOCOL.
+enum SrpCapability {
+  // Session key is derived with HKDF from the SRP secret and a hash of the
+  // handshake, instead of PBKDF2 (see AesSessionKey).
+  SrpCapabilityHkdfKey = BIT(0),
+  // Server issues resumption tickets, and accepts them (see session-ticket.h).
+  // Requires SrpCapabilityHkdfKey.
+  SrpCapabilityResumption = BIT(1),
+  // Packets can be compressed (see compressing-session-protector.h).
+  SrpCapabilityCompression = BIT(2)
+};
+
+// Capabilities supported by this version of the code.
+static const uint8_t kSrpCapabilities =
+    SrpCapabilityHkdfKey | SrpCapabilityResumption | SrpCapabilityCompression;
+
+// Sent instead of the index of the prime in the server hello, when the
+// server accepted the ticket of the client and no SRP will take place.
+static const uint16_t kSrpResumedIndex = 0xffff;
+
+// Table of the groups (prime and generator) that can be used for SRP
+// authentication. All the values needed for the computations are parsed
+// and precomputed once, when the object is created, and never modified
+// after. Use Shared() to get a process wide instance that can be safely
+// used from all sessions and threads, without paying the setup cost
+// over and over.
 class SecurePrimes {
  public:
   struct Prime {
@@ -14,19 +46,37 @@ class SecurePrimes {
   SecurePrimes();
   ~SecurePrimes();
 
+  static const SecurePrimes& Shared();
+
   bool ValidIndex(int index) const;
   const BigNumber& GetPrime(int index) const;
   const BigNumber& GetGenerator(int index) const;
+  // k = SHA1(N | PAD(g)), the multiplier parameter of SRP-6a.
+  const BigNumber& GetMultiplier(int index) const;
+  const MontgomeryContext& GetMontgomery(int index) const;
+
+  // result = g^exp % N, for the group at index.
+  void ModExpGenerator(BigNumberContext* bnctx, int index,
+                       const BigNumber& exp, BigNumber* result) const;
+  // result = base^exp % N, for the group at index.
+  void ModExp(BigNumberContext* bnctx, int index, const BigNumber& base,
+              const BigNumber& exp, BigNumber* result) const;
 
   const Prime& GetDescriptor(int index) const;
 
  private:
+  NO_COPY(SecurePrimes);
+
+  struct Group {
+    BigNumber prime;
+    BigNumber generator;
+    BigNumber multiplier;
+    MontgomeryContext montgomery;
+  };
+
   static const Prime kValidPrimes[];
 
-  // The following are treated like a cache. Marked as "mutable" to allow for
-  // lazy initialization.
-  mutable BigNumber** generators_;
-  mutable BigNumber** primes_;
+  Group* groups_;
 };
 
 #endif /* SRP_COMMON_H */
@@ -22,7 +22,7 @@ bool SrpSecret::FromPassword(const string& username, const ScopedPassword& passw
 
   // Generate salt.
   salt.resize(kSaltLen);
-  prng_.Get(&*salt.begin(), kSaltLen);
+  DefaultPrng::ForThisThread()->Get(&*salt.begin(), kSaltLen);
 
   return FromPassword(username, salt, index_, password);
 }
@@ -49,10 +49,8 @@ bool SrpSecret::FromPassword(
   // See rfc5054 - x = SHA1(s | SHA1(I | ":" | P))
   x_.SetFromBinary(hash);
 
-  const BigNumber& n = primes_.GetPrime(index);
-  const BigNumber& g = primes_.GetGenerator(index);
-
-  bnctx_.ModExp(&v_, g, x_, n);
+  BigNumberContext bnctx;
+  primes_.ModExpGenerator(&bnctx, index, x_, &v_);
   return true;
 }
 
@@ -134,6 +132,35 @@ void SrpSecret::CalculateU(
   u->SetFromBinary(ustr);
 }
 
+void SrpSecret::CalculateTranscript(
+    const string& username, const string& salt, const BigNumber& N,
+    const BigNumber& A, const BigNumber& B, string* transcript) {
+  string Nstr;
+  N.ExportAsBinary(&Nstr);
+
+  string Astr;
+  A.ExportAsBinary(&Astr);
+  PadToN(Nstr, &Astr);
+
+  string Bstr;
+  B.ExportAsBinary(&Bstr);
+  PadToN(Nstr, &Bstr);
+
+  // username and salt are variable length, prefix them with their size so
+  // different pairs can't produce the same input.
+  Buffer buffer;
+  EncodeToBuffer(username, buffer.Input());
+  EncodeToBuffer(salt, buffer.Input());
+  string prefix;
+  buffer.Output()->ConsumeString(&prefix);
+
+  Digest digest(Digest::kSHA256);
+  digest.Update(prefix);
+  digest.Update(Astr);
+  digest.Update(Bstr);
+  digest.Get(transcript);
+}
+
 void SrpSecret::CalculateK(
     const BigNumber& N, const BigNumber& g, BigNumber* k) {
   string Nstr;
@@ -44,6 +44,11 @@ class SrpSecret : public UserSecret {
     const BigNumber& N, const BigNumber& g, BigNumber* k);
   static void CalculateU(
     const BigNumber& N, const BigNumber& A, const BigNumber& B, BigNumber* u);
+  // SHA256(username | salt | PAD(A) | PAD(B)), binds a key derived from the
+  // SRP secret to the handshake that produced it.
+  static void CalculateTranscript(
+    const string& username, const string& salt, const BigNumber& N,
+    const BigNumber& A, const BigNumber& B, string* transcript);
 
  private:
   const SecurePrimes& primes_;
@@ -52,9 +57,6 @@ class SrpSecret : public UserSecret {
   string salt_;
   BigNumber x_;
   BigNumber v_;
-
-  BigNumberContext bnctx_;
-  DefaultPrng prng_;
 };
 
 #endif /* SRP_PASSWD_H */
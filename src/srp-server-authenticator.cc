@@ -1,10 +1,16 @@
 #include "srp-server-authenticator.h"
 #include "aes-session-protector.h"
+#include "rotating-session-protector.h"
+#include "compressing-session-protector.h"
+#include "session-ticket.h"
+#include "serializers.h"
 #include "conversions.h"
 
-SrpServerAuthenticator::SrpServerAuthenticator(UserDb* udb, Prng* prng)
+SrpServerAuthenticator::SrpServerAuthenticator(
+    UserLookup* users, Prng* prng, SessionTicketKeys* tickets)
     : prng_(prng),
-      userdb_(udb) {
+      users_(users),
+      tickets_(tickets) {
 }
 
 void SrpServerAuthenticator::StartAuthentication(
@@ -23,10 +29,17 @@ SrpServerAuthenticator::AuthenticationSession::AuthenticationSession(
     SrpServerAuthenticator* parent,
     authentication_done_handler_t* callback)
     : parent_(parent),
-      srps_(parent->prng_, &(parent->cntx_)),
+      srps_(parent->prng_),
+      connection_(NULL),
+      user_found_callback_(bind(
+        &SrpServerAuthenticator::AuthenticationSession::UserFoundCallback, this, placeholders::_1, placeholders::_2)),
       authentication_done_callback_(callback),
       parse_public_key_callback_(bind(
         &SrpServerAuthenticator::AuthenticationSession::ParsePublicKeyCallback, this, placeholders::_1, placeholders::_2)),
+      lookup_pending_callback_(bind(
+        &SrpServerAuthenticator::AuthenticationSession::LookupPendingCallback, this, placeholders::_1, placeholders::_2)),
+      drop_callback_(bind(
+        &SrpServerAuthenticator::AuthenticationSession::DropCallback, this, placeholders::_1, placeholders::_2)),
       close_callback_(bind(
         &SrpServerAuthenticator::AuthenticationSession::CloseCallback, this, placeholders::_1, placeholders::_2)) {
   LOG_DEBUG("Authentication session created");
@@ -34,6 +47,7 @@ SrpServerAuthenticator::AuthenticationSession::AuthenticationSession(
 
 SrpServerAuthenticator::AuthenticationSession::~AuthenticationSession() {
   LOG_DEBUG();
+  parent_->users_->Cancel(&user_found_callback_);
   // FIXME: delete this?
 }
 
@@ -41,37 +55,60 @@ void SrpServerAuthenticator::AuthenticationSession::StartAuthentication(
     ServerConnectedSession* connection, OutputCursor* cursor) {
   LOG_DEBUG();
 
+  if (!parent_->tickets_)
+    srps_.LimitCapabilities(kSrpCapabilities & ~SrpCapabilityResumption);
+
   OutputCursor parsed(*cursor);
   int result = srps_.ParseClientHello(&parsed, &username_);
-  if (result < 0) {
-    // TODO: handle error
-    LOG_FATAL("failed to parse hello");
-    return;
-  }
-  if (result > 0) {
-    // TODO: handle error
-    LOG_FATAL("need more data");
+  // The hello must fit a single packet, there's no waiting for more.
+  if (result) {
+    LOG_ERROR("failed to parse hello, %d bytes, %s", cursor->LeftSize(),
+              result < 0 ? "invalid" : "truncated");
+    Fail(connection, SessionFailed);
     return;
   }
 
-  string encodedpassword;;
-  UserDbSession udbs(parent_->userdb_);
-  if (!parent_->userdb_->GetUser(username_, &encodedpassword)) {
-    LOG_FATAL("failed to find username %s (%d - %d) in db", username_.c_str(), username_.length(), strlen(username_.c_str()));
-    // TODO: handle error!!
+  // Everything needed from the hello has been copied, the lookup below
+  // might complete long after this packet is gone.
+  cursor->Increment(cursor->LeftSize() - parsed.LeftSize());
+  connection_ = connection;
+  connection->SetCallbacks(&lookup_pending_callback_, &close_callback_);
+  parent_->users_->Lookup(username_, &user_found_callback_);
+}
+
+void SrpServerAuthenticator::AuthenticationSession::LookupPendingCallback(
+    ServerConnectedSession* connection, OutputCursor* cursor) {
+  // Most likely the hello again, the client got tired of waiting.
+  LOG_DEBUG("still looking up %s, dropping %d bytes", username_.c_str(),
+            cursor->LeftSize());
+  cursor->Increment(cursor->LeftSize());
+}
+
+void SrpServerAuthenticator::AuthenticationSession::UserFoundCallback(
+    UserLookup::Result result, const string& encodedpassword) {
+  ServerConnectedSession* connection(connection_);
+  connection_ = NULL;
+
+  if (result != UserLookup::Found) {
+    LOG_ERROR("failed to find username %s (%d - %d) in db, result %d", username_.c_str(), username_.length(), strlen(username_.c_str()), result);
     // TODO: timing attack? even if there is no error value, 
+    Fail(connection, result == UserLookup::NotFound ? SessionDenied : SessionFailed);
     return;
   }
 
+  // Users removed from the db can't resume, the lookup above is needed.
+  if (!srps_.Ticket().empty() && Resume(connection))
+    return;
+
   if (!srps_.InitSession(username_, encodedpassword)) {
-    LOG_FATAL("failed to initialize session for %s", username_.c_str());
-    // TODO: handle errors!!
+    LOG_ERROR("failed to initialize session for %s", username_.c_str());
+    Fail(connection, SessionFailed);
     return;
   }
 
   if (!srps_.FillServerHello(connection->Message())) {
-    LOG_FATAL("failed to generate server hello for %s", username_.c_str());
-    // TODO: handle errors!!
+    LOG_ERROR("failed to generate server hello for %s", username_.c_str());
+    Fail(connection, SessionFailed);
     return;
   }
 
@@ -81,38 +118,91 @@ void SrpServerAuthenticator::AuthenticationSession::StartAuthentication(
     return;
   }
 
-  cursor->Increment(cursor->LeftSize() - parsed.LeftSize());
   connection->SetCallbacks(&parse_public_key_callback_, &close_callback_);
 }
 
+bool SrpServerAuthenticator::AuthenticationSession::Resume(
+    ServerConnectedSession* connection) {
+  string username;
+  ScopedPassword secret;
+  if (!parent_->tickets_->Redeem(srps_.Ticket(), &username, &secret) ||
+      username != username_) {
+    LOG_DEBUG("cannot resume session for %s, doing full handshake",
+              username_.c_str());
+    return false;
+  }
+
+  AesSessionKey aeskey(parent_->prng_);
+  srps_.FillServerResumed(connection->Message());
+  aeskey.SendSalt(connection->Message());
+  if (!connection->SendMessage()) {
+    // TODO(protocol): is this the sanest thing we can do?
+    LOG_DEBUG("send message failed");
+    return true;
+  }
+
+  string transcript;
+  SessionTicket::CalculateTranscript(
+      username_, srps_.Ticket(), srps_.ClientNonce(), &transcript);
+  srps_.AddCapabilities(&transcript);
+  aeskey.DeriveKey(secret, transcript);
+  Authenticated(aeskey, secret);
+  return true;
+}
+
+void SrpServerAuthenticator::AuthenticationSession::Authenticated(
+    const AesSessionKey& aeskey, const ScopedPassword& secret) {
+  SessionKeyChain keys(aeskey, secret);
+  EncodeSessionProtector* encoder = new RotatingSessionEncoder(parent_->prng_, keys);
+  DecodeSessionProtector* decoder = new RotatingSessionDecoder(parent_->prng_, keys);
+  if (srps_.Capabilities() & SrpCapabilityCompression) {
+    encoder = new CompressingSessionEncoder(encoder);
+    decoder = new CompressingSessionDecoder(decoder);
+  }
+
+  // TODO(SECURITY): don't initialize the io channel - eg, don't invoke the callback -
+  // until first packet. This will increase the cost of a DoS attack.
+  (*authentication_done_callback_)(SessionMaybeAuthenticated, encoder, decoder);
+}
+
 void SrpServerAuthenticator::AuthenticationSession::ParsePublicKeyCallback(
     ServerConnectedSession* connection, OutputCursor* cursor) {
   LOG_DEBUG();
 
   OutputCursor parsed(*cursor);
   int result = srps_.ParseClientPublicKey(&parsed);
-  if (result < 0) {
-    LOG_FATAL("parse public key failed");
-    // TODO: handle error
-    return;
-  }
-  if (result > 0) {
-    // TODO: handle error
-    LOG_ERROR("need more data");
+  if (result) {
+    LOG_ERROR("parse public key failed, %d bytes, %s", cursor->LeftSize(),
+              result < 0 ? "invalid" : "truncated");
+    Fail(connection, SessionFailed);
     return;
   }
 
   if (!srps_.FillServerPublicKey(connection->Message())) {
-    LOG_FATAL("fill server public key failed");
-    // TODO: handle errors!!
+    LOG_ERROR("fill server public key failed");
+    Fail(connection, SessionFailed);
     return;
   }
 
   ScopedPassword secret;
   srps_.GetPrivateKey(&secret);
 
+  string transcript;
+  if (srps_.Capabilities() & SrpCapabilityHkdfKey)
+    srps_.GetTranscript(&transcript);
+
   AesSessionKey aeskey(parent_->prng_);
   aeskey.SendSalt(connection->Message());
+  if (srps_.Capabilities() & SrpCapabilityResumption) {
+    ScopedPassword resumption;
+    SessionTicket::DeriveSecret(secret, transcript, &resumption);
+
+    string ticket;
+    if (!parent_->tickets_->Issue(username_, resumption, &ticket))
+      ticket.clear();
+    // An empty ticket tells the client there's nothing to resume.
+    EncodeToBuffer(ticket, connection->Message());
+  }
   if (!connection->SendMessage()) {
     // TODO(protocol): is this the sanest thing we can do?
     LOG_DEBUG("send message failed");
@@ -121,21 +211,30 @@ void SrpServerAuthenticator::AuthenticationSession::ParsePublicKeyCallback(
 
   cursor->Increment(cursor->LeftSize() - parsed.LeftSize());
 
-  // TODO(SECURITY): this MUST happen AFTER client supplied its password, as it's costly.
-  // TODO(SECURITY): also, this doesn't seem the best idea. It'd be great if we had something
-  // cheap we could use to verify that the client knows the password by doing some costly
-  // operation.
-  // FIXME: setupkey
-  aeskey.SetupKey(secret);
+  if (srps_.Capabilities() & SrpCapabilityHkdfKey) {
+    aeskey.DeriveKey(secret, transcript);
+  } else {
+    // TODO(SECURITY): this MUST happen AFTER client supplied its password, as it's costly.
+    // TODO(SECURITY): also, this doesn't seem the best idea. It'd be great if we had something
+    // cheap we could use to verify that the client knows the password by doing some costly
+    // operation.
+    aeskey.SetupKey(secret);
+  }
 
   // TODO(SECURITY,DEBUG): remove this.
   LOG_DEBUG("secret: %s", ConvertToHex(secret.Data(), secret.Used()).c_str());
-  AesSessionEncoder* encoder = new AesSessionEncoder(parent_->prng_, aeskey);
-  AesSessionDecoder* decoder = new AesSessionDecoder(parent_->prng_, aeskey);
+  Authenticated(aeskey, secret);
+}
 
-  // TODO(SECURITY): don't initialize the io channel - eg, don't invoke the callback -
-  // until first packet. This will increase the cost of a DoS attack.
-  (*authentication_done_callback_)(SessionMaybeAuthenticated, encoder, decoder);
+void SrpServerAuthenticator::AuthenticationSession::Fail(
+    ServerConnectedSession* connection, AuthenticationStatus status) {
+  connection->SetCallbacks(&drop_callback_, &close_callback_);
+  (*authentication_done_callback_)(status, NULL, NULL);
+}
+
+void SrpServerAuthenticator::AuthenticationSession::DropCallback(
+    ServerConnectedSession* connection, OutputCursor* cursor) {
+  cursor->Increment(cursor->LeftSize());
 }
 
 void SrpServerAuthenticator::AuthenticationSession::CloseCallback(
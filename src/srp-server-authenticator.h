@@ -6,10 +6,18 @@
 # include "srp-server.h"
 # include "scramble-session-protector.h"
 # include "server-transcoder.h"
+# include "user-lookup.h"
+
+class SessionTicketKeys;
+class AesSessionKey;
+class ScopedPassword;
 
 class SrpServerAuthenticator : public ServerAuthenticator {
  public:
-  SrpServerAuthenticator(UserDb* userdb, Prng* prng);
+  // If tickets is not NULL, clients are given resumption tickets, and can
+  // use them to skip SRP when reconnecting.
+  SrpServerAuthenticator(UserLookup* users, Prng* prng,
+                         SessionTicketKeys* tickets = NULL);
 
   void StartAuthentication(
       ServerConnectedSession* connection, OutputCursor* cursor,
@@ -28,17 +36,37 @@ class SrpServerAuthenticator : public ServerAuthenticator {
     void StartAuthentication(ServerConnectedSession*, OutputCursor*);
 
    private:
+    void UserFoundCallback(UserLookup::Result result, const string& secret);
+
+    // Returns false if the ticket sent by the client can't be used, in
+    // which case a full SRP handshake must take place.
+    bool Resume(ServerConnectedSession* connection);
+    void Authenticated(const AesSessionKey& aeskey,
+                       const ScopedPassword& secret);
+
+    // Tells the connection manager, which is expected to close the
+    // session. This is deleted when the session is.
+    void Fail(ServerConnectedSession* connection, AuthenticationStatus status);
+
     void ParsePublicKeyCallback(ServerConnectedSession*, OutputCursor*);
+    void LookupPendingCallback(ServerConnectedSession*, OutputCursor*);
+    void DropCallback(ServerConnectedSession*, OutputCursor*);
     void CloseCallback(ServerConnectedSession*, ServerConnectedSession::CloseReason);
 
     SrpServerAuthenticator* parent_;
     SrpServerSession srps_;
     string username_;
 
+    // Connection the hello was received from, while looking up the user.
+    ServerConnectedSession* connection_;
+    UserLookup::done_handler_t user_found_callback_;
+
     authentication_done_handler_t* authentication_done_callback_;
 
     ServerConnectedSession::read_handler_t parse_hello_callback_;
     ServerConnectedSession::read_handler_t parse_public_key_callback_;
+    ServerConnectedSession::read_handler_t lookup_pending_callback_;
+    ServerConnectedSession::read_handler_t drop_callback_;
     ServerConnectedSession::close_handler_t close_callback_;
   };
 
@@ -47,8 +75,8 @@ class SrpServerAuthenticator : public ServerAuthenticator {
 		       ServerConnectedSession* session);
 
   Prng* prng_;
-  BigNumberContext cntx_;
-  UserDb* userdb_;
+  UserLookup* users_;
+  SessionTicketKeys* tickets_;
 };
 
 #endif /* SRP_SERVER_AUTHENTICATOR_H */
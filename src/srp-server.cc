@@ -2,6 +2,7 @@
 #include "serializers.h"
 #include "openssl-helpers.h"
 #include "srp-passwd.h"
+#include "session-ticket.h"
 #include "conversions.h"
 
 int SrpServerSession::ParseClientHello(
@@ -16,14 +17,48 @@ int SrpServerSession::ParseClientHello(
     return result;
   }
 
-  LOG_DEBUG("parsed hello %s", username->c_str());
+  // Capabilities were added later, and are optional. Nothing else is sent
+  // by the client until the server replies, so any byte left is ours.
+  if (initmessage->LeftSize() > 0) {
+    uint8_t capabilities;
+    if (DecodeFromBuffer(initmessage, &capabilities))
+      return -1;
+
+    send_capabilities_ = true;
+    offered_ = capabilities;
+    capabilities_ = capabilities & supported_;
+    if (!(capabilities_ & SrpCapabilityHkdfKey))
+      capabilities_ &= ~SrpCapabilityResumption;
+
+    // A client resuming a session follows with its ticket and a nonce.
+    // They are ignored if we can't resume sessions.
+    if ((capabilities & SrpCapabilityResumption) &&
+        initmessage->LeftSize() > 0) {
+      if (DecodeFromBuffer(initmessage, &ticket_) ||
+          initmessage->ConsumeString(&nonce_, SessionTicket::kNonceLength)) {
+        LOG_DEBUG("invalid ticket or nonce");
+        return -1;
+      }
+      if (!(capabilities_ & SrpCapabilityResumption)) {
+        ticket_.clear();
+        nonce_.clear();
+      }
+    }
+  }
+
+  LOG_DEBUG("parsed hello %s, capabilities %02x", username->c_str(),
+            capabilities_);
   return 0;
 }
 
-SrpServerSession::SrpServerSession(Prng* prng, BigNumberContext* bnctx)
-    : secret_(primes_, 0),
-      prng_(prng),
-      bnctx_(bnctx) {
+SrpServerSession::SrpServerSession(Prng* prng)
+    : primes_(SecurePrimes::Shared()),
+      secret_(primes_, 0),
+      send_capabilities_(false),
+      supported_(kSrpCapabilities),
+      offered_(0),
+      capabilities_(0),
+      prng_(prng) {
   LOG_DEBUG();
 }
 
@@ -44,11 +79,20 @@ bool SrpServerSession::FillServerHello(InputCursor* hello) {
 
   EncodeToBuffer(static_cast<uint16_t>(secret_.index()), hello);
   EncodeToBuffer(secret_.salt(), hello);
+  if (send_capabilities_)
+    EncodeToBuffer(capabilities_, hello);
   // TODO(SECURITY,DEBUG): remove this.
   LOG_DEBUG("index: %d, salt: %s",  secret_.index(), ConvertToHex(secret_.salt().c_str(), secret_.salt().size()).c_str());
   return true;
 }
 
+bool SrpServerSession::FillServerResumed(InputCursor* hello) {
+  LOG_DEBUG("ticket accepted, resuming session");
+  EncodeToBuffer(kSrpResumedIndex, hello);
+  EncodeToBuffer(capabilities_, hello);
+  return true;
+}
+
 bool SrpServerSession::FillServerPublicKey(InputCursor* serverkey) {
   LOG_DEBUG();
   // B = k*v + g^b % N
@@ -58,11 +102,11 @@ bool SrpServerSession::FillServerPublicKey(InputCursor* serverkey) {
   //  *N, prime number.
   //  *g, generator.
 
-  const BigNumber& g = primes_.GetGenerator(secret_.index());
-  const BigNumber& N = primes_.GetPrime(secret_.index());
+  const int index = secret_.index();
+  const BigNumber& N = primes_.GetPrime(index);
+  const BigNumber& k = primes_.GetMultiplier(index);
 
-  BigNumber k;
-  secret_.CalculateK(N, g, &k);
+  BigNumberContext bnctx;
 
   // The IsZero checks below are extremely unlikely to ever trigger.
   // RFC 5054, section 2.5.4.
@@ -71,12 +115,12 @@ bool SrpServerSession::FillServerPublicKey(InputCursor* serverkey) {
       b_.SetFromRandom(prng_, kBLength);
     } while (b_.IsZero());
 
-    bnctx_->ModExp(&B_, g, b_, N);
-  } while (bnctx_->IsDivisibleBy(B_, N));
+    primes_.ModExpGenerator(&bnctx, index, b_, &B_);
+  } while (bnctx.IsDivisibleBy(B_, N));
 
   BigNumber kv;
-  bnctx_->ModMul(&kv, k, secret_.v(), N);
-  bnctx_->ModAdd(&B_, B_, kv, N); 
+  bnctx.ModMul(&kv, k, secret_.v(), N);
+  bnctx.ModAdd(&B_, B_, kv, N); 
 
   EncodeToBuffer(B_, serverkey);
   return true;
@@ -93,7 +137,8 @@ int SrpServerSession::ParseClientPublicKey(OutputCursor* clientkey) {
 
   // Verify that N is not a divisor of A_, otherwise we are in trouble.
   const BigNumber& N = primes_.GetPrime(secret_.index());
-  if (bnctx_->IsDivisibleBy(A_, N)) {
+  BigNumberContext bnctx;
+  if (bnctx.IsDivisibleBy(A_, N)) {
     LOG_DEBUG("A is divisible by N, we're in trouble");
     return -1;
   }
@@ -103,21 +148,38 @@ int SrpServerSession::ParseClientPublicKey(OutputCursor* clientkey) {
 bool SrpServerSession::GetPrivateKey(ScopedPassword* secret) {
   LOG_DEBUG();
 
-  //const BigNumber& g = primes_.GetGenerator(secret_.index());
-  const BigNumber& N = primes_.GetPrime(secret_.index());
+  const int index = secret_.index();
+  const BigNumber& N = primes_.GetPrime(index);
+
+  BigNumberContext bnctx;
 
   // (A * v^u)^b
   BigNumber u;
   secret_.CalculateU(N, A_, B_, &u);
 
   BigNumber vu; 
-  bnctx_->ModExp(&vu, secret_.v(), u, N);
+  primes_.ModExp(&bnctx, index, secret_.v(), u, &vu);
   BigNumber avu;
-  bnctx_->ModMul(&avu, A_, vu, N);
+  bnctx.ModMul(&avu, A_, vu, N);
 
   BigNumber ps;
-  bnctx_->ModExp(&ps, avu, b_, N);
+  primes_.ModExp(&bnctx, index, avu, b_, &ps);
 
   ps.ExportAsBinary(secret);
+
+  // b is not needed anymore, and nobody should be able to find it later.
+  b_.Clear();
   return true;
 }
+
+void SrpServerSession::GetTranscript(string* transcript) {
+  SrpSecret::CalculateTranscript(
+      username_, secret_.salt(), primes_.GetPrime(secret_.index()),
+      A_, B_, transcript);
+  AddCapabilities(transcript);
+}
+
+void SrpServerSession::AddCapabilities(string* transcript) const {
+  transcript->push_back(static_cast<char>(offered_));
+  transcript->push_back(static_cast<char>(capabilities_));
+}
@@ -42,9 +42,20 @@ class OutputCursor;
 
 class SrpServerSession {
  public:
-  SrpServerSession(Prng* prng, BigNumberContext* context);
+  explicit SrpServerSession(Prng* prng);
+
+  // Capabilities the server is willing to pick, kSrpCapabilities by
+  // default. Must be called before ParseClientHello.
+  void LimitCapabilities(uint8_t supported) { supported_ = supported; }
+
+  int ParseClientHello(OutputCursor* hellomessage, string* username);
+  // If the client offered to resume a previous session, the ticket and
+  // nonce it sent. Empty otherwise.
+  const string& Ticket() const { return ticket_; }
+  const string& ClientNonce() const { return nonce_; }
+  // Replaces the server hello when the ticket has been accepted.
+  bool FillServerResumed(InputCursor* serverhello);
 
-  static int ParseClientHello(OutputCursor* hellomessage, string* username);
   bool InitSession(const string& username, const string& secret);
 
   bool FillServerHello(InputCursor* serverhello);
@@ -52,8 +63,16 @@ class SrpServerSession {
 
   bool FillServerPublicKey(InputCursor* serverkey);
   bool GetPrivateKey(ScopedPassword* secret);
+  // Only valid after both public keys have been exchanged. Includes the
+  // capabilities, see AddCapabilities.
+  void GetTranscript(string* transcript);
+  // Appends the capabilities the client offered and we picked.
+  void AddCapabilities(string* transcript) const;
+
+  // Capabilities both peers support, see SrpCapability.
+  uint8_t Capabilities() const { return capabilities_; }
 
-  const SecurePrimes primes_;
+  const SecurePrimes& primes_;
 
  private:
   // RFC 5054 requires at least 256 bits (aka, 32 bytes). 48 = 384 bits, which
@@ -67,8 +86,17 @@ class SrpServerSession {
   SrpSecret secret_;
   string username_;
 
+  // Old clients send no capabilities, and expect none back.
+  bool send_capabilities_;
+  uint8_t supported_;
+  // As sent by the client, unknown bits included.
+  uint8_t offered_;
+  uint8_t capabilities_;
+
+  string ticket_;
+  string nonce_;
+
   Prng* prng_;
-  BigNumberContext* bnctx_;
 };
 
 #endif /* SRP_SERVER_H */
@@ -0,0 +1,301 @@
+#include "stream-compressor.h"
+#include "serializers.h"
+#include "buffer.h"
+
+#include <string.h>
+
+const int StreamHistory::kWindowSize;
+const int StreamHistory::kHistorySize;
+const uint64_t StreamHistory::kResetBytes;
+const uint8_t StreamHistory::kFlagCompressed;
+const uint8_t StreamHistory::kFlagReset;
+const int StreamHistory::kMaxPacketSize;
+const int StreamCompressor::kHashLog;
+
+namespace {
+
+// From the LZ4 block format: matches are at least kMinMatch bytes, the
+// last kLastLiterals bytes are always literals, and the last match must
+// start at least kMatchFindLimit bytes before the end.
+const int kMinMatch = 4;
+const int kLastLiterals = 5;
+const int kMatchFindLimit = 12;
+// As in lz4.c, after 2^kSkipStrength misses in a row, positions are
+// skipped faster: incompressible data costs little.
+const int kSkipStrength = 6;
+
+inline uint32_t Read32(const unsigned char* data) {
+  uint32_t value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+// Lengths of 15 or more continue in the following bytes, 255 meaning
+// that there is one more byte to add.
+unsigned char* WriteLength(unsigned char* output, int length) {
+  for (; length >= 255; length -= 255)
+    *output++ = 255;
+  *output++ = length;
+  return output;
+}
+
+bool ReadLength(const unsigned char** input, const unsigned char* end,
+                int* length) {
+  unsigned char byte;
+  do {
+    if (*input >= end || *length > StreamHistory::kHistorySize)
+      return false;
+    byte = *(*input)++;
+    *length += byte;
+  } while (byte == 255);
+  return true;
+}
+
+// Writes literals, followed by a match of matchsize bytes offset bytes
+// back. The last sequence has no match, and matchsize is 0.
+unsigned char* WriteSequence(
+    unsigned char* output, const unsigned char* literals, int literalsize,
+    int offset, int matchsize) {
+  unsigned char* token(output++);
+  if (literalsize >= 15) {
+    *token = 15 << 4;
+    output = WriteLength(output, literalsize - 15);
+  } else {
+    *token = literalsize << 4;
+  }
+  memcpy(output, literals, literalsize);
+  output += literalsize;
+  if (!matchsize)
+    return output;
+
+  *output++ = offset & 0xff;
+  *output++ = offset >> 8;
+  matchsize -= kMinMatch;
+  if (matchsize >= 15) {
+    *token |= 15;
+    output = WriteLength(output, matchsize - 15);
+  } else {
+    *token |= matchsize;
+  }
+  return output;
+}
+
+}  // namespace
+
+StreamHistory::StreamHistory()
+    : history_(new char[kHistorySize]),
+      used_(0),
+      total_(0) {
+}
+
+StreamHistory::~StreamHistory() {
+  delete [] history_;
+}
+
+void StreamHistory::Reset() {
+  used_ = 0;
+  total_ = 0;
+}
+
+int StreamHistory::MakeRoom(int size) {
+  if (used_ + size <= kHistorySize)
+    return 0;
+
+  int keep(min(kWindowSize, kHistorySize - size));
+  int shift(used_ - keep);
+  memmove(history_, history_ + shift, keep);
+  used_ = keep;
+  return shift;
+}
+
+StreamCompressor::StreamCompressor()
+    : packets_(0),
+      compressed_(0),
+      resets_(0),
+      bytes_in_(0),
+      bytes_out_(0) {
+  memset(table_, 0xff, sizeof(table_));
+}
+
+StreamCompressor::~StreamCompressor() {
+  if (!packets_)
+    return;
+
+  LOG_INFO("stream compression: %llu packets, %llu compressed, %llu resets, "
+           "%llu -> %llu bytes (%.1f%%)",
+           (unsigned long long)packets_, (unsigned long long)compressed_,
+           (unsigned long long)resets_, (unsigned long long)bytes_in_,
+           (unsigned long long)bytes_out_,
+           bytes_in_ ? 100.0 * bytes_out_ / bytes_in_ : 100.0);
+}
+
+int StreamCompressor::CompressBlock(int start, int size, char* output) {
+  const unsigned char* base(reinterpret_cast<unsigned char*>(history_));
+  unsigned char* op(reinterpret_cast<unsigned char*>(output));
+  const int end(start + size);
+  const int matchlimit(end - kLastLiterals);
+  const int mflimit(end - kMatchFindLimit);
+
+  int anchor(start);
+  int ip(start);
+  int misses(0);
+  while (ip < mflimit) {
+    uint32_t sequence(Read32(base + ip));
+    int32_t* slot(&table_[(sequence * 2654435761U) >> (32 - kHashLog)]);
+    int ref(*slot);
+    *slot = ip;
+    if (ref < 0 || ip - ref > kWindowSize || Read32(base + ref) != sequence) {
+      ip += 1 + (misses++ >> kSkipStrength);
+      continue;
+    }
+    misses = 0;
+
+    while (ip > anchor && ref > 0 && base[ip - 1] == base[ref - 1]) {
+      --ip;
+      --ref;
+    }
+    int length(kMinMatch);
+    while (ip + length < matchlimit && base[ref + length] == base[ip + length])
+      ++length;
+
+    op = WriteSequence(op, base + anchor, ip - anchor, ip - ref, length);
+    ip += length;
+    anchor = ip;
+  }
+
+  op = WriteSequence(op, base + anchor, end - anchor, 0, 0);
+  return op - reinterpret_cast<unsigned char*>(output);
+}
+
+bool StreamCompressor::Compress(OutputCursor* input, InputCursor* output) {
+  int size(input->LeftSize());
+  if (size > kMaxPacketSize)
+    return false;
+
+  uint8_t flags(0);
+  if (total_ >= kResetBytes) {
+    Reset();
+    memset(table_, 0xff, sizeof(table_));
+    flags |= kFlagReset;
+    ++resets_;
+  }
+
+  int shift(MakeRoom(size));
+  if (shift) {
+    for (int i = 0; i < (1 << kHashLog); ++i)
+      table_[i] = table_[i] >= shift ? table_[i] - shift : -1;
+  }
+
+  int start(used_);
+  input->Consume(history_ + start, size);
+  used_ += size;
+  total_ += size;
+
+  ++packets_;
+  bytes_in_ += size;
+
+  string compressed(size + size / 255 + 16, '\0');
+  int compressedsize(CompressBlock(start, size, &compressed[0]));
+  if (compressedsize + static_cast<int>(sizeof(uint16_t)) < size) {
+    ++compressed_;
+    EncodeToBuffer(static_cast<uint8_t>(flags | kFlagCompressed), output);
+    EncodeToBuffer(static_cast<uint16_t>(size), output);
+    output->Add(compressed.data(), compressedsize);
+    bytes_out_ += compressedsize + 3;
+  } else {
+    EncodeToBuffer(flags, output);
+    output->Add(history_ + start, size);
+    bytes_out_ += size + 1;
+  }
+  return true;
+}
+
+StreamDecompressor::StreamDecompressor()
+    : packets_(0),
+      compressed_(0) {
+}
+
+StreamDecompressor::~StreamDecompressor() {
+  LOG_DEBUG("stream decompression: %llu packets, %llu compressed",
+            (unsigned long long)packets_, (unsigned long long)compressed_);
+}
+
+bool StreamDecompressor::DecompressBlock(
+    const string& input, int start, int size) {
+  const unsigned char* ip(reinterpret_cast<const unsigned char*>(input.data()));
+  const unsigned char* const iend(ip + input.size());
+  unsigned char* const base(reinterpret_cast<unsigned char*>(history_));
+  unsigned char* op(base + start);
+  unsigned char* const oend(op + size);
+
+  while (ip < iend) {
+    unsigned char token(*ip++);
+    int literals(token >> 4);
+    if (literals == 15 && !ReadLength(&ip, iend, &literals))
+      return false;
+    if (literals > iend - ip || literals > oend - op)
+      return false;
+    memcpy(op, ip, literals);
+    op += literals;
+    ip += literals;
+
+    // The last sequence has only literals.
+    if (ip == iend)
+      return op == oend;
+
+    if (iend - ip < 2)
+      return false;
+    int offset(ip[0] | (ip[1] << 8));
+    ip += 2;
+    if (!offset || offset > op - base)
+      return false;
+
+    int length(token & 15);
+    if (length == 15 && !ReadLength(&ip, iend, &length))
+      return false;
+    length += kMinMatch;
+    if (length > oend - op)
+      return false;
+
+    // Matches can overlap with what they produce, copy byte by byte.
+    const unsigned char* ref(op - offset);
+    while (length--)
+      *op++ = *ref++;
+  }
+  return false;
+}
+
+bool StreamDecompressor::Decompress(OutputCursor* input, InputCursor* output) {
+  uint8_t flags;
+  if (DecodeFromBuffer(input, &flags) ||
+      (flags & ~(kFlagCompressed | kFlagReset)))
+    return false;
+  if (flags & kFlagReset)
+    Reset();
+
+  uint16_t original(0);
+  if ((flags & kFlagCompressed) && DecodeFromBuffer(input, &original))
+    return false;
+
+  string data;
+  input->ConsumeString(&data);
+  int size((flags & kFlagCompressed) ? original : data.size());
+  if (size > kMaxPacketSize)
+    return false;
+
+  MakeRoom(size);
+  int start(used_);
+  if (flags & kFlagCompressed) {
+    if (!DecompressBlock(data, start, size))
+      return false;
+    ++compressed_;
+  } else {
+    memcpy(history_ + start, data.data(), size);
+  }
+  used_ += size;
+  total_ += size;
+  ++packets_;
+
+  output->Add(history_ + start, size);
+  return true;
+}
@@ -0,0 +1,129 @@
+#ifndef STREAM_COMPRESSOR_H
+# define STREAM_COMPRESSOR_H
+
+# include "base.h"
+# include "macros.h"
+
+# include <stdint.h>
+
+class InputCursor;
+class OutputCursor;
+
+// Compression for packets sent over a stream, where they arrive in order
+// and none is lost: each packet is compressed with all the packets sent
+// before it as dictionary, so headers repeated over and over (IP and TCP
+// headers, HTTP requests, DNS queries) shrink to a few bytes.
+//
+// Matches are encoded as in the LZ4 block format, but can refer up to
+// kWindowSize bytes back into previous packets. The vendored lz4 has no
+// way to use a dictionary, so compression and decompression are done here.
+//
+// Both sides keep the last packets in a history of kHistorySize bytes,
+// and drop the oldest ones following the same rules, so they always agree
+// on its content. Once kResetBytes went through the history, the
+// compressor starts over with an empty one, and tells the decompressor,
+// so garbage from long ago does not linger around forever.
+//
+// On the stream, each packet is:
+//   <flags (1 byte)><packet, as it was>
+//   <flags (1 byte)><original size (uint16)><lz4 sequences>
+// with kFlagCompressed set in the second case, and kFlagReset set on the
+// first packet after a reset.
+//
+// Note that the dictionary is shared by all the flows carried by the
+// stream: as with any compression before encryption, sizes tell a
+// listener something about how much one packet resembles the others.
+class StreamHistory {
+ public:
+  static const int kWindowSize = 16 * 1024;
+  static const int kHistorySize = 64 * 1024;
+  static const uint64_t kResetBytes = 1024 * 1024;
+
+  static const uint8_t kFlagCompressed = BIT(0);
+  static const uint8_t kFlagReset = BIT(1);
+
+  // Largest packet that can be compressed: with the flags and original
+  // size added, the frame must still fit the uint16 size of the stream.
+  static const int kMaxPacketSize = 65535 - 3;
+
+  StreamHistory();
+  ~StreamHistory();
+
+ protected:
+  // Empties the history.
+  void Reset();
+  // Drops old packets so size more bytes fit in the history, keeping
+  // kWindowSize bytes at least if possible. Returns by how many bytes what
+  // was kept moved towards the start.
+  int MakeRoom(int size);
+
+  char* history_;
+  int used_;
+  uint64_t total_;
+
+ private:
+  NO_COPY(StreamHistory);
+};
+
+class StreamCompressor : public StreamHistory {
+ public:
+  StreamCompressor();
+  ~StreamCompressor();
+
+  // Consumes all of input, and adds the frame for it to output. Returns
+  // false only if input is larger than kMaxPacketSize.
+  bool Compress(OutputCursor* input, InputCursor* output);
+
+  uint64_t PacketCount() const { return packets_; }
+  uint64_t CompressedCount() const { return compressed_; }
+  uint64_t ResetCount() const { return resets_; }
+  uint64_t BytesIn() const { return bytes_in_; }
+  uint64_t BytesOut() const { return bytes_out_; }
+
+ private:
+  static const int kHashLog = 12;
+
+  // Compresses the size bytes at offset start in the history in output,
+  // which must have room for size + size / 255 + 16 bytes. Returns the
+  // number of bytes used.
+  int CompressBlock(int start, int size, char* output);
+
+  // Offset in history_ of the last position with a given hash, or
+  // negative if none.
+  int32_t table_[1 << kHashLog];
+
+  uint64_t packets_;
+  uint64_t compressed_;
+  uint64_t resets_;
+  uint64_t bytes_in_;
+  uint64_t bytes_out_;
+
+  NO_COPY(StreamCompressor);
+};
+
+class StreamDecompressor : public StreamHistory {
+ public:
+  StreamDecompressor();
+  ~StreamDecompressor();
+
+  // Consumes all of input, a frame from StreamCompressor, and adds the
+  // original packet to output. Returns false if the frame is corrupted,
+  // in which case the history can't be trusted anymore.
+  bool Decompress(OutputCursor* input, InputCursor* output);
+
+  uint64_t PacketCount() const { return packets_; }
+  uint64_t CompressedCount() const { return compressed_; }
+
+ private:
+  // Opposite of StreamCompressor::CompressBlock, decompresses input to
+  // size bytes at offset start in the history. Never reads or writes
+  // outside input and the history, whatever input contains.
+  bool DecompressBlock(const string& input, int start, int size);
+
+  uint64_t packets_;
+  uint64_t compressed_;
+
+  NO_COPY(StreamDecompressor);
+};
+
+#endif /* STREAM_COMPRESSOR_H */
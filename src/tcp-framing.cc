@@ -0,0 +1,68 @@
+#include "tcp-framing.h"
+#include "serializers.h"
+
+#include <string.h>
+
+const char TcpFraming::kMagic[] = "\xffTFR";
+const int TcpFraming::kMagicSize;
+const int TcpFraming::kReadSize;
+const int TcpFraming::kMinReadSize;
+const uint32_t TcpFraming::kMaxFrameSize;
+const uint32_t TcpFraming::kControlKernelTlsRequest;
+const uint32_t TcpFraming::kControlKernelTlsStart;
+const uint32_t TcpFraming::kControlKernelTlsRefuse;
+
+void TcpFraming::AddMagic(InputCursor* output) {
+  output->Add(kMagic, kMagicSize);
+}
+
+TcpFraming::Mode TcpFraming::Detect(OutputCursor* input) {
+  char start[kMagicSize];
+  unsigned int size(input->Get(start, kMagicSize));
+  if (memcmp(start, kMagic, size))
+    return Unframed;
+  if (size < static_cast<unsigned int>(kMagicSize))
+    return Unknown;
+
+  input->Increment(kMagicSize);
+  return Framed;
+}
+
+bool TcpFraming::AddFrame(OutputCursor* frame, InputCursor* output) {
+  uint32_t size(frame->LeftSize());
+  if (size > kMaxFrameSize)
+    return false;
+
+  EncodeToBuffer(size, output);
+  EncodeToBuffer(frame, output);
+  return true;
+}
+
+void TcpFraming::AddControl(uint32_t control, InputCursor* output) {
+  EncodeToBuffer(control, output);
+}
+
+TcpFraming::Result TcpFraming::PeekFrame(
+    const OutputCursor& input, uint32_t* size) {
+  OutputCursor cursor(input);
+  if (DecodeFromBuffer(&cursor, size))
+    return Incomplete;
+  if (*size >= kControlKernelTlsRequest && *size <= kControlKernelTlsRefuse)
+    return Control;
+  if (*size > kMaxFrameSize)
+    return Invalid;
+  if (cursor.LeftSize() < *size)
+    return Incomplete;
+  return Complete;
+}
+
+unsigned int TcpFraming::MissingBytes(const OutputCursor& input) {
+  unsigned int available(input.LeftSize());
+  if (available < sizeof(uint32_t))
+    return sizeof(uint32_t) - available;
+
+  uint32_t size;
+  if (PeekFrame(input, &size) != Incomplete)
+    return 0;
+  return sizeof(uint32_t) + size - available;
+}
@@ -0,0 +1,81 @@
+#ifndef TCP_FRAMING_H
+# define TCP_FRAMING_H
+
+# include "base.h"
+# include "buffer.h"
+
+# include <stdint.h>
+
+// Framing of the messages on tcp connections.
+//
+// Originally, each message is sent as it comes out of the encoder, with
+// its size encrypted and followed by padding: the receiver has to decrypt
+// the size before knowing how much data it needs, and starts over
+// whenever a read stops in the middle of a message.
+//
+// Clients that know better start their connection with kMagic, and then
+// send each message as:
+//   <size (uint32)><message, encoded as a whole, as datagrams are>
+// and so does the server on connections that started with kMagic. Sizes
+// are in clear, so a large read can be split into messages without
+// decrypting anything, and every complete message is then decoded in one
+// go, without partial states. Older clients start with the random key of
+// the scramble protector: once in 2^32 connections, one of them will be
+// taken for a framed connection, and fail.
+//
+// A size larger than kMaxFrameSize can be one of the kControl values,
+// with no message following: they are used to switch the connection to
+// kernel tls, see kernel-tls.h. Servers that don't know about them close
+// the connection, so clients only ask for kernel tls when configured to.
+class TcpFraming {
+ public:
+  static const char kMagic[];
+  static const int kMagicSize = 4;
+
+  // Framed connections read up to kReadSize bytes at a time, in pooled
+  // chunks, as long as kMinReadSize are left in the current chunk.
+  static const int kReadSize = BufferChunk::kPooledSize;
+  static const int kMinReadSize = 64 * 1024;
+
+  // Larger frames are garbage.
+  static const uint32_t kMaxFrameSize = 128 * 1024;
+
+  static const uint32_t kControlKernelTlsRequest = 0xffffff01;
+  static const uint32_t kControlKernelTlsStart = 0xffffff02;
+  static const uint32_t kControlKernelTlsRefuse = 0xffffff03;
+
+  enum Mode {
+    Unknown,
+    Unframed,
+    Framed
+  };
+
+  enum Result {
+    Complete,
+    Incomplete,
+    Invalid,
+    Control
+  };
+
+  // Adds kMagic to output, first thing on a connection.
+  static void AddMagic(InputCursor* output);
+  // Looks at the first bytes received on a connection. Returns Unknown if
+  // more bytes are needed to tell, consumes kMagic if Framed.
+  static Mode Detect(OutputCursor* input);
+
+  // Consumes frame, and adds it to output with its size. Returns false,
+  // adding nothing, if the frame is larger than kMaxFrameSize.
+  static bool AddFrame(OutputCursor* frame, InputCursor* output);
+  // Adds a kControl value to output.
+  static void AddControl(uint32_t control, InputCursor* output);
+
+  // Checks if input starts with a complete frame, and if so sets size to
+  // the size of the message in it. If it starts with a control value,
+  // sets size to it, and returns Control. input is left alone.
+  static Result PeekFrame(const OutputCursor& input, uint32_t* size);
+  // Returns how many more bytes are needed before input starts with a
+  // complete frame or control value, 0 if it does already, or is Invalid.
+  static unsigned int MissingBytes(const OutputCursor& input);
+};
+
+#endif /* TCP_FRAMING_H */
@@ -0,0 +1,113 @@
+#include "tcp-profile.h"
+#include "errors.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+
+// Older headers may not know about them, the kernel may still.
+#ifndef TCP_CONGESTION
+# define TCP_CONGESTION 13
+#endif
+#ifndef TCP_USER_TIMEOUT
+# define TCP_USER_TIMEOUT 18
+#endif
+#ifndef TCP_FASTOPEN
+# define TCP_FASTOPEN 23
+#endif
+#ifndef TCP_NOTSENT_LOWAT
+# define TCP_NOTSENT_LOWAT 25
+#endif
+#ifndef TCP_FASTOPEN_CONNECT
+# define TCP_FASTOPEN_CONNECT 30
+#endif
+
+namespace {
+
+const TcpProfile kProfiles[] = {
+  // What uvpn always did: TCP_NODELAY, and kernel defaults.
+  { "default", 0, 0, 0, 0, 0, 0, 0, NULL, 0 },
+  // Bulk transfers over long fat pipes: large buffers, but no more than
+  // 128K unsent, bbr to keep the bottleneck queue empty.
+  { "bulk", 4 << 20, 4 << 20, 128 * 1024, 60000, 60, 10, 6, "bbr", 16 },
+  // Latency first: little unsent data, dead peers detected quickly.
+  { "interactive", 0, 0, 16 * 1024, 20000, 15, 5, 3, "bbr", 16 },
+};
+
+void SetIntOption(int fd, int level, int option, int value,
+                  const char* name) {
+  if (setsockopt(fd, level, option, &value, sizeof(value)) < 0)
+    LOG_PERROR("cannot set %s to %d", name, value);
+}
+
+}  // namespace
+
+const TcpProfile* TcpProfile::Get(const string& name) {
+  for (unsigned int i = 0; i < sizeof(kProfiles) / sizeof(*kProfiles); ++i) {
+    if (name == kProfiles[i].name_)
+      return &kProfiles[i];
+  }
+  return NULL;
+}
+
+const TcpProfile* TcpProfile::Default() {
+  return &kProfiles[0];
+}
+
+string TcpProfile::Names() {
+  string names;
+  for (unsigned int i = 0; i < sizeof(kProfiles) / sizeof(*kProfiles); ++i) {
+    if (i)
+      names.append(", ");
+    names.append(kProfiles[i].name_);
+  }
+  return names;
+}
+
+void TcpProfile::ApplyCommon(int fd) const {
+  SetIntOption(fd, SOL_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+
+  // Buffer sizes must be known before the window scale is negotiated.
+  if (send_buffer_)
+    SetIntOption(fd, SOL_SOCKET, SO_SNDBUF, send_buffer_, "SO_SNDBUF");
+  if (receive_buffer_)
+    SetIntOption(fd, SOL_SOCKET, SO_RCVBUF, receive_buffer_, "SO_RCVBUF");
+  if (notsent_lowat_) {
+    SetIntOption(fd, SOL_TCP, TCP_NOTSENT_LOWAT, notsent_lowat_,
+                 "TCP_NOTSENT_LOWAT");
+  }
+  if (user_timeout_) {
+    SetIntOption(fd, SOL_TCP, TCP_USER_TIMEOUT, user_timeout_,
+                 "TCP_USER_TIMEOUT");
+  }
+
+  if (keepalive_idle_) {
+    SetIntOption(fd, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+    SetIntOption(fd, SOL_TCP, TCP_KEEPIDLE, keepalive_idle_, "TCP_KEEPIDLE");
+    SetIntOption(fd, SOL_TCP, TCP_KEEPINTVL, keepalive_interval_,
+                 "TCP_KEEPINTVL");
+    SetIntOption(fd, SOL_TCP, TCP_KEEPCNT, keepalive_count_, "TCP_KEEPCNT");
+  }
+
+  if (congestion_ && setsockopt(fd, SOL_TCP, TCP_CONGESTION, congestion_,
+                                strlen(congestion_)) < 0) {
+    LOG_PERROR("cannot set TCP_CONGESTION to %s, is the module loaded?",
+               congestion_);
+  }
+}
+
+void TcpProfile::ApplyToConnecting(int fd) const {
+  ApplyCommon(fd);
+  if (fastopen_) {
+    SetIntOption(fd, SOL_TCP, TCP_FASTOPEN_CONNECT, 1,
+                 "TCP_FASTOPEN_CONNECT");
+  }
+}
+
+void TcpProfile::ApplyToListening(int fd) const {
+  ApplyCommon(fd);
+  if (fastopen_)
+    SetIntOption(fd, SOL_TCP, TCP_FASTOPEN, fastopen_, "TCP_FASTOPEN");
+}
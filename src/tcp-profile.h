@@ -0,0 +1,64 @@
+#ifndef TCP_PROFILE_H
+# define TCP_PROFILE_H
+
+# include "base.h"
+
+# include <string>
+
+// Socket options used for tcp connections carrying the tunnel.
+//
+// Tunnelled tcp flows have their own congestion control: all we want
+// from the outer connection is to move bytes, without adding queues of
+// its own. Data in our send queue that the kernel can't send yet only
+// adds latency to every flow in the tunnel, so profiles other than
+// "default" keep it short with TCP_NOTSENT_LOWAT: the socket is reported
+// writable only once little is left unsent, and packets wait in
+// ServerTcpTranscoder instead, where they can be scheduled or dropped.
+//
+// Options are set on the listening socket, and inherited by the accepted
+// ones, or on the connecting socket, before connect(). Options the kernel
+// does not support (old kernels, congestion control modules not loaded)
+// are logged and ignored.
+class TcpProfile {
+ public:
+  // Returns the profile called name, or NULL if there is none.
+  static const TcpProfile* Get(const string& name);
+  // Returns the profile used unless configured otherwise.
+  static const TcpProfile* Default();
+  // Names of all the profiles, separated by ", ", for help messages.
+  static string Names();
+
+  void ApplyToConnecting(int fd) const;
+  void ApplyToListening(int fd) const;
+
+  const char* Name() const { return name_; }
+  bool FastOpen() const { return fastopen_ > 0; }
+
+  // Public for tests, and for the table of profiles. 0 or NULL means
+  // leaving the kernel default.
+  const char* name_;
+  // SO_SNDBUF and SO_RCVBUF, in bytes. Setting them disables the kernel
+  // autotuning, so only large values make sense.
+  int send_buffer_;
+  int receive_buffer_;
+  // TCP_NOTSENT_LOWAT, in bytes.
+  int notsent_lowat_;
+  // TCP_USER_TIMEOUT, in ms: how long sent data can stay unacknowledged
+  // before the connection is closed.
+  int user_timeout_;
+  // SO_KEEPALIVE, TCP_KEEPIDLE and TCP_KEEPINTVL in seconds, and
+  // TCP_KEEPCNT. No keepalives if keepalive_idle_ is 0.
+  int keepalive_idle_;
+  int keepalive_interval_;
+  int keepalive_count_;
+  // TCP_CONGESTION, e.g. "bbr".
+  const char* congestion_;
+  // TCP_FASTOPEN queue length on listening sockets, TCP_FASTOPEN_CONNECT
+  // on connecting ones, so the first message goes out with the SYN.
+  int fastopen_;
+
+ private:
+  void ApplyCommon(int fd) const;
+};
+
+#endif /* TCP_PROFILE_H */
@@ -61,12 +61,24 @@ class BoundReadChannel : virtual public ReadChannel {
   // Note that when reading, the maximum size of the packet is determined
   // by buffer->ContiguousSize(). Call Reserve before invoking this function.
   virtual io_result_e Read(InputCursor* buffer) = 0;
+  // Same as Read, reading no more than size bytes, leaving the rest for
+  // later.
+  virtual io_result_e ReadAtMost(InputCursor* buffer, unsigned int size) = 0;
 };
 
 class BoundChannel : 
     virtual public BaseChannel,
     virtual public BoundReadChannel,
     virtual public BoundWriteChannel {
+ public:
+  // Kernel tls, see kernel-tls.h. Channels that can't do it return false.
+  // AttachKernelTls prepares the channel, before keys are known, and
+  // returns false if kernel tls is not supported. StartKernelTls sets the
+  // key used by the kernel for all the data written, or read, from now on.
+  virtual bool AttachKernelTls() { return false; }
+  virtual bool StartKernelTls(bool transmit, const char* material) {
+    return false;
+  }
 };
 
 class AcceptingChannel : virtual public BaseChannel {
@@ -2,14 +2,16 @@
 
 #include "serializers.h"
 #include "interfaces.h"
+#include "timers.h"
 #include <linux/if_tun.h>
 #include <errno.h>
 
 TunTapClientChannel::TunTapClientChannel(
-    Dispatcher* dispatcher, NetworkConfig* config)
+    Dispatcher* dispatcher, NetworkConfig* config, int coalesce_delay)
     : ClientIOChannel(dispatcher),
       dispatcher_(dispatcher),
-      network_config_(config) {
+      network_config_(config),
+      coalesce_delay_(coalesce_delay) {
   LOG_DEBUG();
 }
 
@@ -22,12 +24,12 @@ void TunTapClientChannel::HandleSession(ClientConnectedSession* session) {
   LOG_DEBUG();
 
   // TODO: track all sessions somewhere!
-  new Session(dispatcher_, session, network_config_);
+  new Session(dispatcher_, session, network_config_, coalesce_delay_);
 }
 
 TunTapClientChannel::Session::Session(
     Dispatcher* dispatcher, ClientConnectedSession* session,
-    NetworkConfig* config)
+    NetworkConfig* config, int coalesce_delay)
     : dispatcher_(dispatcher),
       network_config_(config),
       server_config_callback_(
@@ -36,7 +38,10 @@ TunTapClientChannel::Session::Session(
         bind(&TunTapClientChannel::Session::ServerPacketCallback, this, placeholders::_1, placeholders::_2)),
       tun_tap_read_callback_(bind(&TunTapClientChannel::Session::TunTapReadCallback, this)),
       tun_tap_write_callback_(bind(&TunTapClientChannel::Session::TunTapWriteCallback, this)),
-      session_(session) {
+      session_(session),
+      compress_headers_(false),
+      coalesce_(false),
+      coalesce_delay_(coalesce_delay) {
   // Prepare to receive data back from the server.
   // TODO: move this before Open, and add retry logic!
   // TODO: set a close callback handler!
@@ -62,6 +67,7 @@ void TunTapClientChannel::Session::ServerConfigCallback(
     return;
   }
 
+  bool split(false);
   auto_ptr<IPAddress> client_address;
   auto_ptr<IPAddress> server_address;
   for (unsigned int i = 0; i < values.size(); ++i) {
@@ -77,6 +83,16 @@ void TunTapClientChannel::Session::ServerConfigCallback(
       server_address.reset(IPAddress::Parse(value));
       continue;
     }
+
+    if (name == "HEADER_COMPRESSION") {
+      compress_headers_ = true;
+      continue;
+    }
+
+    if (name == "COALESCING") {
+      split = true;
+      continue;
+    }
   }
 
   if (!client_address.get()) {
@@ -130,6 +146,13 @@ void TunTapClientChannel::Session::ServerConfigCallback(
   session->SetCallbacks(&server_packet_callback_, NULL);
   dispatcher_->AddFd(device_.Fd(), Dispatcher::READ, &tun_tap_read_callback_, NULL);
 
+  // We can always split frames, tell the server so it can coalesce.
+  if (split) {
+    coalesce_ = coalesce_delay_ > 0;
+    PacketCoalescer::Announce(session->Message());
+    session->SendMessage();
+  }
+
   // TODO: if we don't send any form of ack, the server will never know that
   // we got the config... so, it will start sending packets immediately after.
   // If we get packets in the wrong order, we'll have some mess here.
@@ -167,15 +190,44 @@ void TunTapClientChannel::Session::TunTapWriteCallback() {
 void TunTapClientChannel::Session::TunTapReadCallback() {
   LOG_DEBUG();
 
-  // TODO: 4096 should be enough, but maybe we should (1) have this
-  // configurable or (2) figure it out some way. (or fragment, or set
-  // MTU when configuring interface, or...).
-  if (!device_.Read(session_->Message(), kMaxPacketSize)) {
-    LOG_ERROR("read failed");
-    // TODO: handle errors.
-    return;
+  // Packets already waiting in the device go in the same frame, as long
+  // as they fit, and we did not spend more than coalesce_delay_ on them.
+  uint64_t start(Timer().Microseconds());
+  while (true) {
+    // TODO: 4096 should be enough, but maybe we should (1) have this
+    // configurable or (2) figure it out some way. (or fragment, or set
+    // MTU when configuring interface, or...).
+    Buffer packet;
+    if (!device_.Read(packet.Input(), kMaxPacketSize)) {
+      LOG_ERROR("read failed");
+      // TODO: handle errors.
+      break;
+    }
+
+    Buffer compressed;
+    OutputCursor* ready(packet.Output());
+    if (compress_headers_) {
+      header_compressor_.Compress(ready, compressed.Input());
+      ready = compressed.Output();
+    }
+
+    if (!coalescer_.Fits(ready->LeftSize()))
+      SendCoalesced();
+    coalescer_.Add(ready);
+
+    if (!coalesce_ || !device_.HasPending() ||
+        Timer().Microseconds() - start >= static_cast<uint64_t>(coalesce_delay_))
+      break;
   }
 
+  SendCoalesced();
+}
+
+void TunTapClientChannel::Session::SendCoalesced() {
+  if (coalescer_.Empty())
+    return;
+
+  coalescer_.Flush(session_->Message());
   session_->SendMessage();
 }
 
@@ -187,11 +239,22 @@ void TunTapClientChannel::Session::ServerPacketCallback(
   // interface than the current one.
   // TODO: we need to propagate slowness upstream. What if we have way too
   // many packets queued? right now, this is invisible to the caller.
-  EncodeToBuffer(cursor, tun_tap_queue_.ToQueue());
-  tun_tap_queue_.Queued();
+  vector<string> packets;
+  if (!splitter_.Split(cursor, &packets))
+    return;
+
+  bool idle(!tun_tap_queue_.Pending());
+  for (unsigned int i = 0; i < packets.size(); ++i) {
+    Buffer packet;
+    packet.Input()->Add(packets[i]);
+    if (!header_decompressor_.Decompress(packet.Output(),
+                                         tun_tap_queue_.ToQueue()))
+      continue;
+    tun_tap_queue_.Queued();
+  }
 
   // Be lazy, install the write handler only if we have packets to send.
-  if (tun_tap_queue_.Pending() == 1) {
+  if (idle && tun_tap_queue_.Pending()) {
     dispatcher_->SetFd(device_.Fd(), Dispatcher::WRITE, Dispatcher::NONE,
                        NULL, &tun_tap_write_callback_);
   }
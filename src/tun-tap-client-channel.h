@@ -10,6 +10,8 @@
 # include "client-connection-manager.h"
 # include "packet-queue.h"
 # include "interfaces.h"
+# include "header-compressor.h"
+# include "packet-coalescer.h"
 
 # include <vector>
 # include <memory>
@@ -22,7 +24,10 @@ class TunTapClientChannel : public ClientIOChannel {
     USE_TAP = BIT(0) // if not set, use TUN instead.
   } server_flags_e;
 
-  TunTapClientChannel(Dispatcher* dispatcher, NetworkConfig* config);
+  // Packets read from the tun device are coalesced for at most
+  // coalesce_delay microseconds, 0 to disable coalescing.
+  TunTapClientChannel(Dispatcher* dispatcher, NetworkConfig* config,
+                      int coalesce_delay);
   bool Init();
   int GetId() { return IoChannelIdTunTap; }
 
@@ -32,7 +37,7 @@ class TunTapClientChannel : public ClientIOChannel {
   class Session {
    public:
     Session(Dispatcher* dispatcher, ClientConnectedSession* session,
-            NetworkConfig* config);
+            NetworkConfig* config, int coalesce_delay);
 
    private:
     // Handle configuration packet coming from the server.
@@ -43,6 +48,9 @@ class TunTapClientChannel : public ClientIOChannel {
     void TunTapReadCallback();
     void TunTapWriteCallback();
 
+    // Sends the packets coalesced so far, if any.
+    void SendCoalesced();
+
     Dispatcher* dispatcher_;
     NetworkConfig* network_config_;
 
@@ -60,10 +68,23 @@ class TunTapClientChannel : public ClientIOChannel {
     vector<pair<string, string> > variables_;
   
     PacketQueue tun_tap_queue_;
+
+    // Headers are compressed only if the server said it can decompress
+    // them, and decompressed if the server sends them compressed.
+    bool compress_headers_;
+    HeaderCompressor header_compressor_;
+    HeaderDecompressor header_decompressor_;
+
+    // Packets are coalesced only if the server said it can split them.
+    bool coalesce_;
+    int coalesce_delay_;
+    PacketCoalescer coalescer_;
+    PacketSplitter splitter_;
   };
 
   Dispatcher* dispatcher_;
   NetworkConfig* network_config_;
+  int coalesce_delay_;
 };
 
 #endif /* TUN_TAP_CLIENT_CHANNEL_H */
@@ -12,6 +12,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
+#include <poll.h>
 
 TunTapDevice::TunTapDevice() : fd_(-1) {
 }
@@ -78,6 +79,14 @@ bool TunTapDevice::Read(InputCursor* input, int max_size) {
   return true;
 }
 
+bool TunTapDevice::HasPending() const {
+  pollfd descriptor;
+  descriptor.fd = fd_;
+  descriptor.events = POLLIN;
+  descriptor.revents = 0;
+  return poll(&descriptor, 1, 0) > 0 && (descriptor.revents & POLLIN);
+}
+
 bool TunTapDevice::Write(OutputCursor* cursor) {
   OutputCursor::Iovec vect;
   unsigned int iovecsize;
@@ -19,6 +19,8 @@ class TunTapDevice {
 
   bool Read(InputCursor* cursor, int maxsize);
   bool Write(OutputCursor* cursor);
+  // True if a packet can be read right away, without blocking.
+  bool HasPending() const;
 
   int Fd() const { return fd_; }
   const string& Name() const { return device_; }
@@ -3,13 +3,16 @@
 
 #include "serializers.h"
 #include "interfaces.h"
+#include "timers.h"
 
 #include <linux/if_tun.h>
 
-TunTapServerChannel::TunTapServerChannel(Dispatcher* dispatcher, NetworkConfig* config)
+TunTapServerChannel::TunTapServerChannel(
+    Dispatcher* dispatcher, NetworkConfig* config, int coalesce_delay)
     : ServerIOChannel(dispatcher),
       dispatcher_(dispatcher),
-      network_config_(config) {
+      network_config_(config),
+      coalesce_delay_(coalesce_delay) {
   LOG_DEBUG();
 }
 
@@ -35,22 +38,25 @@ bool TunTapServerChannel::Init() {
 void TunTapServerChannel::HandleConnect(ServerConnectedSession* session) {
   LOG_DEBUG();
   // TODO: track all sessions somewhere!
-  new Session(dispatcher_, session, local_address_, ip_manager_.get(), network_config_);
+  new Session(dispatcher_, session, local_address_, ip_manager_.get(),
+              network_config_, coalesce_delay_);
 }
 
 TunTapServerChannel::Session::Session(
     Dispatcher* dispatcher, ServerConnectedSession* session, IPAddress* server_address,
-    IPManager* manager, NetworkConfig* network_config)
+    IPManager* manager, NetworkConfig* network_config, int coalesce_delay)
     : client_read_callback_(bind(&TunTapServerChannel::Session::ClientReadCallback, this,
 	  		    placeholders::_1, placeholders::_2)),
       client_close_callback_(bind(&TunTapServerChannel::Session::ClientCloseCallback, this,
 			     placeholders::_1, placeholders::_2)),
       tun_tap_read_callback_(bind(&TunTapServerChannel::Session::TunTapReadCallback, this)),
       tun_tap_write_callback_(bind(&TunTapServerChannel::Session::TunTapWriteCallback, this)),
+      session_drained_callback_(bind(&TunTapServerChannel::Session::SessionDrainedCallback, this)),
       session_(session),
       dispatcher_(dispatcher),
       ip_manager_(manager),
-      client_address_(NULL) {
+      client_address_(NULL),
+      coalesce_delay_(coalesce_delay) {
   LOG_DEBUG();
 
   session->SetCallbacks(&client_read_callback_, &client_close_callback_);
@@ -107,6 +113,8 @@ TunTapServerChannel::Session::Session(
   vector<pair<string, string> > values;
   values.push_back(make_pair("SERVER_ADDRESS", server_address->AsString()));
   values.push_back(make_pair("CLIENT_ADDRESS", client_address_->AsString()));
+  values.push_back(make_pair("HEADER_COMPRESSION", "1"));
+  values.push_back(make_pair("COALESCING", "1"));
 
   EncodeToBuffer(values, session->Message());
   if (!session->SendMessage()) {
@@ -145,15 +153,60 @@ void TunTapServerChannel::Session::TunTapWriteCallback() {
 void TunTapServerChannel::Session::TunTapReadCallback() {
   LOG_DEBUG();
 
-  // TODO: 4096 should be enough, but maybe we should (1) have this
-  // configurable or (2) figure it out some way. (or fragment, or set
-  // MTU when configuring interface, or...).
-  if (!device_.Read(session_->Message(), kMaxPacketSize)) {
-    LOG_ERROR("read failed");
-    // TODO: handle errors.
-    return;
+  // Packets already waiting in the device go in the same frame, as long
+  // as they fit, and we did not spend more than coalesce_delay_ on them.
+  bool compress(header_decompressor_.PeerCompresses());
+  bool coalesce(coalesce_delay_ > 0 && splitter_.PeerCoalesces());
+  uint64_t start(Timer().Microseconds());
+  while (true) {
+    // TODO: 4096 should be enough, but maybe we should (1) have this
+    // configurable or (2) figure it out some way. (or fragment, or set
+    // MTU when configuring interface, or...).
+    Buffer packet;
+    if (!device_.Read(packet.Input(), kMaxPacketSize)) {
+      LOG_ERROR("read failed");
+      // TODO: handle errors.
+      break;
+    }
+
+    Buffer compressed;
+    OutputCursor* ready(packet.Output());
+    if (compress) {
+      header_compressor_.Compress(ready, compressed.Input());
+      ready = compressed.Output();
+    }
+
+    if (!coalescer_.Fits(ready->LeftSize()))
+      SendCoalesced();
+    coalescer_.Add(ready);
+
+    if (!coalesce || !device_.HasPending() ||
+        Timer().Microseconds() - start >= static_cast<uint64_t>(coalesce_delay_))
+      break;
   }
 
+  SendCoalesced();
+
+  // The session can't keep up: leave packets in the device queue, where
+  // the kernel drops them once full, rather than buffering more.
+  if (session_->IsCongested(&session_drained_callback_)) {
+    LOG_DEBUG("session congested, pausing reads");
+    dispatcher_->SetFd(device_.Fd(), Dispatcher::NONE, Dispatcher::READ,
+                       NULL, NULL);
+  }
+}
+
+void TunTapServerChannel::Session::SessionDrainedCallback() {
+  LOG_DEBUG("session drained, resuming reads");
+  dispatcher_->SetFd(device_.Fd(), Dispatcher::READ, Dispatcher::NONE,
+                     &tun_tap_read_callback_, NULL);
+}
+
+void TunTapServerChannel::Session::SendCoalesced() {
+  if (coalescer_.Empty())
+    return;
+
+  coalescer_.Flush(session_->Message());
   if (!session_->SendMessage()) {
     // TODO: handle errors!
     return;
@@ -168,11 +221,22 @@ void TunTapServerChannel::Session::ClientReadCallback(
   // We need to:
   //   - read it out the cursor. 
   //   - queue it to be written out the tun_tap_device.
-  EncodeToBuffer(cursor, tun_tap_queue_.ToQueue());
-  tun_tap_queue_.Queued();
+  vector<string> packets;
+  if (!splitter_.Split(cursor, &packets))
+    return;
+
+  bool idle(!tun_tap_queue_.Pending());
+  for (unsigned int i = 0; i < packets.size(); ++i) {
+    Buffer packet;
+    packet.Input()->Add(packets[i]);
+    if (!header_decompressor_.Decompress(packet.Output(),
+                                         tun_tap_queue_.ToQueue()))
+      continue;
+    tun_tap_queue_.Queued();
+  }
 
   // Be lazy, install the write handler only if we have packets to send.
-  if (tun_tap_queue_.Pending() == 1) {
+  if (idle && tun_tap_queue_.Pending()) {
     dispatcher_->SetFd(device_.Fd(), Dispatcher::WRITE, Dispatcher::NONE,
                        NULL, &tun_tap_write_callback_);
   }
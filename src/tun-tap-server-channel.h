@@ -8,11 +8,16 @@
 # include "dispatcher.h"
 # include "packet-queue.h"
 # include "interfaces.h"
+# include "header-compressor.h"
+# include "packet-coalescer.h"
 # include "server-connection-manager.h"
 
 class TunTapServerChannel : public ServerIOChannel {
  public:
-  TunTapServerChannel(Dispatcher* dispatcher, NetworkConfig* config);
+  // Packets read from the tun device are coalesced for at most
+  // coalesce_delay microseconds, 0 to disable coalescing.
+  TunTapServerChannel(Dispatcher* dispatcher, NetworkConfig* config,
+                      int coalesce_delay);
   virtual ~TunTapServerChannel() {}
 
   bool Init();
@@ -25,7 +30,8 @@ class TunTapServerChannel : public ServerIOChannel {
     static const int kMaxPacketSize = 4096;
 
     Session(Dispatcher* dispatcher, ServerConnectedSession* session,
-	    IPAddress* server_address, IPManager* manager, NetworkConfig* config);
+	    IPAddress* server_address, IPManager* manager, NetworkConfig* config,
+	    int coalesce_delay);
     ~Session();
 
    private:
@@ -37,11 +43,17 @@ class TunTapServerChannel : public ServerIOChannel {
     void TunTapReadCallback();
     void TunTapWriteCallback();
 
+    // Sends the packets coalesced so far, if any.
+    void SendCoalesced();
+    // Resumes reading from the device, once the session caught up.
+    void SessionDrainedCallback();
+
     ServerConnectedSession::read_handler_t client_read_callback_;
     ServerConnectedSession::close_handler_t client_close_callback_;
 
     Dispatcher::event_handler_t tun_tap_read_callback_;
     Dispatcher::event_handler_t tun_tap_write_callback_;
+    ServerTranscoder::Connection::drained_handler_t session_drained_callback_;
 
     ServerConnectedSession* session_;
     Dispatcher* dispatcher_;
@@ -52,10 +64,21 @@ class TunTapServerChannel : public ServerIOChannel {
     IPManager* ip_manager_;
     IPAddress* client_address_;
     Interface* interface_;
+
+    // Headers are compressed once the client sent compressed ones, so
+    // it knows how to decompress them.
+    HeaderCompressor header_compressor_;
+    HeaderDecompressor header_decompressor_;
+
+    // Same for coalescing, once the client announced it can split frames.
+    int coalesce_delay_;
+    PacketCoalescer coalescer_;
+    PacketSplitter splitter_;
   };
 
   Dispatcher* dispatcher_;
   NetworkConfig* network_config_;
+  int coalesce_delay_;
 
   IPRange valid_range_;
 
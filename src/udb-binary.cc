@@ -0,0 +1,436 @@
+#include "udb-binary.h"
+#include "errors.h"
+#include "hash.h"
+#include "fd-helpers.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <algorithm>
+#include <vector>
+
+const char UdbBinaryIndex::kMagic[] = "uvpn-udb";
+
+const int UdbBinaryIndex::kMagicSize;
+const uint32_t UdbBinaryIndex::kVersion;
+const int UdbBinaryIndex::kHeaderSize;
+const int UdbBinaryIndex::kBucketSize;
+const int UdbBinaryIndex::kRecordSize;
+
+static uint32_t ReadUint32(const char* data) {
+  uint32_t value;
+  memcpy(&value, data, sizeof(value));
+  return ntohl(value);
+}
+
+static uint16_t ReadUint16(const char* data) {
+  uint16_t value;
+  memcpy(&value, data, sizeof(value));
+  return ntohs(value);
+}
+
+static void AppendUint32(uint32_t value, string* output) {
+  value = htonl(value);
+  output->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static void AppendUint16(uint16_t value, string* output) {
+  value = htons(value);
+  output->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+UdbBinaryIndex::UdbBinaryIndex()
+    : base_(NULL),
+      size_(0),
+      buckets_(0),
+      records_(0),
+      datasize_(0),
+      index_(NULL),
+      record_(NULL),
+      data_(NULL) {
+}
+
+UdbBinaryIndex::~UdbBinaryIndex() {
+  Unmap();
+}
+
+uint32_t UdbBinaryIndex::Hash(const char* name, int size) {
+  // Only the lower 32 bits are used, which are the same no matter how
+  // large size_t is, so files can be moved across architectures.
+  return static_cast<uint32_t>(FNVHash(name, size, 0x811c9dc5));
+}
+
+bool UdbBinaryIndex::IsBinary(const string& name) {
+  ScopedFd fd(open(name.c_str(), O_RDONLY));
+  if (!fd.IsValid())
+    return false;
+
+  char magic[kMagicSize];
+  if (fd_read_once(fd.Get(), magic, kMagicSize) != kMagicSize)
+    return false;
+  return !memcmp(magic, kMagic, kMagicSize);
+}
+
+bool UdbBinaryIndex::Write(const string& name, const UserDb::UserMap& users) {
+  // Sorting is not necessary, but makes the output reproducible.
+  vector<string> names;
+  names.reserve(users.size());
+  for (UserDb::UserMap::const_iterator it(users.begin());
+       it != users.end(); ++it)
+    names.push_back(it->first);
+  sort(names.begin(), names.end());
+
+  uint32_t buckets = 16;
+  while (buckets < names.size() * 2)
+    buckets <<= 1;
+
+  vector<uint32_t> index(buckets, 0);
+  string records;
+  string data;
+  records.reserve(names.size() * kRecordSize);
+  for (uint32_t i = 0; i < names.size(); ++i) {
+    const string& username(names[i]);
+    const string& secret(users.find(username)->second);
+    if (username.size() > 0xffff || secret.size() > 0xffff) {
+      LOG_ERROR("user %s is too large for a binary db", username.c_str());
+      return false;
+    }
+
+    uint32_t hash = Hash(username.c_str(), username.size());
+    uint32_t slot = hash & (buckets - 1);
+    while (index[slot])
+      slot = (slot + 1) & (buckets - 1);
+    index[slot] = i + 1;
+
+    AppendUint32(hash, &records);
+    AppendUint32(data.size(), &records);
+    AppendUint16(username.size(), &records);
+    AppendUint16(secret.size(), &records);
+    AppendUint32(data.size() + username.size(), &records);
+    data.append(username);
+    data.append(secret);
+  }
+
+  string output(kMagic, kMagicSize);
+  AppendUint32(kVersion, &output);
+  AppendUint32(buckets, &output);
+  AppendUint32(names.size(), &output);
+  AppendUint32(data.size(), &output);
+  output.append(kHeaderSize - output.size(), '\0');
+  for (vector<uint32_t>::const_iterator it(index.begin());
+       it != index.end(); ++it)
+    AppendUint32(*it, &output);
+  output.append(records);
+  output.append(data);
+
+  const string temp(name + ".tmp");
+  ScopedFd fd(open(temp.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0600));
+  if (!fd.IsValid()) {
+    LOG_PERROR("unable to create %s", temp.c_str());
+    return false;
+  }
+
+  if (!fd_write(fd.Get(), output.data(), output.size()) || fsync(fd.Get())) {
+    LOG_PERROR("unable to write %s", temp.c_str());
+    unlink(temp.c_str());
+    return false;
+  }
+
+  if (close(fd.Release()) || rename(temp.c_str(), name.c_str())) {
+    LOG_PERROR("unable to replace %s with %s", name.c_str(), temp.c_str());
+    unlink(temp.c_str());
+    return false;
+  }
+
+  // The rename itself is only on disk once the directory is.
+  string directory(".");
+  string::size_type slash(name.rfind('/'));
+  if (slash != string::npos)
+    directory.assign(slash ? name.substr(0, slash) : "/");
+  ScopedFd dir(open(directory.c_str(), O_RDONLY | O_DIRECTORY));
+  if (!dir.IsValid() || fsync(dir.Get())) {
+    LOG_PERROR("unable to sync %s", directory.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool UdbBinaryIndex::Map(const string& name) {
+  Unmap();
+
+  ScopedFd fd(open(name.c_str(), O_RDONLY));
+  if (!fd.IsValid()) {
+    LOG_PERROR("unable to open %s", name.c_str());
+    return false;
+  }
+
+  struct stat info;
+  if (fstat(fd.Get(), &info)) {
+    LOG_PERROR("unable to stat %s", name.c_str());
+    return false;
+  }
+  if (info.st_size < kHeaderSize) {
+    LOG_ERROR("%s is too short to be a binary userdb", name.c_str());
+    return false;
+  }
+
+  void* mapped = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd.Get(), 0);
+  if (mapped == MAP_FAILED) {
+    LOG_PERROR("unable to mmap %s", name.c_str());
+    return false;
+  }
+  base_ = static_cast<char*>(mapped);
+  size_ = info.st_size;
+
+  if (memcmp(base_, kMagic, kMagicSize) ||
+      ReadUint32(base_ + kMagicSize) != kVersion) {
+    LOG_ERROR("%s is not a binary userdb, or has an unknown version",
+              name.c_str());
+    Unmap();
+    return false;
+  }
+
+  buckets_ = ReadUint32(base_ + kMagicSize + 4);
+  records_ = ReadUint32(base_ + kMagicSize + 8);
+  datasize_ = ReadUint32(base_ + kMagicSize + 12);
+
+  uint64_t expected = kHeaderSize;
+  expected += static_cast<uint64_t>(buckets_) * kBucketSize;
+  expected += static_cast<uint64_t>(records_) * kRecordSize;
+  expected += datasize_;
+  if (!buckets_ || (buckets_ & (buckets_ - 1)) || records_ >= buckets_ ||
+      expected != size_) {
+    LOG_ERROR("%s is corrupted (buckets %u, records %u, data %u, size %u)",
+              name.c_str(), buckets_, records_, datasize_,
+              static_cast<unsigned int>(size_));
+    Unmap();
+    return false;
+  }
+
+  index_ = base_ + kHeaderSize;
+  record_ = index_ + buckets_ * kBucketSize;
+  data_ = record_ + records_ * kRecordSize;
+  return true;
+}
+
+void UdbBinaryIndex::Unmap() {
+  if (!base_)
+    return;
+
+  munmap(base_, size_);
+  base_ = NULL;
+  size_ = 0;
+  buckets_ = records_ = datasize_ = 0;
+  index_ = record_ = data_ = NULL;
+}
+
+bool UdbBinaryIndex::GetRecord(
+    uint32_t record, uint32_t* hash, const char** name, int* namesize,
+    const char** secret, int* secretsize) const {
+  if (record >= records_)
+    return false;
+
+  const char* cursor = record_ + record * kRecordSize;
+  uint32_t nameoffset = ReadUint32(cursor + 4);
+  uint32_t secretoffset = ReadUint32(cursor + 12);
+  *hash = ReadUint32(cursor);
+  *namesize = ReadUint16(cursor + 8);
+  *secretsize = ReadUint16(cursor + 10);
+
+  // Records are not validated when the file is mapped, so startup does not
+  // depend on the number of users. Check them here instead.
+  if (nameoffset > datasize_ || datasize_ - nameoffset < uint32_t(*namesize) ||
+      secretoffset > datasize_ ||
+      datasize_ - secretoffset < uint32_t(*secretsize))
+    return false;
+
+  *name = data_ + nameoffset;
+  *secret = data_ + secretoffset;
+  return true;
+}
+
+bool UdbBinaryIndex::Find(
+    const string& username, const char** secret, int* size) const {
+  if (!base_)
+    return false;
+
+  uint32_t hash = Hash(username.c_str(), username.size());
+  uint32_t slot = hash & (buckets_ - 1);
+  for (uint32_t probes = 0; probes < buckets_; ++probes) {
+    uint32_t entry = ReadUint32(index_ + slot * kBucketSize);
+    if (!entry)
+      return false;
+
+    uint32_t recordhash;
+    const char* name;
+    int namesize;
+    if (!GetRecord(entry - 1, &recordhash, &name, &namesize, secret, size)) {
+      LOG_ERROR("corrupted record %u in binary userdb", entry - 1);
+      return false;
+    }
+
+    if (recordhash == hash && namesize == static_cast<int>(username.size()) &&
+        !memcmp(name, username.data(), namesize))
+      return true;
+
+    slot = (slot + 1) & (buckets_ - 1);
+  }
+  return false;
+}
+
+bool UdbBinaryIndex::ReadAll(UserDb::UserMap* users) const {
+  for (uint32_t record = 0; record < records_; ++record) {
+    uint32_t hash;
+    const char* name;
+    const char* secret;
+    int namesize, secretsize;
+    if (!GetRecord(record, &hash, &name, &namesize, &secret, &secretsize)) {
+      LOG_ERROR("corrupted record %u in binary userdb", record);
+      return false;
+    }
+
+    (*users)[string(name, namesize)].assign(secret, secretsize);
+  }
+  return true;
+}
+
+UdbBinaryFile::UdbBinaryFile(const string& name)
+    : name_(name),
+      lockfd_(-1) {
+}
+
+UdbBinaryFile::~UdbBinaryFile() {
+  Close();
+}
+
+bool UdbBinaryFile::Open() {
+  DEBUG_FATAL_UNLESS(lockfd_ == -1)(
+      "opening already opened db?");
+
+  // The db itself is replaced on every Commit(), so it can't be used
+  // to serialize writers. Lock a file next to it instead.
+  const string lockname(name_ + ".lock");
+  lockfd_ = open(lockname.c_str(), O_CREAT | O_RDWR, 0600);
+  if (lockfd_ < 0) {
+    LOG_PERROR("unable to open %s", lockname.c_str());
+    return false;
+  }
+
+  struct flock lock;
+  memset(&lock, 0, sizeof(struct flock));
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+  if (fcntl(lockfd_, F_SETLK, &lock) == -1) {
+    LOG_PERROR("unable to lock %s", lockname.c_str());
+    Close();
+    return false;
+  }
+
+  if (access(name_.c_str(), F_OK) && errno == ENOENT)
+    return true;
+
+  UdbBinaryIndex index;
+  if (!index.Map(name_) || !index.ReadAll(&users_)) {
+    LOG_ERROR("userdb %s contains errors", name_.c_str());
+    Close();
+    return false;
+  }
+  return true;
+}
+
+bool UdbBinaryFile::Close() {
+  if (lockfd_ >= 0) {
+    close(lockfd_);
+    lockfd_ = -1;
+  }
+
+  users_.clear();
+  return true;
+}
+
+bool UdbBinaryFile::Commit() {
+  if (lockfd_ < 0) {
+    LOG_ERROR("cannot commit %s - db is not opened.", name_.c_str());
+    return false;
+  }
+
+  return UdbBinaryIndex::Write(name_, users_);
+}
+
+bool UdbBinaryFile::ValidUsername(const string& username, string* reason) {
+  if (username.empty() || username.size() > 0xffff) {
+    if (reason)
+      reason->assign("usernames must be between 1 and 65535 characters long.");
+    return false;
+  }
+  return true;
+}
+
+bool UdbBinaryFile::GetUser(const string& username, string* secret) {
+  if (lockfd_ < 0) {
+    LOG_ERROR("cannot get user %s - db is not opened.", username.c_str());
+    return false;
+  }
+
+  UserMap::const_iterator it(users_.find(username));
+  if (it == users_.end())
+    return false;
+
+  if (secret)
+    secret->assign(it->second);
+  return true;
+}
+
+bool UdbBinaryFile::GetAllUsers(UserMap* users) {
+  if (lockfd_ < 0) {
+    LOG_ERROR("cannot get users - db %s is not opened.", name_.c_str());
+    return false;
+  }
+
+  for (UserMap::const_iterator it(users_.begin()); it != users_.end(); ++it)
+    (*users)[it->first] = it->second;
+  return true;
+}
+
+bool UdbBinaryFile::AddUser(const string& username, const string& secret) {
+  if (lockfd_ < 0) {
+    LOG_ERROR("cannot add user %s - db is not opened.", username.c_str());
+    return false;
+  }
+
+  if (users_.find(username) != users_.end()) {
+    LOG_ERROR("cannot add user %s - an user by that name already exists", username.c_str());
+    return false;
+  }
+
+  users_[username] = secret;
+  return true;
+}
+
+bool UdbBinaryFile::SetUser(const string& username, const string& secret) {
+  if (lockfd_ < 0) {
+    LOG_ERROR("cannot set user %s - db is not opened.", username.c_str());
+    return false;
+  }
+
+  UserMap::iterator it(users_.find(username));
+  if (it == users_.end())
+    return false;
+
+  it->second = secret;
+  return true;
+}
+
+bool UdbBinaryFile::DelUser(const string& username) {
+  if (lockfd_ < 0) {
+    LOG_ERROR("cannot delete user %s - db is not opened.", username.c_str());
+    return false;
+  }
+
+  return users_.erase(username) > 0;
+}
@@ -0,0 +1,102 @@
+#ifndef UDB_BINARY_H
+# define UDB_BINARY_H
+
+# include "base.h"
+# include "macros.h"
+# include "userdb.h"
+
+# include <string>
+
+// Binary user db format, meant to be mmap()ed and used as is.
+//
+// All integers are in network byte order. The file looks like:
+//
+//   header:  char magic[8], uint32 version, uint32 buckets,
+//            uint32 records, uint32 data size, 8 bytes reserved.
+//   index:   uint32 bucket[buckets], with 0 meaning empty, and n
+//            meaning record n - 1. Open addressing with linear probing,
+//            buckets is a power of 2, and at least twice records.
+//   records: uint32 hash, uint32 name offset, uint16 name size,
+//            uint16 secret size, uint32 secret offset, for each user.
+//   data:    names and secrets, offsets are relative to the start of data.
+//
+// Looking up an user costs an hash, and generally a single comparison.
+// Nothing is parsed when the file is loaded, nor allocated on lookups.
+class UdbBinaryIndex {
+ public:
+  static const char kMagic[];
+  static const int kMagicSize = 8;
+  static const uint32_t kVersion = 1;
+
+  static const int kHeaderSize = 32;
+  static const int kBucketSize = 4;
+  static const int kRecordSize = 16;
+
+  UdbBinaryIndex();
+  ~UdbBinaryIndex();
+
+  // Returns true if name exists, and is in this format.
+  static bool IsBinary(const string& name);
+
+  // Writes users to name, atomically: a temporary file is written and
+  // synced first, and then renamed over name.
+  static bool Write(const string& name, const UserDb::UserMap& users);
+
+  bool Map(const string& name);
+  void Unmap();
+  bool IsMapped() const { return base_ != NULL; }
+
+  // On success, secret points directly inside the mapped file, and is valid
+  // until the file is unmapped.
+  bool Find(const string& username, const char** secret, int* size) const;
+  bool ReadAll(UserDb::UserMap* users) const;
+
+  int Users() const { return records_; }
+
+ private:
+  NO_COPY(UdbBinaryIndex);
+
+  static uint32_t Hash(const char* name, int size);
+  bool GetRecord(uint32_t record, uint32_t* hash,
+                 const char** name, int* namesize,
+                 const char** secret, int* secretsize) const;
+
+  char* base_;
+  size_t size_;
+
+  uint32_t buckets_;
+  uint32_t records_;
+  uint32_t datasize_;
+
+  const char* index_;
+  const char* record_;
+  const char* data_;
+};
+
+// UserDb to manipulate binary user dbs, see UdbBinaryIndex.
+class UdbBinaryFile : public UserDb {
+ public:
+  UdbBinaryFile(const string& name);
+  virtual ~UdbBinaryFile();
+
+  virtual bool Open();
+  virtual bool Close();
+
+  virtual bool Commit();
+
+  virtual bool ValidUsername(const string& username, string* reason);
+
+  virtual bool GetUser(const string& username, string* secret);
+  virtual bool GetAllUsers(UserMap* users);
+  virtual bool AddUser(const string& username, const string& secret);
+  virtual bool SetUser(const string& username, const string& secret);
+
+  virtual bool DelUser(const string& username);
+
+ private:
+  const string name_;
+  UserMap users_;
+  int lockfd_;
+};
+
+#endif /* UDB_BINARY_H */
@@ -0,0 +1,239 @@
+#include "user-lookup.h"
+#include "userdb.h"
+#include "sockaddr.h"
+#include "serializers.h"
+#include "stl-helpers.h"
+
+const int CachingUserLookup::kMaxEntries;
+const Timer::ms_timer_t CachingUserLookup::kFoundTtl;
+const Timer::ms_timer_t CachingUserLookup::kNotFoundTtl;
+
+void UserDbLookup::Lookup(const string& username, done_handler_t* done) {
+  string secret;
+  UserDbSession udbs(userdb_);
+  if (!userdb_->GetUser(username, &secret)) {
+    (*done)(NotFound, secret);
+    return;
+  }
+  (*done)(Found, secret);
+}
+
+HelperUserLookup::HelperUserLookup(
+    Transport* transport, const Sockaddr& address)
+    : transport_(transport),
+      address_(address),
+      read_handler_(bind(&HelperUserLookup::HandleRead, this)),
+      write_handler_(bind(&HelperUserLookup::HandleWrite, this)) {
+}
+
+HelperUserLookup::~HelperUserLookup() {
+  if (channel_.get())
+    channel_->Close();
+}
+
+bool HelperUserLookup::Connect() {
+  if (channel_.get())
+    return true;
+
+  LOG_DEBUG("connecting to user lookup helper at %s",
+            address_.AsString().c_str());
+  channel_.reset(transport_->StreamConnect(address_));
+  if (!channel_.get()) {
+    LOG_ERROR("could not connect to user lookup helper at %s",
+              address_.AsString().c_str());
+    return false;
+  }
+
+  channel_->WantRead(&read_handler_);
+  return true;
+}
+
+void HelperUserLookup::Disconnect(const char* reason) {
+  LOG_ERROR("user lookup helper at %s: %s, failing %d lookups",
+            address_.AsString().c_str(), reason, pending_.size());
+
+  channel_->Close();
+  closed_.reset(channel_.release());
+
+  requests_.Output()->Increment(requests_.Output()->LeftSize());
+  replies_.Output()->Increment(replies_.Output()->LeftSize());
+
+  // Callbacks can start new lookups: take the list out first.
+  deque<done_handler_t*> failed;
+  failed.swap(pending_);
+  for (deque<done_handler_t*>::iterator it(failed.begin());
+       it != failed.end(); ++it) {
+    if (*it)
+      (**it)(Failed, string());
+  }
+}
+
+void HelperUserLookup::Lookup(const string& username, done_handler_t* done) {
+  if (!Connect()) {
+    (*done)(Failed, string());
+    return;
+  }
+
+  EncodeToBuffer(username, requests_.Input());
+  pending_.push_back(done);
+  channel_->WantWrite(&write_handler_);
+}
+
+void HelperUserLookup::Cancel(done_handler_t* done) {
+  // The reply will still come, and must be consumed.
+  for (deque<done_handler_t*>::iterator it(pending_.begin());
+       it != pending_.end(); ++it) {
+    if (*it == done)
+      *it = NULL;
+  }
+}
+
+BoundChannel::processing_state_e HelperUserLookup::HandleWrite() {
+  if (!channel_.get())
+    return BoundChannel::DONE;
+
+  if (channel_->Write(requests_.Output()) != BoundChannel::OK) {
+    Disconnect("write failed");
+    return BoundChannel::DONE;
+  }
+
+  if (!requests_.Output()->LeftSize())
+    return BoundChannel::DONE;
+  return BoundChannel::MORE;
+}
+
+BoundChannel::processing_state_e HelperUserLookup::HandleRead() {
+  if (!channel_.get())
+    return BoundChannel::DONE;
+
+  if (channel_->Read(replies_.Input()) != BoundChannel::OK) {
+    Disconnect("read failed, or connection closed");
+    return BoundChannel::DONE;
+  }
+
+  while (replies_.Output()->LeftSize()) {
+    OutputCursor parsed(*replies_.Output());
+    uint8_t result;
+    string secret;
+    // Partial reply, wait for more data.
+    if (DecodeFromBuffer(&parsed, &result) ||
+        DecodeFromBuffer(&parsed, &secret))
+      break;
+    replies_.Output()->Increment(
+        replies_.Output()->LeftSize() - parsed.LeftSize());
+
+    if (pending_.empty() || result > Failed) {
+      Disconnect("sent garbage");
+      return BoundChannel::DONE;
+    }
+
+    done_handler_t* done(pending_.front());
+    pending_.pop_front();
+    if (done)
+      (*done)(static_cast<Result>(result), secret);
+  }
+  return BoundChannel::MORE;
+}
+
+CachingUserLookup::CachingUserLookup(UserLookup* backend)
+    : backend_(backend), hits_(0), misses_(0) {
+}
+
+CachingUserLookup::~CachingUserLookup() {
+  for (PendingMap::iterator it(pending_.begin()); it != pending_.end(); ++it) {
+    backend_->Cancel(&it->second->handler);
+    delete it->second;
+  }
+  while (!entries_.empty())
+    Erase(entries_.begin());
+}
+
+void CachingUserLookup::Lookup(const string& username, done_handler_t* done) {
+  Lookup(username, done, Timer().Milliseconds());
+}
+
+void CachingUserLookup::Lookup(
+    const string& username, done_handler_t* done, Timer::ms_timer_t now) {
+  EntryMap::iterator found(entries_.find(username));
+  if (found != entries_.end()) {
+    Entry* entry(&found->second);
+    Timer::ms_timer_t ttl(entry->result == Found ? kFoundTtl : kNotFoundTtl);
+    if (now - entry->when < ttl) {
+      ++hits_;
+      lru_.splice(lru_.begin(), lru_, entry->lru);
+      // The callback might cause the entry to be evicted.
+      string secret(entry->secret);
+      (*done)(entry->result, secret);
+      memset(&secret[0], 0, secret.size());
+      return;
+    }
+    Erase(found);
+  }
+
+  ++misses_;
+  Pending* pending(StlMapGet(pending_, username));
+  if (pending) {
+    pending->waiters.push_back(done);
+    return;
+  }
+
+  pending = new Pending;
+  pending->username = username;
+  pending->when = now;
+  pending->handler = bind(&CachingUserLookup::LookupDone, this, pending,
+                          placeholders::_1, placeholders::_2);
+  pending->waiters.push_back(done);
+  pending_[username] = pending;
+
+  // Might complete right away, don't touch pending after this.
+  backend_->Lookup(username, &pending->handler);
+}
+
+void CachingUserLookup::Cancel(done_handler_t* done) {
+  for (PendingMap::iterator it(pending_.begin()); it != pending_.end(); ++it)
+    it->second->waiters.remove(done);
+}
+
+void CachingUserLookup::LookupDone(
+    Pending* pending, Result result, const string& secret) {
+  pending_.erase(pending->username);
+  finished_.reset(pending);
+
+  if (result != Failed)
+    Insert(pending->username, result, secret, pending->when);
+  else
+    LOG_DEBUG("lookup for %s failed, not caching", pending->username.c_str());
+
+  // Callbacks can start new lookups, and complete others.
+  list<done_handler_t*> waiters;
+  waiters.swap(pending->waiters);
+  for (list<done_handler_t*>::iterator it(waiters.begin());
+       it != waiters.end(); ++it)
+    (**it)(result, secret);
+}
+
+void CachingUserLookup::Insert(
+    const string& username, Result result, const string& secret,
+    Timer::ms_timer_t now) {
+  EntryMap::iterator found(entries_.find(username));
+  if (found != entries_.end())
+    Erase(found);
+
+  if (static_cast<int>(entries_.size()) >= kMaxEntries)
+    Erase(entries_.find(lru_.back()));
+
+  lru_.push_front(username);
+  Entry* entry(&entries_[username]);
+  entry->result = result;
+  entry->secret = secret;
+  entry->when = now;
+  entry->lru = lru_.begin();
+}
+
+void CachingUserLookup::Erase(EntryMap::iterator it) {
+  string* secret(&it->second.secret);
+  if (!secret->empty())
+    memset(&(*secret)[0], 0, secret->size());
+  lru_.erase(it->second.lru);
+  entries_.erase(it);
+}
@@ -0,0 +1,173 @@
+#ifndef USER_LOOKUP_H
+# define USER_LOOKUP_H
+
+# include "base.h"
+# include "macros.h"
+# include "buffer.h"
+# include "timers.h"
+# include "transport.h"
+
+# include <list>
+# include <deque>
+# include <string>
+
+class UserDb;
+class Sockaddr;
+
+// Asynchronous lookup of users, so a slow or remote user store does not
+// block the dispatcher thread, and all the sessions handled by it.
+//
+// Everything runs on the dispatcher thread: lookups are started from it,
+// and completion callbacks are invoked from it.
+class UserLookup {
+ public:
+  enum Result {
+    Found,
+    NotFound,
+    Failed   //< the store could not be reached, or returned garbage.
+  };
+
+  // secret is what UserDb::GetUser would return, and is only meaningful
+  // if result is Found.
+  typedef function<void (Result, const string& secret)> done_handler_t;
+
+  virtual ~UserLookup() {}
+
+  // Invokes done once the result is known. done may be invoked before
+  // Lookup returns, and must stay valid until it is invoked, or until
+  // Cancel is called.
+  virtual void Lookup(const string& username, done_handler_t* done) = 0;
+  // done will not be invoked anymore, for any of the lookups using it.
+  virtual void Cancel(done_handler_t* done) = 0;
+};
+
+// Lookups in a local UserDb, completed before Lookup returns. Only good
+// for dbs that don't block, like ResidentUserDb.
+class UserDbLookup : public UserLookup {
+ public:
+  explicit UserDbLookup(UserDb* userdb) : userdb_(userdb) {}
+
+  void Lookup(const string& username, done_handler_t* done);
+  void Cancel(done_handler_t* done) {}
+
+ private:
+  NO_COPY(UserDbLookup);
+
+  UserDb* userdb_;
+};
+
+// Lookups forwarded to a helper process over a local stream socket, so
+// users can be kept in ldap, sql, or anything else, without linking any
+// of it in uvpn, or blocking on it. On the socket:
+//   uvpn->helper: <username (uint16 size + data)>
+//   helper->uvpn: <result (uint8)><secret (uint16 size + data)>
+// result is one of the values of UserLookup::Result. Requests can be
+// pipelined, and replies must come in the same order.
+//
+// The connection is opened on the first lookup. If it breaks, all the
+// lookups in flight fail, and it is opened again on the next one.
+class HelperUserLookup : public UserLookup {
+ public:
+  HelperUserLookup(Transport* transport, const Sockaddr& address);
+  ~HelperUserLookup();
+
+  void Lookup(const string& username, done_handler_t* done);
+  void Cancel(done_handler_t* done);
+
+ private:
+  NO_COPY(HelperUserLookup);
+
+  bool Connect();
+  void Disconnect(const char* reason);
+
+  BoundChannel::processing_state_e HandleRead();
+  BoundChannel::processing_state_e HandleWrite();
+
+  Transport* transport_;
+  const Sockaddr& address_;
+
+  auto_ptr<BoundChannel> channel_;
+  // A channel can't be deleted from its own handlers, it is kept here
+  // until the next one is closed.
+  auto_ptr<BoundChannel> closed_;
+
+  BoundChannel::event_handler_t read_handler_;
+  BoundChannel::event_handler_t write_handler_;
+
+  Buffer requests_;
+  Buffer replies_;
+  // One for each request sent, in order. NULL if cancelled.
+  deque<done_handler_t*> pending_;
+};
+
+// Cache in front of a slow UserLookup, keeping both users found and not
+// found for a while: a burst of connections from the same user, or a
+// flood of attempts with a non existing one, only cost one lookup in the
+// backend. Concurrent lookups for the same user are also merged in one.
+//
+// At most kMaxEntries are kept, the least recently used one is dropped to
+// make room. Failures are not cached.
+//
+// A user removed from the store can still log in for up to kFoundTtl.
+class CachingUserLookup : public UserLookup {
+ public:
+  static const int kMaxEntries = 4096;
+  static const Timer::ms_timer_t kFoundTtl = 5 * 60 * 1000;
+  static const Timer::ms_timer_t kNotFoundTtl = 30 * 1000;
+
+  explicit CachingUserLookup(UserLookup* backend);
+  ~CachingUserLookup();
+
+  void Lookup(const string& username, done_handler_t* done);
+  // As above, but with the time to use to check and store entries.
+  void Lookup(const string& username, done_handler_t* done,
+              Timer::ms_timer_t now);
+  void Cancel(done_handler_t* done);
+
+  int Size() const { return entries_.size(); }
+  uint64_t HitCount() const { return hits_; }
+  uint64_t MissCount() const { return misses_; }
+
+ private:
+  NO_COPY(CachingUserLookup);
+
+  typedef list<string> LruList;
+
+  struct Entry {
+    Result result;
+    string secret;
+    Timer::ms_timer_t when;
+    // Position in lru_.
+    LruList::iterator lru;
+  };
+  typedef unordered_map<string, Entry> EntryMap;
+
+  // A lookup in progress in the backend.
+  struct Pending {
+    string username;
+    Timer::ms_timer_t when;
+    done_handler_t handler;
+    list<done_handler_t*> waiters;
+  };
+  typedef unordered_map<string, Pending*> PendingMap;
+
+  void LookupDone(Pending* pending, Result result, const string& secret);
+  void Insert(const string& username, Result result, const string& secret,
+              Timer::ms_timer_t now);
+  void Erase(EntryMap::iterator it);
+
+  UserLookup* backend_;
+
+  EntryMap entries_;
+  // Most recently used first.
+  LruList lru_;
+
+  PendingMap pending_;
+  // Last lookup completed, can't be deleted from its own handler.
+  auto_ptr<Pending> finished_;
+
+  uint64_t hits_;
+  uint64_t misses_;
+};
+
+#endif /* USER_LOOKUP_H */
@@ -16,10 +16,10 @@ UdbSecretFile::~UdbSecretFile() {
   Close();
 }
 
-bool UdbSecretFile::LockFd(int fd) {
+bool UdbSecretFile::LockFd(int fd, short type) {
   struct flock lock;
   memset(&lock, 0, sizeof(struct flock));
-  lock.l_type = F_WRLCK;
+  lock.l_type = type;
   lock.l_whence = SEEK_SET;
   lock.l_start = 0;
   lock.l_len = 0;
@@ -39,7 +39,7 @@ bool UdbSecretFile::Open() {
     return false;
   }
 
-  if (!LockFd(fd_)) {
+  if (!LockFd(fd_, F_WRLCK)) {
     if (errno == EAGAIN) {
       LOG_ERROR("lock for %s held by a different process", name_.c_str());
       return false;
@@ -57,6 +57,41 @@ bool UdbSecretFile::Open() {
   return true;
 }
 
+bool UdbSecretFile::ReadAll(const string& name, UserMap* users) {
+  int fd = open(name.c_str(), O_RDONLY);
+  if (fd < 0) {
+    LOG_PERROR("unable to open %s", name.c_str());
+    return false;
+  }
+
+  // Open() holds a write lock while the file is being changed, and for
+  // as long as the file is open, don't read half written files.
+  if (!LockFd(fd, F_RDLCK)) {
+    if (errno == EAGAIN || errno == EACCES) {
+      LOG_ERROR("lock for %s held by a different process", name.c_str());
+      close(fd);
+      return false;
+    }
+
+    LOG_PERROR("unable to lock %s (continuing anyway)", name.c_str());
+  }
+
+  map<string, string*> parsed;
+  bool result = ParseFd(fd, &parsed);
+  close(fd);
+
+  for (map<string, string*>::iterator it = parsed.begin();
+       it != parsed.end(); ++it) {
+    if (result)
+      (*users)[it->first].swap(*it->second);
+    delete it->second;
+  }
+
+  if (!result)
+    LOG_ERROR("userdb %s contains errors", name.c_str());
+  return result;
+}
+
 bool UdbSecretFile::DelUser(const string& username) {
   if (fd_ < 0) {
     LOG_ERROR("cannot delete user %s - db is not opened.", username.c_str());
@@ -119,6 +154,18 @@ bool UdbSecretFile::GetUser(const string& username, string* secret) {
   return false;
 }
 
+bool UdbSecretFile::GetAllUsers(UserMap* users) {
+  if (fd_ < 0) {
+    LOG_ERROR("cannot get users - db %s is not opened.", name_.c_str());
+    return false;
+  }
+
+  for (map<string, string*>::const_iterator it = users_.begin();
+       it != users_.end(); ++it)
+    (*users)[it->first].assign(*it->second);
+  return true;
+}
+
 bool UdbSecretFile::ParseFd(int fd, map<string, string*>* users) {
   if (lseek(fd, SEEK_SET, 0L) < 0)
     LOG_PERROR("unable to seek fd %d (continuing anyway)", fd);
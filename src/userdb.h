@@ -20,6 +20,9 @@ class UserSecret {
 
 class UserDb {
  public:
+  // username -> secret, as returned by GetUser.
+  typedef unordered_map<string, string> UserMap;
+
   UserDb() {}
   virtual ~UserDb() {}
 
@@ -31,6 +34,7 @@ class UserDb {
   virtual bool ValidUsername(const string& username, string* reason) = 0;
 
   virtual bool GetUser(const string& username, string* secret) = 0;
+  virtual bool GetAllUsers(UserMap* users) = 0;
   virtual bool AddUser(const string& username, const string& secret) = 0;
   virtual bool SetUser(const string& username, const string& secret) = 0;
 
@@ -66,13 +70,19 @@ class UdbSecretFile : public UserDb {
   virtual bool ValidUsername(const string& username, string* reason);
 
   virtual bool GetUser(const string& username, string* secret);
+  virtual bool GetAllUsers(UserMap* users);
   virtual bool AddUser(const string& username, const string& secret);
   virtual bool SetUser(const string& username, const string& secret);
 
   virtual bool DelUser(const string& username);
 
+  // Reads all the users in the file at once, with secrets decoded like
+  // GetUser would return them. The file is only kept open (and locked)
+  // for the duration of the call.
+  static bool ReadAll(const string& name, UserMap* users);
+
  private:
-  static bool LockFd(int fd);
+  static bool LockFd(int fd, short type);
   static bool ParseFd(int fd, map<string, string*>* users);
 
   static void DecodeSecret(const string& secret, string* output);
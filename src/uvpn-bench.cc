@@ -0,0 +1,731 @@
+#include "base.h"
+
+#include <string>
+#include <map>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#include <stdio.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/sockios.h>
+
+#include "uvpn-bench.h"
+#include "dispatcher.h"
+#include "conversions.h"
+#include "stl-helpers.h"
+#include "event-scheduler.h"
+#include "io-channel-id.h"
+#include "socket-transport.h"
+#include "tcp-profile.h"
+#include "fd-helpers.h"
+#include "sockaddr.h"
+#include "srp-passwd.h"
+
+#include "client-io-channel.h"
+#include "client-simple-connection-manager.h"
+#include "client-udp-transcoder.h"
+#include "srp-client-authenticator.h"
+#include "user-chatter.h"
+
+#include "server-io-channel.h"
+#include "server-simple-connection-manager.h"
+#include "server-udp-transcoder.h"
+#include "srp-server-authenticator.h"
+#include "handshake-admission.h"
+#include "session-ticket.h"
+#include "user-lookup.h"
+
+namespace {
+
+// Answers with the username and password it was given, without asking.
+class FixedUserChatter : public UserChatter {
+ public:
+  FixedUserChatter(const string& username, const string& password)
+      : username_(username), password_(password) {}
+
+  bool Get(const InputDescriptor& descriptor, StringBuffer* data) {
+    const string& value(descriptor.name == kInputNamePassword ?
+                        password_ : username_);
+    if (static_cast<int>(value.size()) > data->Size())
+      return false;
+    memcpy(data->Data(), value.data(), value.size());
+    data->Resize(value.size());
+    return true;
+  }
+
+ private:
+  const string username_;
+  const string password_;
+};
+
+// Knows a single user, the one the clients log in as.
+class FixedUserLookup : public UserLookup {
+ public:
+  FixedUserLookup(const string& username, const string& secret)
+      : username_(username), secret_(secret) {}
+
+  void Lookup(const string& username, done_handler_t* done) {
+    if (username != username_) {
+      (*done)(NotFound, string());
+      return;
+    }
+    (*done)(Found, secret_);
+  }
+  void Cancel(done_handler_t* done) {}
+
+ private:
+  const string username_;
+  const string secret_;
+};
+
+// Server side, accepts sessions and drops whatever they send. The first
+// message after authentication means the client is done: the session is
+// closed, so the server does not grow with the handshakes.
+class NullServerChannel : public ServerIOChannel {
+ public:
+  explicit NullServerChannel(Dispatcher* dispatcher)
+      : ServerIOChannel(dispatcher),
+        read_handler_(bind(&NullServerChannel::HandleRead, this,
+                           placeholders::_1, placeholders::_2)) {}
+
+  bool Init() { return true; }
+  int GetId() { return IoChannelIdNone; }
+
+  void HandleConnect(ServerConnectedSession* session) {
+    session->SetCallbacks(&read_handler_, NULL);
+  }
+
+ private:
+  void HandleRead(ServerConnectedSession* session, OutputCursor* data) {
+    data->Increment(data->LeftSize());
+    session->Disconnect();
+  }
+
+  ServerConnectedSession::read_handler_t read_handler_;
+};
+
+// Client side, tells the bench when a session is authenticated.
+class BenchClientChannel : public ClientIOChannel {
+ public:
+  typedef function<void (ClientConnectedSession*)> connected_handler_t;
+
+  BenchClientChannel(Dispatcher* dispatcher, connected_handler_t* connected)
+      : ClientIOChannel(dispatcher),
+        connected_(connected),
+        read_handler_(bind(&BenchClientChannel::HandleRead, this,
+                           placeholders::_1, placeholders::_2)) {}
+
+  int GetId() { return IoChannelIdNone; }
+  bool Init() { return true; }
+
+  void HandleSession(ClientConnectedSession* session) {
+    session->SetCallbacks(&read_handler_, NULL);
+    (*connected_)(session);
+  }
+
+ private:
+  void HandleRead(ClientConnectedSession* session, OutputCursor* data) {
+    data->Increment(data->LeftSize());
+  }
+
+  connected_handler_t* connected_;
+  ClientConnectedSession::read_handler_t read_handler_;
+};
+
+// Keeps clients handshakes in flight, until enough of them are done.
+class HandshakeBench {
+ public:
+  HandshakeBench(Dispatcher* dispatcher, EventScheduler* scheduler,
+                 ClientConnectionManager* manager,
+                 SrpClientAuthenticator* authenticator, UserChatter* chatter,
+                 const string& server, int clients, int handshakes,
+                 bool resume, Timer::ms_timer_t timeout)
+      : dispatcher_(dispatcher),
+        scheduler_(scheduler),
+        manager_(manager),
+        authenticator_(authenticator),
+        chatter_(chatter),
+        server_(server),
+        clients_(clients),
+        handshakes_(handshakes),
+        resume_(resume),
+        timeout_(timeout),
+        started_(0),
+        failed_(0),
+        connected_handler_(bind(&HandshakeBench::Connected, this,
+                                placeholders::_1)),
+        timeout_handler_(bind(&HandshakeBench::Timeout, this)),
+        timeout_event_("bench timeout", &timeout_handler_) {
+    latencies_.reserve(handshakes_);
+  }
+
+  BenchClientChannel::connected_handler_t* ConnectedHandler() {
+    return &connected_handler_;
+  }
+
+  void Start() {
+    start_ = Timer().Microseconds();
+    timeout_event_.Start(scheduler_, timeout_);
+    for (int i = 0; i < clients_ && started_ < handshakes_; ++i)
+      StartHandshake();
+  }
+
+  // Latencies of the handshakes completed, in us, sorted.
+  const vector<uint64_t>& Latencies() const { return latencies_; }
+  // Time taken by the whole run, in us.
+  uint64_t Elapsed() const { return end_ - start_; }
+  int Failed() const { return failed_; }
+  int Pending() const { return pending_.size(); }
+
+ private:
+  void StartHandshake() {
+    ++started_;
+    if (!resume_)
+      authenticator_->ForgetTicket();
+
+    uint64_t now(Timer().Microseconds());
+    ClientConnectedSession* session(manager_->AddConnection(server_, chatter_));
+    if (!session) {
+      ++failed_;
+      MaybeFinish();
+      return;
+    }
+    pending_[session] = now;
+  }
+
+  void Connected(ClientConnectedSession* session) {
+    PendingMap::iterator it(pending_.find(session));
+    if (it == pending_.end())
+      return;
+
+    latencies_.push_back(Timer().Microseconds() - it->second);
+    pending_.erase(it);
+
+    // Done with it: an empty message tells the server started by the bench
+    // to forget the session too. Only --clients sockets are open at once,
+    // and neither side slows down as handshakes pile up.
+    session->Message();
+    session->SendMessage();
+    session->Disconnect();
+
+    if (started_ < handshakes_)
+      StartHandshake();
+    else
+      MaybeFinish();
+  }
+
+  bool Timeout() {
+    LOG_ERROR("timeout, %d handshakes still pending", Pending());
+    Finish();
+    return true;
+  }
+
+  void MaybeFinish() {
+    if (pending_.empty() && started_ >= handshakes_)
+      Finish();
+  }
+
+  void Finish() {
+    end_ = Timer().Microseconds();
+    sort(latencies_.begin(), latencies_.end());
+    dispatcher_->Stop();
+  }
+
+  Dispatcher* dispatcher_;
+  EventScheduler* scheduler_;
+  ClientConnectionManager* manager_;
+  SrpClientAuthenticator* authenticator_;
+  UserChatter* chatter_;
+
+  const string server_;
+  const int clients_;
+  const int handshakes_;
+  const bool resume_;
+  const Timer::ms_timer_t timeout_;
+
+  int started_;
+  int failed_;
+  uint64_t start_;
+  uint64_t end_;
+
+  // When each handshake in flight was started, in us.
+  typedef map<ClientConnectedSession*, uint64_t> PendingMap;
+  PendingMap pending_;
+  vector<uint64_t> latencies_;
+
+  BenchClientChannel::connected_handler_t connected_handler_;
+  EventScheduler::Event::timer_handler_t timeout_handler_;
+  OneOffEvent timeout_event_;
+};
+
+// Cpu time used by pid so far, user and system, in us. -1 if unknown.
+int64_t ProcessCpuTime(pid_t pid) {
+  FILE* file(fopen(("/proc/" + ToString(pid) + "/stat").c_str(), "r"));
+  if (!file)
+    return -1;
+
+  char buffer[1024];
+  int size(fread(buffer, 1, sizeof(buffer) - 1, file));
+  fclose(file);
+  if (size <= 0)
+    return -1;
+  buffer[size] = '\0';
+
+  // The process name is in parentheses, and can contain spaces. utime
+  // and stime are the 12th and 13th fields after it.
+  const char* fields(strrchr(buffer, ')'));
+  unsigned long utime, stime;
+  if (!fields || sscanf(fields + 1,
+          " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+          &utime, &stime) != 2)
+    return -1;
+
+  return static_cast<int64_t>(utime + stime) * 1000000 / sysconf(_SC_CLK_TCK);
+}
+
+// Runs a server listening on address, forever. Writes to ready once
+// clients can connect.
+int RunServer(const string& address, const string& username,
+              const string& password, int ready) {
+  Dispatcher dispatcher;
+  if (!dispatcher.Init()) {
+    LOG_FATAL("could not initialize dispatcher");
+    return 1;
+  }
+  SocketTransport socket_api(&dispatcher);
+
+  SrpSecret srpsecret(SecurePrimes::Shared(), 1);
+  if (!srpsecret.FromPassword(
+          username, ScopedPassword(password.data(), password.size()))) {
+    LOG_FATAL("could not compute secret for %s", username.c_str());
+    return 1;
+  }
+  string secret;
+  srpsecret.ToSecret(&secret);
+  FixedUserLookup users(username, secret);
+
+  Prng* prng(DefaultPrng::ForThisThread());
+  ServerSimpleConnectionManager manager(prng, &dispatcher);
+
+  EventScheduler scheduler;
+  SessionTicketKeys tickets(prng);
+  tickets.Start(&scheduler);
+  // The manager owns both.
+  manager.RegisterIOChannel(new NullServerChannel(&dispatcher));
+  manager.RegisterAuthenticator(
+      new SrpServerAuthenticator(&users, prng, &tickets));
+
+  auto_ptr<Sockaddr> listen(Sockaddr::Parse(address, 1029));
+  if (!listen.get()) {
+    LOG_FATAL("invalid address to listen on: %s", address.c_str());
+    return 1;
+  }
+  HandshakeAdmission admission(prng);
+  ServerUdpTranscoder t_udp(
+      &dispatcher, &socket_api, *listen, &manager, &admission);
+  if (!t_udp.Start()) {
+    LOG_FATAL("could not listen on %s", address.c_str());
+    return 1;
+  }
+
+  if (write(ready, "", 1) != 1) {
+    LOG_FATAL("could not tell the bench we are ready");
+    return 1;
+  }
+  close(ready);
+
+  dispatcher.Start(&scheduler);
+  return 0;
+}
+
+// Accepts a single connection on address, with the options of profile,
+// and discards whatever it reads, until the connection is closed. Writes
+// to ready once the bench can connect.
+int RunStreamSink(const string& address, const TcpProfile* profile,
+                  int ready) {
+  auto_ptr<Sockaddr> listen(Sockaddr::Parse(address, 1029));
+  if (!listen.get()) {
+    LOG_FATAL("invalid address to listen on: %s", address.c_str());
+    return 1;
+  }
+
+  ScopedFd fd(socket(listen->Family(), SOCK_STREAM, 0));
+  int reuseaddr(1);
+  if (!fd.IsValid() ||
+      setsockopt(fd.Get(), SOL_SOCKET, SO_REUSEADDR, &reuseaddr,
+                 sizeof(reuseaddr)) < 0) {
+    LOG_FATAL("could not create socket: %s", strerror(errno));
+    return 1;
+  }
+  profile->ApplyToListening(fd.Get());
+  if (bind(fd.Get(), listen->Data(), listen->Size()) != 0 ||
+      ::listen(fd.Get(), 1) != 0) {
+    LOG_FATAL("could not listen on %s: %s", address.c_str(), strerror(errno));
+    return 1;
+  }
+
+  if (write(ready, "", 1) != 1) {
+    LOG_FATAL("could not tell the bench we are ready");
+    return 1;
+  }
+  close(ready);
+
+  ScopedFd connection(accept(fd.Get(), NULL, NULL));
+  if (!connection.IsValid()) {
+    LOG_FATAL("could not accept connection: %s", strerror(errno));
+    return 1;
+  }
+
+  vector<char> buffer(BufferChunk::kPooledSize);
+  while (fd_read_once(connection.Get(), &buffer[0], buffer.size()) > 0)
+    ;
+  return 0;
+}
+
+// Forks a server running run, returns its pid once it is ready, or -1.
+// run is passed the fd to write to once clients can connect.
+pid_t StartServer(const function<int (int)>& run) {
+  int ready[2];
+  if (pipe(ready)) {
+    LOG_ERROR("could not create pipe: %s", strerror(errno));
+    return -1;
+  }
+
+  pid_t pid(fork());
+  if (pid < 0) {
+    LOG_ERROR("could not fork server: %s", strerror(errno));
+    close(ready[0]);
+    close(ready[1]);
+    return -1;
+  }
+  if (!pid) {
+    close(ready[0]);
+    _exit(run(ready[1]));
+  }
+
+  close(ready[1]);
+  char byte;
+  bool started(read(ready[0], &byte, 1) == 1);
+  close(ready[0]);
+  if (!started) {
+    LOG_ERROR("server did not start");
+    waitpid(pid, NULL, 0);
+    return -1;
+  }
+  return pid;
+}
+
+// What the stream bench saw.
+struct StreamStats {
+  StreamStats()
+      : written(0), acked(0), elapsed(0), samples(0), unsent(0),
+        max_unsent(0), rtt(0), max_rtt(0) {}
+
+  uint64_t written;
+  // Bytes written that the sink acknowledged.
+  uint64_t acked;
+  // In us.
+  uint64_t elapsed;
+
+  // Sampled along the way: bytes written but not sent yet by the kernel,
+  // and the rtt it measured, in us. Large queues at either end show as a
+  // large rtt.
+  uint64_t samples;
+  uint64_t unsent;
+  int max_unsent;
+  uint64_t rtt;
+  int max_rtt;
+};
+
+// Writes to server as fast as it can for seconds, on a connection with
+// the options of profile.
+bool RunStreamBench(const string& server, const TcpProfile* profile,
+                    int seconds, StreamStats* stats) {
+  auto_ptr<Sockaddr> address(Sockaddr::Parse(server, 1029));
+  if (!address.get()) {
+    LOG_ERROR("invalid server address: %s", server.c_str());
+    return false;
+  }
+
+  ScopedFd fd(socket(address->Family(), SOCK_STREAM, 0));
+  if (!fd.IsValid()) {
+    LOG_ERROR("could not create socket: %s", strerror(errno));
+    return false;
+  }
+  profile->ApplyToConnecting(fd.Get());
+  if (connect(fd.Get(), address->Data(), address->Size()) != 0) {
+    LOG_ERROR("could not connect to %s: %s", server.c_str(), strerror(errno));
+    return false;
+  }
+  fcntl(fd.Get(), F_SETFL, fcntl(fd.Get(), F_GETFL) | O_NONBLOCK);
+
+  vector<char> data(BufferChunk::kPooledSize, 'x');
+  uint64_t start(Timer().Microseconds());
+  uint64_t end(start + static_cast<uint64_t>(seconds) * 1000000);
+  uint64_t next_sample(start);
+  uint64_t now(start);
+  while (now < end) {
+    pollfd event = { fd.Get(), POLLOUT, 0 };
+    if (poll(&event, 1, 10) < 0 && errno != EINTR) {
+      LOG_ERROR("poll failed: %s", strerror(errno));
+      return false;
+    }
+
+    if (event.revents & (POLLERR | POLLHUP)) {
+      LOG_ERROR("connection to %s closed", server.c_str());
+      return false;
+    }
+    if (event.revents & POLLOUT) {
+      int written(write(fd.Get(), &data[0], data.size()));
+      if (written < 0 && errno != EAGAIN && errno != EINPROGRESS) {
+        LOG_ERROR("write failed: %s", strerror(errno));
+        return false;
+      }
+      if (written > 0)
+        stats->written += written;
+    }
+
+    now = Timer().Microseconds();
+    if (now < next_sample)
+      continue;
+    next_sample = now + 10000;
+
+    int unsent(0);
+    tcp_info info;
+    socklen_t size(sizeof(info));
+    if (ioctl(fd.Get(), SIOCOUTQNSD, &unsent) < 0 ||
+        getsockopt(fd.Get(), SOL_TCP, TCP_INFO, &info, &size) < 0)
+      continue;
+    ++stats->samples;
+    stats->unsent += unsent;
+    stats->max_unsent = max(stats->max_unsent, unsent);
+    stats->rtt += info.tcpi_rtt;
+    stats->max_rtt = max(stats->max_rtt, static_cast<int>(info.tcpi_rtt));
+  }
+
+  int unacked(0);
+  if (ioctl(fd.Get(), SIOCOUTQ, &unacked) < 0)
+    unacked = 0;
+  stats->acked = stats->written - unacked;
+  stats->elapsed = now - start;
+  return true;
+}
+
+}  // namespace
+
+UvpnBench::UvpnBench(ConfigParser* parser)
+    : mode_(
+          parser, Option::Default, "mode", "m", "handshakes",
+          "What to benchmark: 'handshakes', for the authentication path, "
+          "or 'stream', for the throughput of a tcp connection with the "
+          "options of --tcp-profile."),
+      server_(
+          parser, Option::Default, "server", "s", "",
+          "Address of the uvpn server to benchmark, as ip:port. If not "
+          "specified, a server is started on the --listen address, and "
+          "stopped once done. Unlike that one, uvpn-server keeps the "
+          "sessions of the clients, and grows as the bench runs."),
+      server_pid_(
+          parser, Option::Default, "server-pid", "P", "",
+          "Pid of the server specified with --server, if running on the "
+          "same machine, to report its cpu usage."),
+      listen_(
+          parser, Option::Default, "listen", "l", "127.0.0.1:11029",
+          "Address the server started by the bench listens on."),
+      clients_(
+          parser, Option::Default, "clients", "c", "16",
+          "Number of clients handshaking at the same time."),
+      handshakes_(
+          parser, Option::Default, "handshakes", "k", "1000",
+          "Total number of handshakes to perform. Each client closes its "
+          "session once authenticated, and the next handshake starts."),
+      resume_(
+          parser, Option::Default, "resume", "r", "no",
+          "If 'yes', clients resume the session of the previous client, "
+          "and only the first handshake goes through SRP."),
+      username_(
+          parser, Option::Default, "user", "u", "bench",
+          "User to log in as. The server started by the bench knows "
+          "only this user."),
+      password_(
+          parser, Option::Default, "password", "p", "bench",
+          "Password of the user."),
+      timeout_(
+          parser, Option::Default, "timeout", "T", "60",
+          "Seconds after which the bench gives up on pending handshakes."),
+      tcp_profile_(
+          parser, Option::Default, "tcp-profile", "o", "default",
+          "In stream mode, the tcp profile to benchmark, as passed to "
+          "uvpn-server and uvpn-client. When the bench starts the server, "
+          "it uses the profile as well. Otherwise, --server must accept "
+          "a connection and discard what it reads, like 'nc -l'."),
+      duration_(
+          parser, Option::Default, "duration", "d", "10",
+          "In stream mode, seconds to keep the connection busy for.") {
+}
+
+int UvpnBench::RunStream() {
+  const TcpProfile* profile(TcpProfile::Get(tcp_profile_.Get()));
+  if (!profile) {
+    LOG_FATAL("invalid --tcp-profile %s, known profiles are: %s",
+              tcp_profile_.Get().c_str(), TcpProfile::Names().c_str());
+    return 1;
+  }
+  int duration;
+  if (!FromString(duration_.Get(), &duration) || duration <= 0) {
+    LOG_FATAL("--duration must be a positive number");
+    return 1;
+  }
+
+  string server(server_.Get());
+  pid_t serverpid(-1);
+  bool forked(server.empty());
+  if (forked) {
+    server = listen_.Get();
+    serverpid = StartServer(bind(&RunStreamSink, server, profile,
+                                 placeholders::_1));
+    if (serverpid < 0)
+      return 1;
+  }
+
+  StreamStats stats;
+  int64_t clientcpu(ProcessCpuTime(getpid()));
+  bool done(RunStreamBench(server, profile, duration, &stats));
+  if (clientcpu >= 0)
+    clientcpu = ProcessCpuTime(getpid()) - clientcpu;
+
+  if (forked) {
+    kill(serverpid, SIGTERM);
+    waitpid(serverpid, NULL, 0);
+  }
+  if (!done || !stats.elapsed)
+    return 1;
+
+  printf("stream: %s profile, %.1f Mbit/s acknowledged, over %.3f s\n",
+         profile->Name(), stats.acked * 8.0 / stats.elapsed,
+         stats.elapsed / 1e6);
+  if (stats.samples) {
+    printf("unsent in kernel: avg %.1f KB, max %.1f KB\n",
+           stats.unsent / 1024.0 / stats.samples, stats.max_unsent / 1024.0);
+    printf("rtt: avg %.3f ms, max %.3f ms\n",
+           stats.rtt / 1e3 / stats.samples, stats.max_rtt / 1e3);
+  }
+  if (clientcpu >= 0 && stats.acked)
+    printf("client cpu: %.1f us/MB\n",
+           static_cast<double>(clientcpu) * (1 << 20) / stats.acked);
+  return 0;
+}
+
+int UvpnBench::Run() {
+  if (mode_.Get() == "stream")
+    return RunStream();
+  if (mode_.Get() != "handshakes") {
+    LOG_FATAL("invalid --mode %s, must be handshakes or stream",
+              mode_.Get().c_str());
+    return 1;
+  }
+
+  int clients, handshakes, timeout;
+  if (!FromString(clients_.Get(), &clients) || clients <= 0 ||
+      !FromString(handshakes_.Get(), &handshakes) || handshakes <= 0 ||
+      !FromString(timeout_.Get(), &timeout) || timeout <= 0) {
+    LOG_FATAL("--clients, --handshakes and --timeout must be positive numbers");
+    return 1;
+  }
+
+  // A socket per client, make room for all of them.
+  rlimit files;
+  if (!getrlimit(RLIMIT_NOFILE, &files)) {
+    files.rlim_cur = files.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &files);
+    if (files.rlim_cur != RLIM_INFINITY &&
+        static_cast<rlim_t>(clients) + 64 > files.rlim_cur) {
+      LOG_FATAL("%d clients need more than %d file descriptors",
+                clients, static_cast<int>(files.rlim_cur));
+      return 1;
+    }
+  }
+
+  // Before anything else: the server must not share any state with us.
+  string server(server_.Get());
+  pid_t serverpid(-1);
+  bool forked(server.empty());
+  if (forked) {
+    server = listen_.Get();
+    serverpid = StartServer(bind(&RunServer, server, username_.Get(),
+                                 password_.Get(), placeholders::_1));
+    if (serverpid < 0)
+      return 1;
+  } else if (!server_pid_.Get().empty() &&
+             !FromString(server_pid_.Get(), &serverpid)) {
+    LOG_FATAL("invalid --server-pid %s", server_pid_.Get().c_str());
+    return 1;
+  }
+
+  Dispatcher dispatcher;
+  if (!dispatcher.Init()) {
+    LOG_FATAL("could not initialize dispatcher");
+    return 1;
+  }
+  EventScheduler scheduler;
+  Prng* prng(DefaultPrng::ForThisThread());
+
+  // The manager owns what is registered with it.
+  ClientSimpleConnectionManager manager(prng, &dispatcher);
+  SrpClientAuthenticator* authenticator(new SrpClientAuthenticator(prng));
+  FixedUserChatter chatter(username_.Get(), password_.Get());
+  HandshakeBench bench(&dispatcher, &scheduler, &manager, authenticator,
+                       &chatter, server, clients, handshakes,
+                       resume_.Get() == "yes", timeout * 1000);
+
+  manager.RegisterTransport(new SocketTransport(&dispatcher));
+  manager.RegisterIOChannel(
+      new BenchClientChannel(&dispatcher, bench.ConnectedHandler()));
+  manager.RegisterTranscoder(new ClientUdpTranscoder());
+  manager.RegisterAuthenticator(authenticator);
+
+  int64_t servercpu(serverpid > 0 ? ProcessCpuTime(serverpid) : -1);
+  int64_t clientcpu(ProcessCpuTime(getpid()));
+  bench.Start();
+  dispatcher.Start(&scheduler);
+  if (servercpu >= 0)
+    servercpu = ProcessCpuTime(serverpid) - servercpu;
+  if (clientcpu >= 0)
+    clientcpu = ProcessCpuTime(getpid()) - clientcpu;
+
+  if (forked) {
+    kill(serverpid, SIGTERM);
+    waitpid(serverpid, NULL, 0);
+  }
+
+  const vector<uint64_t>& latencies(bench.Latencies());
+  int done(latencies.size());
+  printf("handshakes: %d done, %d failed, %d timed out, in %.3f s\n",
+         done, bench.Failed(), bench.Pending(), bench.Elapsed() / 1e6);
+  if (!done)
+    return 1;
+
+  printf("handshakes/s: %.1f, with %d clients, %s\n",
+         done * 1e6 / bench.Elapsed(), clients,
+         resume_.Get() == "yes" ? "resuming sessions" : "full srp");
+  printf("latency: p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+         latencies[done / 2] / 1e3, latencies[done * 99 / 100] / 1e3,
+         latencies[done - 1] / 1e3);
+  if (clientcpu >= 0)
+    printf("client cpu: %.1f us/handshake\n",
+           static_cast<double>(clientcpu) / done);
+  if (servercpu >= 0)
+    printf("server cpu: %.1f us/handshake\n",
+           static_cast<double>(servercpu) / done);
+  return 0;
+}
@@ -0,0 +1,72 @@
+// Copyright (c) 2008,2009,2010,2011 Mark Moreno (kramonerom@gmail.com).
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+//    1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+//    2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY Mark Moreno ''AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+// EVENT SHALL Mark Moreno OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// 
+// The views and conclusions contained in the software and documentation are
+// those of the authors and should not be interpreted as representing official
+// policies, either expressed or implied, of Mark Moreno.
+
+#ifndef UVPN_BENCH_H
+# define UVPN_BENCH_H
+
+# include "base.h"
+# include "yaarg.h"
+
+# include <string>
+
+// Load generator for the authentication path: runs many concurrent
+// clients through SRP, or resumption, against a server, and reports
+// handshake latency, handshakes per second and cpu per handshake.
+//
+// Clients use the real authenticator, connection manager and udp
+// transcoder, but no tun device: sessions are dropped as soon as they are
+// authenticated. Unless a server is given, one is forked and listens on
+// loopback, with the same components as uvpn-server, and a single user.
+//
+// In stream mode, measures instead what a tcp profile (see tcp-profile.h)
+// gives to tunnels carried over tcp: a single connection is kept full for
+// a while, reporting the throughput, and how much data was left queued
+// in the kernel, adding latency.
+class UvpnBench {
+ public:
+  UvpnBench(ConfigParser* parser);
+  int Run();
+
+ private:
+  int RunStream();
+
+  StringOption mode_;
+  StringOption server_;
+  StringOption server_pid_;
+  StringOption listen_;
+  StringOption clients_;
+  StringOption handshakes_;
+  StringOption resume_;
+  StringOption username_;
+  StringOption password_;
+  StringOption timeout_;
+  StringOption tcp_profile_;
+  StringOption duration_;
+};
+
+#endif /* UVPN_BENCH_H */
@@ -1,12 +1,19 @@
 #include "base.h"
 
 #include <string>
+#include <vector>
+
+#include <net/if.h>
 
 #include "dispatcher.h"
+#include "event-scheduler.h"
+#include "conversions.h"
+#include "stl-helpers.h"
 #include "interfaces.h"
 
 #include "tun-tap-client-channel.h"
 #include "socket-transport.h"
+#include "tcp-profile.h"
 #include "srp-client-authenticator.h"
 #include "client-simple-connection-manager.h"
 #include "terminal-user-chatter.h"
@@ -33,7 +40,53 @@ UvpnClient::UvpnClient(ConfigParser* parser)
           "to have a different name. With this option, you can specify "
           "the name of the uvpn instance to launch. You don't normally need "
           "to specify this option, but if you do, remember that you also need "
-          "to pass it to uvpn-ctl.") {
+          "to pass it to uvpn-ctl."),
+      coalesce_delay_(
+          parser, Option::Default, "coalesce-delay", "c", "100",
+          "Small packets read from the tunnel in a burst are packed "
+          "together, so they share the cost of encryption and of the "
+          "outer headers. This is how long, in microseconds, we may keep "
+          "reading packets before sending what we have. 0 disables "
+          "coalescing, leaving every packet to be sent on its own."),
+      tcp_profile_(
+          parser, Option::Default, "tcp-profile", "p", "default",
+          "Socket options for tunnels carried over tcp. 'default' only "
+          "disables Nagle, and leaves everything else to the kernel. "
+          "'bulk' uses large buffers, bbr and fast open, for throughput on "
+          "long fat links. 'interactive' keeps as little data queued in "
+          "the kernel as possible, and detects dead peers quickly."),
+      kernel_tls_(
+          parser, Option::Default, "kernel-tls", "k", "no",
+          "With 'yes', tunnels carried over tcp ask the server to hand "
+          "encryption to the kernel tls support once authenticated, "
+          "using keys derived from the session. Falls back to uvpn "
+          "encryption if either side's kernel lacks it."),
+      paths_(
+          parser, Option::Default, "paths", "m", "",
+          "Comma separated list of 'udp' and 'tcp' connections to open to "
+          "the server once authenticated, in addition to the first one. "
+          "Packets are spread over all of them, in proportion to how fast "
+          "they are, and move to the others when one stops working. "
+          "'udp@wlan0' or 'tcp@eth1' sends the connection out of that "
+          "network interface, whatever the routes say, to use links the "
+          "default route does not go through. Empty uses a single "
+          "connection."),
+      fec_(
+          parser, Option::Default, "fec", "f", "no",
+          "Number of packets sent over udp for which repairs are computed "
+          "and sent too, up to 64, so the server can rebuild the packets "
+          "lost without waiting for them to be sent again. Fewer packets "
+          "per block recover faster, at the cost of more repairs: how many "
+          "follows the loss the server measures. 'no' sends no repairs. "
+          "Needs a server that knows about repairs."),
+      hello_key_(
+          parser, Option::Default, "hello-key", "y", "",
+          "Key of the tag carried by the first datagram of udp "
+          "connections, as 32 hex digits, the same on clients and server. "
+          "The server silently drops datagrams without a valid tag: with a "
+          "key of your own, hosts not knowing it can't even tell uvpn is "
+          "listening. Empty uses the key built in uvpn, which anyone can "
+          "compute, and only keeps out traffic that is not uvpn.") {
 }
 
 void UvpnClient::Run() {
@@ -48,6 +101,13 @@ void UvpnClient::Run() {
 
   // Allows to open connections using the socket api.
   SocketTransport socket_api(&dispatcher);
+  const TcpProfile* profile(TcpProfile::Get(tcp_profile_.Get()));
+  if (!profile) {
+    LOG_FATAL("invalid --tcp-profile %s, known profiles are: %s",
+              tcp_profile_.Get().c_str(), TcpProfile::Names().c_str());
+    return;
+  }
+  socket_api.SetStreamProfile(profile);
   //SocksTransport socks_api(&dispatcher);
   //ProxyTransport proxy_api(&dispatcher);
   
@@ -65,7 +125,12 @@ void UvpnClient::Run() {
 
   // Initialize IO channels. Client IO channels wait for packets / requests
   // from the user, and forward them to the server.
-  TunTapClientChannel io_tuntap(&dispatcher, &config);
+  int coalesce_delay;
+  if (!FromString(coalesce_delay_.Get(), &coalesce_delay) || coalesce_delay < 0) {
+    LOG_FATAL("invalid --coalesce-delay %s", coalesce_delay_.Get().c_str());
+    return;
+  }
+  TunTapClientChannel io_tuntap(&dispatcher, &config, coalesce_delay);
   if (!io_tuntap.Init()) {
     LOG_FATAL("could not initialize tun tap handler");
     return;
@@ -73,16 +138,77 @@ void UvpnClient::Run() {
   //ProxyChannel io_proxy(&dispatcher, &socket_api);
   //ProxyChannel io_socks(&dispatcher, &socket_api);
 
-  DefaultPrng prng;
+  Prng* prng(DefaultPrng::ForThisThread());
+
+  string hello_key;
+  if (!HelloFilter::ParseKey(hello_key_.Get(), &hello_key)) {
+    LOG_FATAL("invalid --hello-key, expected %d hex digits",
+              HelloFilter::kKeySize * 2);
+    return;
+  }
 
-  ClientUdpTranscoder t_udp;
-  ClientTcpTranscoder t_tcp;
+  EventScheduler scheduler;
+  ClientUdpTranscoder t_udp(hello_key.empty() ? NULL : hello_key.data());
+  if (fec_.Get() != "no") {
+    int block_size;
+    if (!FromString(fec_.Get(), &block_size) || block_size < 1 ||
+        block_size > ReedSolomon::kMaxData) {
+      LOG_FATAL("invalid --fec %s", fec_.Get().c_str());
+      return;
+    }
+    t_udp.EnableFec(&scheduler, block_size);
+  }
+  ClientTcpTranscoder t_tcp(TcpFraming::Framed, kernel_tls_.Get() == "yes");
+
+  // Paths bound to a device each get their own transport.
+  vector<ClientTranscoder*> paths;
+  vector<Transport*> path_transports;
+  vector<SocketTransport*> device_transports;
+  StlAutoDeleteElements<vector<SocketTransport*> > device_transports_deleter(
+      &device_transports);
+  const string& names(paths_.Get());
+  for (string::size_type start(0), end; start < names.size(); start = end + 1) {
+    end = names.find(',', start);
+    if (end == string::npos)
+      end = names.size();
+
+    string name(names, start, end - start);
+    string device;
+    string::size_type at(name.find('@'));
+    if (at != string::npos) {
+      device = name.substr(at + 1);
+      name.resize(at);
+      if (device.empty() || device.size() >= IFNAMSIZ) {
+        LOG_FATAL("invalid --paths %s, bad interface name", names.c_str());
+        return;
+      }
+    }
+
+    if (name == "udp") {
+      paths.push_back(&t_udp);
+    } else if (name == "tcp") {
+      paths.push_back(&t_tcp);
+    } else {
+      LOG_FATAL("invalid --paths %s, can only list udp and tcp", names.c_str());
+      return;
+    }
+
+    if (device.empty()) {
+      path_transports.push_back(NULL);
+      continue;
+    }
+    SocketTransport* transport(new SocketTransport(&dispatcher));
+    transport->SetStreamProfile(profile);
+    transport->SetDevice(device);
+    device_transports.push_back(transport);
+    path_transports.push_back(transport);
+  }
 
   // Takes care of performing authentication.
   // We could have multiple, different, authenticator modules.
-  SrpClientAuthenticator a_srp(&prng);
+  SrpClientAuthenticator a_srp(prng);
 
-  ClientSimpleConnectionManager manager(&prng, &dispatcher);
+  ClientSimpleConnectionManager manager(prng, &dispatcher);
   controller.AddClient(&manager);
 
   manager.RegisterTransport(&socket_api);
@@ -98,10 +224,16 @@ void UvpnClient::Run() {
 
   manager.RegisterAuthenticator(&a_srp);
 
+  if (!paths.empty()) {
+    manager.EnableMultipath(&scheduler);
+    for (unsigned int i = 0; i < paths.size(); ++i)
+      manager.RegisterPathTranscoder(paths[i], path_transports[i]);
+  }
+
   // Initialize user chatter.
   TerminalUserChatter chatter;
 
   // Connect, and perform authentication.
   manager.AddConnection(server, &chatter);
-  dispatcher.Start();
+  dispatcher.Start(&scheduler);
 }
@@ -40,6 +40,12 @@ class UvpnClient {
  private:
   StringOption type_;
   StringOption name_;
+  StringOption coalesce_delay_;
+  StringOption tcp_profile_;
+  StringOption kernel_tls_;
+  StringOption paths_;
+  StringOption fec_;
+  StringOption hello_key_;
 };
 
 #endif /* UVPN_CLIENT_H */
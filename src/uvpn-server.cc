@@ -33,16 +33,25 @@
 
 #include "uvpn-server.h"
 #include "dispatcher.h"
+#include "conversions.h"
 
 #include "tun-tap-server-channel.h"
 #include "socket-transport.h"
+#include "tcp-profile.h"
 #include "srp-server-authenticator.h"
 #include "server-udp-transcoder.h"
+#include "handshake-admission.h"
+#include "session-ticket.h"
+#include "event-scheduler.h"
 #include "server-tcp-transcoder.h"
 #include "server-simple-connection-manager.h"
 #include "interfaces.h"
 #include "daemon-controller.h"
 #include "daemon-controller-server.h"
+#include "resident-userdb.h"
+#include "file-watcher.h"
+#include "user-lookup.h"
+#include "sockaddr.h"
 
 UvpnServer::UvpnServer(ConfigParser* parser)
     : type_(
@@ -60,7 +69,36 @@ UvpnServer::UvpnServer(ConfigParser* parser)
           "to have a different name. With this option, you can specify "
           "the name of the uvpn instance to launch. You don't normally need "
           "to specify this option, but if you do, remember that you also need "
-          "to pass it to uvpn-ctl.") {
+          "to pass it to uvpn-ctl."),
+      users_helper_(
+          parser, Option::Default, "users-helper", "u", "",
+          "By default, users are read from a local file, managed with "
+          "uvpn-user. With this option, users are instead looked up by "
+          "asking a helper process listening on the specified unix socket. "
+          "See user-lookup.h for the protocol spoken on the socket. "
+          "Results are cached for a few minutes."),
+      coalesce_delay_(
+          parser, Option::Default, "coalesce-delay", "c", "100",
+          "Small packets read from the tunnel in a burst are packed "
+          "together, so they share the cost of encryption and of the "
+          "outer headers. This is how long, in microseconds, we may keep "
+          "reading packets before sending what we have. 0 disables "
+          "coalescing, leaving every packet to be sent on its own."),
+      tcp_profile_(
+          parser, Option::Default, "tcp-profile", "p", "default",
+          "Socket options for tunnels carried over tcp. 'default' only "
+          "disables Nagle, and leaves everything else to the kernel. "
+          "'bulk' uses large buffers, bbr and fast open, for throughput on "
+          "long fat links. 'interactive' keeps as little data queued in "
+          "the kernel as possible, and detects dead peers quickly."),
+      hello_key_(
+          parser, Option::Default, "hello-key", "y", "",
+          "Key of the tag carried by the first datagram of udp "
+          "connections, as 32 hex digits, the same on clients and server. "
+          "The server silently drops datagrams without a valid tag: with a "
+          "key of your own, hosts not knowing it can't even tell uvpn is "
+          "listening. Empty uses the key built in uvpn, which anyone can "
+          "compute, and only keeps out traffic that is not uvpn.") {
 }
 
 int UvpnServer::Run() {
@@ -70,6 +108,13 @@ int UvpnServer::Run() {
     return 1;
   }
   SocketTransport socket_api(&dispatcher);
+  const TcpProfile* profile(TcpProfile::Get(tcp_profile_.Get()));
+  if (!profile) {
+    LOG_FATAL("invalid --tcp-profile %s, known profiles are: %s",
+              tcp_profile_.Get().c_str(), TcpProfile::Names().c_str());
+    return 1;
+  }
+  socket_api.SetStreamProfile(profile);
 
   // Initialize controller, so uvpn-ctl works.
   AcceptingChannel* channel = DaemonController::Listen(
@@ -81,12 +126,40 @@ int UvpnServer::Run() {
   DaemonControllerServer controller;
   controller.Listen(channel);
 
-  UdbSecretFile userdb("/root/uvpn.passwd");
+  // Users are kept in memory, and reloaded whenever uvpn-user changes them.
+  FileWatcher watcher(&dispatcher);
+  FileWatcher* userwatcher(&watcher);
+  if (!watcher.Init()) {
+    LOG_ERROR("could not initialize file watcher, changes to users will require a restart");
+    userwatcher = NULL;
+  }
+  ResidentUserDb userdb("/root/uvpn.passwd");
+  UserDbLookup dblookup(&userdb);
+  UserLookup* users(&dblookup);
+
+  // Users from an external store are cached, lookups are expensive.
+  auto_ptr<LocalSockaddr> helper;
+  auto_ptr<HelperUserLookup> helperlookup;
+  auto_ptr<CachingUserLookup> cachedlookup;
+  if (users_helper_.Get().empty()) {
+    if (!userdb.Load(userwatcher))
+      LOG_ERROR("could not load users, nobody will be able to login");
+  } else {
+    helper.reset(new LocalSockaddr(users_helper_.Get()));
+    helperlookup.reset(new HelperUserLookup(&socket_api, *helper));
+    cachedlookup.reset(new CachingUserLookup(helperlookup.get()));
+    users = cachedlookup.get();
+  }
   NetworkConfig netconfig;
 
   // Initialize IO channels. Server IO channels expect packets / requests
   // from the users, interpret them, and forward them.
-  TunTapServerChannel io_tuntap(&dispatcher, &netconfig);
+  int coalesce_delay;
+  if (!FromString(coalesce_delay_.Get(), &coalesce_delay) || coalesce_delay < 0) {
+    LOG_FATAL("invalid --coalesce-delay %s", coalesce_delay_.Get().c_str());
+    return 1;
+  }
+  TunTapServerChannel io_tuntap(&dispatcher, &netconfig, coalesce_delay);
   if (!io_tuntap.Init()) { // TODO: move this somewhere else?
     LOG_FATAL("could not initialize tun-tap-server-channel");
     return 1;
@@ -96,27 +169,44 @@ int UvpnServer::Run() {
   //SocksChannel io_socks(&dispatcher, &socket_api);
 
   // Initialize ConnectionManager.
-  DefaultPrng prng;
-  ServerSimpleConnectionManager manager(&prng, &dispatcher);
+  // The dispatcher thread gets its own prng, shared by all the components
+  // running on it.
+  Prng* prng(DefaultPrng::ForThisThread());
+  ServerSimpleConnectionManager manager(prng, &dispatcher);
   controller.AddServer(&manager);
 
   // Initialize authenticators.
-  SrpServerAuthenticator auth_srp(&userdb, &prng);
+  EventScheduler scheduler;
+  SessionTicketKeys tickets(prng);
+  tickets.Start(&scheduler);
+  SrpServerAuthenticator auth_srp(users, prng, &tickets);
   manager.RegisterIOChannel(&io_tuntap);
   //manager.RegisterIOChannel(&io_proxy);
   manager.RegisterAuthenticator(&auth_srp);
+  // Clients choose whether to use more than one connection.
+  manager.EnableMultipath(&scheduler);
 
   // Initialize transcoders.
+  string hello_key;
+  if (!HelloFilter::ParseKey(hello_key_.Get(), &hello_key)) {
+    LOG_FATAL("invalid --hello-key, expected %d hex digits",
+              HelloFilter::kKeySize * 2);
+    return 1;
+  }
   auto_ptr<Sockaddr> listen(Sockaddr::Parse("0.0.0.0", 1029));
+  HandshakeAdmission admission(prng);
   ServerUdpTranscoder t_udp(
-      &dispatcher, &socket_api, *listen, &manager);
+      &dispatcher, &socket_api, *listen, &manager, &admission,
+      hello_key.empty() ? NULL : hello_key.data());
+  // Clients choose whether to send repairs, and get some back if they do.
+  t_udp.EnableFec(&scheduler);
   ServerTcpTranscoder t_tcp(&socket_api, *listen, &manager);
 
   // TODO: both Start() can return errors. We should probably let the
   // manager handle starting the transcoders.
   t_udp.Start();
   t_tcp.Start();
-  dispatcher.Start();
+  dispatcher.Start(&scheduler);
 
   return 0;
 }
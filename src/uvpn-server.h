@@ -40,6 +40,10 @@ class UvpnServer {
  private:
   StringOption type_;
   StringOption name_;
+  StringOption users_helper_;
+  StringOption coalesce_delay_;
+  StringOption tcp_profile_;
+  StringOption hello_key_;
 };
 
 #endif /* UVPN_SERVER_H */
@@ -1,5 +1,6 @@
 #include "base.h"
 #include "userdb.h"
+#include "udb-binary.h"
 #include "errors.h"
 #include "terminal.h"
 #include "conversions.h"
@@ -9,6 +10,7 @@
 
 #include <string.h>
 #include <string>
+#include <memory>
 
 // TODO: move this in password.h and password.cc (in ScopedPassword).
 bool GetPassword(ScopedPassword* retval) {
@@ -128,6 +130,34 @@ bool GetUser(UserDb* udb, UserSecret* secret, int argc, char** argv) {
   return true;
 }
 
+// Converts the db into the binary format, which the server can mmap.
+// Writing to the same path as the db converts it in place.
+bool CompileUsers(UserDb* udb, int argc, char** argv) {
+  if (argc < 1) {
+    LOG_ERROR("no output file supplied (%d)", argc);
+    return false;
+  }
+  const string output(argv[0]);
+
+  UserDb::UserMap users;
+  {
+    UserDbSession session(udb);
+    if (!udb->GetAllUsers(&users)) {
+      LOG_ERROR("could not read users");
+      return false;
+    }
+  }
+
+  if (!UdbBinaryIndex::Write(output, users)) {
+    LOG_ERROR("could not write %s", output.c_str());
+    return false;
+  }
+
+  printf("%d users written to %s\n", static_cast<int>(users.size()),
+         output.c_str());
+  return true;
+}
+
 bool GenerateUser(UserDb* udb, int argc, char** argv) {
   return false;
 }
@@ -137,22 +167,31 @@ int main(int argc, char** argv) {
     LOG_FATAL("you must specify an argument (only %d specified)", argc);
   }
 
-  UdbSecretFile udb("/root/uvpn.passwd");
-  SecurePrimes primes;
+  // Binary dbs are created with "compile", and stay binary from then on.
+  const string dbname("/root/uvpn.passwd");
+  auto_ptr<UserDb> udbholder;
+  if (UdbBinaryIndex::IsBinary(dbname))
+    udbholder.reset(new UdbBinaryFile(dbname));
+  else
+    udbholder.reset(new UdbSecretFile(dbname));
+  UserDb* udb(udbholder.get());
+
   // FIXME: instead of "1" below, choose a key based on command line options.
-  SrpSecret secret(primes, 1);
+  SrpSecret secret(SecurePrimes::Shared(), 1);
 
   const char* command = argv[1];
   if (!strcmp(command, "add")) {
-    AddUser(&udb, &secret, argc - 2, argv + 2);
+    AddUser(udb, &secret, argc - 2, argv + 2);
   } else if (!strcmp(command, "del")) {
-    DelUser(&udb, argc - 2, argv + 2);
+    DelUser(udb, argc - 2, argv + 2);
   } else if (!strcmp(command, "change")) {
 //    ChangeUser(argc - 2, argv + 2);
   } else if (!strcmp(command, "generate")) {
 //    GenerateUser(argc - 2, argv + 2);
   } else if (!strcmp(command, "get")) {
-    GetUser(&udb, &secret, argc - 2, argv + 2);
+    GetUser(udb, &secret, argc - 2, argv + 2);
+  } else if (!strcmp(command, "compile")) {
+    CompileUsers(udb, argc - 2, argv + 2);
   } else {
     LOG_FATAL("unknown command %s", command);
   }
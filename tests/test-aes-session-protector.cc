@@ -38,3 +38,39 @@ TEST(AesSessionProtector, EncodeDecode) {
 
   EXPECT_EQ(string(data), string(decrypted.Output()->Data()));
 }
+
+TEST(AesSessionProtector, DeriveKey) {
+  DefaultPrng prng;
+
+  ScopedPassword secret(STRBUFFER("this is a high entropy secret"));
+
+  AesSessionKey keysend(&prng);
+  AesSessionKey keyrecv(&prng);
+  AesSessionKey keyother(&prng);
+
+  Buffer buffer;
+  keysend.SendSalt(buffer.Input());
+  string salt;
+  buffer.Output()->ConsumeString(&salt);
+
+  Buffer recvbuffer;
+  recvbuffer.Input()->Add(salt.data(), salt.size());
+  EXPECT_EQ(0, keyrecv.RecvSalt(recvbuffer.Output()));
+  Buffer otherbuffer;
+  otherbuffer.Input()->Add(salt.data(), salt.size());
+  EXPECT_EQ(0, keyother.RecvSalt(otherbuffer.Output()));
+
+  keysend.DeriveKey(secret, "transcript");
+  keyrecv.DeriveKey(secret, "transcript");
+  keyother.DeriveKey(secret, "another transcript");
+
+  EXPECT_EQ(0, memcmp(keysend.GetKey(), keyrecv.GetKey(),
+                      AesSessionKey::kKeyLengthInBytes));
+  EXPECT_NE(0, memcmp(keysend.GetKey(), keyother.GetKey(),
+                      AesSessionKey::kKeyLengthInBytes));
+
+  // Slow and fast derivation must not end up with the same key.
+  keyother.SetupKey(secret);
+  EXPECT_NE(0, memcmp(keysend.GetKey(), keyother.GetKey(),
+                      AesSessionKey::kKeyLengthInBytes));
+}
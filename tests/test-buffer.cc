@@ -245,3 +245,58 @@ TEST(BufferTest, ProduceConsumeProduceConsume) {
   EXPECT_EQ(data2, read);
   EXPECT_EQ(0, buffer.Output()->LeftSize());
 }
+
+TEST(BufferTest, ReservesLargeChunks) {
+  Buffer buffer;
+  buffer.Input()->Reserve(100, BufferChunk::kPooledSize);
+  EXPECT_EQ(static_cast<unsigned int>(BufferChunk::kPooledSize),
+            buffer.Input()->ContiguousSize());
+
+  // Enough room left, no new chunk.
+  buffer.Input()->Increment(1000);
+  buffer.Input()->Reserve(100, BufferChunk::kPooledSize);
+  EXPECT_EQ(static_cast<unsigned int>(BufferChunk::kPooledSize - 1000),
+            buffer.Input()->ContiguousSize());
+
+  // Freed chunks are handed out again.
+  const char* data;
+  {
+    Buffer freed;
+    freed.Input()->Reserve(100, BufferChunk::kPooledSize);
+    data = freed.Input()->Data();
+  }
+  Buffer reused;
+  reused.Input()->Reserve(100, BufferChunk::kPooledSize);
+  EXPECT_EQ(data, reused.Input()->Data());
+}
+
+TEST(BufferTest, LimitedCursors) {
+  Buffer buffer;
+  buffer.Input()->Add(string(20000, 'a'));
+  buffer.Input()->Reserve(20000);
+  buffer.Input()->Add(string(20000, 'b'));
+
+  // Limit past the end of the first chunk, consumed as data is read.
+  OutputCursor limited(*buffer.Output());
+  limited.Increment(10000);
+  limited.LimitLeftSize(15000);
+  EXPECT_EQ(15000u, limited.LeftSize());
+
+  OutputCursor::Iovec vect;
+  unsigned int count;
+  EXPECT_EQ(15000u, limited.GetIovec(&vect, &count));
+  EXPECT_EQ(2u, count);
+  EXPECT_EQ(5000u, vect[1].iov_len);
+
+  limited.Increment(limited.ContiguousSize());
+  EXPECT_EQ(5000u, limited.LeftSize());
+  EXPECT_EQ(5000u, limited.ContiguousSize());
+
+  char data[10000];
+  EXPECT_EQ(5000u, limited.Get(data, sizeof(data)));
+  EXPECT_EQ(5000u, limited.Consume(data, sizeof(data)));
+  EXPECT_EQ('b', data[4999]);
+  EXPECT_EQ(0u, limited.LeftSize());
+  EXPECT_EQ(0u, limited.ContiguousSize());
+  EXPECT_EQ(40000u, buffer.Output()->LeftSize());
+}
@@ -0,0 +1,169 @@
+#include "gtest.h"
+
+#include "src/compressing-session-protector.h"
+#include "src/serializers.h"
+#include "src/buffer.h"
+
+// Protectors doing nothing, to look at what the compressing ones produce.
+class CopyEncoder : public EncodeSessionProtector {
+ public:
+  bool Start(InputCursor* output, StartOptions options) { return true; }
+  bool End(InputCursor* output) { return true; }
+  bool Continue(OutputCursor* input, InputCursor* output) {
+    return EncodeToBuffer(input, output);
+  }
+  bool AddPadding(InputCursor* output, int datasize) { return true; }
+};
+
+class CopyDecoder : public DecodeSessionProtector {
+ public:
+  Result Start(OutputCursor* input, InputCursor* output,
+               StartOptions options) { return SUCCEEDED; }
+  Result End(InputCursor* output) { return SUCCEEDED; }
+  Result Continue(OutputCursor* input, InputCursor* output,
+                  uint32_t until) {
+    EncodeToBuffer(input, output);
+    return SUCCEEDED;
+  }
+  Result RemovePadding(OutputCursor* output, int datasize,
+                       uint8_t* padsize) {
+    *padsize = 0;
+    return SUCCEEDED;
+  }
+};
+
+// A sequence number followed by an IPv4 UDP packet from port, carrying
+// payload.
+static string MakeFrame(uint16_t port, const string& payload) {
+  string packet(28, '\0');
+  int size(packet.size() + payload.size());
+  packet[0] = 0x45;
+  packet[2] = static_cast<char>(size >> 8);
+  packet[3] = static_cast<char>(size & 0xff);
+  packet[9] = 17;
+  packet[12] = 10;
+  packet[16] = 10;
+  packet[19] = 1;
+  packet[20] = static_cast<char>(port >> 8);
+  packet[21] = static_cast<char>(port & 0xff);
+  return string(8, 's') + packet + payload;
+}
+
+static string RandomData(int size, uint32_t seed) {
+  string data(size, '\0');
+  for (int i = 0; i < size; ++i) {
+    seed = seed * 1103515245 + 12345;
+    data[i] = static_cast<char>(seed >> 16);
+  }
+  return data;
+}
+
+class CompressingSessionProtectorTest : public ::testing::Test {
+ protected:
+  CompressingSessionProtectorTest()
+      : encoder_(new CopyEncoder), decoder_(new CopyDecoder) {}
+
+  // Returns the size of the encoded frame, -1 if it could not be decoded
+  // back.
+  int EncodeDecode(const string& frame) {
+    Buffer input, encoded, decoded;
+    input.Input()->Add(frame);
+    EXPECT_TRUE(encoder_.Encode(input.Output(), encoded.Input()));
+    int size(encoded.Output()->LeftSize());
+    if (decoder_.Decode(encoded.Output(), decoded.Input()) !=
+        DecodeSessionProtector::SUCCEEDED)
+      return -1;
+
+    string result;
+    decoded.Output()->ConsumeString(&result);
+    EXPECT_EQ(frame, result);
+    return size;
+  }
+
+  DecodeSessionProtector::Result Decode(const string& frame) {
+    Buffer encoded, decoded;
+    encoded.Input()->Add(frame);
+    return decoder_.Decode(encoded.Output(), decoded.Input());
+  }
+
+  CompressingSessionEncoder encoder_;
+  CompressingSessionDecoder decoder_;
+};
+
+TEST_F(CompressingSessionProtectorTest, CompressesText) {
+  string text;
+  for (int i = 0; i < 40; ++i)
+    text.append("GET /index.html HTTP/1.1\r\nHost: example.com\r\n");
+  string frame(MakeFrame(80, text));
+
+  int size(EncodeDecode(frame));
+  EXPECT_LT(0, size);
+  EXPECT_GT(static_cast<int>(frame.size()) / 4, size);
+  EXPECT_EQ(1, encoder_.CompressedCount());
+  EXPECT_EQ(1, decoder_.CompressedCount());
+  EXPECT_EQ(frame.size(), encoder_.BytesIn());
+  EXPECT_EQ(static_cast<uint64_t>(size), encoder_.BytesOut());
+
+  // Too short to be worth it.
+  string small(MakeFrame(80, "hello"));
+  EXPECT_EQ(static_cast<int>(small.size()) + 1, EncodeDecode(small));
+  EXPECT_EQ(1, encoder_.CompressedCount());
+}
+
+TEST_F(CompressingSessionProtectorTest, BacksOffRandomFlows) {
+  // Random data is recognized from the sample, and sent as is.
+  string frame(MakeFrame(443, RandomData(1000, 1)));
+  EXPECT_EQ(static_cast<int>(frame.size()) + 1, EncodeDecode(frame));
+  EXPECT_EQ(1, encoder_.SampledOutCount());
+  EXPECT_EQ(0, encoder_.CompressedCount());
+
+  // The flow is left alone for a frame, then for two, four, ...
+  EncodeDecode(MakeFrame(443, RandomData(1000, 2)));
+  EXPECT_EQ(1, encoder_.SkippedCount());
+  EncodeDecode(MakeFrame(443, RandomData(1000, 3)));
+  EXPECT_EQ(2, encoder_.SampledOutCount());
+  EncodeDecode(MakeFrame(443, RandomData(1000, 4)));
+  EncodeDecode(MakeFrame(443, RandomData(1000, 5)));
+  EXPECT_EQ(3, encoder_.SkippedCount());
+  EXPECT_EQ(2, encoder_.SampledOutCount());
+
+  // Other flows are not affected.
+  string text(1000, 'a');
+  EXPECT_GT(100, EncodeDecode(MakeFrame(80, text)));
+  EXPECT_EQ(1, encoder_.CompressedCount());
+
+  // Text with a random tail passes the sample, but does not compress
+  // enough: the flow backs off anyway.
+  string mixed(MakeFrame(8080, RandomData(1000, 6) + string(64, 'a')));
+  EXPECT_EQ(static_cast<int>(mixed.size()) + 1, EncodeDecode(mixed));
+  EXPECT_EQ(1, encoder_.CompressedCount());
+  EncodeDecode(mixed);
+  EXPECT_EQ(4, encoder_.SkippedCount());
+  EXPECT_EQ(2, encoder_.SampledOutCount());
+}
+
+TEST_F(CompressingSessionProtectorTest, RejectsCorruptedFrames) {
+  EXPECT_EQ(DecodeSessionProtector::CORRUPTED_DATA, Decode(""));
+  EXPECT_EQ(DecodeSessionProtector::CORRUPTED_DATA, Decode("\x07" "data"));
+
+  // Claims to be 1000 bytes long, but there's not enough data.
+  Buffer frame;
+  EncodeToBuffer(CompressingSessionEncoder::kFrameLz4, frame.Input());
+  EncodeToBuffer(static_cast<uint16_t>(1000), frame.Input());
+  frame.Input()->Add(string(1, '\xf0'));
+  string encoded;
+  frame.Output()->ConsumeString(&encoded);
+  EXPECT_EQ(DecodeSessionProtector::CORRUPTED_DATA, Decode(encoded));
+  EXPECT_EQ(3, decoder_.CorruptedCount());
+}
+
+TEST_F(CompressingSessionProtectorTest, StreamsArePassedThrough) {
+  string text(1000, 'a');
+  Buffer input, encoded;
+  input.Input()->Add(text);
+  EXPECT_TRUE(encoder_.Start(encoded.Input(), SessionProtector::NoPadding));
+  EXPECT_TRUE(encoder_.Continue(input.Output(), encoded.Input()));
+  EXPECT_TRUE(encoder_.End(encoded.Input()));
+  EXPECT_EQ(1000, encoded.Output()->LeftSize());
+  EXPECT_EQ(0, encoder_.FrameCount());
+}
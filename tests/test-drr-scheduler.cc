@@ -0,0 +1,84 @@
+#include "gtest.h"
+
+#include "src/drr-scheduler.h"
+
+TEST(DrrScheduler, SingleFlowGetsTheWholeRound) {
+  DrrScheduler scheduler;
+  DrrScheduler::Flow flow(&scheduler);
+
+  EXPECT_EQ(0, static_cast<int>(flow.Turn(0)));
+  EXPECT_EQ(0, scheduler.ActiveFlows());
+
+  EXPECT_EQ(1000, static_cast<int>(flow.Turn(1000)));
+  EXPECT_EQ(1, scheduler.ActiveFlows());
+  flow.Sent(1000, 0);
+  EXPECT_EQ(0, scheduler.ActiveFlows());
+  EXPECT_EQ(0, static_cast<int>(flow.Deficit()));
+
+  unsigned int queued(3 * DrrScheduler::kRoundBytes);
+  EXPECT_EQ(DrrScheduler::kRoundBytes, flow.Turn(queued));
+  flow.Sent(DrrScheduler::kRoundBytes, queued - DrrScheduler::kRoundBytes);
+  EXPECT_EQ(1, scheduler.ActiveFlows());
+  EXPECT_EQ(1000 + DrrScheduler::kRoundBytes,
+            static_cast<unsigned int>(scheduler.SentBytes()));
+}
+
+TEST(DrrScheduler, SharesBytesFairly) {
+  DrrScheduler scheduler;
+  DrrScheduler::Flow bulk(&scheduler), small(&scheduler);
+
+  // A bulk flow with a lot queued, a flow with small messages trickling
+  // in: the small one is never starved, the bulk one gets the rest.
+  unsigned int bulk_queued(16 * DrrScheduler::kRoundBytes);
+  unsigned int bulk_sent(0), small_sent(0);
+  for (int round = 0; round < 8; ++round) {
+    unsigned int allowed(bulk.Turn(bulk_queued));
+    bulk_queued -= allowed;
+    bulk_sent += allowed;
+    bulk.Sent(allowed, bulk_queued);
+
+    allowed = small.Turn(100);
+    EXPECT_EQ(100, static_cast<int>(allowed));
+    small_sent += allowed;
+    small.Sent(allowed, 0);
+  }
+  EXPECT_EQ(800, static_cast<int>(small_sent));
+  EXPECT_LE(7 * DrrScheduler::kRoundBytes / 2, bulk_sent);
+
+  // Two bulk flows share each round.
+  DrrScheduler::Flow other(&scheduler);
+  EXPECT_EQ(DrrScheduler::kRoundBytes / 2, other.Turn(bulk_queued));
+  EXPECT_EQ(2, scheduler.ActiveFlows());
+  EXPECT_EQ(DrrScheduler::kRoundBytes / 2, scheduler.Quantum());
+}
+
+TEST(DrrScheduler, CapsDeficitOfBlockedFlows) {
+  DrrScheduler scheduler;
+  DrrScheduler::Flow blocked(&scheduler), other(&scheduler);
+  other.Turn(DrrScheduler::kRoundBytes * 4);
+
+  // The socket takes nothing: the deficit does not grow without bounds.
+  for (int round = 0; round < 10; ++round) {
+    EXPECT_GE(2 * scheduler.Quantum(),
+              blocked.Turn(DrrScheduler::kRoundBytes * 4));
+    blocked.Sent(0, DrrScheduler::kRoundBytes * 4);
+    EXPECT_GE(scheduler.Quantum(), blocked.Deficit());
+  }
+
+  // Less than a quantum left: partially sent, the rest is kept.
+  unsigned int allowed(blocked.Turn(DrrScheduler::kRoundBytes * 4));
+  blocked.Sent(allowed / 4, DrrScheduler::kRoundBytes * 4 - allowed / 4);
+  EXPECT_EQ(scheduler.Quantum(), blocked.Deficit());
+
+  // Many flows: each gets at least kMinQuantum.
+  DrrScheduler crowded;
+  vector<DrrScheduler::Flow*> flows;
+  for (int i = 0; i < 1000; ++i) {
+    flows.push_back(new DrrScheduler::Flow(&crowded));
+    flows.back()->Turn(1 << 20);
+  }
+  EXPECT_EQ(DrrScheduler::kMinQuantum, crowded.Quantum());
+  for (unsigned int i = 0; i < flows.size(); ++i)
+    delete flows[i];
+  EXPECT_EQ(0, crowded.ActiveFlows());
+}
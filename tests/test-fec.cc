@@ -0,0 +1,216 @@
+#include "gtest.h"
+
+#include "src/fec.h"
+#include "src/buffer.h"
+#include "src/serializers.h"
+
+#include <stdlib.h>
+
+TEST(Gf256, Arithmetic) {
+  for (int i = 1; i < 256; ++i) {
+    uint8_t value(static_cast<uint8_t>(i));
+    EXPECT_EQ(1, Gf256::Multiply(value, Gf256::Inverse(value)));
+    EXPECT_EQ(value, Gf256::Multiply(value, 1));
+    EXPECT_EQ(0, Gf256::Multiply(value, 0));
+  }
+  // x^8 = x^4 + x^3 + x^2 + 1.
+  EXPECT_EQ(0x1d, Gf256::Multiply(0x80, 0x02));
+  EXPECT_EQ(Gf256::Multiply(0x53, 0xca), Gf256::Multiply(0xca, 0x53));
+}
+
+TEST(Gf256, MultiplyAddMatchesScalar) {
+  // Odd size, so both the vector loop and its tail are exercised.
+  const unsigned int size(16 * 7 + 5);
+  uint8_t source[size], vector[size], scalar[size];
+  srandom(1);
+  for (int factor = 0; factor < 256; ++factor) {
+    for (unsigned int i = 0; i < size; ++i) {
+      source[i] = static_cast<uint8_t>(random());
+      vector[i] = scalar[i] = static_cast<uint8_t>(random());
+    }
+    Gf256::MultiplyAdd(static_cast<uint8_t>(factor), source, vector, size);
+    Gf256::MultiplyAddScalar(static_cast<uint8_t>(factor), source, scalar, size);
+    ASSERT_EQ(0, memcmp(vector, scalar, size)) << "factor " << factor;
+  }
+}
+
+TEST(ReedSolomon, RecoversErasures) {
+  srandom(2);
+  for (int round = 0; round < 50; ++round) {
+    int count(1 + random() % ReedSolomon::kMaxData);
+    int repair_count(1 + random() % ReedSolomon::kMaxRepair);
+    vector<string> symbols(count);
+    vector<const string*> data(count);
+    for (int i = 0; i < count; ++i) {
+      for (int j = 0; j < 40; ++j)
+        symbols[i].push_back(static_cast<char>(random()));
+      data[i] = &symbols[i];
+    }
+
+    vector<string> repairs(ReedSolomon::kMaxRepair);
+    for (int i = 0; i < ReedSolomon::kMaxRepair; ++i)
+      ReedSolomon::Encode(data, i, &repairs[i]);
+
+    // Loses up to repair_count data symbols, and uses repair_count repairs
+    // picked at random.
+    vector<int> lost;
+    for (int i = 0; i < repair_count && i < count; ++i) {
+      int index(random() % count);
+      if (data[index]) {
+        data[index] = NULL;
+        lost.push_back(index);
+      }
+    }
+    sort(lost.begin(), lost.end());
+
+    vector<const string*> available;
+    vector<int> indexes;
+    for (int i = 0; i < ReedSolomon::kMaxRepair &&
+         static_cast<int>(indexes.size()) < repair_count; ++i) {
+      if (random() % 2 || ReedSolomon::kMaxRepair - i <=
+          repair_count - static_cast<int>(indexes.size())) {
+        available.push_back(&repairs[i]);
+        indexes.push_back(i);
+      }
+    }
+
+    vector<string> recovered;
+    ASSERT_TRUE(ReedSolomon::Decode(data, available, indexes, &recovered));
+    ASSERT_EQ(lost.size(), recovered.size());
+    for (unsigned int i = 0; i < lost.size(); ++i)
+      EXPECT_TRUE(symbols[lost[i]] == recovered[i]);
+  }
+
+  // Not enough repairs.
+  vector<string> symbols(3, string(10, 'x'));
+  vector<const string*> data(3);
+  for (int i = 0; i < 3; ++i)
+    data[i] = &symbols[i];
+  string repair;
+  ReedSolomon::Encode(data, 0, &repair);
+  data[1] = data[2] = NULL;
+  vector<const string*> available(1, &repair);
+  vector<int> indexes(1, 0);
+  vector<string> recovered;
+  EXPECT_FALSE(ReedSolomon::Decode(data, available, indexes, &recovered));
+}
+
+// A message as FecDecoder returns it, sequence number included.
+static string Message(uint64_t sequence, const string& payload) {
+  Buffer message;
+  EncodeToBuffer(sequence, message.Input());
+  message.Input()->Add(payload);
+  string result;
+  message.Output()->ConsumeString(&result);
+  return result;
+}
+
+static void Deliver(FecDecoder* decoder, const string& repair,
+                    vector<string>* recovered) {
+  Buffer message;
+  message.Input()->Add(repair);
+  uint64_t first;
+  ASSERT_EQ(0, DecodeFromBuffer(message.Output(), &first));
+  ASSERT_TRUE(first & FecEncoder::kRepairFlag);
+  EXPECT_TRUE(decoder->HandleRepair(
+      first & ~FecEncoder::kRepairFlag, message.Output(), recovered));
+}
+
+TEST(Fec, RecoversLostMessages) {
+  FecEncoder encoder(8);
+  FecDecoder decoder;
+  encoder.SetPeerLoss(250);
+  EXPECT_EQ(4, encoder.RepairCount(8));
+
+  // A first block makes the decoder start holding messages.
+  vector<string> repairs, recovered;
+  for (uint64_t sequence = 100; sequence < 108; ++sequence) {
+    Buffer payload;
+    payload.Input()->Add(string(sequence % 20, 'a'));
+    EXPECT_EQ(sequence == 107, encoder.Add(sequence, *payload.Output(), 0));
+    decoder.Add(sequence, *payload.Output());
+  }
+  encoder.Close(0, &repairs);
+  ASSERT_EQ(4, static_cast<int>(repairs.size()));
+  Deliver(&decoder, repairs[0], &recovered);
+  EXPECT_TRUE(recovered.empty());
+  EXPECT_TRUE(decoder.SeenRepairs());
+  EXPECT_EQ(8, decoder.PeerBlockSize());
+
+  // Three messages of various sizes lost, out of a block closed early.
+  repairs.clear();
+  for (uint64_t sequence = 108; sequence < 114; ++sequence) {
+    Buffer payload;
+    payload.Input()->Add(string(sequence * 7 % 50, 'b' + sequence % 20));
+    EXPECT_FALSE(encoder.Add(sequence, *payload.Output(), 0));
+    if (sequence != 109 && sequence != 110 && sequence != 113)
+      decoder.Add(sequence, *payload.Output());
+  }
+  EXPECT_FALSE(encoder.Expired(FecEncoder::kMaxBlockDelay - 1));
+  EXPECT_TRUE(encoder.Expired(FecEncoder::kMaxBlockDelay));
+  encoder.Close(123, &repairs);
+  EXPECT_FALSE(encoder.Pending());
+  ASSERT_EQ(3, static_cast<int>(repairs.size()));
+
+  Deliver(&decoder, repairs[2], &recovered);
+  Deliver(&decoder, repairs[0], &recovered);
+  EXPECT_TRUE(recovered.empty());
+  Deliver(&decoder, repairs[1], &recovered);
+  EXPECT_EQ(123, static_cast<int>(decoder.PeerLoss()));
+  ASSERT_EQ(3, static_cast<int>(recovered.size()));
+  EXPECT_TRUE(recovered[0] == Message(109, string(109 * 7 % 50, 'b' + 109 % 20)));
+  EXPECT_TRUE(recovered[1] == Message(110, string(110 * 7 % 50, 'b' + 110 % 20)));
+  EXPECT_TRUE(recovered[2] == Message(113, string(113 * 7 % 50, 'b' + 113 % 20)));
+  EXPECT_EQ(3, static_cast<int>(decoder.RecoveredCount()));
+  // A block closed early doesn't tell the block size.
+  EXPECT_EQ(8, decoder.PeerBlockSize());
+
+  // Once done, more repairs for the block don't recover anything again.
+  recovered.clear();
+  Deliver(&decoder, repairs[1], &recovered);
+  EXPECT_TRUE(recovered.empty());
+
+  // Malformed repairs are rejected.
+  Buffer truncated;
+  truncated.Input()->Add(string(2, '\x01'));
+  EXPECT_FALSE(decoder.HandleRepair(200, truncated.Output(), &recovered));
+}
+
+TEST(Fec, MeasuresLossAndAdapts) {
+  FecDecoder decoder;
+  Buffer payload;
+  payload.Input()->Add("x");
+
+  // One message out of 10 lost.
+  for (uint64_t sequence = 0; sequence < 10000; ++sequence) {
+    if (sequence % 10 != 5)
+      decoder.Add(sequence, *payload.Output());
+  }
+  EXPECT_LT(80, static_cast<int>(decoder.Loss()));
+  EXPECT_GT(120, static_cast<int>(decoder.Loss()));
+
+  // Redundancy follows the loss the peer reports.
+  FecEncoder encoder(FecEncoder::kDefaultBlockSize);
+  EXPECT_EQ(1, encoder.RepairCount(16));
+  encoder.SetPeerLoss(decoder.Loss());
+  EXPECT_LE(3, encoder.RepairCount(16));
+  EXPECT_GE(4, encoder.RepairCount(16));
+  encoder.SetPeerLoss(1000);
+  EXPECT_EQ(ReedSolomon::kMaxRepair, encoder.RepairCount(64));
+  EXPECT_EQ(2, encoder.RepairCount(2));
+
+  // Gaps in the sequence start a new block.
+  EXPECT_FALSE(encoder.Add(10, *payload.Output(), 0));
+  EXPECT_FALSE(encoder.Add(12, *payload.Output(), 0));
+  vector<string> repairs;
+  encoder.Close(0, &repairs);
+  ASSERT_EQ(1, static_cast<int>(repairs.size()));
+  Buffer repair;
+  repair.Input()->Add(repairs[0]);
+  uint64_t first;
+  uint8_t count;
+  EXPECT_EQ(0, DecodeFromBuffer(repair.Output(), &first));
+  EXPECT_EQ(0, DecodeFromBuffer(repair.Output(), &count));
+  EXPECT_EQ(12 | FecEncoder::kRepairFlag, first);
+  EXPECT_EQ(1, static_cast<int>(count));
+}
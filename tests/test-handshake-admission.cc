@@ -0,0 +1,176 @@
+#include "gtest.h"
+
+#include "src/handshake-admission.h"
+#include "src/sockaddr.h"
+#include "src/buffer.h"
+#include "src/prng.h"
+
+#include <memory>
+
+static HandshakeAdmission::Verdict CheckFrom(
+    HandshakeAdmission* admission, const char* address,
+    Timer::ms_timer_t now, HandshakeAdmission::ticket_t* ticket = NULL,
+    Buffer* challenge = NULL) {
+  auto_ptr<Sockaddr> sockaddr(Sockaddr::Parse(address, 1029));
+  Buffer packet;
+  packet.Input()->Add("hello, this is a hello");
+
+  HandshakeAdmission::ticket_t unused;
+  Buffer unused_challenge;
+  return admission->Check(
+      *sockaddr, packet.Output(), now, ticket ? ticket : &unused,
+      challenge ? challenge->Input() : unused_challenge.Input());
+}
+
+TEST(HandshakeAdmission, RateLimitsPrefixes) {
+  DefaultPrng prng;
+  HandshakeAdmission admission(&prng);
+  Timer::ms_timer_t now(Timer().Milliseconds());
+
+  // Different hosts in the same /24 share the same bucket.
+  HandshakeAdmission::ticket_t ticket;
+  for (uint32_t i = 0; i < HandshakeAdmission::kPrefixBurst; ++i) {
+    string address("10.0.0." + ToString(i + 1));
+    EXPECT_EQ(HandshakeAdmission::Admit,
+              CheckFrom(&admission, address.c_str(), now, &ticket));
+    admission.Release(ticket);
+  }
+  EXPECT_EQ(HandshakeAdmission::Drop,
+            CheckFrom(&admission, "10.0.0.200", now));
+  EXPECT_EQ(1, admission.DroppedCount());
+
+  // Others are not affected.
+  EXPECT_EQ(HandshakeAdmission::Admit,
+            CheckFrom(&admission, "10.0.1.1", now));
+  EXPECT_EQ(HandshakeAdmission::Admit,
+            CheckFrom(&admission, "2001:db8::1", now));
+
+  // Tokens come back with time.
+  now += 1000 / HandshakeAdmission::kPrefixRate;
+  EXPECT_EQ(HandshakeAdmission::Admit,
+            CheckFrom(&admission, "10.0.0.200", now));
+  EXPECT_EQ(HandshakeAdmission::Drop,
+            CheckFrom(&admission, "10.0.0.200", now));
+}
+
+TEST(HandshakeAdmission, IPv6Prefixes) {
+  DefaultPrng prng;
+  HandshakeAdmission admission(&prng);
+  Timer::ms_timer_t now(Timer().Milliseconds());
+
+  HandshakeAdmission::ticket_t ticket;
+  for (uint32_t i = 0; i < HandshakeAdmission::kPrefixBurst; ++i) {
+    // Same /56, different /64s.
+    string address("2001:db8:0:" + ToString(i) + "::1");
+    EXPECT_EQ(HandshakeAdmission::Admit,
+              CheckFrom(&admission, address.c_str(), now, &ticket));
+    admission.Release(ticket);
+  }
+  EXPECT_EQ(HandshakeAdmission::Drop,
+            CheckFrom(&admission, "2001:db8:0:ff::1", now));
+  EXPECT_EQ(HandshakeAdmission::Admit,
+            CheckFrom(&admission, "2001:db8:0:100::1", now));
+}
+
+TEST(HandshakeAdmission, PendingExpireAndRelease) {
+  DefaultPrng prng;
+  HandshakeAdmission admission(&prng);
+  Timer::ms_timer_t now(Timer().Milliseconds());
+
+  HandshakeAdmission::ticket_t first;
+  EXPECT_EQ(HandshakeAdmission::Admit,
+            CheckFrom(&admission, "10.1.0.1", now, &first));
+  HandshakeAdmission::ticket_t second;
+  EXPECT_EQ(HandshakeAdmission::Admit,
+            CheckFrom(&admission, "10.2.0.1", now + 10, &second));
+  EXPECT_EQ(2, admission.Pending());
+
+  admission.Release(second);
+  EXPECT_EQ(1, admission.Pending());
+  admission.Release(second);
+  EXPECT_EQ(1, admission.Pending());
+
+  // The first one times out.
+  EXPECT_EQ(HandshakeAdmission::Admit,
+            CheckFrom(&admission, "10.3.0.1", now +
+                      HandshakeAdmission::kHandshakeTimeout));
+  EXPECT_EQ(1, admission.Pending());
+  admission.Release(first);
+  EXPECT_EQ(1, admission.Pending());
+}
+
+TEST(HandshakeAdmission, ChallengeUnderLoad) {
+  DefaultPrng prng;
+  HandshakeAdmission admission(&prng);
+  Timer::ms_timer_t now(Timer().Milliseconds());
+
+  // Each handshake from a different /24, not to hit the rate limits.
+  for (int i = 0; i < HandshakeAdmission::kChallengeThreshold; ++i) {
+    string address("10." + ToString(i) + ".0.1");
+    EXPECT_EQ(HandshakeAdmission::Admit,
+              CheckFrom(&admission, address.c_str(), now));
+  }
+
+  Buffer challenge;
+  EXPECT_EQ(HandshakeAdmission::Challenge,
+            CheckFrom(&admission, "192.168.0.1", now, NULL, &challenge));
+  EXPECT_EQ(1, admission.ChallengedCount());
+
+  string cookie;
+  ASSERT_TRUE(HandshakeAdmission::ParseChallenge(*challenge.Output(), &cookie));
+  EXPECT_EQ(HandshakeAdmission::kCookieSize, cookie.size());
+
+  // The cookie is only good for the address it was sent to.
+  auto_ptr<Sockaddr> client(Sockaddr::Parse("192.168.0.1", 1029));
+  auto_ptr<Sockaddr> other(Sockaddr::Parse("192.168.0.1", 1030));
+  {
+    Buffer hello;
+    HandshakeAdmission::AddCookie(cookie, hello.Input());
+    hello.Input()->Add("hello");
+
+    HandshakeAdmission::ticket_t ticket;
+    EXPECT_EQ(HandshakeAdmission::Drop, admission.Check(
+        *other, hello.Output(), now, &ticket, challenge.Input()));
+    EXPECT_EQ(HandshakeAdmission::kNoTicket, ticket);
+
+    EXPECT_EQ(HandshakeAdmission::Admit, admission.Check(
+        *client, hello.Output(), now, &ticket, challenge.Input()));
+    EXPECT_NE(HandshakeAdmission::kNoTicket, ticket);
+
+    // The cookie has been stripped.
+    string left;
+    hello.Output()->ConsumeString(&left);
+    EXPECT_EQ("hello", left);
+  }
+
+  // Cookies survive one rotation of the secret, but not two.
+  for (int rotations = 1; rotations <= 2; ++rotations) {
+    now += HandshakeAdmission::kCookieLifetime;
+
+    Buffer hello;
+    HandshakeAdmission::AddCookie(cookie, hello.Input());
+    hello.Input()->Add("hello");
+
+    HandshakeAdmission::ticket_t ticket;
+    EXPECT_EQ(rotations == 1 ? HandshakeAdmission::Admit :
+                  HandshakeAdmission::Drop,
+              admission.Check(*client, hello.Output(), now, &ticket,
+                              challenge.Input()));
+  }
+}
+
+TEST(HandshakeAdmission, ParseChallenge) {
+  string cookie;
+  Buffer packet;
+  packet.Input()->Add(HandshakeAdmission::kMagic,
+                      HandshakeAdmission::kMagicSize);
+  EXPECT_FALSE(HandshakeAdmission::ParseChallenge(*packet.Output(), &cookie));
+
+  packet.Input()->Add(string(HandshakeAdmission::kCookieSize, 'x'));
+  EXPECT_TRUE(HandshakeAdmission::ParseChallenge(*packet.Output(), &cookie));
+  EXPECT_EQ(string(HandshakeAdmission::kCookieSize, 'x'), cookie);
+
+  // Anything longer is not a challenge.
+  packet.Input()->Add("x", 1);
+  EXPECT_FALSE(HandshakeAdmission::ParseChallenge(*packet.Output(), &cookie));
+}
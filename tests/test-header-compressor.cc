@@ -0,0 +1,207 @@
+#include "gtest.h"
+
+#include "src/header-compressor.h"
+#include "src/buffer.h"
+
+static void Put16(string* packet, int offset, uint16_t value) {
+  (*packet)[offset] = static_cast<char>(value >> 8);
+  (*packet)[offset + 1] = static_cast<char>(value & 0xff);
+}
+
+static void Put32(string* packet, int offset, uint32_t value) {
+  Put16(packet, offset, value >> 16);
+  Put16(packet, offset + 2, value & 0xffff);
+}
+
+static void SetIpv4Checksum(string* packet) {
+  uint32_t sum(0);
+  for (int i = 0; i < 20; i += 2)
+    sum += (static_cast<unsigned char>((*packet)[i]) << 8) |
+        static_cast<unsigned char>((*packet)[i + 1]);
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+  Put16(packet, 10, ~sum);
+}
+
+// IPv4 TCP packet, with a timestamp option.
+static string MakeTcp(uint16_t id, uint32_t seq, uint32_t ack,
+                      uint8_t flags, uint16_t window, uint32_t timestamp,
+                      const string& payload) {
+  string packet(20 + 32, '\0');
+  packet[0] = 0x45;
+  Put16(&packet, 2, packet.size() + payload.size());
+  Put16(&packet, 4, id);
+  packet[6] = 0x40;
+  packet[8] = 64;
+  packet[9] = 6;
+  Put32(&packet, 12, 0x0a000001);
+  Put32(&packet, 16, 0x0a000002);
+  SetIpv4Checksum(&packet);
+
+  Put16(&packet, 20, 40000);
+  Put16(&packet, 22, 80);
+  Put32(&packet, 24, seq);
+  Put32(&packet, 28, ack);
+  packet[32] = 8 << 4;
+  packet[33] = flags;
+  Put16(&packet, 34, window);
+  Put16(&packet, 36, seq ^ timestamp);
+  packet[40] = 1;
+  packet[41] = 1;
+  packet[42] = 8;
+  packet[43] = 10;
+  Put32(&packet, 44, timestamp);
+  Put32(&packet, 48, timestamp - 100);
+  return packet + payload;
+}
+
+// IPv6 UDP packet.
+static string MakeUdp6(uint16_t port, const string& payload) {
+  string packet(40 + 8, '\0');
+  packet[0] = 0x60;
+  Put16(&packet, 4, 8 + payload.size());
+  packet[6] = 17;
+  packet[7] = 64;
+  packet[8] = 0x20;
+  packet[24] = 0x20;
+  packet[39] = 1;
+  Put16(&packet, 40, 5353);
+  Put16(&packet, 42, port);
+  Put16(&packet, 44, 8 + payload.size());
+  Put16(&packet, 46, payload.size());
+  return packet + payload;
+}
+
+static string Compress(HeaderCompressor* compressor, const string& packet) {
+  Buffer input, output;
+  input.Input()->Add(packet);
+  compressor->Compress(input.Output(), output.Input());
+  EXPECT_EQ(0, static_cast<int>(input.Output()->LeftSize()));
+  string result;
+  output.Output()->ConsumeString(&result);
+  return result;
+}
+
+// Returns false if the packet was dropped, checks it is the original
+// otherwise.
+static bool Decompress(HeaderDecompressor* decompressor, const string& sent,
+                       const string& original) {
+  Buffer input, output;
+  input.Input()->Add(sent);
+  if (!decompressor->Decompress(input.Output(), output.Input())) {
+    EXPECT_EQ(0, static_cast<int>(output.Output()->LeftSize()));
+    return false;
+  }
+  string result;
+  output.Output()->ConsumeString(&result);
+  EXPECT_TRUE(original == result);
+  return true;
+}
+
+TEST(HeaderCompressor, CompressesTcpFlow) {
+  HeaderCompressor compressor;
+  HeaderDecompressor decompressor;
+  EXPECT_FALSE(decompressor.PeerCompresses());
+
+  string payload("GET / HTTP/1.1\r\n\r\n");
+  for (int i = 0; i < 100; ++i) {
+    string packet(MakeTcp(1000 + i, 5000 + i * payload.size(), 7777,
+                          i % 2 ? 0x18 : 0x10, 512, 100000 + i, payload));
+    string sent(Compress(&compressor, packet));
+    if (i < HeaderCompressor::kIrRepeats) {
+      EXPECT_EQ(HeaderCompressor::kPacketIr, static_cast<uint8_t>(sent[0]));
+      EXPECT_EQ(packet.size() + 2, sent.size());
+    } else {
+      EXPECT_EQ(HeaderCompressor::kPacketCompressed,
+                static_cast<uint8_t>(sent[0]));
+      // Type, context, check, fields, id, seq, ack, flags, options,
+      // checksum; the window is left out after a while.
+      int header(4 + 1 + 2 + 2 + 1 + 12 + 2);
+      if (i < HeaderCompressor::kWindow)
+        header += 2;
+      EXPECT_EQ(header + payload.size(), sent.size()) << "packet " << i;
+    }
+    EXPECT_TRUE(Decompress(&decompressor, sent, packet));
+  }
+  EXPECT_TRUE(decompressor.PeerCompresses());
+  EXPECT_EQ(97, static_cast<int>(compressor.CompressedCount()));
+  EXPECT_EQ(0, static_cast<int>(decompressor.DroppedCount()));
+  EXPECT_LT(compressor.HeaderBytesOut() * 2, compressor.HeaderBytesIn());
+}
+
+TEST(HeaderCompressor, SurvivesLosses) {
+  HeaderCompressor compressor;
+  HeaderDecompressor decompressor;
+
+  // Large segments: 16 lsb bits of the sequence number only cover 22 of
+  // them.
+  uint32_t seq(0xfffff000);
+  int dropped(0);
+  for (int i = 0; i < 3 * HeaderCompressor::kRefreshInterval; ++i) {
+    string packet(MakeTcp(i, seq, 1, 0x10, 512, i, ""));
+    seq += 1448;
+    string sent(Compress(&compressor, packet));
+
+    // Loses up to kWindow - 1 in a row, which should be harmless, and
+    // then, once, more than that.
+    int position(i % 40);
+    if (position >= 5 && position < 5 + HeaderCompressor::kWindow - 1)
+      continue;
+    if (i >= 300 && i < 340)
+      continue;
+
+    bool delivered(Decompress(&decompressor, sent, packet));
+    if (!delivered)
+      ++dropped;
+    // Recovers at the next refresh, at the latest.
+    if (i < 300 || i >= 2 * HeaderCompressor::kRefreshInterval)
+      EXPECT_TRUE(delivered) << "packet " << i;
+  }
+  EXPECT_LT(0, dropped);
+  EXPECT_EQ(dropped, static_cast<int>(decompressor.DroppedCount()));
+}
+
+TEST(HeaderCompressor, HandlesUdpAndOthers) {
+  HeaderCompressor compressor;
+  HeaderDecompressor decompressor;
+
+  // Two flows, in different contexts.
+  for (int i = 0; i < 10; ++i) {
+    for (int port = 53; port <= 54; ++port) {
+      string packet(MakeUdp6(port, string(i, 'x')));
+      string sent(Compress(&compressor, packet));
+      if (i >= HeaderCompressor::kIrRepeats)
+        EXPECT_EQ(4 + 2 + i, static_cast<int>(sent.size()));
+      EXPECT_TRUE(Decompress(&decompressor, sent, packet));
+    }
+  }
+
+  // Fragments, ICMP, and so on are sent as they are.
+  string fragment(MakeTcp(1, 2, 3, 0x10, 512, 4, "data"));
+  fragment[6] = 0x20;
+  EXPECT_TRUE(fragment == Compress(&compressor, fragment));
+  string icmp(MakeTcp(1, 2, 3, 0x10, 512, 4, "data"));
+  icmp[9] = 1;
+  EXPECT_TRUE(icmp == Compress(&compressor, icmp));
+  EXPECT_TRUE(Decompress(&decompressor, icmp, icmp));
+
+  // Garbage, unknown contexts, truncated packets.
+  HeaderDecompressor empty;
+  string tcp(MakeTcp(1, 2, 3, 0x10, 512, 4, "data"));
+  string compressed(Compress(&compressor, tcp));
+  compressed = Compress(&compressor, tcp);
+  compressed = Compress(&compressor, tcp);
+  compressed = Compress(&compressor, tcp);
+  EXPECT_EQ(HeaderCompressor::kPacketCompressed,
+            static_cast<uint8_t>(compressed[0]));
+  EXPECT_FALSE(Decompress(&empty, compressed, tcp));
+  EXPECT_FALSE(Decompress(&empty, "", ""));
+  EXPECT_FALSE(Decompress(&empty, "\x10garbage", ""));
+  EXPECT_FALSE(Decompress(&empty, string("\x20\x01", 2) + "garbage", ""));
+  EXPECT_FALSE(Decompress(&empty, string("\x30\xff", 2), ""));
+  EXPECT_EQ(5, static_cast<int>(empty.DroppedCount()));
+
+  string ir(string(1, HeaderCompressor::kPacketIr) + compressed[1] + tcp);
+  EXPECT_TRUE(Decompress(&empty, ir, tcp));
+  EXPECT_FALSE(Decompress(&empty, compressed.substr(0, 10), ""));
+}
@@ -0,0 +1,96 @@
+#include "gtest.h"
+
+#include "src/hello-filter.h"
+#include "src/buffer.h"
+#include "src/hash.h"
+
+TEST(SipHash24, ReferenceVectors) {
+  char key[16];
+  char message[64];
+  for (int i = 0; i < 16; ++i)
+    key[i] = static_cast<char>(i);
+  for (int i = 0; i < 64; ++i)
+    message[i] = static_cast<char>(i);
+
+  // From the appendix of the SipHash paper, and its reference code.
+  EXPECT_EQ(0x726fdb47dd0e0e31ULL, SipHash24(key, message, 0));
+  EXPECT_EQ(0x93f5f5799a932462ULL, SipHash24(key, message, 8));
+  EXPECT_EQ(0xa129ca6149be45e5ULL, SipHash24(key, message, 15));
+}
+
+TEST(HelloFilter, AcceptsTaggedHellos) {
+  HelloFilter client, server;
+  string hello("this is a hello long enough not to be fully covered");
+
+  Buffer packet;
+  client.AddHello(1029, hello, packet.Input());
+  EXPECT_EQ(HelloFilter::kTagSize + hello.size(),
+            packet.Output()->LeftSize());
+
+  EXPECT_TRUE(server.Check(1029, packet.Output()));
+  string received;
+  packet.Output()->ConsumeString(&received);
+  EXPECT_EQ(hello, received);
+  EXPECT_EQ(0, server.RejectedCount());
+
+  // Short hellos are covered completely.
+  Buffer shorter;
+  client.AddHello(1029, "hi", shorter.Input());
+  EXPECT_TRUE(server.Check(1029, shorter.Output()));
+}
+
+TEST(HelloFilter, RejectsGarbage) {
+  HelloFilter client, server;
+
+  Buffer empty;
+  EXPECT_FALSE(server.Check(1029, empty.Output()));
+  Buffer garbage;
+  garbage.Input()->Add("0123456789abcdef0123456789abcdef0123456789");
+  EXPECT_FALSE(server.Check(1029, garbage.Output()));
+  // Nothing is consumed from rejected packets.
+  EXPECT_EQ(42, garbage.Output()->LeftSize());
+
+  // Valid hello, but for a different connection id.
+  Buffer otherid;
+  client.AddHello(1029, "hello", otherid.Input());
+  EXPECT_FALSE(server.Check(1030, otherid.Output()));
+
+  // Valid hello, but tampered with.
+  Buffer tampered;
+  client.AddHello(1029, "hello", tampered.Input());
+  tampered.Input()->Add("!");
+  EXPECT_FALSE(server.Check(1029, tampered.Output()));
+
+  // Valid hello, but with a different key.
+  HelloFilter other("0123456789abcdef");
+  Buffer otherkey;
+  other.AddHello(1029, "hello", otherkey.Input());
+  EXPECT_FALSE(server.Check(1029, otherkey.Output()));
+
+  EXPECT_EQ(5, server.RejectedCount());
+}
+
+TEST(HelloFilter, ParsesKeys) {
+  string key;
+  EXPECT_TRUE(HelloFilter::ParseKey("", &key));
+  EXPECT_EQ("", key);
+
+  EXPECT_TRUE(HelloFilter::ParseKey("30313233343536373839616263646566", &key));
+  EXPECT_EQ("0123456789abcdef", key);
+  EXPECT_TRUE(HelloFilter::ParseKey("303132333435363738396162636465AF", &key));
+  EXPECT_EQ("0123456789abcde\xaf", key);
+
+  // Too short, too long, odd or not hex.
+  EXPECT_FALSE(HelloFilter::ParseKey("3031323334353637", &key));
+  EXPECT_FALSE(HelloFilter::ParseKey(
+      "3031323334353637383961626364656667", &key));
+  EXPECT_FALSE(HelloFilter::ParseKey("3031323334353637383961626364656", &key));
+  EXPECT_FALSE(HelloFilter::ParseKey("3031323334353637383961626364656g", &key));
+
+  // The key parsed is the one used.
+  EXPECT_TRUE(HelloFilter::ParseKey("30313233343536373839616263646566", &key));
+  HelloFilter client(key.data()), server("0123456789abcdef");
+  Buffer hello;
+  client.AddHello(1029, "hello", hello.Input());
+  EXPECT_TRUE(server.Check(1029, hello.Output()));
+}
@@ -0,0 +1,170 @@
+#include "gtest.h"
+
+#include "src/kernel-tls.h"
+#include "src/tcp-framing.h"
+#include "src/transport.h"
+#include "src/protector.h"
+#include "src/buffer.h"
+
+#include <string.h>
+
+// Records the keys installed, instead of talking to the kernel.
+class FakeChannel : public BoundChannel {
+ public:
+  explicit FakeChannel(bool supported) : supported_(supported) {}
+
+  virtual void Close() {}
+  virtual void WantWrite(const event_handler_t* callback) {}
+  virtual void WantRead(const event_handler_t* callback) {}
+  virtual io_result_e Write(OutputCursor* buffer) { return OK; }
+  virtual io_result_e Read(InputCursor* buffer) { return OK; }
+  virtual io_result_e ReadAtMost(InputCursor* buffer, unsigned int size) {
+    return OK;
+  }
+
+  virtual bool AttachKernelTls() { return supported_; }
+  virtual bool StartKernelTls(bool transmit, const char* material) {
+    (transmit ? transmit_ : receive_).assign(material, KernelTls::kMaterialSize);
+    return true;
+  }
+
+  bool supported_;
+  string transmit_;
+  string receive_;
+};
+
+// Derives keys from the label alone, like two peers sharing a secret.
+class FakeProtector : public SessionProtector {
+ public:
+  explicit FakeProtector(bool authenticated) : authenticated_(authenticated) {}
+
+  virtual bool ExportKey(const char* label, char* key, int size) const {
+    if (!authenticated_)
+      return false;
+    for (int i = 0; i < size; ++i)
+      key[i] = label[i % strlen(label)] + i;
+    return true;
+  }
+
+  bool authenticated_;
+};
+
+static uint32_t ConsumeControl(Buffer* stream) {
+  uint32_t control(0);
+  EXPECT_EQ(TcpFraming::Control, TcpFraming::PeekFrame(*stream->Output(), &control));
+  stream->Output()->Increment(sizeof(uint32_t));
+  return control;
+}
+
+TEST(KernelTls, SwitchesBothDirections) {
+  FakeChannel client_channel(true), server_channel(true);
+  FakeProtector authenticated(true), anonymous(false);
+  KernelTls client(KernelTls::Client), server(KernelTls::Server);
+  Buffer to_server, to_client;
+
+  client.Request(&client_channel, &to_server);
+  EXPECT_TRUE(client.ReadsFrameByFrame());
+  EXPECT_FALSE(client.SendsClear());
+  EXPECT_EQ(TcpFraming::kControlKernelTlsRequest, ConsumeControl(&to_server));
+  server.HandleRequest(&server_channel, &to_client);
+  EXPECT_EQ(0, static_cast<int>(to_client.Output()->LeftSize()));
+
+  // Nothing happens until the session is authenticated.
+  server.MaybeStart(anonymous, &to_client);
+  EXPECT_FALSE(server.SendsClear());
+  EXPECT_EQ(0, static_cast<int>(to_client.Output()->LeftSize()));
+
+  // Queued data goes out before the switch, encrypted by us.
+  to_client.Input()->Add("queued");
+  server.MaybeStart(authenticated, &to_client);
+  EXPECT_TRUE(server.SendsClear());
+  EXPECT_TRUE(server.ReadsFrameByFrame());
+  EXPECT_EQ(10, static_cast<int>(server.WriteLimit()));
+  EXPECT_TRUE(server.HandleWritten(&server_channel, 6));
+  EXPECT_TRUE(server_channel.transmit_.empty());
+  EXPECT_TRUE(server.HandleWritten(&server_channel, 4));
+  EXPECT_EQ(0, static_cast<int>(server.WriteLimit()));
+  EXPECT_FALSE(server_channel.transmit_.empty());
+
+  to_client.Output()->Increment(6);
+  EXPECT_EQ(TcpFraming::kControlKernelTlsStart, ConsumeControl(&to_client));
+  EXPECT_TRUE(client.HandleStart(&client_channel, &authenticated, &to_server));
+  EXPECT_TRUE(client.ReceivesClear());
+  EXPECT_TRUE(client.SendsClear());
+  EXPECT_TRUE(server_channel.transmit_ == client_channel.receive_);
+
+  EXPECT_TRUE(client.HandleWritten(&client_channel, 4));
+  EXPECT_EQ(TcpFraming::kControlKernelTlsStart, ConsumeControl(&to_server));
+  EXPECT_TRUE(server.HandleStart(&server_channel, NULL, &to_client));
+  EXPECT_TRUE(server.ReceivesClear());
+  EXPECT_TRUE(client_channel.transmit_ == server_channel.receive_);
+  EXPECT_FALSE(client_channel.transmit_ == client_channel.receive_);
+
+  // Once is enough.
+  EXPECT_FALSE(server.HandleStart(&server_channel, NULL, &to_client));
+}
+
+TEST(KernelTls, FallsBack) {
+  FakeChannel unsupported(false), supported(true);
+  FakeProtector authenticated(true);
+  KernelTls client(KernelTls::Client), server(KernelTls::Server);
+  Buffer to_server, to_client;
+
+  // Clients without kernel support don't ask.
+  client.Request(&unsupported, &to_server);
+  EXPECT_EQ(0, static_cast<int>(to_server.Output()->LeftSize()));
+  EXPECT_FALSE(client.ReadsFrameByFrame());
+
+  // Servers without it refuse.
+  client.Request(&supported, &to_server);
+  server.HandleRequest(&unsupported, &to_client);
+  EXPECT_EQ(TcpFraming::kControlKernelTlsRefuse, ConsumeControl(&to_client));
+  client.HandleRefuse();
+  EXPECT_FALSE(client.ReadsFrameByFrame());
+  EXPECT_FALSE(client.SendsClear());
+
+  server.MaybeStart(authenticated, &to_client);
+  EXPECT_FALSE(server.SendsClear());
+  EXPECT_EQ(0, static_cast<int>(to_client.Output()->LeftSize()));
+
+  // A start nobody asked for is an error.
+  KernelTls other(KernelTls::Client);
+  EXPECT_FALSE(other.HandleStart(&supported, &authenticated, &to_server));
+}
+
+// Starts kernel tls on the server side of a connection bound to binding,
+// returns the key it transmits with.
+static string ServerKey(uint32_t binding, const SessionProtector& protector) {
+  FakeChannel channel(true);
+  KernelTls server(KernelTls::Server);
+  server.Bind(binding);
+  Buffer to_client;
+  server.HandleRequest(&channel, &to_client);
+  server.MaybeStart(protector, &to_client);
+  EXPECT_TRUE(server.HandleWritten(&channel, 4));
+  return channel.transmit_;
+}
+
+TEST(KernelTls, BindsKeysToConnections) {
+  FakeProtector authenticated(true);
+
+  // Connections sharing a session only share keys if bound the same.
+  EXPECT_TRUE(ServerKey(0, authenticated) == ServerKey(0, authenticated));
+  EXPECT_FALSE(ServerKey(0, authenticated) == ServerKey(1, authenticated));
+  EXPECT_FALSE(ServerKey(1, authenticated) == ServerKey(2, authenticated));
+  EXPECT_TRUE(ServerKey(2, authenticated) == ServerKey(2, authenticated));
+
+  // Both peers agree on the keys of a bound connection.
+  FakeChannel client_channel(true), server_channel(true);
+  KernelTls client(KernelTls::Client), server(KernelTls::Server);
+  client.Bind(3);
+  server.Bind(3);
+  Buffer to_server, to_client;
+  client.Request(&client_channel, &to_server);
+  server.HandleRequest(&server_channel, &to_client);
+  server.MaybeStart(authenticated, &to_client);
+  EXPECT_TRUE(server.HandleWritten(&server_channel, 4));
+  EXPECT_TRUE(client.HandleStart(&client_channel, &authenticated, &to_server));
+  EXPECT_TRUE(server_channel.transmit_ == client_channel.receive_);
+  EXPECT_TRUE(ServerKey(3, authenticated) == client_channel.receive_);
+}
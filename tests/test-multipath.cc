@@ -0,0 +1,223 @@
+#include "gtest.h"
+
+#include "src/multipath.h"
+#include "src/protector.h"
+#include "src/buffer.h"
+
+#include <string.h>
+
+// Derives keys from the label, and from a secret shared by the peers.
+class FakeProtector : public SessionProtector {
+ public:
+  explicit FakeProtector(char secret) : secret_(secret) {}
+
+  virtual bool ExportKey(const char* label, char* key, int size) const {
+    for (int i = 0; i < size; ++i)
+      key[i] = label[i % strlen(label)] ^ secret_ ^ i;
+    return true;
+  }
+
+  char secret_;
+};
+
+// Sends a message with payload on path from sender to receiver, returns
+// the sequence number received.
+static uint32_t Send(Multipath* sender, int sent_on, Multipath* receiver,
+                     int received_on, Timer::ms_timer_t sent,
+                     Timer::ms_timer_t arrived, const string& payload) {
+  Buffer message;
+  sender->AddHeader(sent_on, payload.empty(), sent, message.Input());
+  EXPECT_EQ(Multipath::kHeaderSize,
+            static_cast<int>(message.Output()->LeftSize()));
+  message.Input()->Add(payload);
+  EXPECT_TRUE(Multipath::HasHeader(*message.Output()));
+
+  uint32_t sequence(0);
+  EXPECT_TRUE(receiver->HandleHeader(
+      received_on, arrived, message.Output(), &sequence));
+  string left;
+  message.Output()->ConsumeString(&left);
+  EXPECT_TRUE(payload == left);
+  return sequence;
+}
+
+TEST(Multipath, MeasuresAndSpreads) {
+  Multipath client, server;
+  int client_fast(client.AddPath(true, 0)), client_slow(client.AddPath(true, 0));
+  int server_fast(server.AddPath(true, 0)), server_slow(server.AddPath(true, 0));
+  EXPECT_EQ(2, client.ConfirmedPaths());
+
+  // 10 ms of rtt on the fast path, 80 ms on the slow one, both ways.
+  Timer::ms_timer_t now(1000);
+  for (int i = 0; i < 50; ++i, now += 100) {
+    Send(&client, client_fast, &server, server_fast, now, now + 5, "x");
+    Send(&server, server_fast, &client, client_fast, now + 5, now + 10, "y");
+    Send(&client, client_slow, &server, server_slow, now, now + 40, "x");
+    Send(&server, server_slow, &client, client_slow, now + 40, now + 80, "y");
+  }
+  EXPECT_EQ(10, static_cast<int>(client.Rtt(client_fast)));
+  EXPECT_EQ(80, static_cast<int>(client.Rtt(client_slow)));
+  EXPECT_EQ(0, static_cast<int>(client.Loss(client_fast)));
+  EXPECT_EQ(35, static_cast<int>(client.HoldTime()));
+
+  // 8 times as many messages go to the fast path, interleaved.
+  int fast(0);
+  for (int i = 0; i < 90; ++i) {
+    int path(client.Pick(now));
+    ASSERT_TRUE(path == client_fast || path == client_slow);
+    if (path == client_fast)
+      ++fast;
+  }
+  EXPECT_EQ(80, fast);
+}
+
+TEST(Multipath, FailsOverAndMeasuresLoss) {
+  Multipath client, server;
+  int first(client.AddPath(true, 0)), second(client.AddPath(true, 0));
+  int server_first(server.AddPath(true, 0)), server_second(server.AddPath(true, 0));
+
+  // Half the messages on the first path get lost.
+  Timer::ms_timer_t now(0);
+  for (int i = 0; i < 200; ++i, now += 10) {
+    Buffer lost;
+    if (i % 2)
+      client.AddHeader(first, false, now, lost.Input());
+    else
+      Send(&client, first, &server, server_first, now, now + 10, "x");
+    Send(&server, server_first, &client, first, now + 10, now + 20, "y");
+    Send(&client, second, &server, server_second, now, now + 10, "x");
+    Send(&server, server_second, &client, second, now + 10, now + 20, "y");
+  }
+  // The server tells the client what it received.
+  EXPECT_LT(400, static_cast<int>(client.Loss(first)));
+  EXPECT_GT(600, static_cast<int>(client.Loss(first)));
+  EXPECT_EQ(0, static_cast<int>(client.Loss(second)));
+  EXPECT_EQ(0, static_cast<int>(server.Loss(server_first)));
+
+  // The second path goes silent: after kMinDeadTime, only the first is
+  // used, and the second gets an occasional probe.
+  Timer::ms_timer_t heard(now + 10);
+  Buffer ignored;
+  client.AddHeader(second, false, heard + 1, ignored.Input());
+  EXPECT_TRUE(client.IsAlive(second, heard + Multipath::kMinDeadTime));
+  now = heard + Multipath::kMinDeadTime + 1;
+  EXPECT_FALSE(client.IsAlive(second, now));
+  for (int i = 0; i < 10; ++i)
+    EXPECT_EQ(first, client.Pick(now));
+  EXPECT_TRUE(client.NeedsProbe(second, now));
+
+  // The probe makes it through, and the path is back.
+  Send(&client, second, &server, server_second, now, now + 10, "");
+  EXPECT_TRUE(server.NeedsProbe(server_second, now + 10));
+  Send(&server, server_second, &client, second, now + 10, now + 20, "");
+  EXPECT_TRUE(client.IsAlive(second, now + 20));
+  EXPECT_FALSE(client.NeedsProbe(second, now + 20));
+
+  // With no path left alive, the last heard from is still tried.
+  client.RemovePath(second);
+  Buffer more;
+  client.AddHeader(first, false, now, more.Input());
+  EXPECT_EQ(first, client.Pick(now + 10 * Multipath::kMinDeadTime));
+
+  // Paths not confirmed are not used until heard from.
+  int third(client.AddPath(false, now));
+  EXPECT_EQ(1, client.ConfirmedPaths());
+  EXPECT_FALSE(client.IsConfirmed(third));
+  EXPECT_FALSE(client.NeedsProbe(third, now + 10000));
+  int server_third(server.AddPath(true, now));
+  Send(&server, server_third, &client, third, now, now + 10, "");
+  EXPECT_TRUE(client.IsConfirmed(third));
+  EXPECT_EQ(2, client.ConfirmedPaths());
+}
+
+TEST(Multipath, JoinsWithTokens) {
+  FakeProtector client(42), server(42), other(43);
+  uint64_t client_id, server_id, other_id;
+  EXPECT_TRUE(Multipath::SessionId(client, &client_id));
+  EXPECT_TRUE(Multipath::SessionId(server, &server_id));
+  EXPECT_TRUE(Multipath::SessionId(other, &other_id));
+  EXPECT_EQ(client_id, server_id);
+  EXPECT_NE(client_id, other_id);
+
+  Buffer join;
+  EXPECT_TRUE(Multipath::AddJoin(client, 7, join.Input()));
+  EXPECT_EQ(Multipath::kJoinSize, static_cast<int>(join.Output()->LeftSize()));
+  EXPECT_FALSE(Multipath::HasHeader(*join.Output()));
+
+  uint64_t id;
+  uint32_t counter;
+  string token;
+  OutputCursor copy(*join.Output());
+  EXPECT_TRUE(Multipath::ParseJoin(&copy, &id, &counter, &token));
+  EXPECT_EQ(server_id, id);
+  EXPECT_EQ(7, static_cast<int>(counter));
+  EXPECT_TRUE(Multipath::CheckJoin(server, counter, token));
+  EXPECT_FALSE(Multipath::CheckJoin(server, counter + 1, token));
+  EXPECT_FALSE(Multipath::CheckJoin(other, counter, token));
+
+  // Anything else is not a join.
+  Buffer garbage;
+  garbage.Input()->Add(string(Multipath::kJoinSize, '\x45'));
+  EXPECT_FALSE(Multipath::ParseJoin(garbage.Output(), &id, &counter, &token));
+  Buffer truncated;
+  truncated.Input()->Add(string(1, Multipath::kFrameJoin));
+  EXPECT_FALSE(Multipath::ParseJoin(truncated.Output(), &id, &counter, &token));
+}
+
+static void Add(ReorderBuffer* reorder, uint32_t sequence,
+                Timer::ms_timer_t now, vector<string>* ready) {
+  Buffer message;
+  message.Input()->Add(string(1, 'a' + sequence % 26));
+  reorder->Add(sequence, message.Output(), now, ready);
+}
+
+TEST(ReorderBuffer, PutsBackInOrder) {
+  ReorderBuffer reorder;
+  reorder.SetHoldTime(50);
+  vector<string> ready;
+
+  Add(&reorder, 0, 0, &ready);
+  Add(&reorder, 2, 0, &ready);
+  Add(&reorder, 3, 0, &ready);
+  EXPECT_EQ(1, static_cast<int>(ready.size()));
+  EXPECT_FALSE(reorder.Empty());
+  Add(&reorder, 1, 0, &ready);
+  ASSERT_EQ(4, static_cast<int>(ready.size()));
+  EXPECT_TRUE(ready[1] == "b" && ready[2] == "c" && ready[3] == "d");
+  EXPECT_TRUE(reorder.Empty());
+
+  // 4 is lost: 5 waits for the hold time only.
+  ready.clear();
+  Add(&reorder, 5, 100, &ready);
+  reorder.Expire(149, &ready);
+  EXPECT_TRUE(ready.empty());
+  reorder.Expire(150, &ready);
+  ASSERT_EQ(1, static_cast<int>(ready.size()));
+  EXPECT_TRUE(ready[0] == "f");
+  EXPECT_EQ(1, static_cast<int>(reorder.SkippedCount()));
+
+  // And if it shows up anyway, it is delivered as is.
+  Add(&reorder, 4, 200, &ready);
+  EXPECT_EQ(2, static_cast<int>(ready.size()));
+  EXPECT_EQ(1, static_cast<int>(reorder.LateCount()));
+}
+
+TEST(ReorderBuffer, BoundsHeldMessages) {
+  ReorderBuffer reorder;
+  vector<string> ready;
+
+  for (uint32_t i = 0; i < 0x20; ++i)
+    Add(&reorder, i, 0, &ready);
+  EXPECT_EQ(0x20, static_cast<int>(ready.size()));
+  ready.clear();
+
+  // Messages keep coming after a gap: once too many are held, the gap is
+  // given up on.
+  uint32_t base(0x20);
+  for (int i = 1; i <= ReorderBuffer::kMaxHeld; ++i)
+    Add(&reorder, base + i, 0, &ready);
+  EXPECT_TRUE(ready.empty());
+  Add(&reorder, base + ReorderBuffer::kMaxHeld + 1, 0, &ready);
+  EXPECT_EQ(ReorderBuffer::kMaxHeld + 1, static_cast<int>(ready.size()));
+  EXPECT_TRUE(reorder.Empty());
+}
@@ -1,6 +1,7 @@
 #include "gtest.h"
 #include "src/openssl-helpers.h"
 #include "src/buffer.h"
+#include "src/conversions.h"
 
 TEST(OpenSSLHelpersTest, ShaDigest) {
   Digest digest(Digest::kSHA1);
@@ -59,3 +60,70 @@ TEST(BigNumberTest, Buffer) {
 
   EXPECT_EQ("3", exported);
 }
+
+TEST(BigNumberContextTest, PooledPerThread) {
+  BN_CTX* first;
+  {
+    BigNumberContext context;
+    first = context.Get();
+
+    // Nested contexts cannot share the same BN_CTX.
+    BigNumberContext nested;
+    EXPECT_NE(first, nested.Get());
+  }
+
+  BigNumberContext context;
+  EXPECT_EQ(first, context.Get());
+}
+
+TEST(BigNumberContextTest, ScrubbedWhenReturned) {
+  BN_CTX* used;
+  {
+    BigNumberContext context;
+    used = context.Get();
+
+    BigNumber base, exp, module, result;
+    base.SetFromHex("1234567890ABCDEF1234567890ABCDEF");
+    exp.SetFromHex("FEDCBA0987654321FEDCBA0987654321");
+    module.SetFromHex("F123456789ABCDEF0123456789ABCDEF1");
+    context.ModExp(&result, base, exp, module);
+  }
+
+  BigNumberContext context;
+  ASSERT_EQ(used, context.Get());
+
+  int nonzero = 0;
+  BN_CTX_start(context.Get());
+  for (int i = 0; i < 16; ++i) {
+    BIGNUM* bn = BN_CTX_get(context.Get());
+    for (int j = 0; j < bn->dmax; ++j)
+      nonzero += bn->d[j] != 0;
+  }
+  BN_CTX_end(context.Get());
+  EXPECT_EQ(0, nonzero);
+}
+
+TEST(HkdfTest, Rfc5869) {
+  // Test case 1 from appendix A of RFC 5869.
+  char ikm[22];
+  memset(ikm, 0x0b, sizeof(ikm));
+  const char salt[] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b,
+    0x0c
+  };
+  const unsigned char info[] = {
+    0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9
+  };
+
+  char prk[32];
+  Hkdf::Extract(Hmac::kSHA256, salt, sizeof(salt), ikm, sizeof(ikm), prk);
+  EXPECT_EQ("077709362c2e32df0ddc3f0dc47bba6390b6c73bb50f9c3122ec844ad7c2b3e5",
+            ConvertToHex(prk, sizeof(prk)));
+
+  char okm[42];
+  Hkdf::Expand(Hmac::kSHA256, prk, sizeof(prk),
+               reinterpret_cast<const char*>(info), sizeof(info),
+               okm, sizeof(okm));
+  EXPECT_EQ("3cb25f25faacd57a90434f64d0362f2a2d2d0a90cf1a5a4c5db02d56ecc4c5bf"
+            "34007208d5b887185865", ConvertToHex(okm, sizeof(okm)));
+}
@@ -0,0 +1,115 @@
+#include "gtest.h"
+
+#include "src/packet-coalescer.h"
+#include "src/buffer.h"
+
+static void Add(PacketCoalescer* coalescer, const string& packet) {
+  Buffer input;
+  input.Input()->Add(packet);
+  EXPECT_TRUE(coalescer->Fits(packet.size()));
+  coalescer->Add(input.Output());
+  EXPECT_EQ(0, static_cast<int>(input.Output()->LeftSize()));
+}
+
+static string Flush(PacketCoalescer* coalescer) {
+  Buffer output;
+  coalescer->Flush(output.Input());
+  EXPECT_TRUE(coalescer->Empty());
+  string frame;
+  output.Output()->ConsumeString(&frame);
+  return frame;
+}
+
+// Returns false if the frame was rejected.
+static bool Split(PacketSplitter* splitter, const string& frame,
+                  vector<string>* packets) {
+  Buffer input;
+  input.Input()->Add(frame);
+  bool result(splitter->Split(input.Output(), packets));
+  EXPECT_EQ(0, static_cast<int>(input.Output()->LeftSize()));
+  return result;
+}
+
+TEST(PacketCoalescer, SendsSinglePacketsAsTheyAre) {
+  PacketCoalescer coalescer;
+  PacketSplitter splitter;
+  EXPECT_TRUE(coalescer.Empty());
+
+  string packet("\x45 an IP packet");
+  Add(&coalescer, packet);
+  EXPECT_FALSE(coalescer.Empty());
+  string frame(Flush(&coalescer));
+  EXPECT_TRUE(packet == frame);
+
+  vector<string> packets;
+  EXPECT_TRUE(Split(&splitter, frame, &packets));
+  ASSERT_EQ(1, static_cast<int>(packets.size()));
+  EXPECT_TRUE(packet == packets[0]);
+  EXPECT_FALSE(splitter.PeerCoalesces());
+
+  // Larger than a frame, still fits when alone.
+  string large(3000, '\x60');
+  EXPECT_TRUE(coalescer.Fits(large.size()));
+  Add(&coalescer, large);
+  EXPECT_FALSE(coalescer.Fits(1));
+  EXPECT_TRUE(large == Flush(&coalescer));
+}
+
+TEST(PacketCoalescer, PacksAndSplits) {
+  PacketCoalescer coalescer;
+  PacketSplitter splitter;
+
+  // 40 bytes acks, as many as fit in a frame.
+  vector<string> sent;
+  for (int i = 0; coalescer.Fits(40); ++i) {
+    string packet(40, static_cast<char>('a' + i % 26));
+    packet[0] = 0x45;
+    Add(&coalescer, packet);
+    sent.push_back(packet);
+  }
+  EXPECT_EQ((PacketCoalescer::kMaxFrameSize - 1) / 42,
+            static_cast<int>(sent.size()));
+
+  string frame(Flush(&coalescer));
+  EXPECT_EQ(PacketCoalescer::kFrameCoalesced, static_cast<uint8_t>(frame[0]));
+  EXPECT_GE(PacketCoalescer::kMaxFrameSize, static_cast<int>(frame.size()));
+  EXPECT_EQ(1, static_cast<int>(coalescer.FrameCount()));
+  EXPECT_EQ(static_cast<int>(sent.size()),
+            static_cast<int>(coalescer.PacketCount()));
+
+  vector<string> packets;
+  EXPECT_TRUE(Split(&splitter, frame, &packets));
+  EXPECT_TRUE(sent == packets);
+  EXPECT_TRUE(splitter.PeerCoalesces());
+
+  // The coalescer is ready for more.
+  Add(&coalescer, "\x45" "1");
+  Add(&coalescer, "\x45" "22");
+  EXPECT_EQ(string("\x10\x00\x02\x45" "1\x00\x03\x45" "22", 10),
+            Flush(&coalescer));
+}
+
+TEST(PacketCoalescer, HandlesAnnouncementsAndGarbage) {
+  PacketSplitter splitter;
+
+  Buffer announce;
+  PacketCoalescer::Announce(announce.Input());
+  string frame;
+  announce.Output()->ConsumeString(&frame);
+
+  vector<string> packets;
+  EXPECT_TRUE(Split(&splitter, frame, &packets));
+  EXPECT_TRUE(packets.empty());
+  EXPECT_TRUE(splitter.PeerCoalesces());
+
+  // Truncated sizes and packets are rejected as a whole.
+  EXPECT_FALSE(Split(&splitter, string("\x10\x00\x01" "a\x00", 5), &packets));
+  EXPECT_FALSE(Split(&splitter, string("\x10\x00\x05" "abc", 6), &packets));
+  EXPECT_TRUE(packets.empty());
+
+  // Empty frames go through as they are, and will be dropped later.
+  EXPECT_TRUE(Split(&splitter, "", &packets));
+  ASSERT_EQ(1, static_cast<int>(packets.size()));
+  EXPECT_TRUE(packets[0].empty());
+  EXPECT_EQ(4, static_cast<int>(splitter.FrameCount()));
+}
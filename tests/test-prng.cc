@@ -1,8 +1,10 @@
 #include "gtest.h"
 #include <unordered_set>
 #include <iostream>
+#include <pthread.h>
 
 #include "src/prng.h"
+#include "src/buffer.h"
 #include "src/base.h"
 #include "src/errors.h"
 
@@ -45,3 +47,68 @@ TEST(DefaultPrng, GetZeroTerminated) {
     EXPECT_EQ(ran - 1, zero - buffer);
   }
 }
+
+TEST(ChaCha20Prng, Block) {
+  // Test vector from section 2.3.2 of RFC 7539.
+  const uint32_t key[] = {
+    0x03020100, 0x07060504, 0x0b0a0908, 0x0f0e0d0c,
+    0x13121110, 0x17161514, 0x1b1a1918, 0x1f1e1d1c
+  };
+  const uint32_t nonce[] = { 0x09000000, 0x4a000000, 0x00000000 };
+  const uint32_t expected[] = {
+    0xe4e7f110, 0x15593bd1, 0x1fdd0f50, 0xc47120a3,
+    0xc7f4d1c7, 0x0368c033, 0x9aaa2204, 0x4e6cd4c3,
+    0x466482d2, 0x09aa9f07, 0x05d7c214, 0xa2028bd9,
+    0xd19c12b5, 0xb94e16de, 0xe883d0cb, 0x4e3c50a2
+  };
+
+  uint32_t output[ChaCha20Prng::kBlockSize / 4];
+  ChaCha20Prng::Block(key, 1, nonce, output);
+  for (unsigned int i = 0; i < sizeof_array(expected); i++)
+    EXPECT_EQ(expected[i], output[i]);
+}
+
+TEST(ChaCha20Prng, GetAcrossRefills) {
+  ChaCha20Prng prng;
+
+  // Odd sizes, so reads straddle the internal buffer boundaries.
+  char previous[333];
+  char current[333];
+  prng.Get(previous, sizeof(previous));
+  for (int i = 0; i < 256; i++) {
+    prng.Get(current, sizeof(current));
+    EXPECT_NE(0, memcmp(previous, current, sizeof(current)));
+    memcpy(previous, current, sizeof(current));
+  }
+}
+
+TEST(ChaCha20Prng, Fill) {
+  ChaCha20Prng prng;
+  Buffer buffer;
+
+  buffer.Input()->Add("header", 6);
+  char* data = prng.Fill(buffer.Input(), 16);
+  EXPECT_EQ(22, buffer.Output()->LeftSize());
+
+  char copy[22];
+  EXPECT_EQ(22, buffer.Output()->Get(copy, sizeof(copy)));
+  EXPECT_EQ(0, memcmp(copy, "header", 6));
+  EXPECT_EQ(0, memcmp(copy + 6, data, 16));
+}
+
+static void* GetThreadPrng(void* prng) {
+  *static_cast<ChaCha20Prng**>(prng) = ChaCha20Prng::ForThisThread();
+  return NULL;
+}
+
+TEST(ChaCha20Prng, ForThisThread) {
+  ChaCha20Prng* mine(ChaCha20Prng::ForThisThread());
+  EXPECT_EQ(mine, ChaCha20Prng::ForThisThread());
+
+  ChaCha20Prng* other(NULL);
+  pthread_t thread;
+  ASSERT_EQ(0, pthread_create(&thread, NULL, GetThreadPrng, &other));
+  ASSERT_EQ(0, pthread_join(thread, NULL));
+  EXPECT_TRUE(other != NULL);
+  EXPECT_NE(mine, other);
+}
@@ -0,0 +1,76 @@
+#include "gtest.h"
+
+#include "src/replay-window.h"
+
+TEST(ReplayWindowTest, InOrder) {
+  ReplayWindow window;
+
+  for (uint64_t i = 0; i < 10000; i++)
+    EXPECT_EQ(ReplayWindow::Accepted, window.Check(i));
+  EXPECT_EQ(9999, window.Highest());
+  EXPECT_EQ(0, window.ReorderedCount());
+
+  for (uint64_t i = 9999; i > 9999 - ReplayWindow::kWindowSize; i--)
+    EXPECT_EQ(ReplayWindow::Replayed, window.Check(i));
+  EXPECT_EQ(ReplayWindow::kWindowSize, window.ReplayedCount());
+
+  EXPECT_EQ(ReplayWindow::TooOld, window.Check(0));
+  EXPECT_EQ(ReplayWindow::TooOld,
+            window.Check(9999 - ReplayWindow::kWindowSize));
+  EXPECT_EQ(2, window.TooOldCount());
+}
+
+TEST(ReplayWindowTest, Reordered) {
+  ReplayWindow window;
+
+  EXPECT_EQ(ReplayWindow::Accepted, window.Check(100));
+  EXPECT_EQ(ReplayWindow::Accepted, window.Check(98));
+  EXPECT_EQ(ReplayWindow::Accepted, window.Check(99));
+  EXPECT_EQ(ReplayWindow::Replayed, window.Check(98));
+  EXPECT_EQ(ReplayWindow::Accepted, window.Check(101));
+  EXPECT_EQ(2, window.ReorderedCount());
+  EXPECT_EQ(1, window.ReplayedCount());
+}
+
+TEST(ReplayWindowTest, Jumps) {
+  ReplayWindow window;
+
+  EXPECT_EQ(ReplayWindow::Accepted, window.Check(5));
+  // Jump more than a whole window ahead: all the old state is gone.
+  EXPECT_EQ(ReplayWindow::Accepted, window.Check(1000000));
+  EXPECT_EQ(ReplayWindow::TooOld, window.Check(5));
+
+  // Anything in the window that has not been seen is accepted, even
+  // if it lands in words that were reused.
+  for (uint64_t i = 1000000 - ReplayWindow::kWindowSize + 1; i < 1000000; i++)
+    EXPECT_EQ(ReplayWindow::Accepted, window.Check(i));
+  EXPECT_EQ(ReplayWindow::Replayed, window.Check(1000000));
+
+  // Small jumps, crossing word boundaries.
+  for (uint64_t i = 1000000 + 63; i < 1010000; i += 63)
+    EXPECT_EQ(ReplayWindow::Accepted, window.Check(i));
+  for (uint64_t i = 1000000 + 63; i < 1010000; i += 63) {
+    if (window.Highest() - i < ReplayWindow::kWindowSize)
+      EXPECT_EQ(ReplayWindow::Replayed, window.Check(i));
+    else
+      EXPECT_EQ(ReplayWindow::TooOld, window.Check(i));
+  }
+}
+
+TEST(ReplayWindowTest, TestLeavesWindowAlone) {
+  ReplayWindow window;
+
+  EXPECT_EQ(ReplayWindow::Accepted, window.Check(5000));
+  // A forged sequence far ahead would make everything else too old.
+  EXPECT_EQ(ReplayWindow::Accepted, window.Test(1000000));
+  EXPECT_EQ(5000, window.Highest());
+  EXPECT_EQ(ReplayWindow::Accepted, window.Test(4999));
+  EXPECT_EQ(ReplayWindow::Accepted, window.Check(4999));
+
+  EXPECT_EQ(ReplayWindow::Replayed, window.Test(5000));
+  EXPECT_EQ(ReplayWindow::TooOld,
+            window.Test(5000 - ReplayWindow::kWindowSize));
+  EXPECT_EQ(0, window.ReplayedCount());
+  EXPECT_EQ(0, window.TooOldCount());
+  EXPECT_EQ(1, window.ReorderedCount());
+}
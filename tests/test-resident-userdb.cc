@@ -0,0 +1,101 @@
+#include "gtest.h"
+#include "src/resident-userdb.h"
+
+static void WriteUsers(const char* name, const char* user, const char* secret) {
+  UdbSecretFile testdb(name);
+  EXPECT_TRUE(testdb.Open());
+  if (!testdb.SetUser(user, secret))
+    EXPECT_TRUE(testdb.AddUser(user, secret));
+  EXPECT_TRUE(testdb.Commit());
+  EXPECT_TRUE(testdb.Close());
+}
+
+TEST(ResidentUserDb, LoadAndReload) {
+  unlink("/tmp/test-resident.db");
+  WriteUsers("/tmp/test-resident.db", "pippo", "pass1");
+  WriteUsers("/tmp/test-resident.db", "pluto", "pass2");
+
+  ResidentUserDb userdb("/tmp/test-resident.db");
+  EXPECT_TRUE(userdb.Load(NULL));
+
+  string secret;
+  EXPECT_TRUE(userdb.GetUser("pippo", &secret));
+  EXPECT_EQ("pass1", secret);
+  EXPECT_TRUE(userdb.GetUser("pluto", &secret));
+  EXPECT_EQ("pass2", secret);
+  EXPECT_FALSE(userdb.GetUser("topolino", &secret));
+
+  // Changes are not visible until reloaded.
+  WriteUsers("/tmp/test-resident.db", "topolino", "pass3");
+  WriteUsers("/tmp/test-resident.db", "pippo", "pass4");
+  EXPECT_FALSE(userdb.GetUser("topolino", &secret));
+
+  EXPECT_TRUE(userdb.Reload());
+  EXPECT_TRUE(userdb.GetUser("topolino", &secret));
+  EXPECT_EQ("pass3", secret);
+  EXPECT_TRUE(userdb.GetUser("pippo", &secret));
+  EXPECT_EQ("pass4", secret);
+}
+
+TEST(ResidentUserDb, KeepsUsersIfFileIsGone) {
+  unlink("/tmp/test-resident.db");
+  WriteUsers("/tmp/test-resident.db", "pippo", "pass1");
+
+  ResidentUserDb userdb("/tmp/test-resident.db");
+  EXPECT_TRUE(userdb.Load(NULL));
+
+  unlink("/tmp/test-resident.db");
+  EXPECT_FALSE(userdb.Reload());
+
+  string secret;
+  EXPECT_TRUE(userdb.GetUser("pippo", &secret));
+  EXPECT_EQ("pass1", secret);
+}
+
+TEST(ResidentUserDb, ReadOnly) {
+  unlink("/tmp/test-resident.db");
+  WriteUsers("/tmp/test-resident.db", "pippo", "pass1");
+
+  ResidentUserDb userdb("/tmp/test-resident.db");
+  EXPECT_TRUE(userdb.Load(NULL));
+  EXPECT_FALSE(userdb.AddUser("pluto", "pass2"));
+  EXPECT_FALSE(userdb.SetUser("pippo", "pass2"));
+  EXPECT_FALSE(userdb.DelUser("pippo"));
+  EXPECT_FALSE(userdb.Commit());
+}
+
+TEST(ResidentUserDb, SwitchesToBinary) {
+  unlink("/tmp/test-resident.db");
+  WriteUsers("/tmp/test-resident.db", "pippo", "pass1");
+
+  ResidentUserDb userdb("/tmp/test-resident.db");
+  EXPECT_TRUE(userdb.Load(NULL));
+
+  UserDb::UserMap users;
+  users["pippo"] = "pass2";
+  users["pluto"] = "pass3";
+  ASSERT_TRUE(UdbBinaryIndex::Write("/tmp/test-resident.db", users));
+  EXPECT_TRUE(userdb.Reload());
+
+  string secret;
+  EXPECT_TRUE(userdb.GetUser("pippo", &secret));
+  EXPECT_EQ("pass2", secret);
+  EXPECT_TRUE(userdb.GetUser("pluto", &secret));
+  EXPECT_EQ("pass3", secret);
+  EXPECT_FALSE(userdb.GetUser("topolino", &secret));
+}
+
+TEST(ResidentUserDb, LoadsWithUninitializedWatcher) {
+  unlink("/tmp/test-resident.db");
+  WriteUsers("/tmp/test-resident.db", "pippo", "pass1");
+
+  // As when Init() fails: users are loaded, just not watched.
+  EpollDispatcher dispatcher;
+  FileWatcher watcher(&dispatcher);
+  ResidentUserDb userdb("/tmp/test-resident.db");
+  EXPECT_TRUE(userdb.Load(&watcher));
+
+  string secret;
+  EXPECT_TRUE(userdb.GetUser("pippo", &secret));
+  EXPECT_EQ("pass1", secret);
+}
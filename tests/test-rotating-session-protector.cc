@@ -0,0 +1,215 @@
+#include "gtest.h"
+
+#include "src/rotating-session-protector.h"
+#include "src/buffer.h"
+#include "src/password.h"
+
+class RotatingSessionProtectorTest : public ::testing::Test {
+ protected:
+  RotatingSessionProtectorTest()
+      : password_(STRBUFFER("this is the key")), key_(&prng_) {
+    Buffer buffer;
+    key_.SendSalt(buffer.Input());
+    key_.SetupKey(password_);
+  }
+
+  // Encodes data with encoder, and checks that decoder can read it back.
+  void EncodeDecode(RotatingSessionEncoder* encoder,
+                    RotatingSessionDecoder* decoder, const string& data) {
+    Buffer encrypted;
+    EncodeFrame(encoder, data, &encrypted);
+    EXPECT_EQ(data, DecodeFrame(decoder, &encrypted));
+  }
+
+  void EncodeFrame(RotatingSessionEncoder* encoder, const string& data,
+                   Buffer* encrypted) {
+    Buffer cleartext;
+    cleartext.Input()->Add(data);
+    EXPECT_TRUE(encoder->Encode(cleartext.Output(), encrypted->Input()));
+  }
+
+  string DecodeFrame(RotatingSessionDecoder* decoder, Buffer* encrypted) {
+    Buffer decrypted;
+    if (decoder->Decode(encrypted->Output(), decrypted.Input()) !=
+        RotatingSessionDecoder::SUCCEEDED)
+      return "<error>";
+
+    string result;
+    decrypted.Output()->ConsumeString(&result);
+    return result;
+  }
+
+  DefaultPrng prng_;
+  ScopedPassword password_;
+  AesSessionKey key_;
+};
+
+TEST_F(RotatingSessionProtectorTest, SameKeysOnBothSides) {
+  SessionKeyChain first(key_, password_);
+  SessionKeyChain second(key_, password_);
+
+  char key1[AesSessionKey::kKeyLengthInBytes];
+  char key2[AesSessionKey::kKeyLengthInBytes];
+  first.GetKey(0, key1);
+  EXPECT_EQ(0, memcmp(key1, key_.GetKey(), sizeof(key1)));
+
+  for (uint32_t i = 1; i < 10; i++) {
+    first.GetKey(i, key1);
+    second.GetKey(i, key2);
+    EXPECT_EQ(0, memcmp(key1, key2, sizeof(key1)));
+
+    second.GetKey(i - 1, key2);
+    EXPECT_NE(0, memcmp(key1, key2, sizeof(key1)));
+  }
+}
+
+TEST_F(RotatingSessionProtectorTest, Rotate) {
+  SessionKeyChain keys(key_, password_);
+  RotatingSessionEncoder encoder(&prng_, keys);
+  RotatingSessionDecoder decoder(&prng_, keys);
+
+  EncodeDecode(&encoder, &decoder, "before rotation");
+  EXPECT_EQ(0, decoder.Generation());
+
+  for (uint32_t i = 1; i < 300; i++) {
+    encoder.Rotate();
+    EncodeDecode(&encoder, &decoder, "after rotation");
+    EXPECT_EQ(i, encoder.Generation());
+    EXPECT_EQ(i, decoder.Generation());
+  }
+}
+
+TEST_F(RotatingSessionProtectorTest, Overlap) {
+  SessionKeyChain keys(key_, password_);
+  RotatingSessionEncoder encoder(&prng_, keys);
+  RotatingSessionDecoder decoder(&prng_, keys);
+
+  // A frame encoded with the old key, delivered after the switch.
+  Buffer late;
+  EncodeFrame(&encoder, "late frame", &late);
+
+  encoder.Rotate();
+  EncodeDecode(&encoder, &decoder, "new key");
+  EXPECT_EQ(1, decoder.Generation());
+  EXPECT_EQ("late frame", DecodeFrame(&decoder, &late));
+
+  // Once the overlap window is over, the old key is no longer accepted.
+  EncodeFrame(&encoder, "late frame", &late);
+  encoder.Rotate();
+  for (uint32_t i = 0; i <= RotatingSessionDecoder::kOverlapFrames; i++)
+    EncodeDecode(&encoder, &decoder, "new key");
+  EXPECT_EQ(2, decoder.Generation());
+  EXPECT_EQ("<error>", DecodeFrame(&decoder, &late));
+}
+
+TEST_F(RotatingSessionProtectorTest, ExportsKeys) {
+  SessionKeyChain first(key_, password_);
+  SessionKeyChain second(key_, password_);
+  RotatingSessionEncoder encoder(&prng_, first);
+  RotatingSessionDecoder decoder(&prng_, second);
+
+  char key1[44];
+  char key2[44];
+  EXPECT_TRUE(encoder.ExportKey("label", key1, sizeof(key1)));
+  EXPECT_TRUE(decoder.ExportKey("label", key2, sizeof(key2)));
+  EXPECT_EQ(0, memcmp(key1, key2, sizeof(key1)));
+
+  // Unrelated to other labels, and to the keys used by the protectors.
+  decoder.ExportKey("other label", key2, sizeof(key2));
+  EXPECT_NE(0, memcmp(key1, key2, sizeof(key1)));
+  first.GetKey(1, key2);
+  EXPECT_NE(0, memcmp(key1, key2, AesSessionKey::kKeyLengthInBytes));
+}
+
+TEST_F(RotatingSessionProtectorTest, ForgedFramesDontSwitchKeys) {
+  SessionKeyChain keys(key_, password_);
+  RotatingSessionEncoder encoder(&prng_, keys);
+  RotatingSessionDecoder decoder(&prng_, keys);
+
+  encoder.Rotate();
+  Buffer encrypted;
+  EncodeFrame(&encoder, "new key", &encrypted);
+  string frame;
+  encrypted.Output()->ConsumeString(&frame);
+
+  // Any byte changed, from the key id to the tag, is caught.
+  for (unsigned int i = 0; i < frame.size(); i += 7) {
+    string forged(frame);
+    forged[i] ^= 0x20;
+    Buffer buffer;
+    buffer.Input()->Add(forged);
+    EXPECT_EQ("<error>", DecodeFrame(&decoder, &buffer));
+    EXPECT_EQ(0, decoder.Generation());
+  }
+
+  // Garbage with the next key id does not get the decoder to switch.
+  Buffer garbage;
+  garbage.Input()->Add(frame.substr(0, 1) + string(frame.size() - 1, 'x'));
+  EXPECT_EQ("<error>", DecodeFrame(&decoder, &garbage));
+  EXPECT_EQ(0, decoder.Generation());
+
+  Buffer genuine;
+  genuine.Input()->Add(frame);
+  EXPECT_EQ("new key", DecodeFrame(&decoder, &genuine));
+  EXPECT_EQ(1, decoder.Generation());
+}
+
+TEST_F(RotatingSessionProtectorTest, BoundData) {
+  SessionKeyChain keys(key_, password_);
+  RotatingSessionEncoder encoder(&prng_, keys);
+  RotatingSessionDecoder decoder(&prng_, keys);
+
+  Buffer cleartext;
+  cleartext.Input()->Add("bound frame");
+  Buffer encrypted;
+  EXPECT_TRUE(encoder.EncodeBound(
+      "connection id", cleartext.Output(), encrypted.Input()));
+  string frame;
+  encrypted.Output()->ConsumeString(&frame);
+
+  // Only accepted with the same data bound to it.
+  const char* const kOthers[] = { "", "connection ie", "connection id " };
+  for (unsigned int i = 0; i < sizeof(kOthers) / sizeof(*kOthers); ++i) {
+    Buffer buffer, decrypted;
+    buffer.Input()->Add(frame);
+    EXPECT_EQ(RotatingSessionDecoder::CORRUPTED_DATA,
+              decoder.DecodeBound(kOthers[i], buffer.Output(), decrypted.Input()));
+  }
+
+  Buffer buffer, decrypted;
+  buffer.Input()->Add(frame);
+  EXPECT_EQ(RotatingSessionDecoder::SUCCEEDED,
+            decoder.DecodeBound("connection id", buffer.Output(), decrypted.Input()));
+  string result;
+  decrypted.Output()->ConsumeString(&result);
+  EXPECT_EQ("bound frame", result);
+}
+
+TEST_F(RotatingSessionProtectorTest, WholeFrames) {
+  SessionKeyChain keys(key_, password_);
+  RotatingSessionEncoder encoder(&prng_, keys);
+  RotatingSessionDecoder decoder(&prng_, keys);
+
+  // Too short to be a frame: dropped, not waited on.
+  Buffer truncated, decrypted;
+  truncated.Input()->Add(string(RotatingSessionEncoder::kTagLength, 'x'));
+  EXPECT_EQ(RotatingSessionDecoder::CORRUPTED_DATA,
+            decoder.Decode(truncated.Output(), decrypted.Input()));
+  EXPECT_EQ(0, static_cast<int>(truncated.Output()->LeftSize()));
+
+  // Frames encoded after, and decoded across, chunk boundaries.
+  const int kFiller(BufferChunk::kRoundedSize - 20);
+  Buffer encrypted;
+  encrypted.Input()->Add(string(kFiller, 'f'));
+  EncodeFrame(&encoder, "across chunks", &encrypted);
+  encrypted.Output()->Increment(kFiller);
+  string frame;
+  encrypted.Output()->ConsumeString(&frame);
+
+  Buffer split;
+  split.Input()->Add(string(kFiller, 'f'));
+  split.Input()->Add(frame);
+  split.Output()->Increment(kFiller);
+  EXPECT_EQ("across chunks", DecodeFrame(&decoder, &split));
+  EXPECT_EQ(0, static_cast<int>(split.Output()->LeftSize()));
+}
@@ -37,3 +37,17 @@ TEST(SerializerTest, EncodeDecodeVector) {
   EXPECT_EQ("foo", output[2]);
   EXPECT_EQ(3, output.size());
 }
+
+TEST(SerializerTest, EncodeDecodeUint64) {
+  Buffer buffer;
+
+  const uint64_t value = 0x0123456789abcdefULL;
+  EncodeToBuffer(value, buffer.Input());
+  EXPECT_EQ(8, buffer.Output()->LeftSize());
+  EXPECT_EQ(0x01, buffer.Output()->Data()[0]);
+
+  uint64_t decoded;
+  EXPECT_FALSE(DecodeFromBuffer(buffer.Output(), &decoded));
+  EXPECT_EQ(value, decoded);
+  EXPECT_LT(0, DecodeFromBuffer(buffer.Output(), &decoded));
+}
@@ -0,0 +1,212 @@
+#include "gtest.h"
+
+#include "src/server-udp-transcoder.h"
+#include "src/server-connection-manager.h"
+#include "src/hello-filter.h"
+#include "src/serializers.h"
+#include "src/buffer.h"
+
+#include <arpa/inet.h>
+#include <deque>
+
+// Hands the datagrams queued to the transcoder, all from the same address.
+class FakeChannel : public DatagramChannel {
+ public:
+  FakeChannel() : handler_(NULL) {
+    in_addr address;
+    address.s_addr = htonl(0x0a000001);
+    address_ = IPv4Sockaddr(address, 4242);
+  }
+
+  virtual void Close() {}
+  virtual void WantWrite(const event_handler_t* callback) {}
+  virtual void WantRead(const event_handler_t* callback) {
+    handler_ = callback;
+  }
+  virtual io_result_e Write(OutputCursor* buffer, const Sockaddr& remote) {
+    return OK;
+  }
+  virtual io_result_e Read(InputCursor* buffer, Sockaddr** remote) {
+    buffer->Add(datagrams_.front());
+    datagrams_.pop_front();
+    *remote = new IPv4Sockaddr(address_);
+    return OK;
+  }
+
+  void Deliver(const string& datagram) {
+    datagrams_.push_back(datagram);
+    (*handler_)();
+  }
+
+  const event_handler_t* handler_;
+  IPv4Sockaddr address_;
+  deque<string> datagrams_;
+};
+
+class FakeTransport : public Transport {
+ public:
+  explicit FakeTransport(DatagramChannel* channel) : channel_(channel) {}
+
+  virtual BoundChannel* DatagramConnect(const Sockaddr& address) {
+    return NULL;
+  }
+  virtual DatagramChannel* DatagramListenOn(const Sockaddr& address) {
+    return channel_;
+  }
+  virtual AcceptingChannel* StreamListenOn(const Sockaddr& address) {
+    return NULL;
+  }
+  virtual BoundChannel* StreamConnect(const Sockaddr& address) {
+    return NULL;
+  }
+
+  DatagramChannel* channel_;
+};
+
+// Frames starting with 'g' decode to what follows, others are corrupted.
+class FakeDecoder : public DecodeSessionProtector {
+ public:
+  FakeDecoder() : authenticates_(false) {}
+
+  virtual Result Decode(OutputCursor* input, InputCursor* output) {
+    string frame;
+    input->ConsumeString(&frame);
+    if (frame.empty() || frame[0] != 'g')
+      return CORRUPTED_DATA;
+    output->Add(frame.substr(1));
+    return SUCCEEDED;
+  }
+  virtual bool Authenticates() const { return authenticates_; }
+
+  virtual Result Start(
+      OutputCursor* input, InputCursor* output, StartOptions options) {
+    return CORRUPTED_DATA;
+  }
+  virtual Result End(InputCursor* output) { return CORRUPTED_DATA; }
+  virtual Result Continue(
+      OutputCursor* input, InputCursor* output, uint32_t until) {
+    return CORRUPTED_DATA;
+  }
+  virtual Result RemovePadding(
+      OutputCursor* output, int datasize, uint8_t* padsize) {
+    return CORRUPTED_DATA;
+  }
+
+  bool authenticates_;
+};
+
+class FakeSession : public ServerConnectedSession {
+ public:
+  FakeSession() : packets_(0), errors_(0) {}
+
+  virtual DecodeSessionProtector* GetDecoder() { return &decoder_; }
+  virtual EncodeSessionProtector* GetEncoder() { return NULL; }
+  virtual State IsReady(const ConnectionKey& key, OutputCursor* cursor) {
+    return Ready;
+  }
+  virtual void HandlePacket(
+      const ConnectionKey& key, ServerTranscoder::Connection* connection,
+      OutputCursor* data) {
+    ++packets_;
+  }
+  virtual void HandleError(
+      const ConnectionKey& key, ServerTranscoder::Connection* connection,
+      const CloseReason error) {
+    ++errors_;
+  }
+  virtual InputCursor* Message() { return NULL; }
+  virtual bool SendMessage() { return false; }
+  virtual void SetCallbacks(read_handler_t*, close_handler_t*) {}
+  virtual void Disconnect() {}
+
+  FakeDecoder decoder_;
+  int packets_;
+  int errors_;
+};
+
+class FakeManager : public ServerConnectionManager {
+ public:
+  FakeManager() : connection_(NULL) {}
+
+  virtual ServerConnectedSession::State GetSession(
+      const ConnectionKey& key, OutputCursor* cursor,
+      ServerConnectedSession** session) {
+    *session = &session_;
+    return connection_ ? ServerConnectedSession::Ready :
+        ServerConnectedSession::NeedNewSession;
+  }
+  virtual ServerConnectedSession* CreateSession(
+      const ConnectionKey& key, OutputCursor* cursor,
+      ServerTranscoder::Connection* connection) {
+    connection_ = connection;
+    return &session_;
+  }
+  virtual void HandleError(
+      const ConnectionKey& key, ServerTranscoder::Connection* connection,
+      const ServerConnectedSession::CloseReason error) {
+    ++session_.errors_;
+  }
+  virtual void RegisterIOChannel(ServerIOChannel* channel) {}
+  virtual void RegisterAuthenticator(ServerAuthenticator* authenticator) {}
+
+  FakeSession session_;
+  ServerTranscoder::Connection* connection_;
+};
+
+static const uint64_t kId = 0x1234567890abcdefULL;
+
+// Datagram for connection kId, carrying frame, tagged if it is the hello.
+static string Datagram(const string& frame, bool hello) {
+  Buffer datagram;
+  EncodeToBuffer(kId, datagram.Input());
+  if (hello)
+    HelloFilter().AddHello(kId, frame, datagram.Input());
+  else
+    datagram.Input()->Add(frame);
+  string result;
+  datagram.Output()->ConsumeString(&result);
+  return result;
+}
+
+// A frame the fake decoder accepts, with message sequence.
+static string Frame(uint64_t sequence) {
+  Buffer frame;
+  frame.Input()->Add("g");
+  EncodeToBuffer(sequence, frame.Input());
+  frame.Input()->Add("payload");
+  string result;
+  frame.Output()->ConsumeString(&result);
+  return result;
+}
+
+TEST(ServerUdpTranscoder, SurvivesCorruptedDatagrams) {
+  FakeChannel* channel(new FakeChannel);
+  FakeTransport transport(channel);
+  FakeManager manager;
+  IPv4Sockaddr address;
+  ServerUdpTranscoder transcoder(NULL, &transport, address, &manager);
+  ASSERT_TRUE(transcoder.Start());
+
+  channel->Deliver(Datagram(Frame(0), true));
+  ASSERT_TRUE(manager.connection_ != NULL);
+  EXPECT_EQ(1, manager.session_.packets_);
+
+  // Once frames are authenticated, bad tags are dropped and counted.
+  manager.session_.decoder_.authenticates_ = true;
+  channel->Deliver(Datagram("forged", false));
+  channel->Deliver(Datagram("", false));
+  EXPECT_EQ(0, manager.session_.errors_);
+  EXPECT_EQ(2, static_cast<int>(transcoder.CorruptedCount()));
+
+  channel->Deliver(Datagram(Frame(1), false));
+  EXPECT_EQ(2, manager.session_.packets_);
+
+  // During the handshake, the session is still closed.
+  manager.session_.decoder_.authenticates_ = false;
+  channel->Deliver(Datagram("forged", false));
+  EXPECT_EQ(1, manager.session_.errors_);
+  EXPECT_EQ(2, static_cast<int>(transcoder.CorruptedCount()));
+
+  // Owned by the session in the real thing.
+  delete manager.connection_;
+}
@@ -0,0 +1,86 @@
+#include "gtest.h"
+
+#include "src/session-ticket.h"
+#include "src/password.h"
+#include "src/prng.h"
+
+TEST(SessionTicketKeys, IssueAndRedeem) {
+  DefaultPrng prng;
+  SessionTicketKeys keys(&prng);
+
+  ScopedPassword secret(STRBUFFER("0123456789abcdef0123456789abcdef"));
+  string ticket;
+  EXPECT_TRUE(keys.Issue("foouser", secret, &ticket));
+  // Nothing in clear in the ticket.
+  EXPECT_EQ(string::npos, ticket.find("foouser"));
+
+  string username;
+  ScopedPassword redeemed;
+  EXPECT_TRUE(keys.Redeem(ticket, &username, &redeemed));
+  EXPECT_EQ("foouser", username);
+  EXPECT_EQ(secret.Used(), redeemed.Used());
+  EXPECT_EQ(0, memcmp(secret.Data(), redeemed.Data(), secret.Used()));
+
+  // Two tickets for the same content differ.
+  string other;
+  EXPECT_TRUE(keys.Issue("foouser", secret, &other));
+  EXPECT_NE(ticket, other);
+}
+
+TEST(SessionTicketKeys, RejectsTampered) {
+  DefaultPrng prng;
+  SessionTicketKeys keys(&prng);
+  SessionTicketKeys otherkeys(&prng);
+
+  ScopedPassword secret(STRBUFFER("0123456789abcdef0123456789abcdef"));
+  string ticket;
+  EXPECT_TRUE(keys.Issue("foouser", secret, &ticket));
+
+  string username;
+  ScopedPassword redeemed;
+  for (unsigned int i = 0; i < ticket.size(); ++i) {
+    string tampered(ticket);
+    tampered[i] ^= 0x01;
+    EXPECT_FALSE(keys.Redeem(tampered, &username, &redeemed)) << i;
+  }
+
+  EXPECT_FALSE(keys.Redeem(ticket.substr(0, ticket.size() - 1),
+                           &username, &redeemed));
+  EXPECT_FALSE(keys.Redeem("", &username, &redeemed));
+  EXPECT_FALSE(otherkeys.Redeem(ticket, &username, &redeemed));
+}
+
+TEST(SessionTicketKeys, Rotate) {
+  DefaultPrng prng;
+  SessionTicketKeys keys(&prng);
+
+  ScopedPassword secret(STRBUFFER("0123456789abcdef0123456789abcdef"));
+  string ticket;
+  EXPECT_TRUE(keys.Issue("foouser", secret, &ticket));
+
+  string username;
+  ScopedPassword redeemed;
+  keys.Rotate();
+  EXPECT_TRUE(keys.Redeem(ticket, &username, &redeemed));
+  keys.Rotate();
+  EXPECT_FALSE(keys.Redeem(ticket, &username, &redeemed));
+}
+
+TEST(SessionTicket, DeriveAndTranscript) {
+  ScopedPassword srpsecret(STRBUFFER("secret computed by srp"));
+  ScopedPassword first, second, third;
+  SessionTicket::DeriveSecret(srpsecret, "transcript", &first);
+  SessionTicket::DeriveSecret(srpsecret, "transcript", &second);
+  SessionTicket::DeriveSecret(srpsecret, "other transcript", &third);
+
+  EXPECT_EQ(SessionTicket::kSecretLength, first.Used());
+  EXPECT_TRUE(first.SameAs(second));
+  EXPECT_FALSE(first.SameAs(third));
+
+  string nonce(SessionTicket::kNonceLength, 'n');
+  string transcript, other;
+  SessionTicket::CalculateTranscript("foouser", "ticket", nonce, &transcript);
+  SessionTicket::CalculateTranscript("foouse", "rticket", nonce, &other);
+  EXPECT_EQ(32, static_cast<int>(transcript.size()));
+  EXPECT_NE(transcript, other);
+}
@@ -3,6 +3,8 @@
 #include "src/buffer.h"
 #include "src/srp-client.h"
 #include "src/srp-server.h"
+#include "src/serializers.h"
+#include "src/session-ticket.h"
 
 TEST(SecurePrimes, VerifyAll) {
   SecurePrimes primes;
@@ -24,6 +26,46 @@ TEST(SecurePrimes, VerifyAll) {
   }
 }
 
+TEST(SecurePrimes, SharedIsShared) {
+  EXPECT_EQ(&SecurePrimes::Shared(), &SecurePrimes::Shared());
+}
+
+TEST(SecurePrimes, PrecomputedValues) {
+  const SecurePrimes& primes = SecurePrimes::Shared();
+  BigNumberContext bnctx;
+  DefaultPrng prng;
+
+  for (int i = 0; primes.ValidIndex(i); i++) {
+    const BigNumber& N = primes.GetPrime(i);
+    const BigNumber& g = primes.GetGenerator(i);
+
+    BigNumber k;
+    SrpSecret::CalculateK(N, g, &k);
+    string expected, got;
+    k.ExportAsHex(&expected);
+    primes.GetMultiplier(i).ExportAsHex(&got);
+    EXPECT_EQ(expected, got);
+
+    BigNumber exp;
+    exp.SetFromRandom(&prng, 384);
+
+    BigNumber plain, mont;
+    bnctx.ModExp(&plain, g, exp, N);
+    primes.ModExpGenerator(&bnctx, i, exp, &mont);
+    plain.ExportAsHex(&expected);
+    mont.ExportAsHex(&got);
+    EXPECT_EQ(expected, got);
+
+    BigNumber base;
+    base.SetFromRandom(&prng, 384);
+    bnctx.ModExp(&plain, base, exp, N);
+    primes.ModExp(&bnctx, i, base, exp, &mont);
+    plain.ExportAsHex(&expected);
+    mont.ExportAsHex(&got);
+    EXPECT_EQ(expected, got);
+  }
+}
+
 // How does the key size affect performance?
 // The numbers below are from my laptop. Note
 // that this test runs both the client code and
@@ -42,11 +84,10 @@ TEST(SecurePrimes, VerifyAll) {
 
 TEST(SrpInteractions, VerifyHandshake) {
   Buffer buffer;
-  BigNumberContext bnctx;
   DefaultPrng prng;
 
-  SrpClientSession srp_client(&prng, &bnctx, "foouser");
-  SrpServerSession srp_server(&prng, &bnctx);
+  SrpClientSession srp_client(&prng, "foouser");
+  SrpServerSession srp_server(&prng);
 
   srp_client.FillClientHello(buffer.Input());
   LOG_DEBUG("client hello size: %d", buffer.Output()->LeftSize());
@@ -56,9 +97,8 @@ TEST(SrpInteractions, VerifyHandshake) {
   EXPECT_EQ("foouser", username);
 
   // Build a valid secret for the user.
-  SecurePrimes primes;
   ScopedPassword password(STRBUFFER("this-is-his-password"));
-  SrpSecret secret(primes, 6);
+  SrpSecret secret(SecurePrimes::Shared(), 6);
   EXPECT_TRUE(secret.FromPassword("foouser", password));
   string encodedpassword;
   secret.ToSecret(&encodedpassword);
@@ -85,4 +125,149 @@ TEST(SrpInteractions, VerifyHandshake) {
   LOG_DEBUG("client private key: %d", client_private_key.Used());
 
   EXPECT_TRUE(server_private_key.SameAs(client_private_key));
+
+  EXPECT_EQ(kSrpCapabilities, srp_server.Capabilities());
+  EXPECT_EQ(kSrpCapabilities, srp_client.Capabilities());
+
+  string server_transcript, client_transcript;
+  srp_server.GetTranscript(&server_transcript);
+  srp_client.GetTranscript(&client_transcript);
+  // A hash, and the capabilities offered and picked.
+  EXPECT_EQ(34, static_cast<int>(server_transcript.size()));
+  EXPECT_EQ(server_transcript, client_transcript);
+}
+
+// Runs a handshake where the capabilities picked by the server are
+// replaced with picked before reaching the client. Returns what the
+// client thought of the server hello.
+static int TamperedHandshake(uint8_t picked, string* server_transcript,
+                             string* client_transcript) {
+  Buffer buffer;
+  DefaultPrng prng;
+  SrpClientSession srp_client(&prng, "foouser");
+  SrpServerSession srp_server(&prng);
+
+  srp_client.FillClientHello(buffer.Input());
+  string username;
+  EXPECT_EQ(0, srp_server.ParseClientHello(buffer.Output(), &username));
+
+  ScopedPassword password(STRBUFFER("this-is-his-password"));
+  SrpSecret secret(SecurePrimes::Shared(), 0);
+  EXPECT_TRUE(secret.FromPassword("foouser", password));
+  string encodedpassword;
+  secret.ToSecret(&encodedpassword);
+  EXPECT_TRUE(srp_server.InitSession("foouser", encodedpassword));
+
+  // The capabilities are the last byte of the hello.
+  srp_server.FillServerHello(buffer.Input());
+  string hello;
+  buffer.Output()->ConsumeString(&hello);
+  hello[hello.size() - 1] = static_cast<char>(picked);
+  buffer.Input()->Add(hello);
+  int result(srp_client.ParseServerHello(buffer.Output()));
+  if (result)
+    return result;
+
+  EXPECT_TRUE(srp_client.FillClientPublicKey(buffer.Input()));
+  EXPECT_EQ(0, srp_server.ParseClientPublicKey(buffer.Output()));
+  EXPECT_TRUE(srp_server.FillServerPublicKey(buffer.Input()));
+  EXPECT_EQ(0, srp_client.ParseServerPublicKey(buffer.Output()));
+
+  srp_server.GetTranscript(server_transcript);
+  srp_client.GetTranscript(client_transcript);
+  return 0;
+}
+
+TEST(SrpInteractions, CapabilitiesAreBound) {
+  string server_transcript, client_transcript;
+  EXPECT_EQ(0, TamperedHandshake(kSrpCapabilities, &server_transcript,
+                                 &client_transcript));
+  EXPECT_EQ(server_transcript, client_transcript);
+
+  // Compression stripped: keys won't match.
+  EXPECT_EQ(0, TamperedHandshake(kSrpCapabilities & ~SrpCapabilityCompression,
+                                 &server_transcript, &client_transcript));
+  EXPECT_NE(server_transcript, client_transcript);
+
+  // Hkdf stripped, or bits the client did not offer: refused.
+  EXPECT_GT(0, TamperedHandshake(kSrpCapabilities & ~SrpCapabilityHkdfKey,
+                                 &server_transcript, &client_transcript));
+  EXPECT_GT(0, TamperedHandshake(kSrpCapabilities | BIT(7),
+                                 &server_transcript, &client_transcript));
+}
+
+TEST(SrpInteractions, ClientWithoutCapabilities) {
+  Buffer buffer;
+  DefaultPrng prng;
+
+  SrpServerSession srp_server(&prng);
+
+  // Hello from a client that does not know about capabilities.
+  EncodeToBuffer(string("foouser"), buffer.Input());
+  string username;
+  EXPECT_EQ(0, srp_server.ParseClientHello(buffer.Output(), &username));
+  EXPECT_EQ(0, srp_server.Capabilities());
+
+  ScopedPassword password(STRBUFFER("this-is-his-password"));
+  SrpSecret secret(SecurePrimes::Shared(), 0);
+  EXPECT_TRUE(secret.FromPassword("foouser", password));
+  string encodedpassword;
+  secret.ToSecret(&encodedpassword);
+  EXPECT_TRUE(srp_server.InitSession("foouser", encodedpassword));
+
+  // ... and it must get back exactly what it expects, index and salt.
+  srp_server.FillServerHello(buffer.Input());
+  uint16_t index;
+  string salt;
+  EXPECT_EQ(0, DecodeFromBuffer(buffer.Output(), &index));
+  EXPECT_EQ(0, DecodeFromBuffer(buffer.Output(), &salt));
+  EXPECT_EQ(0, buffer.Output()->LeftSize());
+}
+
+TEST(SrpInteractions, ResumeHello) {
+  Buffer buffer;
+  DefaultPrng prng;
+
+  SrpClientSession srp_client(&prng, "foouser");
+  SrpServerSession srp_server(&prng);
+
+  string nonce(SessionTicket::kNonceLength, 'n');
+  srp_client.SetTicket("opaque ticket", nonce);
+  srp_client.FillClientHello(buffer.Input());
+
+  string username;
+  EXPECT_EQ(0, srp_server.ParseClientHello(buffer.Output(), &username));
+  EXPECT_EQ("foouser", username);
+  EXPECT_EQ("opaque ticket", srp_server.Ticket());
+  EXPECT_EQ(nonce, srp_server.ClientNonce());
+  EXPECT_EQ(0, buffer.Output()->LeftSize());
+
+  EXPECT_TRUE(srp_server.FillServerResumed(buffer.Input()));
+  EXPECT_EQ(0, srp_client.ParseServerHello(buffer.Output()));
+  EXPECT_TRUE(srp_client.Resumed());
+  EXPECT_EQ(kSrpCapabilities, srp_client.Capabilities());
+}
+
+TEST(SrpInteractions, ResumeNotSupported) {
+  Buffer buffer;
+  DefaultPrng prng;
+
+  SrpClientSession srp_client(&prng, "foouser");
+  SrpServerSession srp_server(&prng);
+  srp_server.LimitCapabilities(SrpCapabilityHkdfKey);
+
+  srp_client.SetTicket("opaque ticket", string(SessionTicket::kNonceLength, 'n'));
+  srp_client.FillClientHello(buffer.Input());
+
+  // The ticket is ignored, but the hello must still be valid.
+  string username;
+  EXPECT_EQ(0, srp_server.ParseClientHello(buffer.Output(), &username));
+  EXPECT_EQ(SrpCapabilityHkdfKey, srp_server.Capabilities());
+  EXPECT_EQ("", srp_server.Ticket());
+
+  // A server resuming a session we did not ask to resume is an error.
+  SrpClientSession no_ticket(&prng, "foouser");
+  Buffer resumed;
+  EXPECT_TRUE(srp_server.FillServerResumed(resumed.Input()));
+  EXPECT_GT(0, no_ticket.ParseServerHello(resumed.Output()));
 }
@@ -0,0 +1,142 @@
+#include "gtest.h"
+
+#include "src/stream-compressor.h"
+#include "src/serializers.h"
+#include "src/conversions.h"
+#include "src/buffer.h"
+
+static string RandomData(int size, uint32_t seed) {
+  string data(size, '\0');
+  for (int i = 0; i < size; ++i) {
+    seed = seed * 1103515245 + 12345;
+    data[i] = static_cast<char>(seed >> 16);
+  }
+  return data;
+}
+
+// Compresses packet, checks it comes back the same, returns the size of
+// the frame on the stream.
+static int RoundTrip(StreamCompressor* compressor,
+                     StreamDecompressor* decompressor, const string& packet) {
+  Buffer input, frame, output;
+  input.Input()->Add(packet);
+  EXPECT_TRUE(compressor->Compress(input.Output(), frame.Input()));
+  EXPECT_EQ(0, static_cast<int>(input.Output()->LeftSize()));
+  int size(frame.Output()->LeftSize());
+
+  EXPECT_TRUE(decompressor->Decompress(frame.Output(), output.Input()));
+  string result;
+  output.Output()->ConsumeString(&result);
+  EXPECT_TRUE(packet == result);
+  return size;
+}
+
+TEST(StreamCompressor, UsesPreviousPackets) {
+  StreamCompressor compressor;
+  StreamDecompressor decompressor;
+
+  // Too short and too different from each other to compress alone, but
+  // all alike.
+  string request("GET /index.html HTTP/1.1\r\nHost: www.example.com\r\n"
+                 "Accept: */*\r\nUser-Agent: uvpn-test/1.0\r\n\r\n");
+  int first(RoundTrip(&compressor, &decompressor, request));
+  EXPECT_EQ(static_cast<int>(request.size()) + 1, first);
+
+  int last(0);
+  for (int i = 0; i < 100; ++i) {
+    string packet(request);
+    packet.replace(5, 5, ToString(10000 + i));
+    last = RoundTrip(&compressor, &decompressor, packet);
+  }
+  EXPECT_LT(last, first / 4);
+  EXPECT_EQ(101, static_cast<int>(compressor.PacketCount()));
+  EXPECT_EQ(100, static_cast<int>(compressor.CompressedCount()));
+  EXPECT_EQ(100, static_cast<int>(decompressor.CompressedCount()));
+}
+
+TEST(StreamCompressor, SendsRandomDataRaw) {
+  StreamCompressor compressor;
+  StreamDecompressor decompressor;
+
+  for (int i = 0; i < 10; ++i) {
+    string packet(RandomData(1400, i));
+    EXPECT_EQ(1401, RoundTrip(&compressor, &decompressor, packet));
+  }
+  EXPECT_EQ(0, static_cast<int>(compressor.CompressedCount()));
+
+  // A packet already seen is still found in the history.
+  EXPECT_GT(100, RoundTrip(&compressor, &decompressor, RandomData(1400, 3)));
+}
+
+TEST(StreamCompressor, SlidesAndResets) {
+  StreamCompressor compressor;
+  StreamDecompressor decompressor;
+
+  // Sizes not dividing the history, some larger than the window, and
+  // more data than kResetBytes, so all the paths are taken.
+  uint64_t total(0);
+  for (int i = 0; total < 3 * StreamHistory::kResetBytes; ++i) {
+    int size((i * 7919) % 20000 + 1);
+    string packet(RandomData(size / 2, i % 5) + string(size - size / 2, 'a'));
+    RoundTrip(&compressor, &decompressor, packet);
+    total += size;
+  }
+  EXPECT_EQ(2, static_cast<int>(compressor.ResetCount()));
+
+  string largest(RandomData(StreamHistory::kMaxPacketSize, 1));
+  RoundTrip(&compressor, &decompressor, largest);
+  RoundTrip(&compressor, &decompressor, largest.substr(0, 1000));
+
+  Buffer input, frame;
+  input.Input()->Add(largest + "x");
+  EXPECT_FALSE(compressor.Compress(input.Output(), frame.Input()));
+}
+
+TEST(StreamCompressor, RejectsCorruptedFrames) {
+  // Frame, original size, and lz4 sequences.
+  struct {
+    uint8_t flags;
+    uint16_t size;
+    const char* data;
+    int datasize;
+  } frames[] = {
+    // Unknown flag.
+    { 0x80, 0, "", 0 },
+    // Match before the start of the history.
+    { StreamHistory::kFlagCompressed, 8, "\x00\x01\x00", 3 },
+    // Offset 0.
+    { StreamHistory::kFlagCompressed, 8, "\x10" "a\x00\x00", 4 },
+    // Match longer than the original size.
+    { StreamHistory::kFlagCompressed, 8, "\x1f" "a\x01\x00\x10", 5 },
+    // Truncated offset.
+    { StreamHistory::kFlagCompressed, 8, "\x10" "a\x01", 3 },
+    // Literals past the end of the input.
+    { StreamHistory::kFlagCompressed, 8, "\x80" "a", 2 },
+    // Decompresses to less than the original size.
+    { StreamHistory::kFlagCompressed, 8, "\x10" "a", 2 },
+    // Endless length.
+    { StreamHistory::kFlagCompressed, 8, "\xf0\xff\xff", 3 },
+  };
+
+  for (unsigned int i = 0; i < sizeof(frames) / sizeof(frames[0]); ++i) {
+    StreamDecompressor decompressor;
+    Buffer frame, output;
+    EncodeToBuffer(frames[i].flags, frame.Input());
+    if (frames[i].flags == StreamHistory::kFlagCompressed)
+      EncodeToBuffer(frames[i].size, frame.Input());
+    frame.Input()->Add(frames[i].data, frames[i].datasize);
+    EXPECT_FALSE(decompressor.Decompress(frame.Output(), output.Input()))
+        << "frame " << i;
+  }
+
+  // And a valid one: 'a', then 7 more copied from 1 byte back.
+  StreamDecompressor decompressor;
+  Buffer frame, output;
+  EncodeToBuffer(StreamHistory::kFlagCompressed, frame.Input());
+  EncodeToBuffer(static_cast<uint16_t>(8), frame.Input());
+  frame.Input()->Add("\x13" "a\x01\x00" "\x00", 5);
+  EXPECT_TRUE(decompressor.Decompress(frame.Output(), output.Input()));
+  string result;
+  output.Output()->ConsumeString(&result);
+  EXPECT_EQ("aaaaaaaa", result);
+}
@@ -0,0 +1,120 @@
+#include "gtest.h"
+
+#include "src/tcp-framing.h"
+#include "src/serializers.h"
+#include "src/buffer.h"
+
+static TcpFraming::Mode Detect(const string& start, int* left) {
+  Buffer input;
+  input.Input()->Add(start);
+  TcpFraming::Mode mode(TcpFraming::Detect(input.Output()));
+  *left = input.Output()->LeftSize();
+  return mode;
+}
+
+TEST(TcpFraming, DetectsFramedConnections) {
+  Buffer magic;
+  TcpFraming::AddMagic(magic.Input());
+  string start;
+  magic.Output()->ConsumeString(&start);
+  EXPECT_EQ(TcpFraming::kMagicSize, static_cast<int>(start.size()));
+
+  int left;
+  EXPECT_EQ(TcpFraming::Framed, Detect(start + "frames", &left));
+  EXPECT_EQ(6, left);
+  EXPECT_EQ(TcpFraming::Unknown, Detect(start.substr(0, 2), &left));
+  EXPECT_EQ(2, left);
+  EXPECT_EQ(TcpFraming::Unknown, Detect("", &left));
+
+  // Old clients start with a random key.
+  EXPECT_EQ(TcpFraming::Unframed, Detect(string("\x00\x05key", 5), &left));
+  EXPECT_EQ(5, left);
+  EXPECT_EQ(TcpFraming::Unframed, Detect(start.substr(0, 2) + "x", &left));
+}
+
+TEST(TcpFraming, SplitsFrames) {
+  Buffer stream;
+  vector<string> sent;
+  for (int i = 0; i < 10; ++i) {
+    string message(i * 1000, static_cast<char>('a' + i));
+    Buffer frame;
+    frame.Input()->Add(message);
+    EXPECT_TRUE(TcpFraming::AddFrame(frame.Output(), stream.Input()));
+    EXPECT_EQ(0, static_cast<int>(frame.Output()->LeftSize()));
+    sent.push_back(message);
+  }
+
+  // Fed a few bytes at a time, frames come out once complete only.
+  Buffer input;
+  vector<string> received;
+  while (stream.Output()->LeftSize()) {
+    string chunk;
+    stream.Output()->ConsumeString(&chunk, 777);
+    input.Input()->Add(chunk);
+
+    uint32_t size;
+    TcpFraming::Result result;
+    while ((result = TcpFraming::PeekFrame(*input.Output(), &size)) ==
+           TcpFraming::Complete) {
+      input.Output()->Increment(sizeof(uint32_t));
+      string message;
+      input.Output()->ConsumeString(&message, size);
+      received.push_back(message);
+    }
+    EXPECT_EQ(TcpFraming::Incomplete, result);
+  }
+  EXPECT_TRUE(sent == received);
+}
+
+TEST(TcpFraming, RejectsLargeFrames) {
+  Buffer frame, stream;
+  frame.Input()->Add(string(TcpFraming::kMaxFrameSize + 1, 'x'));
+  EXPECT_FALSE(TcpFraming::AddFrame(frame.Output(), stream.Input()));
+  EXPECT_EQ(0, static_cast<int>(stream.Output()->LeftSize()));
+
+  uint32_t size;
+  EncodeToBuffer(TcpFraming::kMaxFrameSize + 1, stream.Input());
+  EXPECT_EQ(TcpFraming::Invalid, TcpFraming::PeekFrame(*stream.Output(), &size));
+  EXPECT_EQ(4, static_cast<int>(stream.Output()->LeftSize()));
+}
+
+TEST(TcpFraming, HandlesControlValues) {
+  Buffer stream;
+  TcpFraming::AddControl(TcpFraming::kControlKernelTlsStart, stream.Input());
+  Buffer frame;
+  frame.Input()->Add("record");
+  EXPECT_TRUE(TcpFraming::AddFrame(frame.Output(), stream.Input()));
+
+  uint32_t size;
+  EXPECT_EQ(TcpFraming::Control, TcpFraming::PeekFrame(*stream.Output(), &size));
+  EXPECT_EQ(TcpFraming::kControlKernelTlsStart, size);
+  EXPECT_EQ(0, static_cast<int>(TcpFraming::MissingBytes(*stream.Output())));
+  stream.Output()->Increment(sizeof(uint32_t));
+  EXPECT_EQ(TcpFraming::Complete, TcpFraming::PeekFrame(*stream.Output(), &size));
+  EXPECT_EQ(6, static_cast<int>(size));
+
+  // Values between kMaxFrameSize and the control values are still garbage.
+  Buffer garbage;
+  EncodeToBuffer(TcpFraming::kControlKernelTlsRequest - 1, garbage.Input());
+  EXPECT_EQ(TcpFraming::Invalid, TcpFraming::PeekFrame(*garbage.Output(), &size));
+}
+
+TEST(TcpFraming, CountsMissingBytes) {
+  Buffer frame, stream;
+  frame.Input()->Add(string(100, 'x'));
+  EXPECT_TRUE(TcpFraming::AddFrame(frame.Output(), stream.Input()));
+  string all;
+  stream.Output()->ConsumeString(&all);
+
+  // Reading exactly what is missing never goes past the frame.
+  Buffer input;
+  EXPECT_EQ(4, static_cast<int>(TcpFraming::MissingBytes(*input.Output())));
+  input.Input()->Add(all.substr(0, 3));
+  EXPECT_EQ(1, static_cast<int>(TcpFraming::MissingBytes(*input.Output())));
+  input.Input()->Add(all.substr(3, 1));
+  EXPECT_EQ(100, static_cast<int>(TcpFraming::MissingBytes(*input.Output())));
+  input.Input()->Add(all.substr(4, 60));
+  EXPECT_EQ(40, static_cast<int>(TcpFraming::MissingBytes(*input.Output())));
+  input.Input()->Add(all.substr(64));
+  EXPECT_EQ(0, static_cast<int>(TcpFraming::MissingBytes(*input.Output())));
+}
@@ -0,0 +1,51 @@
+#include "gtest.h"
+
+#include "src/tcp-profile.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+static int GetIntOption(int fd, int level, int option) {
+  int value(-1);
+  socklen_t size(sizeof(value));
+  EXPECT_EQ(0, getsockopt(fd, level, option, &value, &size));
+  return value;
+}
+
+TEST(TcpProfile, FindsProfiles) {
+  const TcpProfile* profile(TcpProfile::Default());
+  ASSERT_TRUE(profile != NULL);
+  EXPECT_EQ(string("default"), profile->Name());
+  EXPECT_TRUE(profile == TcpProfile::Get("default"));
+  EXPECT_FALSE(profile->FastOpen());
+
+  ASSERT_TRUE(TcpProfile::Get("bulk") != NULL);
+  ASSERT_TRUE(TcpProfile::Get("interactive") != NULL);
+  EXPECT_TRUE(TcpProfile::Get("") == NULL);
+  EXPECT_TRUE(TcpProfile::Get("bulky") == NULL);
+  EXPECT_EQ(string("default, bulk, interactive"), TcpProfile::Names());
+}
+
+TEST(TcpProfile, SetsOptions) {
+  int fd(socket(AF_INET, SOCK_STREAM, 0));
+  ASSERT_LE(0, fd);
+  int sndbuf(GetIntOption(fd, SOL_SOCKET, SO_SNDBUF));
+
+  TcpProfile::Default()->ApplyToConnecting(fd);
+  EXPECT_EQ(1, GetIntOption(fd, SOL_TCP, TCP_NODELAY));
+  EXPECT_EQ(0, GetIntOption(fd, SOL_SOCKET, SO_KEEPALIVE));
+  EXPECT_EQ(sndbuf, GetIntOption(fd, SOL_SOCKET, SO_SNDBUF));
+
+  // Congestion control and fast open depend on the kernel, and are not
+  // checked.
+  const TcpProfile* profile(TcpProfile::Get("interactive"));
+  profile->ApplyToListening(fd);
+  EXPECT_EQ(1, GetIntOption(fd, SOL_TCP, TCP_NODELAY));
+  EXPECT_EQ(1, GetIntOption(fd, SOL_SOCKET, SO_KEEPALIVE));
+  EXPECT_EQ(profile->keepalive_idle_, GetIntOption(fd, SOL_TCP, TCP_KEEPIDLE));
+  EXPECT_EQ(profile->keepalive_count_, GetIntOption(fd, SOL_TCP, TCP_KEEPCNT));
+  close(fd);
+}
@@ -0,0 +1,92 @@
+#include "gtest.h"
+#include "src/udb-binary.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+TEST(UdbBinaryIndex, WriteAndFind) {
+  unlink("/tmp/test-binary.db");
+
+  UserDb::UserMap users;
+  char name[32], secret[32];
+  for (int i = 0; i < 1000; ++i) {
+    snprintf(name, sizeof(name), "user%d", i);
+    snprintf(secret, sizeof(secret), "secret%d", i * 7);
+    users[name] = secret;
+  }
+  users["empty"] = "";
+
+  EXPECT_FALSE(UdbBinaryIndex::IsBinary("/tmp/test-binary.db"));
+  ASSERT_TRUE(UdbBinaryIndex::Write("/tmp/test-binary.db", users));
+  EXPECT_TRUE(UdbBinaryIndex::IsBinary("/tmp/test-binary.db"));
+
+  UdbBinaryIndex index;
+  ASSERT_TRUE(index.Map("/tmp/test-binary.db"));
+  EXPECT_EQ(1001, index.Users());
+
+  for (UserDb::UserMap::const_iterator it(users.begin());
+       it != users.end(); ++it) {
+    const char* found;
+    int size;
+    ASSERT_TRUE(index.Find(it->first, &found, &size));
+    EXPECT_EQ(it->second, string(found, size));
+  }
+
+  const char* found;
+  int size;
+  EXPECT_FALSE(index.Find("user1000", &found, &size));
+  EXPECT_FALSE(index.Find("", &found, &size));
+
+  UserDb::UserMap readback;
+  EXPECT_TRUE(index.ReadAll(&readback));
+  EXPECT_TRUE(users == readback);
+}
+
+TEST(UdbBinaryIndex, RefusesCorruptedFiles) {
+  unlink("/tmp/test-binary.db");
+
+  UserDb::UserMap users;
+  users["pippo"] = "pass1";
+  ASSERT_TRUE(UdbBinaryIndex::Write("/tmp/test-binary.db", users));
+  ASSERT_EQ(0, truncate("/tmp/test-binary.db", UdbBinaryIndex::kHeaderSize + 8));
+
+  UdbBinaryIndex index;
+  EXPECT_FALSE(index.Map("/tmp/test-binary.db"));
+  EXPECT_FALSE(index.IsMapped());
+
+  const char* found;
+  int size;
+  EXPECT_FALSE(index.Find("pippo", &found, &size));
+}
+
+TEST(UdbBinaryFile, FullRound) {
+  unlink("/tmp/test-binary.db");
+
+  UdbBinaryFile testdb("/tmp/test-binary.db");
+  EXPECT_TRUE(testdb.Open());
+
+  string secret;
+  EXPECT_FALSE(testdb.GetUser("pippo", &secret));
+  EXPECT_TRUE(testdb.AddUser("pippo", "pass1"));
+  EXPECT_TRUE(testdb.AddUser("pluto", "pass2"));
+  EXPECT_FALSE(testdb.AddUser("pluto", "pass3"));
+  EXPECT_TRUE(testdb.Commit());
+  EXPECT_TRUE(testdb.Close());
+
+  EXPECT_TRUE(UdbBinaryIndex::IsBinary("/tmp/test-binary.db"));
+
+  EXPECT_TRUE(testdb.Open());
+  EXPECT_TRUE(testdb.GetUser("pippo", &secret));
+  EXPECT_EQ("pass1", secret);
+  EXPECT_TRUE(testdb.SetUser("pluto", "pass4"));
+  EXPECT_TRUE(testdb.DelUser("pippo"));
+  EXPECT_FALSE(testdb.DelUser("pippo"));
+  EXPECT_TRUE(testdb.Commit());
+  EXPECT_TRUE(testdb.Close());
+
+  EXPECT_TRUE(testdb.Open());
+  EXPECT_FALSE(testdb.GetUser("pippo", &secret));
+  EXPECT_TRUE(testdb.GetUser("pluto", &secret));
+  EXPECT_EQ("pass4", secret);
+  EXPECT_TRUE(testdb.Close());
+}
@@ -0,0 +1,183 @@
+#include "gtest.h"
+
+#include "src/user-lookup.h"
+#include "src/userdb.h"
+#include "src/conversions.h"
+
+#include <utility>
+
+// Backend completing lookups only when told to.
+class FakeLookup : public UserLookup {
+ public:
+  void Lookup(const string& username, done_handler_t* done) {
+    lookups_.push_back(make_pair(username, done));
+  }
+  void Cancel(done_handler_t* done) {}
+
+  int Pending() const { return lookups_.size(); }
+
+  void Complete(Result result, const string& secret) {
+    pair<string, done_handler_t*> lookup(lookups_.front());
+    lookups_.pop_front();
+    (*lookup.second)(result, secret);
+  }
+
+ private:
+  list<pair<string, done_handler_t*> > lookups_;
+};
+
+class LookupResult {
+ public:
+  LookupResult()
+      : done(false), result(UserLookup::Failed),
+        handler(bind(&LookupResult::Done, this, placeholders::_1,
+                     placeholders::_2)) {}
+
+  void Done(UserLookup::Result r, const string& s) {
+    done = true;
+    result = r;
+    secret = s;
+  }
+
+  bool done;
+  UserLookup::Result result;
+  string secret;
+  UserLookup::done_handler_t handler;
+};
+
+TEST(CachingUserLookup, CachesFoundAndNotFound) {
+  FakeLookup backend;
+  CachingUserLookup cache(&backend);
+  Timer::ms_timer_t now(1000);
+
+  LookupResult first;
+  cache.Lookup("pippo", &first.handler, now);
+  EXPECT_FALSE(first.done);
+  EXPECT_EQ(1, backend.Pending());
+  backend.Complete(UserLookup::Found, "secret");
+  EXPECT_TRUE(first.done);
+  EXPECT_EQ(UserLookup::Found, first.result);
+  EXPECT_EQ("secret", first.secret);
+
+  // Second lookup is served from the cache, before returning.
+  LookupResult second;
+  cache.Lookup("pippo", &second.handler, now + 1);
+  EXPECT_TRUE(second.done);
+  EXPECT_EQ("secret", second.secret);
+  EXPECT_EQ(0, backend.Pending());
+  EXPECT_EQ(1, static_cast<int>(cache.HitCount()));
+
+  LookupResult missing;
+  cache.Lookup("pluto", &missing.handler, now);
+  backend.Complete(UserLookup::NotFound, "");
+  EXPECT_EQ(UserLookup::NotFound, missing.result);
+
+  LookupResult again;
+  cache.Lookup("pluto", &again.handler, now + 1);
+  EXPECT_TRUE(again.done);
+  EXPECT_EQ(UserLookup::NotFound, again.result);
+  EXPECT_EQ(2, cache.Size());
+
+  // Users not found expire sooner.
+  LookupResult expired;
+  cache.Lookup("pluto", &expired.handler,
+               now + CachingUserLookup::kNotFoundTtl);
+  EXPECT_FALSE(expired.done);
+  EXPECT_EQ(1, backend.Pending());
+  backend.Complete(UserLookup::NotFound, "");
+
+  LookupResult cached;
+  cache.Lookup("pippo", &cached.handler,
+               now + CachingUserLookup::kNotFoundTtl);
+  EXPECT_TRUE(cached.done);
+  cache.Lookup("pippo", &cached.handler,
+               now + CachingUserLookup::kFoundTtl);
+  EXPECT_EQ(1, backend.Pending());
+}
+
+TEST(CachingUserLookup, MergesAndCancels) {
+  FakeLookup backend;
+  CachingUserLookup cache(&backend);
+
+  LookupResult first, second, cancelled;
+  cache.Lookup("pippo", &first.handler, 0);
+  cache.Lookup("pippo", &cancelled.handler, 0);
+  cache.Lookup("pippo", &second.handler, 0);
+  EXPECT_EQ(1, backend.Pending());
+
+  cache.Cancel(&cancelled.handler);
+  backend.Complete(UserLookup::Found, "secret");
+  EXPECT_TRUE(first.done);
+  EXPECT_TRUE(second.done);
+  EXPECT_EQ("secret", second.secret);
+  EXPECT_FALSE(cancelled.done);
+}
+
+TEST(CachingUserLookup, FailuresAreNotCached) {
+  FakeLookup backend;
+  CachingUserLookup cache(&backend);
+
+  LookupResult first;
+  cache.Lookup("pippo", &first.handler, 0);
+  backend.Complete(UserLookup::Failed, "");
+  EXPECT_EQ(UserLookup::Failed, first.result);
+  EXPECT_EQ(0, cache.Size());
+
+  LookupResult second;
+  cache.Lookup("pippo", &second.handler, 0);
+  EXPECT_FALSE(second.done);
+  EXPECT_EQ(1, backend.Pending());
+}
+
+TEST(CachingUserLookup, EvictsLeastRecentlyUsed) {
+  FakeLookup backend;
+  CachingUserLookup cache(&backend);
+
+  LookupResult result;
+  for (int i = 0; i < CachingUserLookup::kMaxEntries; ++i) {
+    cache.Lookup("user" + ToString(i), &result.handler, 0);
+    backend.Complete(UserLookup::Found, "secret");
+  }
+  EXPECT_EQ(CachingUserLookup::kMaxEntries, cache.Size());
+
+  // Use the first one, so the second one is the oldest.
+  result.done = false;
+  cache.Lookup("user0", &result.handler, 0);
+  EXPECT_TRUE(result.done);
+
+  cache.Lookup("newuser", &result.handler, 0);
+  backend.Complete(UserLookup::Found, "secret");
+  EXPECT_EQ(CachingUserLookup::kMaxEntries, cache.Size());
+
+  result.done = false;
+  cache.Lookup("user0", &result.handler, 0);
+  EXPECT_TRUE(result.done);
+  cache.Lookup("user1", &result.handler, 0);
+  EXPECT_EQ(1, backend.Pending());
+}
+
+TEST(UserDbLookup, CompletesRightAway) {
+  unlink("/tmp/test-user-lookup.db");
+  {
+    UdbSecretFile testdb("/tmp/test-user-lookup.db");
+    EXPECT_TRUE(testdb.Open());
+    EXPECT_TRUE(testdb.AddUser("pippo", "pass1"));
+    EXPECT_TRUE(testdb.Commit());
+    EXPECT_TRUE(testdb.Close());
+  }
+
+  UdbSecretFile userdb("/tmp/test-user-lookup.db");
+  UserDbLookup lookup(&userdb);
+
+  LookupResult found;
+  lookup.Lookup("pippo", &found.handler);
+  EXPECT_TRUE(found.done);
+  EXPECT_EQ(UserLookup::Found, found.result);
+  EXPECT_EQ("pass1", found.secret);
+
+  LookupResult missing;
+  lookup.Lookup("pluto", &missing.handler);
+  EXPECT_TRUE(missing.done);
+  EXPECT_EQ(UserLookup::NotFound, missing.result);
+  unlink("/tmp/test-user-lookup.db");
+}